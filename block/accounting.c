@@ -278,6 +278,20 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     qemu_mutex_unlock(&stats->lock);
 }
 
+/*
+ * Account the time a request was held back to be merged with other requests
+ * before it was submitted.
+ */
+void block_acct_merge_delay(BlockAcctStats *stats, enum BlockAcctType type,
+                            int64_t delay_ns)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    stats->merge_delay_ns[type] += delay_ns;
+    qemu_mutex_unlock(&stats->lock);
+}
+
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
     return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
@@ -336,6 +336,21 @@ static bool backup_cancel(Job *job, bool force)
     return true;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    BlockCopyStats stats;
+
+    block_copy_get_stats(s->bcs, &stats);
+    info->u.backup = (BlockJobInfoBackup) {
+        .chunk_size = stats.chunk_size,
+        .latency = stats.latency,
+        .block_status_queries = stats.status_queries,
+        .block_status_prefetched = stats.status_prefetched,
+        .coalesced = stats.coalesced,
+    };
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -350,6 +365,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
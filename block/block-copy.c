@@ -28,14 +28,30 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+#define BLOCK_COPY_MAX_ADAPTIVE_BUFFER (8 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+/*
+ * The chunk size of the copy method is scaled by 2^chunk_shift, which is
+ * adapted each BLOCK_COPY_ADAPT_TASKS completed tasks to keep the task latency
+ * below BLOCK_COPY_TARGET_LATENCY while the throughput keeps growing.
+ */
+#define BLOCK_COPY_CHUNK_SHIFT_MIN (-4)
+#define BLOCK_COPY_CHUNK_SHIFT_MAX 3
+#define BLOCK_COPY_ADAPT_TASKS 16
+#define BLOCK_COPY_TARGET_LATENCY (100 * SCALE_MS)
+
+/* How far ahead of the copy the block status of the source is queried */
+#define BLOCK_COPY_STATUS_WINDOW (256 * MiB)
+
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
@@ -54,6 +70,7 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    bool prefetch_status;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
     /* Coroutine where async block-copy is running */
@@ -112,6 +129,39 @@ static int64_t task_end(BlockCopyTask *task)
     return task->req.offset + task->req.bytes;
 }
 
+typedef struct BlockCopyStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+    int ret;
+} BlockCopyStatusExtent;
+
+/*
+ * Block status of the source, queried ahead of the copy by a separate
+ * coroutine during one block_copy_dirty_clusters() run.
+ *
+ * Dirty areas of the copy bitmap are never written on the source while they
+ * stay dirty (copy-before-write copies them first), so the block status of
+ * dirty areas does not change after it has been queried.
+ *
+ * Only accessed by the coroutines of one call, which run in the AioContext
+ * of the source node.
+ */
+typedef struct BlockCopyStatusPrefetch {
+    BlockCopyCallState *call_state;
+    /* Sorted by offset, not overlapping */
+    GArray *extents;
+    /* Every area below @end that was dirty when it was reached has an extent */
+    int64_t end;
+    /* Start of the next task; the prefetch stays within the window after it */
+    int64_t cursor;
+    bool running;
+    bool stop;
+    /* The prefetch coroutine waits here for the cursor to move on */
+    CoQueue cursor_moved;
+    /* block_copy_dirty_clusters() waits here for new extents */
+    CoQueue extents_added;
+} BlockCopyStatusPrefetch;
+
 typedef struct BlockCopyState {
     /*
      * BdrvChild objects are not owned or managed by block-copy. They are
@@ -160,25 +210,116 @@ typedef struct BlockCopyState {
     ProgressMeter *progress;
     SharedResource *mem;
     RateLimit rate_limit;
+    bool rate_limited; /* atomic */
+
+    /*
+     * Adaptive chunk size, see block_copy_adapt_chunk_size().
+     * Protected by lock.
+     */
+    int chunk_shift;
+    int chunk_shift_max;
+    int adapt_dir;
+    int adapt_tasks;
+    int64_t adapt_start;
+    int64_t adapt_bytes;
+    int64_t adapt_latency;
+    uint64_t adapt_throughput;
+
+    /* Statistics, see BlockCopyStats */
+    Stat64 stat_chunk_size;
+    Stat64 stat_latency;
+    Stat64 stat_status_queries;
+    Stat64 stat_status_prefetched;
+    Stat64 stat_coalesced;
 } BlockCopyState;
 
 /* Called with lock held */
 static int64_t block_copy_chunk_size(BlockCopyState *s)
 {
+    int64_t chunk, max_chunk;
+
     switch (s->method) {
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
     case COPY_RANGE_SMALL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
-                   s->max_transfer);
+        chunk = BLOCK_COPY_MAX_BUFFER;
+        /* Each task allocates a bounce buffer of this size */
+        max_chunk = BLOCK_COPY_MAX_ADAPTIVE_BUFFER;
+        break;
     case COPY_RANGE_FULL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
-                   s->max_transfer);
+        chunk = BLOCK_COPY_MAX_COPY_RANGE;
+        max_chunk = INT64_MAX;
+        break;
     default:
         /* Cannot have COPY_WRITE_ZEROES here.  */
         abort();
     }
+
+    if (s->chunk_shift >= 0) {
+        chunk = MIN(chunk << s->chunk_shift, max_chunk);
+    } else {
+        chunk >>= -s->chunk_shift;
+    }
+
+    return MIN(MAX(s->cluster_size, chunk), s->max_transfer);
+}
+
+/*
+ * Account a completed task of @bytes that took @latency ns and, every
+ * BLOCK_COPY_ADAPT_TASKS tasks, adapt the chunk size: shrink it when the
+ * tasks take too long, grow it while they are fast and growing it did not
+ * decrease the throughput.
+ *
+ * Called with lock held.
+ */
+static void block_copy_adapt_chunk_size(BlockCopyState *s, int64_t bytes,
+                                        int64_t latency)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t throughput;
+    int shift;
+
+    if (!s->adapt_tasks) {
+        s->adapt_start = now - latency;
+    }
+    s->adapt_tasks++;
+    s->adapt_bytes += bytes;
+    s->adapt_latency += latency;
+
+    if (s->adapt_tasks < BLOCK_COPY_ADAPT_TASKS) {
+        return;
+    }
+
+    latency = s->adapt_latency / s->adapt_tasks;
+    throughput = s->adapt_bytes * NANOSECONDS_PER_SECOND /
+                 MAX(now - s->adapt_start, 1);
+    stat64_set(&s->stat_latency, latency);
+
+    shift = s->chunk_shift;
+    if (s->method == COPY_READ_WRITE_CLUSTER ||
+        qatomic_read(&s->rate_limited)) {
+        /* Fixed chunk size, or the throughput is not ours to measure */
+    } else if (latency > BLOCK_COPY_TARGET_LATENCY) {
+        shift--;
+    } else if (s->adapt_dir > 0 &&
+               throughput < s->adapt_throughput - s->adapt_throughput / 8) {
+        /* Larger tasks did not pay off, don't try them again */
+        s->chunk_shift_max = s->chunk_shift - 1;
+        shift--;
+    } else if (latency < BLOCK_COPY_TARGET_LATENCY / 4) {
+        shift++;
+    }
+    shift = MIN(MAX(shift, BLOCK_COPY_CHUNK_SHIFT_MIN), s->chunk_shift_max);
+
+    trace_block_copy_adapt_chunk_size(s, latency, throughput, shift);
+
+    s->adapt_dir = shift - s->chunk_shift;
+    s->chunk_shift = shift;
+    s->adapt_throughput = throughput;
+    s->adapt_tasks = 0;
+    s->adapt_bytes = 0;
+    s->adapt_latency = 0;
 }
 
 /*
@@ -194,6 +335,7 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
 
     QEMU_LOCK_GUARD(&s->lock);
     max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    stat64_set(&s->stat_chunk_size, max_chunk);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -418,6 +560,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .max_transfer = QEMU_ALIGN_DOWN(
                                     block_copy_max_transfer(source, target),
                                     cluster_size),
+        .chunk_shift_max = BLOCK_COPY_CHUNK_SHIFT_MAX,
     };
 
     s->discard_source = discard_source;
@@ -568,6 +711,7 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyState *s = t->s;
     bool error_is_read = false;
     BlockCopyMethod method = t->method;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -580,6 +724,13 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             s->method = method;
         }
 
+        /* Zeroes are written without moving data, they tell nothing */
+        if (ret >= 0 && t->method != COPY_WRITE_ZEROES) {
+            block_copy_adapt_chunk_size(s, t->req.bytes,
+                                        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                        start);
+        }
+
         if (ret < 0) {
             if (!t->call_state->ret) {
                 t->call_state->ret = ret;
@@ -602,12 +753,10 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
 }
 
 static coroutine_fn GRAPH_RDLOCK
-int block_copy_block_status(BlockCopyState *s, int64_t offset, int64_t bytes,
+int block_copy_query_status(BlockCopyState *s, int64_t offset, int64_t bytes,
                             int64_t *pnum)
 {
-    int64_t num;
     BlockDriverState *base;
-    int ret;
 
     if (qatomic_read(&s->skip_unallocated)) {
         base = bdrv_backing_chain_next(s->source->bs);
@@ -615,8 +764,180 @@ int block_copy_block_status(BlockCopyState *s, int64_t offset, int64_t bytes,
         base = NULL;
     }
 
-    ret = bdrv_co_block_status_above(s->source->bs, base, offset, bytes, &num,
-                                     NULL, NULL);
+    stat64_add(&s->stat_status_queries, 1);
+    return bdrv_co_block_status_above(s->source->bs, base, offset, bytes, pnum,
+                                      NULL, NULL);
+}
+
+static void coroutine_fn block_copy_status_prefetch_entry(void *opaque)
+{
+    BlockCopyStatusPrefetch *p = opaque;
+    BlockCopyCallState *call_state = p->call_state;
+    BlockCopyState *s = call_state->s;
+    int64_t end = call_state->offset + call_state->bytes;
+
+    GRAPH_RDLOCK_GUARD();
+
+    while (!p->stop && p->end < end) {
+        BlockCopyStatusExtent e;
+
+        if (p->end - p->cursor >= BLOCK_COPY_STATUS_WINDOW) {
+            qemu_co_queue_wait(&p->cursor_moved, NULL);
+            continue;
+        }
+
+        /* Clean areas are not copied, skip them */
+        e.offset = bdrv_dirty_bitmap_next_dirty(s->copy_bitmap, p->end,
+                                                end - p->end);
+        if (e.offset < 0) {
+            p->end = end;
+            break;
+        }
+
+        e.ret = block_copy_query_status(s, e.offset,
+                                        MIN(end - e.offset,
+                                            BLOCK_COPY_STATUS_WINDOW),
+                                        &e.bytes);
+        if (e.ret < 0 || e.bytes == 0) {
+            /* Leave the rest to block_copy_block_status() */
+            break;
+        }
+
+        g_array_append_val(p->extents, e);
+        p->end = e.offset + e.bytes;
+        qemu_co_queue_restart_all(&p->extents_added);
+    }
+
+    p->running = false;
+    qemu_co_queue_restart_all(&p->extents_added);
+}
+
+static BlockCopyStatusPrefetch *coroutine_fn
+block_copy_status_prefetch_start(BlockCopyCallState *call_state)
+{
+    BlockCopyStatusPrefetch *p = g_new(BlockCopyStatusPrefetch, 1);
+    Coroutine *co;
+
+    *p = (BlockCopyStatusPrefetch) {
+        .call_state = call_state,
+        .extents = g_array_new(false, false, sizeof(BlockCopyStatusExtent)),
+        .end = call_state->offset,
+        .cursor = call_state->offset,
+        .running = true,
+    };
+    qemu_co_queue_init(&p->cursor_moved);
+    qemu_co_queue_init(&p->extents_added);
+
+    co = qemu_coroutine_create(block_copy_status_prefetch_entry, p);
+    aio_co_enter(qemu_get_current_aio_context(), co);
+
+    return p;
+}
+
+static void coroutine_fn
+block_copy_status_prefetch_stop(BlockCopyStatusPrefetch *p)
+{
+    if (!p) {
+        return;
+    }
+
+    p->stop = true;
+    qemu_co_queue_restart_all(&p->cursor_moved);
+    while (p->running) {
+        qemu_co_queue_wait(&p->extents_added, NULL);
+    }
+
+    g_array_free(p->extents, true);
+    g_free(p);
+}
+
+/*
+ * Look up the block status at @offset in the prefetched extents, waiting for
+ * the prefetch coroutine to get there if needed.  Adjacent extents of the
+ * same kind are merged, up to @bytes.
+ *
+ * Returns false if there is no prefetched extent for @offset.
+ */
+static bool coroutine_fn
+block_copy_status_lookup(BlockCopyState *s, BlockCopyStatusPrefetch *p,
+                         int64_t offset, int64_t bytes, int *pret,
+                         int64_t *pnum)
+{
+    BlockCopyStatusExtent *e;
+    int mask = BDRV_BLOCK_ZERO;
+    int64_t num;
+    guint i, n;
+
+    p->cursor = offset;
+    qemu_co_queue_restart_all(&p->cursor_moved);
+
+    while (true) {
+        /* Extents behind the cursor will not be needed again */
+        for (n = 0; n < p->extents->len; n++) {
+            e = &g_array_index(p->extents, BlockCopyStatusExtent, n);
+            if (e->offset + e->bytes > offset) {
+                break;
+            }
+        }
+        g_array_remove_range(p->extents, 0, n);
+
+        if (p->end > offset || !p->running) {
+            break;
+        }
+        qemu_co_queue_wait(&p->extents_added, NULL);
+    }
+
+    if (!p->extents->len) {
+        return false;
+    }
+    e = &g_array_index(p->extents, BlockCopyStatusExtent, 0);
+    if (e->offset > offset) {
+        return false;
+    }
+
+    if (qatomic_read(&s->skip_unallocated)) {
+        mask |= BDRV_BLOCK_ALLOCATED;
+    }
+
+    *pret = e->ret;
+    num = e->offset + e->bytes - offset;
+    for (i = 1; i < p->extents->len && num < bytes; i++) {
+        BlockCopyStatusExtent *next =
+            &g_array_index(p->extents, BlockCopyStatusExtent, i);
+
+        if (next->offset != offset + num ||
+            (next->ret & mask) != (e->ret & mask)) {
+            break;
+        }
+        num += next->bytes;
+    }
+
+    stat64_add(&s->stat_status_prefetched, 1);
+    if (i > 1) {
+        stat64_add(&s->stat_coalesced, 1);
+    }
+
+    *pnum = MIN(num, bytes);
+    return true;
+}
+
+/*
+ * Get the block status of the source for a task at @offset.  With @prefetch,
+ * the status is taken from the prefetched extents if possible.
+ */
+static coroutine_fn GRAPH_RDLOCK
+int block_copy_block_status(BlockCopyState *s,
+                            BlockCopyStatusPrefetch *prefetch,
+                            int64_t offset, int64_t bytes, int64_t *pnum)
+{
+    int64_t num;
+    int ret;
+
+    if (!prefetch ||
+        !block_copy_status_lookup(s, prefetch, offset, bytes, &ret, &num)) {
+        ret = block_copy_query_status(s, offset, bytes, &num);
+    }
+
     if (ret < 0 || num < s->cluster_size) {
         /*
          * On error or if failed to obtain large enough chunk just fallback to
@@ -736,6 +1057,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     bool found_dirty = false;
     int64_t end = offset + bytes;
     AioTaskPool *aio = NULL;
+    BlockCopyStatusPrefetch *prefetch = NULL;
 
     /*
      * block_copy() user is responsible for keeping source and target in same
@@ -747,6 +1069,10 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
     assert(QEMU_IS_ALIGNED(bytes, s->cluster_size));
 
+    if (call_state->prefetch_status) {
+        prefetch = block_copy_status_prefetch_start(call_state);
+    }
+
     while (bytes && aio_task_pool_status(aio) == 0 &&
            !qatomic_read(&call_state->cancelled)) {
         BlockCopyTask *task;
@@ -764,8 +1090,8 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         found_dirty = true;
 
-        ret = block_copy_block_status(s, task->req.offset, task->req.bytes,
-                                      &status_bytes);
+        ret = block_copy_block_status(s, prefetch, task->req.offset,
+                                      task->req.bytes, &status_bytes);
         assert(ret >= 0); /* never fail */
         if (status_bytes < task->req.bytes) {
             block_copy_task_shrink(task, status_bytes);
@@ -814,6 +1140,8 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
     }
 
 out:
+    block_copy_status_prefetch_stop(prefetch);
+
     if (aio) {
         aio_task_pool_wait_all(aio);
 
@@ -965,6 +1293,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .prefetch_status = true,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
@@ -1047,6 +1376,7 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     ratelimit_set_speed(&s->rate_limit, speed, BLOCK_COPY_SLICE_TIME);
+    qatomic_set(&s->rate_limited, speed != 0);
 
     /*
      * Note: it's good to kick all call states from here, but it should be done
@@ -1055,3 +1385,14 @@ void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
      * only one call_state by hand.
      */
 }
+
+void block_copy_get_stats(BlockCopyState *s, BlockCopyStats *stats)
+{
+    *stats = (BlockCopyStats) {
+        .chunk_size = stat64_get(&s->stat_chunk_size),
+        .latency = stat64_get(&s->stat_latency),
+        .status_queries = stat64_get(&s->stat_status_queries),
+        .status_prefetched = stat64_get(&s->stat_status_prefetched),
+        .coalesced = stat64_get(&s->stat_coalesced),
+    };
+}
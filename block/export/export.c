@@ -79,7 +79,9 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockExport *exp = NULL;
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
-    AioContext *ctx;
+    AioContext *ctx, *iothread_ctx = NULL;
+    AioContext **multithread_ctxs = NULL;
+    size_t multithread_count = 0;
     uint64_t perm;
     int ret;
 
@@ -100,6 +102,18 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         return NULL;
     }
 
+    if (export->iothreads) {
+        if (export->iothread) {
+            error_setg(errp, "iothread and iothreads are mutually exclusive");
+            return NULL;
+        }
+        if (!drv->supports_multithread) {
+            error_setg(errp, "The %s export type does not support multiple "
+                       "iothreads", BlockExportType_str(export->type));
+            return NULL;
+        }
+    }
+
     bs = bdrv_lookup_bs(NULL, export->node_name, errp);
     if (!bs) {
         return NULL;
@@ -115,10 +129,26 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
 
     ctx = bdrv_get_aio_context(bs);
 
-    if (export->iothread) {
+    if (export->iothreads) {
+        strList *name;
+        size_t i = 0;
+
+        multithread_count = QAPI_LIST_LENGTH(export->iothreads);
+        multithread_ctxs = g_new(AioContext *, multithread_count);
+
+        for (name = export->iothreads; name; name = name->next) {
+            IOThread *iothread = iothread_by_id(name->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", name->value);
+                goto fail;
+            }
+            multithread_ctxs[i++] = iothread_get_aio_context(iothread);
+        }
+
+        iothread_ctx = multithread_ctxs[0];
+    } else if (export->iothread) {
         IOThread *iothread;
-        AioContext *new_ctx;
-        Error **set_context_errp;
 
         iothread = iothread_by_id(export->iothread);
         if (!iothread) {
@@ -126,13 +156,18 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
             goto fail;
         }
 
-        new_ctx = iothread_get_aio_context(iothread);
+        iothread_ctx = iothread_get_aio_context(iothread);
+    }
+
+    if (iothread_ctx) {
+        Error **set_context_errp;
 
         /* Ignore errors with fixed-iothread=false */
         set_context_errp = fixed_iothread ? errp : NULL;
-        ret = bdrv_try_change_aio_context(bs, new_ctx, NULL, set_context_errp);
+        ret = bdrv_try_change_aio_context(bs, iothread_ctx, NULL,
+                                          set_context_errp);
         if (ret == 0) {
-            ctx = new_ctx;
+            ctx = iothread_ctx;
         } else if (fixed_iothread) {
             goto fail;
         }
@@ -178,6 +213,9 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .id         = g_strdup(export->id),
         .ctx        = ctx,
         .blk        = blk,
+
+        .multithread_ctxs   = multithread_ctxs,
+        .multithread_count  = multithread_count,
     };
 
     ret = drv->create(exp, export, errp);
@@ -199,6 +237,7 @@ fail:
         g_free(exp->id);
         g_free(exp);
     }
+    g_free(multithread_ctxs);
     return NULL;
 }
 
@@ -219,6 +258,7 @@ static void blk_exp_delete_bh(void *opaque)
     blk_set_dev_ops(exp->blk, NULL, NULL);
     blk_unref(exp->blk);
     qapi_event_send_block_export_deleted(exp->id);
+    g_free(exp->multithread_ctxs);
     g_free(exp->id);
     g_free(exp);
 }
@@ -19,17 +19,23 @@
 #define FUSE_USE_VERSION 31
 
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/memalign.h"
 #include "block/aio.h"
 #include "block/block_int-common.h"
 #include "block/export.h"
 #include "block/fuse.h"
+#include "block/graph-lock.h"
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
 #include "qemu/main-loop.h"
 #include "sysemu/block-backend.h"
 
+#include "standard-headers/linux/fuse.h"
+
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 
@@ -39,33 +45,136 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/ioctl.h>
 #endif
 
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/*
+ * Largest write request we accept.  Write payloads are processed in place in
+ * the buffer the request was read into, so every queue needs buffers of this
+ * size.  This is the default limit of the kernel (256 pages).
+ */
+#define FUSE_MAX_WRITE_BYTES (1 * MiB)
+
+/* Header of a write request, followed by the payload */
+#define FUSE_IN_PLACE_WRITE_BYTES \
+    (sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in))
+
+/* The kernel requires room for the largest write request */
+#define FUSE_REQUEST_BUF_SIZE (FUSE_IN_PLACE_WRITE_BYTES + FUSE_MAX_WRITE_BYTES)
+
+/* Unused request buffers kept per queue */
+#define FUSE_MAX_FREE_BUFS 16
+
+/* Background requests (readahead, async direct I/O) per queue */
+#define FUSE_MAX_BACKGROUND_PER_QUEUE 16
+
+/* Oldest protocol version whose request layout we understand */
+#define FUSE_MIN_KERNEL_MINOR_VERSION 9
+
+/* Capabilities we enable if the kernel offers them */
+#define FUSE_INIT_FLAGS (FUSE_ASYNC_READ | FUSE_BIG_WRITES | \
+                         FUSE_AUTO_INVAL_DATA | FUSE_ASYNC_DIO | \
+                         FUSE_MAX_PAGES)
+
+/* Whether a request of @len bytes is large enough for the argument @arg */
+#define FUSE_IN_ARG_FITS(len, arg) \
+    ((len) >= sizeof(struct fuse_in_header) + sizeof(arg))
+
+
+typedef struct FuseExport FuseExport;
+
+/*
+ * A buffer to read a request from the FUSE device into.  The request is
+ * placed so that the payload of write requests is aligned to the host page
+ * size, which lets it go to the block layer without a bounce buffer.
+ */
+typedef struct FuseRequestBuf {
+    /* Allocated with qemu_memalign() */
+    void *mem;
+    /* Start of the request in @mem */
+    char *data;
+
+    QSLIST_ENTRY(FuseRequestBuf) next;
+} FuseRequestBuf;
 
-typedef struct FuseExport {
+/*
+ * Requests are read and processed in one queue per AioContext, each with its
+ * own clone of the FUSE device fd.  The first queue uses the fd of the FUSE
+ * session.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    AioContext *ctx;
+    int fuse_fd;
+
+    /* Buffer that the next request is read into */
+    FuseRequestBuf *buf;
+
+    /* Unused buffers, only accessed from @ctx */
+    QSLIST_HEAD(, FuseRequestBuf) free_bufs;
+    unsigned int num_free_bufs;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
-    bool mounted, fd_handler_set_up;
+    bool mounted, fd_handlers_set_up;
+    /* Set when reading from the FUSE device failed for good (atomic) */
+    bool halted;
+
+    FuseQueue *queues;
+    size_t num_queues;
 
     char *mountpoint;
     bool writable;
     bool growable;
+    /*
+     * Serializes resizes, so that a request growing the image checks
+     * the length and truncates without others resizing in between
+     */
+    CoMutex resize_lock;
     /* Whether allow_other was used as a mount option or not */
     bool allow_other;
 
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
+
+/* The part of a request that is copied out of the request buffer */
+typedef struct FuseRequestIn {
+    struct fuse_in_header hdr;
+    union {
+        struct fuse_init_in init;
+        struct fuse_getattr_in getattr;
+        struct fuse_setattr_in setattr;
+        struct fuse_open_in open;
+        struct fuse_read_in read;
+        struct fuse_write_in write;
+        struct fuse_fsync_in fsync;
+        struct fuse_fallocate_in fallocate;
+        struct fuse_lseek_in lseek;
+    };
+} FuseRequestIn;
+
+/* Passed to fuse_co_process_request(), only valid until it yields */
+typedef struct FuseRequestArgs {
+    FuseQueue *q;
+    size_t len;
+} FuseRequestArgs;
 
 static GHashTable *exports;
-static const struct fuse_lowlevel_ops fuse_ops;
+
+/*
+ * Requests are parsed by this driver, libfuse is only used to mount and
+ * unmount the export.
+ */
+static const struct fuse_lowlevel_ops fuse_ops = {};
 
 static void fuse_export_shutdown(BlockExport *exp);
 static void fuse_export_delete(BlockExport *exp);
@@ -74,19 +183,34 @@ static void init_exports_table(void);
 
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
-static void read_from_fuse_export(void *opaque);
+static int setup_fuse_queues(FuseExport *exp, Error **errp);
+static void read_from_fuse_fd(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
 
 
+/**
+ * Enable or disable request processing in all queues.
+ */
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        aio_set_fd_handler(q->ctx, q->fuse_fd,
+                           enable ? read_from_fuse_fd : NULL,
+                           NULL, NULL, NULL, enable ? q : NULL);
+    }
+    exp->fd_handlers_set_up = enable;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -96,10 +220,16 @@ static void fuse_export_drained_end(void *opaque)
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /* Without explicit iothreads, the only queue follows the block node */
+    if (!exp->common.multithread_ctxs && exp->num_queues) {
+        exp->queues[0].ctx = exp->common.ctx;
+    }
+
+    /* Do not resume after shutdown or a fatal error */
+    if (!qatomic_read(&exp->halted) && exp->fuse_session &&
+        !fuse_session_exited(exp->fuse_session)) {
+        fuse_export_set_fd_handlers(exp, true);
+    }
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -142,7 +272,7 @@ static int fuse_export_create(BlockExport *blk_exp,
 
     /*
      * We handle draining ourselves using an in-flight counter and by disabling
-     * the FUSE fd handler. Do not queue BlockBackend requests, they need to
+     * the FUSE fd handlers. Do not queue BlockBackend requests, they need to
      * complete so the in-flight counter reaches zero.
      */
     blk_set_disable_request_queuing(exp->common.blk, true);
@@ -178,6 +308,7 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    qemu_co_mutex_init(&exp->resize_lock);
 
     /* set default */
     if (!args->has_allow_other) {
@@ -206,6 +337,12 @@ static int fuse_export_create(BlockExport *blk_exp,
         goto fail;
     }
 
+    ret = setup_fuse_queues(exp, errp);
+    if (ret < 0) {
+        fuse_export_shutdown(blk_exp);
+        goto fail;
+    }
+
     return 0;
 
 fail:
@@ -237,8 +374,9 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
     int ret;
 
     /*
-     * max_read needs to match what fuse_init() sets.
-     * max_write need not be supplied.
+     * The kernel only learns max_read from the mount options, and
+     * fuse_co_read() must reject anything larger.  max_write is
+     * negotiated by fuse_init() instead.
      */
     mount_opts = g_strdup_printf("max_read=%zu,default_permissions%s",
                                  FUSE_MAX_BOUNCE_BYTES,
@@ -269,11 +407,6 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
-
     return 0;
 
 fail:
@@ -282,32 +415,197 @@ fail:
 }
 
 /**
- * Callback to be invoked when the FUSE session FD can be read from.
+ * Open a new FUSE device fd that is connected to the same mount as
+ * @session_fd.  Requests can be read from either fd, but must be answered
+ * on the fd they were read from.
+ */
+static int clone_fuse_fd(int session_fd, Error **errp)
+{
+#ifdef __linux__
+    uint32_t src_fd = session_fd;
+    int fd, ret;
+
+    fd = qemu_open("/dev/fuse", O_RDWR, errp);
+    if (fd < 0) {
+        return -EIO;
+    }
+
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &src_fd) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Failed to clone FUSE device fd");
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+#else
+    error_setg(errp, "Multiple iothreads are not supported for FUSE exports "
+               "on this host");
+    return -ENOTSUP;
+#endif
+}
+
+static FuseRequestBuf *fuse_request_buf_new(void)
+{
+    FuseRequestBuf *buf = g_new0(FuseRequestBuf, 1);
+    size_t align = qemu_real_host_page_size();
+
+    QEMU_BUILD_BUG_ON(FUSE_IN_PLACE_WRITE_BYTES > 4096);
+
+    buf->mem = qemu_memalign(align, align + FUSE_MAX_WRITE_BYTES);
+    buf->data = (char *)buf->mem + align - FUSE_IN_PLACE_WRITE_BYTES;
+    return buf;
+}
+
+static void fuse_request_buf_free(FuseRequestBuf *buf)
+{
+    qemu_vfree(buf->mem);
+    g_free(buf);
+}
+
+/**
+ * Get a buffer for the next request of @q, preferably an unused one.
+ */
+static FuseRequestBuf *fuse_queue_get_buf(FuseQueue *q)
+{
+    FuseRequestBuf *buf = QSLIST_FIRST(&q->free_bufs);
+
+    if (!buf) {
+        return fuse_request_buf_new();
+    }
+
+    QSLIST_REMOVE_HEAD(&q->free_bufs, next);
+    q->num_free_bufs--;
+    return buf;
+}
+
+static void fuse_queue_put_buf(FuseQueue *q, FuseRequestBuf *buf)
+{
+    if (q->num_free_bufs >= FUSE_MAX_FREE_BUFS) {
+        fuse_request_buf_free(buf);
+        return;
+    }
+
+    QSLIST_INSERT_HEAD(&q->free_bufs, buf, next);
+    q->num_free_bufs++;
+}
+
+/**
+ * Set up one queue per iothread (or a single one in the export's
+ * AioContext), and start processing requests.
+ */
+static int setup_fuse_queues(FuseExport *exp, Error **errp)
+{
+    int session_fd = fuse_session_fd(exp->fuse_session);
+    size_t i;
+
+    exp->num_queues = MAX(exp->common.multithread_count, 1);
+    exp->queues = g_new0(FuseQueue, exp->num_queues);
+
+    for (i = 0; i < exp->num_queues; i++) {
+        exp->queues[i] = (FuseQueue) {
+            .exp        = exp,
+            .ctx        = exp->common.multithread_ctxs ?
+                          exp->common.multithread_ctxs[i] : exp->common.ctx,
+            .fuse_fd    = -1,
+            .free_bufs  = QSLIST_HEAD_INITIALIZER(free_bufs),
+        };
+    }
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        if (i == 0) {
+            q->fuse_fd = session_fd;
+        } else {
+            q->fuse_fd = clone_fuse_fd(session_fd, errp);
+            if (q->fuse_fd < 0) {
+                return q->fuse_fd;
+            }
+        }
+
+        /*
+         * All fds of the mount share the same pending requests, so several
+         * queues may be woken up for one request.  Only one gets it, the
+         * others must not block.
+         */
+        if (!g_unix_set_fd_nonblocking(q->fuse_fd, true, NULL)) {
+            error_setg_errno(errp, errno,
+                             "Failed to make FUSE device fd non-blocking");
+            return -errno;
+        }
+
+        q->buf = fuse_request_buf_new();
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
+    return 0;
+}
+
+static void fuse_dec_in_flight(FuseExport *exp)
+{
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    }
+}
+
+static void coroutine_fn fuse_co_process_request(void *opaque);
+
+/**
+ * Callback to be invoked when a FUSE device fd can be read from.
  * (This is basically the FUSE event loop.)
+ *
+ * Every request is processed in its own coroutine, so a queue can have
+ * many requests in flight.
  */
-static void read_from_fuse_export(void *opaque)
+static void read_from_fuse_fd(void *opaque)
 {
-    FuseExport *exp = opaque;
-    int ret;
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    FuseRequestArgs args = { .q = q };
+    Coroutine *co;
+    ssize_t ret;
 
     blk_exp_ref(&exp->common);
 
     qatomic_inc(&exp->in_flight);
 
-    do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
-    } while (ret == -EINTR);
+    ret = RETRY_ON_EINTR(read(q->fuse_fd, q->buf->data,
+                              FUSE_REQUEST_BUF_SIZE));
     if (ret < 0) {
+        /*
+         * EAGAIN: Another queue took the request
+         * ENOENT: The request was interrupted before we could read it
+         */
+        if (errno == EAGAIN || errno == ENOENT) {
+            goto out;
+        }
+
+        /* ENODEV means the export has been unmounted, e.g. by fusermount */
+        if (errno != ENODEV) {
+            error_report("Failed to read from FUSE device: %s",
+                         strerror(errno));
+        }
+
+        /* Stop polling an fd that will never give us requests again */
+        qatomic_set(&exp->halted, true);
+        aio_set_fd_handler(q->ctx, q->fuse_fd, NULL, NULL, NULL, NULL, NULL);
         goto out;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
-        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    if (ret < sizeof(struct fuse_in_header)) {
+        error_report("Short read from FUSE device (%zd bytes)", ret);
+        goto out;
     }
 
+    /* fuse_co_process_request() drops the references when it is done */
+    args.len = ret;
+    co = qemu_coroutine_create(fuse_co_process_request, &args);
+    qemu_coroutine_enter(co);
+    return;
+
+out:
+    fuse_dec_in_flight(exp);
     blk_exp_unref(&exp->common);
 }
 
@@ -318,11 +616,8 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
 
-        if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
+        if (exp->fd_handlers_set_up) {
+            fuse_export_set_fd_handlers(exp, false);
         }
     }
 
@@ -338,6 +633,25 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+        FuseRequestBuf *buf, *next_buf;
+
+        /* The first queue uses the session fd, which libfuse closes */
+        if (i > 0 && q->fuse_fd >= 0) {
+            close(q->fuse_fd);
+        }
+
+        if (q->buf) {
+            fuse_request_buf_free(q->buf);
+        }
+        QSLIST_FOREACH_SAFE(buf, &q->free_bufs, next, next_buf) {
+            fuse_request_buf_free(buf);
+        }
+    }
+    g_free(exp->queues);
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -347,7 +661,6 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
     g_free(exp->mountpoint);
 }
 
@@ -375,114 +688,138 @@ static bool is_regular_file(const char *path, Error **errp)
 }
 
 /**
- * A chance to set change some parameters supplied to FUSE_INIT.
+ * Negotiate the protocol version and parameters with the kernel.
  */
-static void fuse_init(void *userdata, struct fuse_conn_info *conn)
+static int fuse_init(FuseExport *exp, struct fuse_init_out *out,
+                     const struct fuse_init_in *in, size_t *out_len)
 {
-    /*
-     * MIN_NON_ZERO() would not be wrong here, but what we set here
-     * must equal what has been passed to fuse_session_new().
-     * Therefore, as long as max_read must be passed as a mount option
-     * (which libfuse claims will be changed at some point), we have
-     * to set max_read to a fixed value here.
-     */
-    conn->max_read = FUSE_MAX_BOUNCE_BYTES;
+    uint32_t max_background;
 
-    conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
-}
+    *out = (struct fuse_init_out) {
+        .major = FUSE_KERNEL_VERSION,
+        .minor = FUSE_KERNEL_MINOR_VERSION,
+    };
+    *out_len = sizeof(*out);
 
-/**
- * Let clients look up files.  Always return ENOENT because we only
- * care about the mountpoint itself.
- */
-static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
-{
-    fuse_reply_err(req, ENOENT);
+    /* The kernel retries with our major version if it supports that */
+    if (in->major > FUSE_KERNEL_VERSION) {
+        return 0;
+    }
+
+    if (in->major < FUSE_KERNEL_VERSION ||
+        in->minor < FUSE_MIN_KERNEL_MINOR_VERSION) {
+        error_report("Unsupported FUSE protocol version %" PRIu32 ".%" PRIu32,
+                     in->major, in->minor);
+        return -EPROTO;
+    }
+
+    max_background = FUSE_MAX_BACKGROUND_PER_QUEUE * exp->num_queues;
+
+    out->minor = MIN(in->minor, FUSE_KERNEL_MINOR_VERSION);
+    out->max_readahead = in->max_readahead;
+    out->flags = in->flags & FUSE_INIT_FLAGS;
+    out->max_background = MIN(max_background, UINT16_MAX);
+    out->congestion_threshold = out->max_background * 3 / 4;
+    out->max_write = FUSE_MAX_WRITE_BYTES;
+
+    /* Without FUSE_MAX_PAGES, the kernel limits requests to 32 pages */
+    if (out->flags & FUSE_MAX_PAGES) {
+        out->max_pages = FUSE_MAX_WRITE_BYTES / qemu_real_host_page_size();
+    }
+
+    if (out->minor < 23) {
+        *out_len = FUSE_COMPAT_22_INIT_OUT_SIZE;
+    }
+
+    return 0;
 }
 
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_getattr(FuseExport *exp,
+                                        struct fuse_attr_out *out,
+                                        uint64_t inode)
 {
-    struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
-    FuseExport *exp = fuse_req_userdata(req);
 
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    WITH_GRAPH_RDLOCK_GUARD() {
+        allocated_blocks =
+            bdrv_co_get_allocated_file_size(blk_bs(exp->common.blk));
+    }
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
         allocated_blocks = DIV_ROUND_UP(allocated_blocks, 512);
     }
 
-    statbuf = (struct stat) {
-        .st_ino     = inode,
-        .st_mode    = exp->st_mode,
-        .st_nlink   = 1,
-        .st_uid     = exp->st_uid,
-        .st_gid     = exp->st_gid,
-        .st_size    = length,
-        .st_blksize = blk_bs(exp->common.blk)->bl.request_alignment,
-        .st_blocks  = allocated_blocks,
-        .st_atime   = now,
-        .st_mtime   = now,
-        .st_ctime   = now,
+    *out = (struct fuse_attr_out) {
+        .attr_valid = 1,
+        .attr = {
+            .ino        = inode,
+            .mode       = exp->st_mode,
+            .nlink      = 1,
+            .uid        = exp->st_uid,
+            .gid        = exp->st_gid,
+            .size       = length,
+            .blksize    = blk_bs(exp->common.blk)->bl.request_alignment,
+            .blocks     = allocated_blocks,
+            .atime      = now,
+            .mtime      = now,
+            .ctime      = now,
+        },
     };
 
-    fuse_reply_attr(req, &statbuf, 1.);
+    return 0;
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+/**
+ * Resize the image to @size.  With @grow_only, which requests that
+ * extend the image past EOF use, the image is left alone if it is
+ * already at least @size bytes long, so that concurrent requests
+ * never shrink it.
+ */
+static int coroutine_fn fuse_co_do_truncate(FuseExport *exp, int64_t size,
+                                            bool grow_only,
+                                            bool req_zero_write,
+                                            PreallocMode prealloc)
 {
-    uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    bool add_resize_perm;
-    int ret, ret_check;
 
-    /* Growable and writable exports have a permanent RESIZE permission */
-    add_resize_perm = !exp->growable && !exp->writable;
+    /*
+     * Growable and writable exports have a permanent RESIZE permission.
+     * Permissions cannot be changed in coroutine context, so all other
+     * exports cannot be resized.
+     */
+    if (!exp->growable && !exp->writable) {
+        return -EACCES;
+    }
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
-    if (add_resize_perm) {
-
-        if (!qemu_in_main_thread()) {
-            /* Changing permissions like below only works in the main thread */
-            return -EPERM;
-        }
+    QEMU_LOCK_GUARD(&exp->resize_lock);
 
-        blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
+    if (grow_only) {
+        int64_t length = blk_co_getlength(exp->common.blk);
 
-        ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
-                           blk_shared_perm, NULL);
-        if (ret < 0) {
-            return ret;
+        if (length < 0) {
+            return length;
+        }
+        if (length >= size) {
+            return 0;
         }
     }
 
-    ret = blk_truncate(exp->common.blk, size, true, prealloc,
-                       truncate_flags, NULL);
-
-    if (add_resize_perm) {
-        /* Must succeed, because we are only giving up the RESIZE permission */
-        ret_check = blk_set_perm(exp->common.blk, blk_perm,
-                                 blk_shared_perm, &error_abort);
-        assert(ret_check == 0);
-    }
-
-    return ret;
+    return blk_co_truncate(exp->common.blk, size, true, prealloc,
+                           truncate_flags, NULL);
 }
 
 /**
@@ -493,108 +830,111 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
  * without allow_other cannot be given a different UID or GID, and
  * they cannot be given non-owner access.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_setattr(FuseExport *exp,
+                                        struct fuse_attr_out *out,
+                                        uint64_t inode,
+                                        const struct fuse_setattr_in *in)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int supported_attrs;
+    uint32_t to_set, supported_attrs;
     int ret;
 
-    supported_attrs = FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE;
+    /* Like libfuse, ignore the informational bits */
+    to_set = in->valid & ~(FATTR_FH | FATTR_LOCKOWNER);
+
+    supported_attrs = FATTR_SIZE | FATTR_MODE;
     if (exp->allow_other) {
-        supported_attrs |= FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID;
+        supported_attrs |= FATTR_UID | FATTR_GID;
     }
 
     if (to_set & ~supported_attrs) {
-        fuse_reply_err(req, ENOTSUP);
-        return;
+        return -ENOTSUP;
     }
 
     /* Do some argument checks first before committing to anything */
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    if (to_set & FATTR_MODE) {
         /*
          * Without allow_other, non-owners can never access the export, so do
          * not allow setting permissions for them
          */
-        if (!exp->allow_other &&
-            (statbuf->st_mode & (S_IRWXG | S_IRWXO)) != 0)
-        {
-            fuse_reply_err(req, EPERM);
-            return;
+        if (!exp->allow_other && (in->mode & (S_IRWXG | S_IRWXO)) != 0) {
+            return -EPERM;
         }
 
         /* +w for read-only exports makes no sense, disallow it */
-        if (!exp->writable &&
-            (statbuf->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0)
-        {
-            fuse_reply_err(req, EROFS);
-            return;
+        if (!exp->writable && (in->mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0) {
+            return -EROFS;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (to_set & FATTR_SIZE) {
         if (!exp->writable) {
-            fuse_reply_err(req, EACCES);
-            return;
+            return -EACCES;
         }
 
-        ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        ret = fuse_co_do_truncate(exp, in->size, false, true,
+                                  PREALLOC_MODE_OFF);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    if (to_set & FATTR_MODE) {
         /* Ignore FUSE-supplied file type, only change the mode */
-        exp->st_mode = (statbuf->st_mode & 07777) | S_IFREG;
+        exp->st_mode = (in->mode & 07777) | S_IFREG;
     }
 
-    if (to_set & FUSE_SET_ATTR_UID) {
-        exp->st_uid = statbuf->st_uid;
+    if (to_set & FATTR_UID) {
+        exp->st_uid = in->uid;
     }
 
-    if (to_set & FUSE_SET_ATTR_GID) {
-        exp->st_gid = statbuf->st_gid;
+    if (to_set & FATTR_GID) {
+        exp->st_gid = in->gid;
     }
 
-    fuse_getattr(req, inode, fi);
+    return fuse_co_getattr(exp, out, inode);
 }
 
 /**
  * Let clients open a file (i.e., the exported image).
  */
-static void fuse_open(fuse_req_t req, fuse_ino_t inode,
-                      struct fuse_file_info *fi)
+static int fuse_open(FuseExport *exp, struct fuse_open_out *out)
 {
-    fuse_reply_open(req, fi);
+    /* The block layer handles concurrent requests, do not serialize them */
+    *out = (struct fuse_open_out) {
+        .open_flags = FOPEN_PARALLEL_DIRECT_WRITES,
+    };
+    return 0;
 }
 
 /**
- * Handle client reads from the exported image.
+ * Handle client reads from the exported image.  On success, *bufptr points
+ * to the data, which the caller must free with qemu_vfree().
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static ssize_t coroutine_fn fuse_co_read(FuseExport *exp, void **bufptr,
+                                         uint64_t offset, uint32_t size)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     void *buf;
     int ret;
 
+    *bufptr = NULL;
+
     /* Limited by max_read, should not happen */
     if (size > FUSE_MAX_BOUNCE_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     /**
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
+    }
+
+    if (offset >= length) {
+        return 0;
     }
 
     if (offset + size > length) {
@@ -603,91 +943,88 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
-        fuse_reply_err(req, ENOMEM);
-        return;
+        return -ENOMEM;
     }
 
-    ret = blk_pread(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_buf(req, buf, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
     }
 
-    qemu_vfree(buf);
+    *bufptr = buf;
+    return size;
 }
 
 /**
- * Handle client writes to the exported image.
+ * Handle client writes to the exported image.  @buf points into the
+ * request buffer.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_write(FuseExport *exp,
+                                      struct fuse_write_out *out,
+                                      uint64_t offset, uint32_t size,
+                                      const void *buf)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     int ret;
 
     /* Limited by max_write, should not happen */
-    if (size > BDRV_REQUEST_MAX_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+    if (size > FUSE_MAX_WRITE_BYTES) {
+        return -EINVAL;
     }
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset + size, true, true,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         } else {
-            size = length - offset;
+            size = offset < length ? length - offset : 0;
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_write(req, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pwrite(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        return ret;
     }
+
+    *out = (struct fuse_write_out) {
+        .size = size,
+    };
+    return 0;
 }
 
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_fallocate(FuseExport *exp, uint64_t offset,
+                                          uint64_t length, uint32_t mode)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
     int ret;
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
-    blk_len = blk_getlength(exp->common.blk);
+    blk_len = blk_co_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        return blk_len;
     }
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
@@ -699,34 +1036,33 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            return -EOPNOTSUPP;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset, true, true,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
-                               PREALLOC_MODE_FALLOC);
+        ret = fuse_co_do_truncate(exp, offset + length, true, true,
+                                  PREALLOC_MODE_FALLOC);
     }
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     else if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            return -EINVAL;
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk, offset, size,
-                                    BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size,
+                                       BDRV_REQ_MAY_UNMAP |
+                                       BDRV_REQ_NO_FALLBACK);
             if (ret == -ENOTSUP) {
                 /*
                  * fallocate() specifies to return EOPNOTSUPP for unsupported
@@ -744,19 +1080,18 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
-                                   PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset + length, true, false,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk,
-                                    offset, size, 0);
+            ret = blk_co_pwrite_zeroes(exp->common.blk,
+                                       offset, size, 0);
             offset += size;
             length -= size;
         } while (ret == 0 && length > 0);
@@ -766,55 +1101,42 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         ret = -EOPNOTSUPP;
     }
 
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
+    return ret < 0 ? ret : 0;
 }
 
 /**
- * Let clients fsync the exported image.
+ * Let clients fsync the exported image.  This is also called for
+ * FUSE_FLUSH, which is sent before an FD to the exported image is closed.
+ * (libfuse notes this to be a way to return last-minute errors.)
  */
-static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
-                       struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_fsync(FuseExport *exp)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int ret;
-
-    ret = blk_flush(exp->common.blk);
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
-}
-
-/**
- * Called before an FD to the exported image is closed.  (libfuse
- * notes this to be a way to return last-minute errors.)
- */
-static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
-                        struct fuse_file_info *fi)
-{
-    fuse_fsync(req, inode, 1, fi);
+    return blk_co_flush(exp->common.blk);
 }
 
 #ifdef CONFIG_FUSE_LSEEK
 /**
  * Let clients inquire allocation status.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_lseek(FuseExport *exp,
+                                      struct fuse_lseek_out *out,
+                                      uint64_t offset, uint32_t whence)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-
     if (whence != SEEK_HOLE && whence != SEEK_DATA) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     while (true) {
         int64_t pnum;
         int ret;
 
-        ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+        WITH_GRAPH_RDLOCK_GUARD() {
+            ret = bdrv_co_block_status_above(blk_bs(exp->common.blk), NULL,
+                                             offset, INT64_MAX, &pnum,
+                                             NULL, NULL);
+        }
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
 
         if (!pnum && (ret & BDRV_BLOCK_EOF)) {
@@ -829,36 +1151,34 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
              * and @blk_len (the client-visible EOF).
              */
 
-            blk_len = blk_getlength(exp->common.blk);
+            blk_len = blk_co_getlength(exp->common.blk);
             if (blk_len < 0) {
-                fuse_reply_err(req, -blk_len);
-                return;
+                return blk_len;
             }
 
             if (offset > blk_len || whence == SEEK_DATA) {
-                fuse_reply_err(req, ENXIO);
-            } else {
-                fuse_reply_lseek(req, offset);
+                return -ENXIO;
             }
-            return;
+
+            out->offset = offset;
+            return 0;
         }
 
         if (ret & BDRV_BLOCK_DATA) {
             if (whence == SEEK_DATA) {
-                fuse_reply_lseek(req, offset);
-                return;
+                out->offset = offset;
+                return 0;
             }
         } else {
             if (whence == SEEK_HOLE) {
-                fuse_reply_lseek(req, offset);
-                return;
+                out->offset = offset;
+                return 0;
             }
         }
 
         /* Safety check against infinite loops */
         if (!pnum) {
-            fuse_reply_err(req, ENXIO);
-            return;
+            return -ENXIO;
         }
 
         offset += pnum;
@@ -866,26 +1186,207 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
 }
 #endif
 
-static const struct fuse_lowlevel_ops fuse_ops = {
-    .init       = fuse_init,
-    .lookup     = fuse_lookup,
-    .getattr    = fuse_getattr,
-    .setattr    = fuse_setattr,
-    .open       = fuse_open,
-    .read       = fuse_read,
-    .write      = fuse_write,
-    .fallocate  = fuse_fallocate,
-    .flush      = fuse_flush,
-    .fsync      = fuse_fsync,
+/**
+ * Send the reply to a request.  @error is 0 or a negative errno value; in
+ * the latter case, there must be no @out or @data.
+ */
+static void fuse_write_response(int fd, uint64_t unique, int error,
+                                const void *out, size_t out_len,
+                                const void *data, size_t data_len)
+{
+    struct fuse_out_header out_hdr = {
+        .len    = sizeof(out_hdr) + out_len + data_len,
+        .error  = error,
+        .unique = unique,
+    };
+    struct iovec iov[] = {
+        { .iov_base = &out_hdr,     .iov_len = sizeof(out_hdr) },
+        { .iov_base = (void *)out,  .iov_len = out_len },
+        { .iov_base = (void *)data, .iov_len = data_len },
+    };
+    ssize_t ret;
+
+    assert(!error || (!out_len && !data_len));
+
+    ret = RETRY_ON_EINTR(writev(fd, iov, ARRAY_SIZE(iov)));
+    if (ret < 0 && errno != ENOENT && errno != ENODEV) {
+        /*
+         * ENOENT: The request was interrupted
+         * ENODEV: The export has been unmounted
+         */
+        error_report("Failed to write to FUSE device: %s", strerror(errno));
+    }
+}
+
+/**
+ * Process one request from the request buffer of the queue in @opaque, and
+ * send the reply.
+ */
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequestArgs *args = opaque;
+    FuseQueue *q = args->q;
+    FuseExport *exp = q->exp;
+    size_t len = args->len;
+    FuseRequestBuf *write_buf = NULL;
+    FuseRequestIn in = {};
+    union {
+        struct fuse_init_out init;
+        struct fuse_attr_out attr;
+        struct fuse_open_out open;
+        struct fuse_write_out write;
+        struct fuse_statfs_out statfs;
+        struct fuse_lseek_out lseek;
+    } out = {};
+    size_t out_len = 0;
+    void *data = NULL;
+    size_t data_len = 0;
+    bool reply = true;
+    ssize_t ret;
+
+    /*
+     * Everything must be taken from the request buffer before the first
+     * yield, when the next request can be read into it.  Write requests
+     * are large, so they take over the whole buffer instead of copying it.
+     */
+    memcpy(&in, q->buf->data, MIN(len, sizeof(in)));
+    if (in.hdr.opcode == FUSE_WRITE) {
+        write_buf = q->buf;
+        q->buf = fuse_queue_get_buf(q);
+    }
+
+    switch (in.hdr.opcode) {
+    case FUSE_INIT:
+        /* Older kernels send a shorter struct fuse_init_in */
+        if (len < sizeof(in.hdr) + offsetof(struct fuse_init_in, flags2)) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = fuse_init(exp, &out.init, &in.init, &out_len);
+        break;
+
+    case FUSE_LOOKUP:
+        /* We only care about the mountpoint itself */
+        ret = -ENOENT;
+        break;
+
+    case FUSE_GETATTR:
+        ret = fuse_co_getattr(exp, &out.attr, in.hdr.nodeid);
+        out_len = sizeof(out.attr);
+        break;
+
+    case FUSE_SETATTR:
+        if (!FUSE_IN_ARG_FITS(len, in.setattr)) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = fuse_co_setattr(exp, &out.attr, in.hdr.nodeid, &in.setattr);
+        out_len = sizeof(out.attr);
+        break;
+
+    case FUSE_OPEN:
+        ret = fuse_open(exp, &out.open);
+        out_len = sizeof(out.open);
+        break;
+
+    case FUSE_READ:
+        if (!FUSE_IN_ARG_FITS(len, in.read)) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = fuse_co_read(exp, &data, in.read.offset, in.read.size);
+        if (ret >= 0) {
+            data_len = ret;
+            ret = 0;
+        }
+        break;
+
+    case FUSE_WRITE:
+        if (!FUSE_IN_ARG_FITS(len, in.write) ||
+            len < FUSE_IN_PLACE_WRITE_BYTES + in.write.size) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = fuse_co_write(exp, &out.write, in.write.offset, in.write.size,
+                            write_buf->data + FUSE_IN_PLACE_WRITE_BYTES);
+        out_len = sizeof(out.write);
+        break;
+
+    case FUSE_FALLOCATE:
+        if (!FUSE_IN_ARG_FITS(len, in.fallocate)) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = fuse_co_fallocate(exp, in.fallocate.offset, in.fallocate.length,
+                                in.fallocate.mode);
+        break;
+
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+        ret = fuse_co_fsync(exp);
+        break;
+
 #ifdef CONFIG_FUSE_LSEEK
-    .lseek      = fuse_lseek,
+    case FUSE_LSEEK:
+        if (!FUSE_IN_ARG_FITS(len, in.lseek)) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = fuse_co_lseek(exp, &out.lseek, in.lseek.offset,
+                            in.lseek.whence);
+        out_len = sizeof(out.lseek);
+        break;
 #endif
-};
+
+    case FUSE_STATFS:
+        /* The same defaults that libfuse reports */
+        out.statfs.st.bsize = 512;
+        out.statfs.st.namelen = 255;
+        out_len = sizeof(out.statfs);
+        ret = 0;
+        break;
+
+    case FUSE_RELEASE:
+    case FUSE_DESTROY:
+        ret = 0;
+        break;
+
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_INTERRUPT:
+        /* No reply expected; we do not support interrupting requests */
+        reply = false;
+        ret = 0;
+        break;
+
+    default:
+        ret = -ENOSYS;
+        break;
+    }
+
+    if (reply) {
+        if (ret < 0) {
+            out_len = 0;
+            data_len = 0;
+        }
+        fuse_write_response(q->fuse_fd, in.hdr.unique, ret < 0 ? ret : 0,
+                            &out, out_len, data, data_len);
+    }
+
+    qemu_vfree(data);
+    if (write_buf) {
+        fuse_queue_put_buf(q, write_buf);
+    }
+
+    fuse_dec_in_flight(exp);
+    blk_exp_unref(&exp->common);
+}
 
 const BlockExportDriver blk_exp_fuse = {
-    .type               = BLOCK_EXPORT_TYPE_FUSE,
-    .instance_size      = sizeof(FuseExport),
-    .create             = fuse_export_create,
-    .delete             = fuse_export_delete,
-    .request_shutdown   = fuse_export_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_FUSE,
+    .instance_size          = sizeof(FuseExport),
+    .supports_multithread   = true,
+    .create                 = fuse_export_create,
+    .delete                 = fuse_export_delete,
+    .request_shutdown       = fuse_export_shutdown,
 };
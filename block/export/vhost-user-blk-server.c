@@ -44,8 +44,10 @@ static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
 {
     VuDev *vu_dev = &req->server->vu_dev;
 
+    vhost_user_server_lock_queue(req->server, req->vq);
     vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
     vu_queue_notify(vu_dev, req->vq);
+    vhost_user_server_unlock_queue(req->server, req->vq);
 
     free(req);
 }
@@ -339,6 +341,9 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
 
     if (vu_opts->has_num_queues) {
         num_queues = vu_opts->num_queues;
+    } else if (exp->multithread_ctxs) {
+        /* Give every iothread a virtqueue to process */
+        num_queues = exp->multithread_count;
     }
     if (num_queues == 0) {
         error_setg(errp, "num-queues must be greater than 0");
@@ -358,6 +363,8 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     blk_set_dev_ops(exp->blk, &vu_blk_dev_ops, vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
+                                 exp->multithread_ctxs,
+                                 exp->multithread_count,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
@@ -383,4 +390,5 @@ const BlockExportDriver blk_exp_vhost_user_blk = {
     .create             = vu_blk_exp_create,
     .delete             = vu_blk_exp_delete,
     .request_shutdown   = vu_blk_exp_request_shutdown,
+    .supports_multithread = true,
 };
@@ -255,6 +255,7 @@ static int ioq_submit(LuringState *s)
             }
             break;
         }
+        aio_context_account_batch(s->aio_context, ret);
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
     }
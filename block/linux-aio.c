@@ -320,6 +320,7 @@ static void ioq_submit(LinuxAioState *s)
             continue;
         }
 
+        aio_context_account_batch(s->aio_context, ret);
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
         aiocb = container_of(iocbs[ret - 1], struct qemu_laiocb, iocb);
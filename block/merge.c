@@ -0,0 +1,415 @@
+/*
+ * Request merging filter driver
+ *
+ * Reads and writes that arrive within a short time of each other and are
+ * adjacent on disk are submitted to the child node as one vectored request.
+ * This trades a little latency for fewer requests on backends where the
+ * number of requests is the limiting factor (network storage, Ceph, ...).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "block/accounting.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define MERGE_OPT_MAX_DELAY_NS "max-delay-ns"
+#define MERGE_OPT_MAX_BYTES "max-bytes"
+
+#define MERGE_DEFAULT_MAX_DELAY_NS 50000
+#define MERGE_DEFAULT_MAX_BYTES (1 * MiB)
+
+typedef struct MergeRequest {
+    int64_t offset;
+    int64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    int64_t start_ns;
+
+    /* Set by the coroutine that submits the batch, protected by s->lock */
+    int ret;
+    bool done;
+
+    QTAILQ_ENTRY(MergeRequest) next;
+} MergeRequest;
+
+typedef struct MergeBatch {
+    bool is_write;
+    BdrvRequestFlags flags;
+    int64_t offset;
+    int64_t bytes;
+    int niov;
+    int nreqs;
+    /* Sorted by offset, without gaps */
+    QTAILQ_HEAD(, MergeRequest) reqs;
+    /* Requests that wait for the batch to complete */
+    CoQueue waiters;
+    QLIST_ENTRY(MergeBatch) next;
+} MergeBatch;
+
+typedef struct BDRVMergeState {
+    int64_t max_delay_ns;
+    int64_t max_bytes;
+
+    /* Requests may come from any thread */
+    CoMutex lock;
+    /* Batches that still accept new requests, protected by lock */
+    QLIST_HEAD(, MergeBatch) batches;
+
+    /* Requests sent to the child node */
+    BlockAcctStats stats;
+} BDRVMergeState;
+
+static QemuOptsList runtime_opts = {
+    .name = "merge",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = MERGE_OPT_MAX_DELAY_NS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "how long to wait for adjacent requests, in nanoseconds, "
+                "default 50000",
+        },
+        {
+            .name = MERGE_OPT_MAX_BYTES,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum size of a merged request, default 1M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int merge_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVMergeState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    s->max_delay_ns = qemu_opt_get_number(opts, MERGE_OPT_MAX_DELAY_NS,
+                                          MERGE_DEFAULT_MAX_DELAY_NS);
+    s->max_bytes = qemu_opt_get_size(opts, MERGE_OPT_MAX_BYTES,
+                                     MERGE_DEFAULT_MAX_BYTES);
+    qemu_opts_del(opts);
+
+    if (s->max_delay_ns > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "max-delay-ns must not exceed one second");
+        return -EINVAL;
+    }
+    if (s->max_bytes > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-bytes must not exceed %" PRId64,
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return -EINVAL;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    QLIST_INIT(&s->batches);
+    block_acct_init(&s->stats);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void merge_close(BlockDriverState *bs)
+{
+    BDRVMergeState *s = bs->opaque;
+
+    assert(QLIST_EMPTY(&s->batches));
+    block_acct_cleanup(&s->stats);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+merge_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+merge_co_submit(BlockDriverState *bs, bool is_write, int64_t offset,
+                int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset,
+                BdrvRequestFlags flags)
+{
+    BDRVMergeState *s = bs->opaque;
+    BlockAcctCookie cookie;
+    int ret;
+
+    block_acct_start(&s->stats, &cookie, bytes,
+                     is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+    if (is_write) {
+        ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    } else {
+        ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                  flags);
+    }
+    if (ret < 0) {
+        block_acct_failed(&s->stats, &cookie);
+    } else {
+        block_acct_done(&s->stats, &cookie);
+    }
+
+    return ret;
+}
+
+/* Called with s->lock held */
+static bool merge_batch_add(MergeBatch *batch,
+                            MergeRequest *req, int niov, bool is_write,
+                            BdrvRequestFlags flags, int64_t max_bytes)
+{
+    if (batch->is_write != is_write || batch->flags != flags ||
+        batch->bytes + req->bytes > max_bytes ||
+        batch->niov + niov > IOV_MAX) {
+        return false;
+    }
+
+    if (batch->offset + batch->bytes == req->offset) {
+        QTAILQ_INSERT_TAIL(&batch->reqs, req, next);
+    } else if (req->offset + req->bytes == batch->offset) {
+        QTAILQ_INSERT_HEAD(&batch->reqs, req, next);
+        batch->offset = req->offset;
+    } else {
+        return false;
+    }
+
+    batch->bytes += req->bytes;
+    batch->niov += niov;
+    batch->nreqs++;
+    return true;
+}
+
+/*
+ * Submit a batch and complete all of its requests.  If the merged request
+ * fails, the requests are retried one by one, so that the error only reaches
+ * the requests that cause it.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+merge_batch_submit(BlockDriverState *bs, MergeBatch *batch)
+{
+    BDRVMergeState *s = bs->opaque;
+    enum BlockAcctType type = batch->is_write ? BLOCK_ACCT_WRITE :
+                                                BLOCK_ACCT_READ;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    MergeRequest *req;
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init(&qiov, batch->niov);
+    QTAILQ_FOREACH(req, &batch->reqs, next) {
+        qemu_iovec_concat(&qiov, req->qiov, req->qiov_offset, req->bytes);
+        block_acct_merge_delay(&s->stats, type, now - req->start_ns);
+    }
+
+    trace_merge_batch_submit(bs, batch->is_write, batch->offset, batch->bytes,
+                             batch->nreqs);
+
+    ret = merge_co_submit(bs, batch->is_write, batch->offset, batch->bytes,
+                          &qiov, 0, batch->flags);
+    qemu_iovec_destroy(&qiov);
+
+    if (ret >= 0) {
+        block_acct_merge_done(&s->stats, type, batch->nreqs - 1);
+    }
+
+    QTAILQ_FOREACH(req, &batch->reqs, next) {
+        if (ret < 0 && batch->nreqs > 1) {
+            req->ret = merge_co_submit(bs, batch->is_write, req->offset,
+                                       req->bytes, req->qiov, req->qiov_offset,
+                                       batch->flags);
+        } else {
+            req->ret = ret;
+        }
+    }
+
+    /*
+     * The requests live on the stack of their coroutines, which may return
+     * as soon as the lock is dropped.
+     */
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        QTAILQ_FOREACH(req, &batch->reqs, next) {
+            req->done = true;
+        }
+        qemu_co_queue_restart_all(&batch->waiters);
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+merge_co_rw(BlockDriverState *bs, bool is_write, int64_t offset,
+            int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset,
+            BdrvRequestFlags flags)
+{
+    BDRVMergeState *s = bs->opaque;
+    int64_t max_bytes = MIN_NON_ZERO(s->max_bytes, bs->bl.max_transfer);
+    MergeRequest req = {
+        .offset = offset,
+        .bytes = bytes,
+        .qiov = qiov,
+        .qiov_offset = qiov_offset,
+        .start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+    };
+    MergeBatch new_batch, *batch;
+    int niov;
+
+    /* Requests with other flags than FUA are passed on as they are */
+    if (!s->max_delay_ns || bytes >= max_bytes ||
+        (flags & ~BDRV_REQ_FUA)) {
+        return merge_co_submit(bs, is_write, offset, bytes, qiov, qiov_offset,
+                               flags);
+    }
+
+    niov = qemu_iovec_subvec_niov(qiov, qiov_offset, bytes);
+
+    qemu_co_mutex_lock(&s->lock);
+    QLIST_FOREACH(batch, &s->batches, next) {
+        if (merge_batch_add(batch, &req, niov, is_write, flags,
+                            max_bytes)) {
+            /* The coroutine that started the batch completes the request */
+            while (!req.done) {
+                qemu_co_queue_wait(&batch->waiters, &s->lock);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            return req.ret;
+        }
+    }
+
+    /* Start a new batch and give adjacent requests some time to join it */
+    batch = &new_batch;
+    *batch = (MergeBatch) {
+        .is_write = is_write,
+        .flags = flags,
+        .offset = offset,
+        .bytes = bytes,
+        .niov = niov,
+        .nreqs = 1,
+    };
+    QTAILQ_INIT(&batch->reqs);
+    qemu_co_queue_init(&batch->waiters);
+    QTAILQ_INSERT_TAIL(&batch->reqs, &req, next);
+    QLIST_INSERT_HEAD(&s->batches, batch, next);
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, s->max_delay_ns);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        QLIST_REMOVE(batch, next);
+    }
+
+    merge_batch_submit(bs, batch);
+    return req.ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+merge_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, size_t qiov_offset,
+                     BdrvRequestFlags flags)
+{
+    return merge_co_rw(bs, false, offset, bytes, qiov, qiov_offset, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+merge_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      QEMUIOVector *qiov, size_t qiov_offset,
+                      BdrvRequestFlags flags)
+{
+    return merge_co_rw(bs, true, offset, bytes, qiov, qiov_offset, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+merge_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       BdrvRequestFlags flags)
+{
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+merge_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static BlockStatsSpecific *merge_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVMergeState *s = bs->opaque;
+    BlockAcctStats *acct = &s->stats;
+
+    QEMU_LOCK_GUARD(&acct->lock);
+
+    stats->driver = BLOCKDEV_DRIVER_MERGE;
+    stats->u.merge = (BlockStatsSpecificMerge) {
+        .rd_operations = acct->nr_ops[BLOCK_ACCT_READ],
+        .wr_operations = acct->nr_ops[BLOCK_ACCT_WRITE],
+        .rd_merged = acct->merged[BLOCK_ACCT_READ],
+        .wr_merged = acct->merged[BLOCK_ACCT_WRITE],
+        .rd_total_time_ns = acct->total_time_ns[BLOCK_ACCT_READ],
+        .wr_total_time_ns = acct->total_time_ns[BLOCK_ACCT_WRITE],
+        .rd_delay_ns = acct->merge_delay_ns[BLOCK_ACCT_READ],
+        .wr_delay_ns = acct->merge_delay_ns[BLOCK_ACCT_WRITE],
+    };
+
+    return stats;
+}
+
+static const char *const merge_strong_runtime_opts[] = {
+    MERGE_OPT_MAX_DELAY_NS,
+    MERGE_OPT_MAX_BYTES,
+
+    NULL
+};
+
+static BlockDriver bdrv_merge = {
+    .format_name                        = "merge",
+    .instance_size                      = sizeof(BDRVMergeState),
+
+    .bdrv_open                          = merge_open,
+    .bdrv_close                         = merge_close,
+    .bdrv_child_perm                    = bdrv_default_perms,
+
+    .bdrv_co_getlength                  = merge_co_getlength,
+
+    .bdrv_co_preadv_part                = merge_co_preadv_part,
+    .bdrv_co_pwritev_part               = merge_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = merge_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = merge_co_pdiscard,
+
+    .bdrv_get_specific_stats            = merge_get_specific_stats,
+
+    .strong_runtime_opts                = merge_strong_runtime_opts,
+    .is_filter                          = true,
+};
+
+static void bdrv_merge_init(void)
+{
+    bdrv_register(&bdrv_merge);
+}
+
+block_init(bdrv_merge_init);
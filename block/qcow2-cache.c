@@ -415,6 +415,30 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Loads the table at @offset into the cache without keeping a reference to
+ * it, so that a later qcow2_cache_get() for it is a cache hit. Returns 1 if
+ * the table had to be read from disk, 0 if it was already cached.
+ */
+int coroutine_fn qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c,
+                                      uint64_t offset)
+{
+    void *table;
+    int ret;
+
+    if (qcow2_cache_is_table_offset(c, offset)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_do_get(bs, c, offset, &table, true);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_put(c, &table);
+
+    return 1;
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
@@ -193,6 +193,16 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     return ret;
 }
 
+/* Offset in the image file of the L2 slice that covers guest @offset */
+static uint64_t l2_slice_offset(BDRVQcow2State *s, uint64_t offset,
+                                uint64_t l2_offset)
+{
+    int start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+
+    return l2_offset + start_of_slice;
+}
+
 /*
  * l2_load
  *
@@ -212,10 +222,9 @@ l2_load(BlockDriverState *bs, uint64_t offset,
         uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int start_of_slice = l2_entry_size(s) *
-        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+    return qcow2_cache_get(bs, s->l2_table_cache,
+                           l2_slice_offset(s, offset, l2_offset),
                            (void **)l2_slice);
 }
 
@@ -742,6 +751,127 @@ fail:
     return ret;
 }
 
+/*
+ * Loads the L2 slice for the next guest offset in the prefetch range into
+ * the L2 cache. Must be called with s->lock held. Returns false when there is
+ * nothing left to prefetch.
+ */
+static bool coroutine_fn GRAPH_RDLOCK
+qcow2_l2_prefetch_next(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t)s->l2_slice_size << s->cluster_bits;
+    uint64_t offset, l1_index, l2_offset;
+    int ret;
+
+    if (s->l2_prefetch_start >= s->l2_prefetch_end) {
+        return false;
+    }
+
+    offset = s->l2_prefetch_start;
+    s->l2_prefetch_start += slice_bytes;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        s->l2_prefetch_start = s->l2_prefetch_end;
+        return false;
+    }
+
+    /*
+     * Unallocated L2 tables need no prefetching. Invalid ones and I/O errors
+     * are left for the actual read to report.
+     */
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return true;
+    }
+
+    ret = qcow2_cache_prefetch(bs, s->l2_table_cache,
+                               l2_slice_offset(s, offset, l2_offset));
+    trace_qcow2_l2_prefetch(qemu_coroutine_self(), offset, ret);
+    if (ret < 0) {
+        s->l2_prefetch_start = s->l2_prefetch_end;
+        return false;
+    }
+
+    return true;
+}
+
+static void coroutine_fn qcow2_l2_prefetch_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    bool more;
+
+    bdrv_graph_co_rdlock();
+
+    /* Drop the lock between slices so that guest requests are not held up */
+    do {
+        qemu_co_mutex_lock(&s->lock);
+        more = qcow2_l2_prefetch_next(bs);
+        if (!more) {
+            s->l2_prefetch_running = false;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+    } while (more);
+
+    bdrv_graph_co_rdunlock();
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Tells the sequential access detector that the guest is reading @bytes at
+ * @offset. Once enough contiguous reads have been seen, the L2 slices
+ * following the one that is being read are loaded in the background, so that
+ * the stream does not have to wait for them when it gets there.
+ *
+ * Must be called with s->lock held.
+ */
+void coroutine_fn GRAPH_RDLOCK
+qcow2_l2_prefetch_notify(BlockDriverState *bs, uint64_t offset, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t)s->l2_slice_size << s->cluster_bits;
+    uint64_t start, end;
+    Coroutine *co;
+
+    if (s->l2_prefetch_slices == 0) {
+        return;
+    }
+
+    /* Tolerate some reordering between the requests of one stream */
+    if (offset + QCOW2_L2_PREFETCH_WINDOW < s->l2_prefetch_next ||
+        offset > s->l2_prefetch_next + QCOW2_L2_PREFETCH_WINDOW)
+    {
+        s->l2_prefetch_seq = 0;
+        s->l2_prefetch_next = offset + bytes;
+        s->l2_prefetch_start = s->l2_prefetch_end = 0;
+        return;
+    }
+
+    s->l2_prefetch_next = MAX(s->l2_prefetch_next, offset + bytes);
+    if (s->l2_prefetch_seq < QCOW2_L2_PREFETCH_MIN_SEQ) {
+        s->l2_prefetch_seq++;
+        return;
+    }
+
+    start = QEMU_ALIGN_UP(s->l2_prefetch_next, slice_bytes);
+    end = start + s->l2_prefetch_slices * slice_bytes;
+    s->l2_prefetch_start = MAX(s->l2_prefetch_start, start);
+    s->l2_prefetch_end = MAX(s->l2_prefetch_end, end);
+
+    if (s->l2_prefetch_running ||
+        s->l2_prefetch_start >= s->l2_prefetch_end)
+    {
+        return;
+    }
+
+    s->l2_prefetch_running = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_l2_prefetch_entry, bs);
+    aio_co_enter(qemu_get_current_aio_context(), co);
+}
+
 /*
  * get_cluster_table
  *
@@ -1081,7 +1211,16 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         /* The offset must fit in the offset field of the L2 table entry */
         assert((offset & L2E_OFFSET_MASK) == offset);
 
-        set_l2_entry(s, l2_slice, l2_index + i, offset | QCOW_OFLAG_COPIED);
+        /*
+         * Clusters that get a fingerprint may be shared by later writes, so
+         * they must not be written in place from now on
+         */
+        if (qcow2_dedup_add_l2meta_cluster(s, m, i, offset)) {
+            set_l2_entry(s, l2_slice, l2_index + i, offset);
+        } else {
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         offset | QCOW_OFLAG_COPIED);
+        }
 
         /* Update bitmap with the subclusters that were just written */
         if (has_subclusters(s) && !m->prealloc) {
@@ -1469,6 +1608,66 @@ static int coroutine_fn handle_dependencies(BlockDriverState *bs,
     return 0;
 }
 
+/*
+ * Points the guest cluster at @offset to the host cluster at @host_offset,
+ * which already contains the data that the guest is writing, instead of
+ * allocating a new cluster. The caller must hold a reference to the host
+ * cluster, which is passed on to the L2 entry on success.
+ *
+ * Returns 1 if the cluster was mapped, 0 if the guest cluster can be
+ * overwritten in place instead (the caller must then write the data
+ * normally), or -errno on failure.
+ */
+int coroutine_fn qcow2_dedup_link_cluster(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *m = NULL;
+    uint64_t *l2_slice, l2_entry, bytes;
+    int l2_index, ret;
+
+    assert(offset_into_cluster(s, offset) == 0);
+    assert(!has_subclusters(s));
+
+    /* Wait for running allocations of the same cluster */
+    do {
+        bytes = s->cluster_size;
+    } while (handle_dependencies(bs, offset, &bytes, &m) == -EAGAIN);
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    if (!cluster_needs_new_alloc(bs, l2_entry)) {
+        /*
+         * In-place writes may be in flight for this cluster, so it cannot
+         * be freed
+         */
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return 0;
+    }
+
+    /* No QCOW_OFLAG_COPIED, the cluster is shared */
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    qcow2_free_any_cluster(bs, l2_entry, QCOW2_DISCARD_NEVER);
+
+    return 1;
+}
+
 /*
  * Checks how many already allocated clusters that don't require a new
  * allocation there are at the given guest_offset (up to *bytes).
@@ -0,0 +1,521 @@
+/*
+ * Content-based cluster deduplication for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Writes of complete clusters are fingerprinted with SHA-256.  When the
+ * fingerprint of new data is found in the fingerprint table, the data is
+ * compared with the listed host cluster and, if it matches, the guest cluster
+ * is pointed at the existing host cluster instead of a new one.
+ *
+ * A host cluster stays in the table only as long as all L2 entries that
+ * reference it lack QCOW_OFLAG_COPIED, so its content cannot change while it
+ * is listed: writes to any of the guest clusters perform COW, even if the
+ * refcount is 1.  Clusters are added to the table when a write allocates them
+ * for a complete cluster of data, and dropped when their refcount reaches 0.
+ *
+ * The table lives in memory while the image is writable, and is only stored
+ * in the image when it is closed (or inactivated) cleanly.  Opening the image
+ * for writing drops the stored table, so a crash only loses fingerprints.
+ *
+ * Outside of image open and close, everything here runs with s->lock held.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DedupEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t host_offset;
+} Qcow2DedupEntry;
+
+struct Qcow2DedupTable {
+    /* Hash -> Qcow2DedupEntry, owns the entries */
+    GHashTable *by_hash;
+    /* Host offset -> Qcow2DedupEntry */
+    GHashTable *by_offset;
+};
+
+static guint dedup_hash_hash(gconstpointer key)
+{
+    /* The key is a cryptographic hash already, any part of it will do */
+    return ldl_he_p(key);
+}
+
+static gboolean dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_HASH_SIZE);
+}
+
+static Qcow2DedupTable *dedup_table_new(void)
+{
+    Qcow2DedupTable *t = g_new0(Qcow2DedupTable, 1);
+
+    t->by_hash = g_hash_table_new_full(dedup_hash_hash, dedup_hash_equal,
+                                       NULL, g_free);
+    t->by_offset = g_hash_table_new(g_int64_hash, g_int64_equal);
+    return t;
+}
+
+static void dedup_table_free(Qcow2DedupTable *t)
+{
+    g_hash_table_destroy(t->by_offset);
+    g_hash_table_destroy(t->by_hash);
+    g_free(t);
+}
+
+static bool dedup_table_add(Qcow2DedupTable *t, const uint8_t *hash,
+                            uint64_t host_offset)
+{
+    Qcow2DedupEntry *e;
+
+    if (g_hash_table_size(t->by_hash) >= QCOW2_DEDUP_MAX_FINGERPRINTS ||
+        g_hash_table_contains(t->by_hash, hash) ||
+        g_hash_table_contains(t->by_offset, &host_offset)) {
+        return false;
+    }
+
+    e = g_new(Qcow2DedupEntry, 1);
+    memcpy(e->hash, hash, QCOW2_DEDUP_HASH_SIZE);
+    e->host_offset = host_offset;
+    g_hash_table_insert(t->by_hash, e->hash, e);
+    g_hash_table_insert(t->by_offset, &e->host_offset, e);
+    return true;
+}
+
+static void dedup_table_remove(Qcow2DedupTable *t, Qcow2DedupEntry *e)
+{
+    g_hash_table_remove(t->by_offset, &e->host_offset);
+    /* Frees @e */
+    g_hash_table_remove(t->by_hash, e->hash);
+}
+
+/*
+ * Flush the header to disk before the clusters it no longer references are
+ * reused.
+ */
+static int GRAPH_RDLOCK update_header_sync(BlockDriverState *bs)
+{
+    int ret;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(bs->file->bs);
+}
+
+static bool GRAPH_RDLOCK
+dedup_entry_is_valid(BlockDriverState *bs, uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t table_size = s->dedup_nb_fingerprints * QCOW2_DEDUP_ENTRY_SIZE;
+    uint64_t refcount;
+
+    if (!host_offset || offset_into_cluster(s, host_offset)) {
+        return false;
+    }
+    if (host_offset < s->dedup_table_offset + table_size &&
+        host_offset + s->cluster_size > s->dedup_table_offset) {
+        return false;
+    }
+    if (qcow2_check_metadata_overlap(bs, 0, host_offset, s->cluster_size)) {
+        return false;
+    }
+    return qcow2_get_refcount(bs, host_offset >> s->cluster_bits,
+                              &refcount) == 0 && refcount > 0;
+}
+
+/*
+ * Loads the fingerprint table stored in the image, if any, and removes it
+ * from the image: it becomes stale as soon as the image is modified.
+ *
+ * Called when the image is opened (or reopened) for writing.
+ */
+int qcow2_dedup_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->dedup_table_offset;
+    uint64_t size = s->dedup_nb_fingerprints * QCOW2_DEDUP_ENTRY_SIZE;
+    uint8_t *table = NULL;
+    uint32_t i;
+    int ret;
+
+    assert(has_dedup(s) && !s->dedup);
+    s->dedup = dedup_table_new();
+
+    if (!offset) {
+        return 0;
+    }
+
+    /*
+     * Refcounts may be inconsistent in a dirty image, so the table cannot be
+     * trusted. Its clusters are leaked, the repair reclaims them.
+     */
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        table = g_try_malloc(size);
+        if (table == NULL) {
+            error_setg(errp, "Could not allocate the fingerprint table");
+            return -ENOMEM;
+        }
+
+        ret = bdrv_pread(bs->file, offset, size, table, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the fingerprint "
+                             "table");
+            goto out;
+        }
+
+        for (i = 0; i < s->dedup_nb_fingerprints; i++) {
+            uint8_t *entry = table + i * QCOW2_DEDUP_ENTRY_SIZE;
+            uint64_t host_offset = ldq_be_p(entry + QCOW2_DEDUP_HASH_SIZE);
+
+            /* Fingerprints are only hints, ignore anything suspicious */
+            if (dedup_entry_is_valid(bs, host_offset)) {
+                dedup_table_add(s->dedup, entry, host_offset);
+            }
+        }
+    }
+
+    s->dedup_table_offset = 0;
+    s->dedup_nb_fingerprints = 0;
+    ret = update_header_sync(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        goto out;
+    }
+
+    if (table) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+
+    ret = 0;
+out:
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Writes the in-memory fingerprint table to the image and drops it, so that
+ * the next writer can pick it up.
+ *
+ * Called when the image is closed, inactivated or reopened read-only.
+ */
+int qcow2_dedup_store(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupTable *t = s->dedup;
+    GHashTableIter iter;
+    Qcow2DedupEntry *e;
+    uint8_t *table, *entry;
+    uint32_t nb_fingerprints;
+    uint64_t size;
+    int64_t offset = 0;
+    int ret;
+
+    if (t == NULL) {
+        return 0;
+    }
+    s->dedup = NULL;
+
+    nb_fingerprints = g_hash_table_size(t->by_hash);
+    if (nb_fingerprints == 0) {
+        dedup_table_free(t);
+        return 0;
+    }
+
+    assert(!s->dedup_table_offset);
+    size = nb_fingerprints * QCOW2_DEDUP_ENTRY_SIZE;
+    table = g_try_malloc(size);
+    if (table == NULL) {
+        error_setg(errp, "Could not allocate the fingerprint table");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    entry = table;
+    g_hash_table_iter_init(&iter, t->by_hash);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &e)) {
+        memcpy(entry, e->hash, QCOW2_DEDUP_HASH_SIZE);
+        stq_be_p(entry + QCOW2_DEDUP_HASH_SIZE, e->host_offset);
+        entry += QCOW2_DEDUP_ENTRY_SIZE;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        ret = offset;
+        offset = 0;
+        error_setg_errno(errp, -ret, "Could not allocate the fingerprint "
+                         "table");
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Fingerprint table would overlap with "
+                         "metadata");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, size, table, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the fingerprint table");
+        goto fail;
+    }
+
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush qcow2 metadata");
+        goto fail;
+    }
+
+    s->dedup_table_offset = offset;
+    s->dedup_nb_fingerprints = nb_fingerprints;
+    ret = update_header_sync(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        s->dedup_table_offset = 0;
+        s->dedup_nb_fingerprints = 0;
+        goto fail;
+    }
+
+    g_free(table);
+    dedup_table_free(t);
+    return 0;
+
+fail:
+    if (offset > 0) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+    g_free(table);
+    dedup_table_free(t);
+    return ret;
+}
+
+void qcow2_dedup_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup) {
+        dedup_table_free(s->dedup);
+        s->dedup = NULL;
+    }
+}
+
+/* Forgets all fingerprints, e.g. because all clusters were discarded */
+void qcow2_dedup_clear(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup) {
+        g_hash_table_remove_all(s->dedup->by_offset);
+        g_hash_table_remove_all(s->dedup->by_hash);
+    }
+}
+
+bool qcow2_dedup_has_cluster(BDRVQcow2State *s, uint64_t host_offset)
+{
+    return s->dedup && g_hash_table_contains(s->dedup->by_offset,
+                                             &host_offset);
+}
+
+/* Called when the refcount of the cluster at @host_offset drops to 0 */
+void qcow2_dedup_forget_cluster(BDRVQcow2State *s, uint64_t host_offset)
+{
+    Qcow2DedupEntry *e;
+
+    if (!s->dedup) {
+        return;
+    }
+
+    e = g_hash_table_lookup(s->dedup->by_offset, &host_offset);
+    if (e) {
+        dedup_table_remove(s->dedup, e);
+    }
+}
+
+/*
+ * Adds the fingerprint of cluster number @i of the allocation @m, which is
+ * being linked at @host_offset, to the table.
+ *
+ * Returns true if the fingerprint was added. The L2 entry must then be
+ * written without QCOW_OFLAG_COPIED.
+ */
+bool qcow2_dedup_add_l2meta_cluster(BDRVQcow2State *s, QCowL2Meta *m, int i,
+                                    uint64_t host_offset)
+{
+    const Qcow2DedupHash *hash;
+
+    if (!s->dedup || !m->dedup_hashes ||
+        i < m->dedup_start || i >= m->dedup_start + m->dedup_count) {
+        return false;
+    }
+
+    hash = &m->dedup_hashes[i - m->dedup_start];
+    return hash->valid && dedup_table_add(s->dedup, hash->data, host_offset);
+}
+
+/*
+ * Attaches the fingerprints of @nb_clusters complete clusters that start at
+ * guest offset @start to the allocations in @m that cover them.
+ */
+void qcow2_dedup_attach_hashes(BDRVQcow2State *s, QCowL2Meta *m,
+                               const Qcow2DedupHash *hashes, uint64_t start,
+                               int nb_clusters)
+{
+    uint64_t end = start + ((uint64_t)nb_clusters << s->cluster_bits);
+
+    for (; m != NULL; m = m->next) {
+        uint64_t m_end = m->offset + ((uint64_t)m->nb_clusters <<
+                                      s->cluster_bits);
+        uint64_t from = MAX(m->offset, start);
+        uint64_t to = MIN(m_end, end);
+
+        if (from >= to || m->prealloc) {
+            continue;
+        }
+
+        m->dedup_hashes = hashes + ((from - start) >> s->cluster_bits);
+        m->dedup_start = (from - m->offset) >> s->cluster_bits;
+        m->dedup_count = (to - from) >> s->cluster_bits;
+    }
+}
+
+/*
+ * Returns the number of clusters in @hashes before the first one whose
+ * fingerprint is known, i.e. that can be written without trying to
+ * deduplicate them.
+ */
+int qcow2_dedup_count_unknown(BDRVQcow2State *s, const Qcow2DedupHash *hashes,
+                              int nb_clusters)
+{
+    int i;
+
+    if (!s->dedup) {
+        return nb_clusters;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        if (hashes[i].valid &&
+            g_hash_table_contains(s->dedup->by_hash, hashes[i].data)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static bool dedup_data_equal(QEMUIOVector *qiov, size_t qiov_offset,
+                             const uint8_t *buf, size_t bytes)
+{
+    QEMUIOVector slice;
+    bool equal = true;
+    int i;
+
+    qemu_iovec_init_slice(&slice, qiov, qiov_offset, bytes);
+    for (i = 0; i < slice.niov && equal; i++) {
+        equal = !memcmp(slice.iov[i].iov_base, buf, slice.iov[i].iov_len);
+        buf += slice.iov[i].iov_len;
+    }
+    qemu_iovec_destroy(&slice);
+
+    return equal;
+}
+
+/*
+ * Tries to write the complete cluster at guest offset @offset, whose data is
+ * at @qiov_offset in @qiov and whose fingerprint is @hash, by sharing an
+ * existing host cluster with the same content.
+ *
+ * Returns 1 if the cluster was written this way, 0 if the data must be
+ * written normally and -errno on failure.
+ */
+int coroutine_fn qcow2_co_dedup_cluster(BlockDriverState *bs, uint64_t offset,
+                                        const Qcow2DedupHash *hash,
+                                        QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+    uint64_t host_offset, refcount;
+    uint8_t *buf;
+    bool compared = false, equal = false;
+    int ret;
+
+    if (!hash->valid) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    e = s->dedup ? g_hash_table_lookup(s->dedup->by_hash, hash->data) : NULL;
+    if (e == NULL) {
+        ret = 0;
+        goto out;
+    }
+    host_offset = e->host_offset;
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        goto out;
+    }
+    if (refcount >= s->refcount_max) {
+        /* Start over with a new copy of the data */
+        ret = 0;
+        goto out;
+    }
+
+    /* Keep the cluster from being freed while its content is compared */
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* If the comparison fails for any reason, just write the data */
+    buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (buf) {
+        ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size, buf,
+                            0);
+        if (ret >= 0) {
+            compared = true;
+            equal = dedup_data_equal(qiov, qiov_offset, buf, s->cluster_size);
+        }
+        qemu_vfree(buf);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (equal) {
+        /* The reference taken above goes to the new L2 entry */
+        ret = qcow2_dedup_link_cluster(bs, offset, host_offset);
+    } else {
+        if (compared) {
+            /* A hash collision, don't try this cluster again */
+            trace_qcow2_dedup_mismatch(qemu_coroutine_self(), host_offset);
+            qcow2_dedup_forget_cluster(s, host_offset);
+        }
+        ret = 0;
+    }
+
+    if (ret <= 0) {
+        qcow2_free_clusters(bs, host_offset, s->cluster_size,
+                            QCOW2_DISCARD_NEVER);
+    } else {
+        trace_qcow2_dedup_hit(qemu_coroutine_self(), offset, host_offset);
+    }
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
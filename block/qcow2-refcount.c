@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "block/aio_task.h"
 #include "block/block-io.h"
 #include "qapi/error.h"
 #include "qcow2.h"
@@ -904,6 +905,8 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
+
+            qcow2_dedup_forget_cluster(s, cluster_offset);
         }
     }
 
@@ -1368,6 +1371,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         if (ret < 0) {
                             goto fail;
                         }
+                        /* clusters with a fingerprint are never modified */
+                        if (qcow2_dedup_has_cluster(s, offset)) {
+                            refcount = MAX(refcount, 2);
+                        }
                         break;
 
                     case QCOW2_CLUSTER_ZERO_PLAIN:
@@ -1590,6 +1597,139 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+typedef struct Qcow2CheckProgress {
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
+    int64_t done;
+    int64_t total;
+} Qcow2CheckProgress;
+
+/* Account for one visited L1 entry; @progress may be NULL */
+static void check_progress_advance(BlockDriverState *bs,
+                                   Qcow2CheckProgress *progress)
+{
+    if (progress && progress->status_cb) {
+        progress->done++;
+        progress->status_cb(bs, progress->done, progress->total,
+                            progress->cb_opaque);
+    }
+}
+
+/*
+ * The L2 tables are read ahead of the scan, so that checking a large image
+ * is not bound by the latency of each metadata read.  They are still
+ * processed one by one in L1 order, so errors are reported and repaired in
+ * the same order as with synchronous reads.
+ */
+#define QCOW2_CHECK_L2_READAHEAD 16
+
+typedef struct Qcow2CheckL2Read {
+    uint64_t *l2_table;
+    int ret;
+    bool done;
+} Qcow2CheckL2Read;
+
+typedef struct Qcow2CheckL2Task {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t l2_offset;
+    Qcow2CheckL2Read *read;
+} Qcow2CheckL2Task;
+
+typedef struct Qcow2CheckReadahead {
+    BlockDriverState *bs;
+    AioTaskPool *pool;
+    uint64_t *l2_offsets;
+    int nb_tables;
+    /* Index of the next table to read and of the next one to return */
+    int issued;
+    int next;
+    Qcow2CheckL2Read reads[QCOW2_CHECK_L2_READAHEAD];
+} Qcow2CheckReadahead;
+
+static int coroutine_fn GRAPH_RDLOCK check_l2_read_task_entry(AioTask *task)
+{
+    Qcow2CheckL2Task *t = container_of(task, Qcow2CheckL2Task, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    t->read->ret = bdrv_co_pread(t->bs->file, t->l2_offset,
+                                 s->l2_size * l2_entry_size(s),
+                                 t->read->l2_table, 0);
+    t->read->done = true;
+
+    /* The error is returned by check_l2_readahead_next() */
+    return 0;
+}
+
+/* Takes ownership of @l2_offsets */
+static void coroutine_fn
+check_l2_readahead_init(Qcow2CheckReadahead *ra, BlockDriverState *bs,
+                        uint64_t *l2_offsets, int nb_tables)
+{
+    *ra = (Qcow2CheckReadahead) {
+        .bs = bs,
+        .pool = aio_task_pool_new(QCOW2_CHECK_L2_READAHEAD),
+        .l2_offsets = l2_offsets,
+        .nb_tables = nb_tables,
+    };
+}
+
+/*
+ * Return the next L2 table in *@l2_table, waiting for it to be read if
+ * needed.  The table stays valid until the next call.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+check_l2_readahead_next(Qcow2CheckReadahead *ra, uint64_t **l2_table)
+{
+    BDRVQcow2State *s = ra->bs->opaque;
+    Qcow2CheckL2Read *r;
+
+    assert(ra->next < ra->nb_tables);
+
+    /* All tables before ra->next have been released by the caller */
+    while (ra->issued < ra->nb_tables &&
+           ra->issued - ra->next < QCOW2_CHECK_L2_READAHEAD) {
+        Qcow2CheckL2Task *t = g_new(Qcow2CheckL2Task, 1);
+
+        r = &ra->reads[ra->issued % QCOW2_CHECK_L2_READAHEAD];
+        if (!r->l2_table) {
+            r->l2_table = qemu_blockalign(ra->bs, s->cluster_size);
+        }
+        r->done = false;
+
+        *t = (Qcow2CheckL2Task) {
+            .task.func = check_l2_read_task_entry,
+            .bs = ra->bs,
+            .l2_offset = ra->l2_offsets[ra->issued],
+            .read = r,
+        };
+        ra->issued++;
+        aio_task_pool_start_task(ra->pool, &t->task);
+    }
+
+    r = &ra->reads[ra->next % QCOW2_CHECK_L2_READAHEAD];
+    while (!r->done) {
+        aio_task_pool_wait_one(ra->pool);
+    }
+    ra->next++;
+
+    *l2_table = r->l2_table;
+    return r->ret;
+}
+
+static void coroutine_fn check_l2_readahead_cleanup(Qcow2CheckReadahead *ra)
+{
+    int i;
+
+    aio_task_pool_wait_all(ra->pool);
+    aio_task_pool_free(ra->pool);
+
+    for (i = 0; i < QCOW2_CHECK_L2_READAHEAD; i++) {
+        qemu_vfree(ra->reads[i].l2_table);
+    }
+    g_free(ra->l2_offsets);
+}
+
 /*
  * Fix L2 entry by making it QCOW2_CLUSTER_ZERO_PLAIN (or making all its present
  * subclusters QCOW2_SUBCLUSTER_ZERO_PLAIN).
@@ -1653,8 +1793,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, which was read from @l2_offset.
+ * While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,24 +1803,15 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
-                   int flags, BdrvCheckMode fix, bool active)
+                   uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                   bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1863,13 +1994,16 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table, int64_t *refcount_table_size,
                    int64_t l1_table_offset, int l1_size,
-                   int flags, BdrvCheckMode fix, bool active)
+                   int flags, BdrvCheckMode fix, bool active,
+                   Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
     g_autofree uint64_t *l1_table = NULL;
+    Qcow2CheckReadahead ra;
+    uint64_t *l2_offsets, *l2_table;
     uint64_t l2_offset;
-    int i, ret;
+    int i, nb_tables, ret;
 
     if (!l1_size) {
         return 0;
@@ -1896,12 +2030,19 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    l2_offsets = g_new(uint64_t, l1_size);
+    nb_tables = 0;
     for (i = 0; i < l1_size; i++) {
         be64_to_cpus(&l1_table[i]);
+        if (l1_table[i]) {
+            l2_offsets[nb_tables++] = l1_table[i] & L1E_OFFSET_MASK;
+        }
     }
+    check_l2_readahead_init(&ra, bs, l2_offsets, nb_tables);
 
     /* Do the actual checks */
     for (i = 0; i < l1_size; i++) {
+        check_progress_advance(bs, progress);
         if (!l1_table[i]) {
             continue;
         }
@@ -1919,7 +2060,7 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
                                        refcount_table, refcount_table_size,
                                        l2_offset, s->cluster_size);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
 
         /* L2 tables are cluster aligned */
@@ -1929,16 +2070,27 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
             res->corruptions++;
         }
 
+        ret = check_l2_readahead_next(&ra, &l2_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            goto out;
+        }
+
         /* Process and check L2 entries */
         ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
+                                 refcount_table_size, l2_offset, l2_table,
+                                 flags, fix, active);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
-    return 0;
+    ret = 0;
+
+out:
+    check_l2_readahead_cleanup(&ra);
+    return ret;
 }
 
 /*
@@ -1950,13 +2102,15 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
  * (qcow2_check_refcounts) by the time this function is called).
  */
 static int coroutine_fn GRAPH_RDLOCK
-check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
+check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
+                   BdrvCheckMode fix, Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
-    int ret;
+    Qcow2CheckReadahead ra;
+    uint64_t *l2_offsets, *l2_table;
+    int ret, read_ret;
     uint64_t refcount;
-    int i, j;
+    int i, j, nb_tables;
     bool repair;
 
     if (fix & BDRV_FIX_ERRORS) {
@@ -1971,15 +2125,27 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
         repair = false;
     }
 
+    l2_offsets = g_new(uint64_t, s->l1_size);
+    nb_tables = 0;
+    for (i = 0; i < s->l1_size; i++) {
+        if (s->l1_table[i] & L1E_OFFSET_MASK) {
+            l2_offsets[nb_tables++] = s->l1_table[i] & L1E_OFFSET_MASK;
+        }
+    }
+    check_l2_readahead_init(&ra, bs, l2_offsets, nb_tables);
+
     for (i = 0; i < s->l1_size; i++) {
         uint64_t l1_entry = s->l1_table[i];
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         int l2_dirty = 0;
 
+        check_progress_advance(bs, progress);
         if (!l2_offset) {
             continue;
         }
 
+        read_ret = check_l2_readahead_next(&ra, &l2_table);
+
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &refcount);
         if (ret < 0) {
@@ -2005,12 +2171,11 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
             }
         }
 
-        ret = bdrv_co_pread(bs->file, l2_offset, s->l2_size * l2_entry_size(s),
-                            l2_table, 0);
-        if (ret < 0) {
+        if (read_ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
-                    strerror(-ret));
+                    strerror(-read_ret));
             res->check_errors++;
+            ret = read_ret;
             goto fail;
         }
 
@@ -2032,6 +2197,11 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                         continue;
                     }
                 }
+                if (has_dedup(s) && refcount == 1 &&
+                    !(l2_entry & QCOW_OFLAG_COPIED)) {
+                    /* May be shared by later writes, see qcow2-dedup.c */
+                    continue;
+                }
                 if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
                     res->corruptions++;
                     fprintf(stderr, "%s OFLAG_COPIED data cluster: "
@@ -2074,7 +2244,7 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    check_l2_readahead_cleanup(&ra);
     return ret;
 }
 
@@ -2200,7 +2370,8 @@ resize_fail:
 static int coroutine_fn GRAPH_RDLOCK
 calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     BdrvCheckMode fix, bool *rebuild,
-                    void **refcount_table, int64_t *nb_clusters)
+                    void **refcount_table, int64_t *nb_clusters,
+                    Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -2227,7 +2398,7 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix, true);
+                             fix, true, progress);
     if (ret < 0) {
         return ret;
     }
@@ -2257,7 +2428,7 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                                  sn->l1_table_offset, sn->l1_size, 0, fix,
-                                 false);
+                                 false, progress);
         if (ret < 0) {
             return ret;
         }
@@ -2293,6 +2464,17 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* fingerprint table */
+    if (s->dedup_table_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->dedup_table_offset,
+                                       s->dedup_nb_fingerprints *
+                                       QCOW2_DEDUP_ENTRY_SIZE);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -2780,14 +2962,20 @@ fail:
  * detected as corrupted, and -errno when an internal error occurred.
  */
 int coroutine_fn GRAPH_RDLOCK
-qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
+qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                      BdrvCheckMode fix, BlockDriverCheckStatusCB *status_cb,
+                      void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
-    int ret;
+    Qcow2CheckProgress progress = {
+        .status_cb = status_cb,
+        .cb_opaque = cb_opaque,
+    };
+    int i, ret;
 
     size = bdrv_co_getlength(bs->file->bs);
     if (size < 0) {
@@ -2804,8 +2992,19 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
+    /*
+     * The work is measured in L1 entries: the active L1 table is walked
+     * twice, once here and once for the OFLAG_COPIED check
+     */
+    progress.total = 2 * s->l1_size;
+    for (i = 0; i < s->nb_snapshots; i++) {
+        if (s->snapshots[i].l1_size <= QCOW_MAX_L1_SIZE / L1E_SIZE) {
+            progress.total += s->snapshots[i].l1_size;
+        }
+    }
+
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, &progress);
     if (ret < 0) {
         goto fail;
     }
@@ -2838,7 +3037,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, NULL);
         if (ret < 0) {
             goto fail;
         }
@@ -2887,7 +3086,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
     }
 
     /* check OFLAG_COPIED */
-    ret = check_oflag_copied(bs, res, fix);
+    ret = check_oflag_copied(bs, res, fix, &progress);
     if (ret < 0) {
         goto fail;
     }
@@ -1,5 +1,5 @@
 /*
- * Threaded data processing for Qcow2: compression, encryption
+ * Threaded data processing for Qcow2: compression, encryption, deduplication
  *
  * Copyright (c) 2004-2006 Fabrice Bellard
  * Copyright (c) 2018 Virtuozzo International GmbH. All rights reserved.
@@ -37,6 +37,7 @@
 #include "block/block-io.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 
 static int coroutine_fn
 qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
@@ -525,3 +526,82 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
                            qcrypto_block_decrypt);
 }
+
+
+/*
+ * Deduplication
+ */
+
+typedef struct Qcow2DedupHashData {
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    size_t cluster_size;
+    int nb_clusters;
+    Qcow2DedupHash *hashes;
+} Qcow2DedupHashData;
+
+static int qcow2_dedup_hash_pool_func(void *opaque)
+{
+    Qcow2DedupHashData *data = opaque;
+    int i;
+
+    for (i = 0; i < data->nb_clusters; i++) {
+        Qcow2DedupHash *hash = &data->hashes[i];
+        size_t offset = data->qiov_offset + i * data->cluster_size;
+        QEMUIOVector cluster;
+        uint8_t *result = NULL;
+        size_t result_len;
+        int ret;
+
+        hash->valid = false;
+
+        /*
+         * Sharing a single zero cluster would quickly overflow its refcount,
+         * and zero writes are better handled by the zero flag anyway
+         */
+        if (qemu_iovec_is_zero(data->qiov, offset, data->cluster_size)) {
+            continue;
+        }
+
+        qemu_iovec_init_slice(&cluster, data->qiov, offset,
+                              data->cluster_size);
+        ret = qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, cluster.iov,
+                                  cluster.niov, &result, &result_len, NULL);
+        qemu_iovec_destroy(&cluster);
+
+        if (ret == 0) {
+            assert(result_len == QCOW2_DEDUP_HASH_SIZE);
+            memcpy(hash->data, result, QCOW2_DEDUP_HASH_SIZE);
+            hash->valid = true;
+        }
+        g_free(result);
+    }
+
+    return 0;
+}
+
+/*
+ * qcow2_co_dedup_hash()
+ *
+ * Computes the fingerprints of @nb_clusters complete clusters of data, from
+ * offset @qiov_offset in @qiov on.  Clusters that cannot be deduplicated are
+ * marked as invalid in @hashes.
+ *
+ * @hashes - array of @nb_clusters fingerprints to fill in
+ */
+void coroutine_fn
+qcow2_co_dedup_hash(BlockDriverState *bs, QEMUIOVector *qiov,
+                    size_t qiov_offset, int nb_clusters,
+                    Qcow2DedupHash *hashes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupHashData arg = {
+        .qiov = qiov,
+        .qiov_offset = qiov_offset,
+        .cluster_size = s->cluster_size,
+        .nb_clusters = nb_clusters,
+        .hashes = hashes,
+    };
+
+    qcow2_co_process(bs, qcow2_dedup_hash_pool_func, &arg);
+}
@@ -73,6 +73,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_DEDUP 0x64656475
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -211,6 +212,7 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     uint64_t offset;
     int ret;
     Qcow2BitmapHeaderExt bitmaps_ext;
+    Qcow2DedupHeaderExt dedup_ext;
 
     if (need_update_header != NULL) {
         *need_update_header = false;
@@ -432,6 +434,53 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_DEDUP:
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            if (!has_dedup(s)) {
+                error_setg(errp, "dedup_ext: Deduplication extension found "
+                           "without the deduplication feature bit");
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dedup_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (dedup_ext.reserved32 != 0) {
+                error_setg(errp, "dedup_ext: Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            dedup_ext.fingerprint_table_offset =
+                be64_to_cpu(dedup_ext.fingerprint_table_offset);
+            dedup_ext.nb_fingerprints =
+                be32_to_cpu(dedup_ext.nb_fingerprints);
+
+            if (dedup_ext.nb_fingerprints == 0 ||
+                dedup_ext.nb_fingerprints > QCOW2_DEDUP_MAX_FINGERPRINTS) {
+                error_setg(errp, "dedup_ext: Invalid number of fingerprints "
+                           "(%" PRIu32 ")", dedup_ext.nb_fingerprints);
+                return -EINVAL;
+            }
+
+            if (dedup_ext.fingerprint_table_offset == 0 ||
+                offset_into_cluster(s, dedup_ext.fingerprint_table_offset)) {
+                error_setg(errp, "dedup_ext: "
+                                 "Invalid fingerprint table offset");
+                return -EINVAL;
+            }
+
+            s->dedup_table_offset = dedup_ext.fingerprint_table_offset;
+            s->dedup_nb_fingerprints = dedup_ext.nb_fingerprints;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -606,7 +655,8 @@ static void qcow2_add_check_result(BdrvCheckResult *out,
 
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
-                      BdrvCheckMode fix)
+                      BdrvCheckMode fix, BlockDriverCheckStatusCB *status_cb,
+                      void *cb_opaque)
 {
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
@@ -620,7 +670,7 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
         return ret;
     }
 
-    ret = qcow2_check_refcounts(bs, &refcount_res, fix);
+    ret = qcow2_check_refcounts(bs, &refcount_res, fix, status_cb, cb_opaque);
     qcow2_add_check_result(result, &refcount_res, true);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -645,13 +695,14 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_check(BlockDriverState *bs, BdrvCheckResult *result,
-               BdrvCheckMode fix)
+               BdrvCheckMode fix, BlockDriverCheckStatusCB *status_cb,
+               void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_co_check_locked(bs, result, fix);
+    ret = qcow2_co_check_locked(bs, result, fix, status_cb, cb_opaque);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -974,6 +1025,7 @@ typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
     int l2_slice_size; /* Number of entries in a slice of the L2 table */
+    int l2_prefetch_slices;
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
@@ -1051,6 +1103,8 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     }
 
     r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    /* Keep most of the cache for the slices that are actually in use */
+    r->l2_prefetch_slices = MIN(QCOW2_L2_PREFETCH_SLICES, l2_cache_size / 4);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1229,6 +1283,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
+    s->l2_prefetch_slices = r->l2_prefetch_slices;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -1495,6 +1550,15 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     s->refcount_max += s->refcount_max - 1;
 
     s->crypt_method_header = header.crypt_method;
+    if (has_dedup(s) &&
+        (s->crypt_method_header || has_subclusters(s) ||
+         (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE))) {
+        error_setg(errp, "Deduplication is not supported with encryption, "
+                   "extended L2 entries or external data files");
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
     if (s->crypt_method_header) {
         if (bdrv_uses_whitelist() &&
             s->crypt_method_header == QCOW_CRYPT_AES) {
@@ -1836,6 +1900,13 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
 
         update_header = update_header && !header_updated;
+
+        if (has_dedup(s) && bdrv_is_writable(bs)) {
+            ret = qcow2_dedup_load(bs, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
     }
 
     if (update_header) {
@@ -1856,7 +1927,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         BdrvCheckResult result = {0};
 
         ret = qcow2_co_check_locked(bs, &result,
-                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS,
+                                    NULL, NULL);
         if (ret < 0 || result.check_errors) {
             if (ret >= 0) {
                 ret = -EIO;
@@ -1869,7 +1941,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
+        qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
 
@@ -1887,6 +1959,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    qcow2_dedup_free(bs);
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
@@ -1997,6 +2070,11 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        ret = qcow2_dedup_store(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2043,6 +2121,25 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
     g_free(state->opaque);
 }
 
+/*
+ * Takes the fingerprint table back after the image has become writable, or
+ * after qcow2_reopen_prepare() stored it but the image stays writable.
+ */
+static void GRAPH_RDLOCK qcow2_reopen_dedup_rw(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Error *local_err = NULL;
+
+    if (!has_dedup(s) || s->dedup || (bdrv_get_flags(bs) & BDRV_O_INACTIVE)) {
+        return;
+    }
+
+    if (qcow2_dedup_load(bs, &local_err) < 0) {
+        error_reportf_err(local_err, "%s: Failed to load the fingerprint "
+                          "table: ", bdrv_get_node_name(bs));
+    }
+}
+
 static void qcow2_reopen_commit_post(BDRVReopenState *state)
 {
     GRAPH_RDLOCK_GUARD_MAINLOOP();
@@ -2060,6 +2157,8 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        qcow2_reopen_dedup_rw(state->bs);
     }
 }
 
@@ -2076,6 +2175,9 @@ static void qcow2_reopen_abort(BDRVReopenState *state)
          */
         s->data_file = state->bs->file;
     }
+    if (bdrv_get_flags(state->bs) & BDRV_O_RDWR) {
+        qcow2_reopen_dedup_rw(state->bs);
+    }
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
 }
@@ -2392,6 +2494,9 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
         qemu_co_mutex_lock(&s->lock);
         ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
                                     &host_offset, &type);
+        if (ret == 0) {
+            qcow2_l2_prefetch_notify(bs, offset, cur_bytes);
+        }
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -2671,10 +2776,26 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    /* Fingerprints of the complete clusters in [dedup_start, dedup_end) */
+    Qcow2DedupHash *dedup_hashes = NULL;
+    uint64_t dedup_start = 0, dedup_end = 0;
+    int dedup_clusters = 0;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
+    if (s->dedup) {
+        dedup_start = ROUND_UP(offset, s->cluster_size);
+        dedup_end = QEMU_ALIGN_DOWN(offset + bytes, s->cluster_size);
+        if (dedup_start < dedup_end) {
+            dedup_clusters = (dedup_end - dedup_start) >> s->cluster_bits;
+            dedup_hashes = g_new(Qcow2DedupHash, dedup_clusters);
+            qcow2_co_dedup_hash(bs, qiov, qiov_offset + dedup_start - offset,
+                                dedup_clusters, dedup_hashes);
+        }
+    }
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        int dedup_index = 0;
 
         l2meta = NULL;
 
@@ -2687,14 +2808,44 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
+        if (dedup_hashes && offset >= dedup_start && offset < dedup_end) {
+            dedup_index = (offset - dedup_start) >> s->cluster_bits;
+            ret = qcow2_co_dedup_cluster(bs, offset, &dedup_hashes[dedup_index],
+                                         qiov, qiov_offset);
+            if (ret < 0) {
+                goto fail_nometa;
+            } else if (ret > 0) {
+                cur_bytes = s->cluster_size;
+                goto next;
+            }
+            /* This cluster must be written, look from the next one on */
+            dedup_index++;
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
+        if (dedup_hashes && offset < dedup_end) {
+            /* Stop before the next cluster that may be deduplicated */
+            int n = qcow2_dedup_count_unknown(s, &dedup_hashes[dedup_index],
+                                              dedup_clusters - dedup_index);
+            if (dedup_index + n < dedup_clusters) {
+                uint64_t limit = dedup_start +
+                    ((uint64_t)(dedup_index + n) << s->cluster_bits) - offset;
+                cur_bytes = MIN(cur_bytes, limit);
+            }
+        }
+
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
                                       &host_offset, &l2meta);
         if (ret < 0) {
             goto out_locked;
         }
 
+        if (dedup_hashes) {
+            qcow2_dedup_attach_hashes(s, l2meta, dedup_hashes, dedup_start,
+                                      dedup_clusters);
+        }
+
         ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
                                             cur_bytes, true);
         if (ret < 0) {
@@ -2714,6 +2865,7 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto fail_nometa;
         }
 
+    next:
         bytes -= cur_bytes;
         offset += cur_bytes;
         qiov_offset += cur_bytes;
@@ -2737,6 +2889,9 @@ fail_nometa:
         g_free(aio);
     }
 
+    /* The write tasks are done with the fingerprints now */
+    g_free(dedup_hashes);
+
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
 
     return ret;
@@ -2747,6 +2902,7 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
     Error *local_err = NULL;
+    Error *dedup_err = NULL;
 
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
@@ -2756,6 +2912,13 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    /* Losing the fingerprints only means that less data is deduplicated */
+    if (qcow2_dedup_store(bs, &dedup_err) < 0) {
+        error_reportf_err(dedup_err, "Lost the fingerprint table during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2799,6 +2962,7 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    qcow2_dedup_free(bs);
 
     g_free(s->image_data_file);
     g_free(s->image_backing_file);
@@ -3067,6 +3231,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_DEDUP_BITNR,
+                .name = "deduplication",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3112,6 +3281,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Deduplication extension */
+    if (s->dedup_table_offset) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .fingerprint_table_offset = cpu_to_be64(s->dedup_table_offset),
+            .nb_fingerprints = cpu_to_be32(s->dedup_nb_fingerprints),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP,
+                             &dedup_header, sizeof(dedup_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -3687,6 +3872,27 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         compression_type = qcow2_opts->compression_type;
     }
 
+    if (!qcow2_opts->has_dedup) {
+        qcow2_opts->dedup = false;
+    }
+    if (qcow2_opts->dedup) {
+        if (version < 3) {
+            error_setg(errp, "Deduplication is only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (qcow2_opts->encrypt || qcow2_opts->data_file ||
+            qcow2_opts->extended_l2)
+        {
+            error_setg(errp, "Deduplication cannot be used with encryption, "
+                       "external data files or extended L2 entries");
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     /* Create BlockBackend to write to the image */
     blk = blk_co_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
                              errp);
@@ -3739,6 +3945,11 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
             cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
     }
 
+    if (qcow2_opts->dedup) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_DEDUP);
+    }
+
     ret = blk_co_pwrite(blk, 0, cluster_size, header, 0);
     g_free(header);
     if (ret < 0) {
@@ -4877,6 +5088,9 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    /* None of the fingerprinted clusters survive */
+    qcow2_dedup_clear(bs);
+
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
@@ -5281,6 +5495,8 @@ qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
             .compression_type   = s->compression_type,
+            .has_dedup          = has_dedup(s),
+            .dedup              = has_dedup(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5454,6 +5670,11 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_dedup(s)) {
+        error_setg(errp, "Cannot downgrade an image with deduplication");
+        return -ENOTSUP;
+    }
+
     /*
      * If any internal snapshot has a different size than the current
      * image size, or VM state size that exceeds 32 bits, downgrading
@@ -6087,6 +6308,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Extended L2 tables",                               \
             .def_value_str = "off"                                      \
         },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_DEDUP,                                    \
+            .type = QEMU_OPT_BOOL,                                      \
+            .help = "Deduplicate clusters with identical data",         \
+        },                                                              \
         {                                                               \
             .name = BLOCK_OPT_PREALLOC,                                 \
             .type = QEMU_OPT_STRING,                                    \
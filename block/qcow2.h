@@ -71,6 +71,13 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/* Number of L2 slices loaded ahead of a sequential read stream */
+#define QCOW2_L2_PREFETCH_SLICES 4
+/* Number of contiguous reads after which a stream is considered sequential */
+#define QCOW2_L2_PREFETCH_MIN_SEQ 4
+/* Reads at most this far from the end of the last one are still contiguous */
+#define QCOW2_L2_PREFETCH_WINDOW (4 * MiB)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -256,17 +263,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_DEDUP_BITNR      = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_DEDUP            = 1 << QCOW2_INCOMPAT_DEDUP_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_DEDUP,
 };
 
 /* Compatible feature bits */
@@ -322,6 +332,32 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t fingerprint_table_offset;
+    uint32_t nb_fingerprints;
+    uint32_t reserved32;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+/* SHA-256 */
+#define QCOW2_DEDUP_HASH_SIZE 32
+
+/* Size of a fingerprint table entry: hash and host offset */
+#define QCOW2_DEDUP_ENTRY_SIZE (QCOW2_DEDUP_HASH_SIZE + sizeof(uint64_t))
+
+/*
+ * Maximum number of fingerprints kept per image. With 64k clusters this
+ * covers 64 GB of unique data for about 100 MB of memory.
+ */
+#define QCOW2_DEDUP_MAX_FINGERPRINTS (1024 * 1024)
+
+typedef struct Qcow2DedupHash {
+    uint8_t data[QCOW2_DEDUP_HASH_SIZE];
+    /* false for clusters that are not candidates, e.g. because they are zero */
+    bool valid;
+} Qcow2DedupHash;
+
+typedef struct Qcow2DedupTable Qcow2DedupTable;
+
 #define QCOW2_MAX_THREADS 4
 
 typedef struct BDRVQcow2State {
@@ -348,6 +384,14 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* L2 slice prefetching for sequential reads, protected by lock */
+    int l2_prefetch_slices;         /* 0 if prefetching is disabled */
+    unsigned l2_prefetch_seq;       /* number of contiguous reads seen */
+    uint64_t l2_prefetch_next;      /* expected guest offset of next read */
+    uint64_t l2_prefetch_start;     /* first guest offset still to prefetch */
+    uint64_t l2_prefetch_end;       /* guest offset to prefetch up to */
+    bool l2_prefetch_running;       /* prefetch coroutine is active */
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -374,6 +418,12 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /* Fingerprint table as stored in the image, only valid after clean close */
+    uint64_t dedup_table_offset;
+    uint32_t dedup_nb_fingerprints;
+    /* In-memory fingerprints, NULL unless deduplicating writes */
+    Qcow2DedupTable *dedup;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -496,6 +546,16 @@ typedef struct QCowL2Meta
     QEMUIOVector *data_qiov;
     size_t data_qiov_offset;
 
+    /**
+     * Fingerprints of the clusters that the guest writes completely, which
+     * are added to the fingerprint table when the clusters are linked.
+     * dedup_hashes[0] belongs to cluster number dedup_start of this
+     * allocation, NULL if there is nothing to add.
+     */
+    const Qcow2DedupHash *dedup_hashes;
+    int dedup_start;
+    int dedup_count;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -598,6 +658,11 @@ typedef enum QCow2MetadataOverlap {
 
 #define INV_OFFSET (-1ULL)
 
+static inline bool has_dedup(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_DEDUP;
+}
+
 static inline bool has_subclusters(BDRVQcow2State *s)
 {
     return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
@@ -888,7 +953,9 @@ qcow2_update_snapshot_refcount(BlockDriverState *bs, int64_t l1_table_offset,
 int GRAPH_RDLOCK qcow2_flush_caches(BlockDriverState *bs);
 int GRAPH_RDLOCK qcow2_write_caches(BlockDriverState *bs);
 int coroutine_fn qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                                       BdrvCheckMode fix);
+                                       BdrvCheckMode fix,
+                                       BlockDriverCheckStatusCB *status_cb,
+                                       void *cb_opaque);
 
 void GRAPH_RDLOCK qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -932,6 +999,10 @@ qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
 
+void coroutine_fn GRAPH_RDLOCK
+qcow2_l2_prefetch_notify(BlockDriverState *bs, uint64_t offset,
+                         uint64_t bytes);
+
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                         unsigned int *bytes, uint64_t *host_offset,
@@ -947,6 +1018,10 @@ qcow2_parse_compressed_l2_entry(BlockDriverState *bs, uint64_t l2_entry,
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_link_cluster(BlockDriverState *bs, uint64_t offset,
+                         uint64_t host_offset);
+
 void coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 
@@ -1018,6 +1093,9 @@ int GRAPH_RDLOCK
 qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                       void **table);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_cache_prefetch(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset);
+
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
@@ -1058,6 +1136,27 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-dedup.c functions */
+int GRAPH_RDLOCK qcow2_dedup_load(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_dedup_store(BlockDriverState *bs, Error **errp);
+void qcow2_dedup_free(BlockDriverState *bs);
+void qcow2_dedup_clear(BlockDriverState *bs);
+
+bool qcow2_dedup_has_cluster(BDRVQcow2State *s, uint64_t host_offset);
+void qcow2_dedup_forget_cluster(BDRVQcow2State *s, uint64_t host_offset);
+bool qcow2_dedup_add_l2meta_cluster(BDRVQcow2State *s, QCowL2Meta *m, int i,
+                                    uint64_t host_offset);
+void qcow2_dedup_attach_hashes(BDRVQcow2State *s, QCowL2Meta *m,
+                               const Qcow2DedupHash *hashes, uint64_t start,
+                               int nb_clusters);
+int qcow2_dedup_count_unknown(BDRVQcow2State *s, const Qcow2DedupHash *hashes,
+                              int nb_clusters);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_dedup_cluster(BlockDriverState *bs, uint64_t offset,
+                       const Qcow2DedupHash *hash, QEMUIOVector *qiov,
+                       size_t qiov_offset);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -1070,5 +1169,9 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+void coroutine_fn
+qcow2_co_dedup_hash(BlockDriverState *bs, QEMUIOVector *qiov,
+                    size_t qiov_offset, int nb_clusters,
+                    Qcow2DedupHash *hashes);
 
 #endif
@@ -0,0 +1,680 @@
+/*
+ * Read cache filter driver
+ *
+ * Keeps recently read data of the child node in memory. This is meant for
+ * nodes that are opened with cache.direct=on, e.g. a base image that many
+ * guests boot from, where the host page cache must not be used, but the same
+ * data is still read over and over again.
+ *
+ * All read-cache nodes on top of the same child node share one cache. The
+ * cache is split into shards with their own lock and eviction list, so that
+ * requests from different threads rarely contend. Writes to the child that
+ * do not go through a read-cache node would not be noticed by the cache, so
+ * other users of the child may neither write to it nor resize it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
+#include "qapi/util.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define READ_CACHE_OPT_SIZE "size"
+#define READ_CACHE_OPT_CHUNK_SIZE "chunk-size"
+#define READ_CACHE_OPT_SHARDS "shards"
+#define READ_CACHE_OPT_EVICTION "eviction"
+
+#define READ_CACHE_DEFAULT_SIZE (64 * MiB)
+#define READ_CACHE_DEFAULT_CHUNK_SIZE (64 * KiB)
+#define READ_CACHE_DEFAULT_SHARDS 16
+#define READ_CACHE_MAX_SHARDS 256
+
+/* Maximum number of bytes read from the child at once to fill the cache */
+#define READ_CACHE_MAX_FILL (1 * MiB)
+
+typedef struct ReadCacheChunk {
+    uint64_t index;     /* offset / chunk_size */
+    uint8_t *data;
+    QTAILQ_ENTRY(ReadCacheChunk) next;
+} ReadCacheChunk;
+
+typedef struct ReadCacheShard {
+    QemuMutex lock;
+    /* Maps chunk indices to chunks, protected by lock */
+    GHashTable *chunks;
+    /* Eviction order, the head is evicted first, protected by lock */
+    QTAILQ_HEAD(, ReadCacheChunk) order;
+    uint64_t nchunks;
+    uint64_t max_chunks;
+} ReadCacheShard;
+
+typedef struct ReadCache {
+    /* Only accessed in the main loop */
+    BlockDriverState *child;
+    int refcnt;
+
+    /* Configuration, constant after creation */
+    uint64_t size;
+    uint64_t chunk_size;
+    unsigned nshards;
+    ReadCacheEviction eviction;
+
+    /*
+     * Writes through any of the read-cache nodes that share the cache.
+     * Data read from the child is only added to the cache if no write
+     * overlapped with the read, see read_cache_insert().
+     */
+    unsigned writes_in_flight;
+    unsigned write_gen;
+
+    Stat64 evictions;
+    ReadCacheShard *shards;
+} ReadCache;
+
+typedef struct BDRVReadCacheState {
+    ReadCache *cache;
+
+    Stat64 hits;
+    Stat64 misses;
+} BDRVReadCacheState;
+
+/* Caches by child node, so that all filters on a node use the same cache */
+static GHashTable *read_caches;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum amount of cached data, default 64M",
+        },
+        {
+            .name = READ_CACHE_OPT_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the cache, default 64k",
+        },
+        {
+            .name = READ_CACHE_OPT_SHARDS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of independently locked parts of the cache, "
+                "default 16",
+        },
+        {
+            .name = READ_CACHE_OPT_EVICTION,
+            .type = QEMU_OPT_STRING,
+            .help = "eviction policy (lru, fifo), default lru",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void read_cache_chunk_free(ReadCacheChunk *chunk)
+{
+    g_free(chunk->data);
+    g_free(chunk);
+}
+
+static ReadCache *read_cache_new(BlockDriverState *child, uint64_t size,
+                                 uint64_t chunk_size, unsigned nshards,
+                                 ReadCacheEviction eviction)
+{
+    ReadCache *cache = g_new0(ReadCache, 1);
+    uint64_t max_chunks = MAX(size / chunk_size / nshards, 1);
+    unsigned i;
+
+    *cache = (ReadCache) {
+        .child = child,
+        .refcnt = 1,
+        .size = size,
+        .chunk_size = chunk_size,
+        .nshards = nshards,
+        .eviction = eviction,
+        .shards = g_new0(ReadCacheShard, nshards),
+    };
+
+    for (i = 0; i < nshards; i++) {
+        ReadCacheShard *shard = &cache->shards[i];
+
+        qemu_mutex_init(&shard->lock);
+        shard->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+        QTAILQ_INIT(&shard->order);
+        shard->max_chunks = max_chunks;
+    }
+
+    return cache;
+}
+
+static void read_cache_free(ReadCache *cache)
+{
+    unsigned i;
+
+    for (i = 0; i < cache->nshards; i++) {
+        ReadCacheShard *shard = &cache->shards[i];
+        ReadCacheChunk *chunk, *next;
+
+        QTAILQ_FOREACH_SAFE(chunk, &shard->order, next, next) {
+            read_cache_chunk_free(chunk);
+        }
+        g_hash_table_destroy(shard->chunks);
+        qemu_mutex_destroy(&shard->lock);
+    }
+
+    g_free(cache->shards);
+    g_free(cache);
+}
+
+static ReadCacheShard *read_cache_shard(ReadCache *cache, uint64_t index)
+{
+    return &cache->shards[index % cache->nshards];
+}
+
+/* Called with shard->lock held */
+static void read_cache_remove(ReadCacheShard *shard, ReadCacheChunk *chunk)
+{
+    g_hash_table_remove(shard->chunks, &chunk->index);
+    QTAILQ_REMOVE(&shard->order, chunk, next);
+    shard->nchunks--;
+    read_cache_chunk_free(chunk);
+}
+
+/* Drops all cached data in [offset, offset + bytes) */
+static void read_cache_invalidate(ReadCache *cache, int64_t offset,
+                                  int64_t bytes)
+{
+    uint64_t first = offset / cache->chunk_size;
+    uint64_t last = (offset + bytes - 1) / cache->chunk_size;
+    uint64_t index;
+    unsigned i;
+
+    if (bytes <= 0) {
+        return;
+    }
+
+    /* Large ranges are cheaper to handle by looking at each cached chunk */
+    if (last - first >= cache->size / cache->chunk_size) {
+        for (i = 0; i < cache->nshards; i++) {
+            ReadCacheShard *shard = &cache->shards[i];
+            ReadCacheChunk *chunk, *next;
+
+            QEMU_LOCK_GUARD(&shard->lock);
+            QTAILQ_FOREACH_SAFE(chunk, &shard->order, next, next) {
+                if (chunk->index >= first && chunk->index <= last) {
+                    read_cache_remove(shard, chunk);
+                }
+            }
+        }
+        return;
+    }
+
+    for (index = first; index <= last; index++) {
+        ReadCacheShard *shard = read_cache_shard(cache, index);
+        ReadCacheChunk *chunk;
+
+        QEMU_LOCK_GUARD(&shard->lock);
+        chunk = g_hash_table_lookup(shard->chunks, &index);
+        if (chunk) {
+            read_cache_remove(shard, chunk);
+        }
+    }
+}
+
+/*
+ * Copies the cached part of chunk @index that overlaps with the request into
+ * @qiov. Returns false if the chunk is not cached.
+ */
+static bool read_cache_lookup(ReadCache *cache, uint64_t index,
+                              uint64_t offset_in_chunk, uint64_t bytes,
+                              QEMUIOVector *qiov, size_t qiov_offset)
+{
+    ReadCacheShard *shard = read_cache_shard(cache, index);
+    ReadCacheChunk *chunk;
+
+    QEMU_LOCK_GUARD(&shard->lock);
+
+    chunk = g_hash_table_lookup(shard->chunks, &index);
+    if (!chunk) {
+        return false;
+    }
+
+    if (cache->eviction == READ_CACHE_EVICTION_LRU) {
+        QTAILQ_REMOVE(&shard->order, chunk, next);
+        QTAILQ_INSERT_TAIL(&shard->order, chunk, next);
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, chunk->data + offset_in_chunk,
+                        bytes);
+    return true;
+}
+
+/*
+ * Adds the data of chunk @index, which was read from the child while the
+ * write generation was @gen, to the cache.
+ *
+ * The data is only added if no write was in flight during the whole read.
+ * A write that starts after the check invalidates the chunk again when it
+ * completes, which takes the shard lock after the chunk has been added.
+ */
+static void read_cache_insert(ReadCache *cache, uint64_t index,
+                              const uint8_t *buf, unsigned gen)
+{
+    ReadCacheShard *shard = read_cache_shard(cache, index);
+    ReadCacheChunk *chunk;
+
+    QEMU_LOCK_GUARD(&shard->lock);
+
+    if (qatomic_read(&cache->writes_in_flight) ||
+        qatomic_read(&cache->write_gen) != gen ||
+        g_hash_table_contains(shard->chunks, &index)) {
+        return;
+    }
+
+    if (shard->nchunks >= shard->max_chunks) {
+        read_cache_remove(shard, QTAILQ_FIRST(&shard->order));
+        stat64_add(&cache->evictions, 1);
+    }
+
+    chunk = g_new(ReadCacheChunk, 1);
+    chunk->index = index;
+    chunk->data = g_memdup2(buf, cache->chunk_size);
+
+    g_hash_table_insert(shard->chunks, &chunk->index, chunk);
+    QTAILQ_INSERT_TAIL(&shard->order, chunk, next);
+    shard->nchunks++;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    Error *local_err = NULL;
+    ReadCacheEviction eviction;
+    uint64_t size, chunk_size, nshards;
+    ReadCache *cache;
+    QemuOpts *opts;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE,
+                             READ_CACHE_DEFAULT_SIZE);
+    chunk_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CHUNK_SIZE,
+                                   READ_CACHE_DEFAULT_CHUNK_SIZE);
+    nshards = qemu_opt_get_number(opts, READ_CACHE_OPT_SHARDS,
+                                  READ_CACHE_DEFAULT_SHARDS);
+    eviction = qapi_enum_parse(&ReadCacheEviction_lookup,
+                               qemu_opt_get(opts, READ_CACHE_OPT_EVICTION),
+                               READ_CACHE_EVICTION_LRU, &local_err);
+    qemu_opts_del(opts);
+
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EINVAL;
+    }
+    if (!is_power_of_2(chunk_size) || chunk_size < BDRV_SECTOR_SIZE ||
+        chunk_size > READ_CACHE_MAX_FILL) {
+        error_setg(errp, "chunk-size must be a power of two between %"
+                   PRIu64 " and %" PRIu64, (uint64_t)BDRV_SECTOR_SIZE,
+                   (uint64_t)READ_CACHE_MAX_FILL);
+        return -EINVAL;
+    }
+    if (size < chunk_size) {
+        error_setg(errp, "size must be at least chunk-size");
+        return -EINVAL;
+    }
+    if (nshards == 0 || nshards > READ_CACHE_MAX_SHARDS) {
+        error_setg(errp, "shards must be between 1 and %d",
+                   READ_CACHE_MAX_SHARDS);
+        return -EINVAL;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (!read_caches) {
+        read_caches = g_hash_table_new(NULL, NULL);
+    }
+
+    cache = g_hash_table_lookup(read_caches, bs->file->bs);
+    if (cache) {
+        if (cache->size != size || cache->chunk_size != chunk_size ||
+            cache->nshards != nshards || cache->eviction != eviction) {
+            error_setg(errp, "Node '%s' already has a read cache with a "
+                       "different configuration",
+                       bdrv_get_node_name(bs->file->bs));
+            return -EINVAL;
+        }
+        cache->refcnt++;
+    } else {
+        cache = read_cache_new(bs->file->bs, size, chunk_size, nshards,
+                               eviction);
+        g_hash_table_insert(read_caches, bs->file->bs, cache);
+    }
+    s->cache = cache;
+
+    stat64_init(&s->hits, 0);
+    stat64_init(&s->misses, 0);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    bs->supported_truncate_flags = bs->file->bs->supported_truncate_flags &
+        BDRV_REQ_ZERO_WRITE;
+
+    return 0;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *cache = s->cache;
+
+    if (--cache->refcnt == 0) {
+        g_hash_table_remove(read_caches, cache->child);
+        read_cache_free(cache);
+    }
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/*
+ * Reads the chunks [first, last] from the child, adds them to the cache and
+ * copies the requested part of them into @qiov.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_fill(BlockDriverState *bs, uint64_t first, uint64_t last,
+                int64_t offset, int64_t bytes, QEMUIOVector *qiov,
+                size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *cache = s->cache;
+    int64_t fill_offset = first * cache->chunk_size;
+    int64_t fill_bytes = (last - first + 1) * cache->chunk_size;
+    unsigned gen = qatomic_read(&cache->write_gen);
+    uint64_t index;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(bs->file->bs, fill_bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    /* Reads after the end of the child return zeroes */
+    ret = bdrv_co_pread(bs->file, fill_offset, fill_bytes, buf, 0);
+    trace_read_cache_fill(bs, fill_offset, fill_bytes, ret);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - fill_offset),
+                        bytes);
+
+    for (index = first; index <= last; index++) {
+        read_cache_insert(cache, index,
+                          buf + (index - first) * cache->chunk_size, gen);
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *cache = s->cache;
+    uint64_t max_fill_chunks = READ_CACHE_MAX_FILL / cache->chunk_size;
+    int64_t end = offset + bytes;
+
+    while (offset < end) {
+        uint64_t index = offset / cache->chunk_size;
+        uint64_t offset_in_chunk = offset % cache->chunk_size;
+        int64_t cur_bytes = MIN(end - offset,
+                                cache->chunk_size - offset_in_chunk);
+        uint64_t last;
+        int ret;
+
+        if (read_cache_lookup(cache, index, offset_in_chunk, cur_bytes,
+                              qiov, qiov_offset)) {
+            stat64_add(&s->hits, 1);
+            offset += cur_bytes;
+            qiov_offset += cur_bytes;
+            continue;
+        }
+
+        /* Read all following chunks of the request that are missing, too */
+        last = index;
+        while (last - index + 1 < max_fill_chunks &&
+               (last + 1) * cache->chunk_size < end) {
+            ReadCacheShard *shard = read_cache_shard(cache, last + 1);
+            uint64_t next = last + 1;
+            bool cached;
+
+            WITH_QEMU_LOCK_GUARD(&shard->lock) {
+                cached = g_hash_table_contains(shard->chunks, &next);
+            }
+            if (cached) {
+                break;
+            }
+            last = next;
+        }
+
+        cur_bytes = MIN(end, (last + 1) * cache->chunk_size) - offset;
+        stat64_add(&s->misses, last - index + 1);
+
+        ret = read_cache_fill(bs, index, last, offset, cur_bytes, qiov,
+                              qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
+
+static void read_cache_write_begin(ReadCache *cache)
+{
+    qatomic_inc(&cache->writes_in_flight);
+    qatomic_inc(&cache->write_gen);
+}
+
+static void read_cache_write_end(ReadCache *cache, int64_t offset,
+                                 int64_t bytes)
+{
+    read_cache_invalidate(cache, offset, bytes);
+    qatomic_inc(&cache->write_gen);
+    qatomic_dec(&cache->writes_in_flight);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    if (flags & BDRV_REQ_WRITE_UNCHANGED) {
+        return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                    qiov_offset, flags);
+    }
+
+    read_cache_write_begin(s->cache);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    read_cache_write_end(s->cache, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_write_begin(s->cache);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_write_end(s->cache, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_write_begin(s->cache);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_write_end(s->cache, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t old_length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int64_t start = MIN(old_length, offset);
+    int ret;
+
+    /* The chunk at the old end of the node caches zeroes after the end */
+    read_cache_write_begin(s->cache);
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    read_cache_write_end(s->cache, start, INT64_MAX - start);
+
+    return ret;
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+read_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /* The image may have been changed while the node was inactive */
+    read_cache_invalidate(s->cache, 0, INT64_MAX);
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /*
+     * Don't share, to keep the cached data valid. This also applies to other
+     * read-cache nodes on the same child, so a shared cache is read-only.
+     */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *cache = s->cache;
+    uint64_t nchunks = 0;
+    unsigned i;
+
+    for (i = 0; i < cache->nshards; i++) {
+        ReadCacheShard *shard = &cache->shards[i];
+
+        WITH_QEMU_LOCK_GUARD(&shard->lock) {
+            nchunks += shard->nchunks;
+        }
+    }
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+    stats->u.read_cache = (BlockStatsSpecificReadCache) {
+        .hits = stat64_get(&s->hits),
+        .misses = stat64_get(&s->misses),
+        .evictions = stat64_get(&cache->evictions),
+        .cached_bytes = nchunks * cache->chunk_size,
+    };
+
+    return stats;
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_SIZE,
+    READ_CACHE_OPT_CHUNK_SIZE,
+    READ_CACHE_OPT_SHARDS,
+    READ_CACHE_OPT_EVICTION,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = read_cache_child_perm,
+
+    .bdrv_co_getlength                  = read_cache_co_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+    .bdrv_co_invalidate_cache           = read_cache_co_invalidate_cache,
+
+    .bdrv_co_preadv_part                = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+
+    .bdrv_get_specific_stats            = read_cache_get_specific_stats,
+
+    .strong_runtime_opts                = read_cache_strong_runtime_opts,
+    .is_filter                          = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -52,6 +52,18 @@ int qemu_chr_fe_write_all(CharBackend *be, const uint8_t *buf, int len)
     return qemu_chr_write(s, buf, len, true);
 }
 
+int qemu_chr_fe_writev_all(CharBackend *be, const struct iovec *iov,
+                           int iovcnt)
+{
+    Chardev *s = be->chr;
+
+    if (!s) {
+        return 0;
+    }
+
+    return qemu_chr_writev_all(s, iov, iovcnt);
+}
+
 int qemu_chr_fe_read_all(CharBackend *be, uint8_t *buf, int len)
 {
     Chardev *s = be->chr;
@@ -39,6 +39,7 @@
 #include "qemu/option.h"
 #include "qemu/id.h"
 #include "qemu/coroutine.h"
+#include "qemu/iov.h"
 #include "qemu/yank.h"
 
 #include "chardev-internal.h"
@@ -195,6 +196,63 @@ int qemu_chr_write(Chardev *s, const uint8_t *buf, int len, bool write_all)
     return offset;
 }
 
+/*
+ * Like qemu_chr_write_all(), but gather the data from @iov.  Backends
+ * with chr_writev send it without first copying it to a linear buffer.
+ */
+int qemu_chr_writev_all(Chardev *s, const struct iovec *iov, int iovcnt)
+{
+    ChardevClass *cc = CHARDEV_GET_CLASS(s);
+    g_autofree struct iovec *local_iov = NULL;
+    struct iovec *cur;
+    unsigned int cnt = iovcnt;
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+    int res = 0;
+    int i;
+
+    /* Logging and replay work on single buffers */
+    if (!cc->chr_writev || s->logfd >= 0 || qemu_chr_replay(s)) {
+        for (i = 0; i < iovcnt; i++) {
+            res = qemu_chr_write(s, iov[i].iov_base, iov[i].iov_len, true);
+            if (res < 0) {
+                return res;
+            }
+            done += res;
+            if (res < iov[i].iov_len) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    local_iov = g_memdup2(iov, iovcnt * sizeof(*iov));
+    cur = local_iov;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    while (done < size) {
+        res = cc->chr_writev(s, cur, cnt);
+        if (res < 0 && errno == EAGAIN) {
+            if (qemu_in_coroutine()) {
+                qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 100000);
+            } else {
+                g_usleep(100);
+            }
+            continue;
+        }
+
+        if (res <= 0) {
+            break;
+        }
+
+        done += res;
+        iov_discard_front(&cur, &cnt, res);
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+
+    return res < 0 ? res : done;
+}
+
 int qemu_chr_be_can_write(Chardev *s)
 {
     CharBackend *be = s->be;
@@ -201,6 +201,27 @@ qcrypto_tls_creds_prop_get_priority(Object *obj,
 }
 
 
+static void
+qcrypto_tls_creds_prop_set_ktls(Object *obj,
+                                bool value,
+                                Error **errp G_GNUC_UNUSED)
+{
+    QCryptoTLSCreds *creds = QCRYPTO_TLS_CREDS(obj);
+
+    creds->ktls = value;
+}
+
+
+static bool
+qcrypto_tls_creds_prop_get_ktls(Object *obj,
+                                Error **errp G_GNUC_UNUSED)
+{
+    QCryptoTLSCreds *creds = QCRYPTO_TLS_CREDS(obj);
+
+    return creds->ktls;
+}
+
+
 static void
 qcrypto_tls_creds_prop_set_endpoint(Object *obj,
                                     int value,
@@ -239,6 +260,9 @@ qcrypto_tls_creds_class_init(ObjectClass *oc, void *data)
     object_class_property_add_str(oc, "priority",
                                   qcrypto_tls_creds_prop_get_priority,
                                   qcrypto_tls_creds_prop_set_priority);
+    object_class_property_add_bool(oc, "ktls",
+                                   qcrypto_tls_creds_prop_get_ktls,
+                                   qcrypto_tls_creds_prop_set_ktls);
 }
 
 
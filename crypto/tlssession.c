@@ -33,6 +33,27 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_LINUX_TLS_H
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* Largest plaintext of a TLS record, RFC 8446 section 5.1 */
+#define QCRYPTO_TLS_RECORD_MAX 16384
+
+#define QCRYPTO_TLS_CONTENT_ALERT 21
+#define QCRYPTO_TLS_CONTENT_HANDSHAKE 22
+#define QCRYPTO_TLS_CONTENT_APPLICATION_DATA 23
+
+#define QCRYPTO_TLS_ALERT_CLOSE_NOTIFY 0
+#define QCRYPTO_TLS_HANDSHAKE_NEW_SESSION_TICKET 4
+#endif
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -44,6 +65,10 @@ struct QCryptoTLSSession {
     QCryptoTLSSessionReadFunc readFunc;
     void *opaque;
     char *peername;
+    int ktlsRxFd;
+    uint8_t *ktlsRxBuf;
+    size_t ktlsRxOffset;
+    size_t ktlsRxLen;
 };
 
 
@@ -58,6 +83,7 @@ qcrypto_tls_session_free(QCryptoTLSSession *session)
     g_free(session->hostname);
     g_free(session->peername);
     g_free(session->authzid);
+    g_free(session->ktlsRxBuf);
     object_unref(OBJECT(session->creds));
     g_free(session);
 }
@@ -101,9 +127,11 @@ qcrypto_tls_session_new(QCryptoTLSCreds *creds,
                         Error **errp)
 {
     QCryptoTLSSession *session;
+    unsigned int flags;
     int ret;
 
     session = g_new0(QCryptoTLSSession, 1);
+    session->ktlsRxFd = -1;
     trace_qcrypto_tls_session_new(
         session, creds, hostname ? hostname : "<none>",
         authzid ? authzid : "<none>", endpoint);
@@ -123,10 +151,19 @@ qcrypto_tls_session_new(QCryptoTLSCreds *creds,
     }
 
     if (endpoint == QCRYPTO_TLS_CREDS_ENDPOINT_SERVER) {
-        ret = gnutls_init(&session->handle, GNUTLS_SERVER);
+        flags = GNUTLS_SERVER;
     } else {
-        ret = gnutls_init(&session->handle, GNUTLS_CLIENT);
+        flags = GNUTLS_CLIENT;
+    }
+    if (creds->ktls) {
+        /*
+         * Sessions are never resumed, and TLS 1.3 tickets sent after
+         * the handshake would only cost the peer a trip through the
+         * control record path of qcrypto_tls_session_read_ktls().
+         */
+        flags |= GNUTLS_NO_TICKETS;
     }
+    ret = gnutls_init(&session->handle, flags);
     if (ret < 0) {
         error_setg(errp, "Cannot initialize TLS session: %s",
                    gnutls_strerror(ret));
@@ -464,12 +501,161 @@ qcrypto_tls_session_write(QCryptoTLSSession *session,
 }
 
 
+#ifdef CONFIG_LINUX_TLS_H
+/*
+ * Receive from the kernel TLS layer, storing the content type of
+ * the record in @type. The kernel never returns data from records
+ * of different types in one call.
+ */
+static ssize_t
+qcrypto_tls_session_ktls_recv(QCryptoTLSSession *session,
+                              void *buf,
+                              size_t len,
+                              uint8_t *type)
+{
+    char control[CMSG_SPACE(sizeof(*type))];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    ret = recvmsg(session->ktlsRxFd, &msg, 0);
+    if (ret < 0) {
+        return -1;
+    }
+
+    *type = QCRYPTO_TLS_CONTENT_APPLICATION_DATA;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+        *type = *(uint8_t *)CMSG_DATA(cmsg);
+    }
+    return ret;
+}
+
+
+/*
+ * Deal with a complete non-application record that the kernel
+ * passed up. Returns 1 if the record can be ignored, 0 if the
+ * peer closed the session and -1 with errno set otherwise.
+ */
+static int
+qcrypto_tls_session_ktls_control(QCryptoTLSSession *session,
+                                 uint8_t type,
+                                 const uint8_t *data,
+                                 size_t len)
+{
+    trace_qcrypto_tls_session_ktls_control(session, type, len);
+
+    switch (type) {
+    case QCRYPTO_TLS_CONTENT_ALERT:
+        if (len == 2 && data[1] == QCRYPTO_TLS_ALERT_CLOSE_NOTIFY) {
+            return 0;
+        }
+        break;
+
+    case QCRYPTO_TLS_CONTENT_HANDSHAKE:
+        /*
+         * Session tickets can be dropped as sessions are never
+         * resumed. Anything else, such as a TLS 1.3 KeyUpdate,
+         * would need the kernel record state to be replaced.
+         */
+        while (len >= 4 &&
+               data[0] == QCRYPTO_TLS_HANDSHAKE_NEW_SESSION_TICKET) {
+            size_t msglen = (data[1] << 16) | (data[2] << 8) | data[3];
+
+            if (msglen > len - 4) {
+                break;
+            }
+            data += 4 + msglen;
+            len -= 4 + msglen;
+        }
+        if (len == 0) {
+            return 1;
+        }
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    errno = EIO;
+    return -1;
+}
+
+
+static ssize_t
+qcrypto_tls_session_read_ktls(QCryptoTLSSession *session,
+                              char *buf,
+                              size_t len)
+{
+    for (;;) {
+        uint8_t *record;
+        uint8_t type;
+        ssize_t got;
+        int ret;
+
+        if (session->ktlsRxLen) {
+            got = MIN(len, session->ktlsRxLen);
+            memcpy(buf, session->ktlsRxBuf + session->ktlsRxOffset, got);
+            session->ktlsRxOffset += got;
+            session->ktlsRxLen -= got;
+            return got;
+        }
+
+        /*
+         * The kernel hands out control records piecewise if they do
+         * not fit the buffer, so short reads go through a bounce
+         * buffer that can always hold a whole record.
+         */
+        if (len >= QCRYPTO_TLS_RECORD_MAX) {
+            record = (uint8_t *)buf;
+            got = qcrypto_tls_session_ktls_recv(session, buf, len, &type);
+        } else {
+            record = session->ktlsRxBuf;
+            got = qcrypto_tls_session_ktls_recv(session, record,
+                                                QCRYPTO_TLS_RECORD_MAX,
+                                                &type);
+        }
+        if (got <= 0) {
+            return got;
+        }
+
+        if (type == QCRYPTO_TLS_CONTENT_APPLICATION_DATA) {
+            if (record == (uint8_t *)buf) {
+                return got;
+            }
+            session->ktlsRxOffset = 0;
+            session->ktlsRxLen = got;
+            continue;
+        }
+
+        ret = qcrypto_tls_session_ktls_control(session, type, record, got);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+}
+#endif /* CONFIG_LINUX_TLS_H */
+
+
 ssize_t
 qcrypto_tls_session_read(QCryptoTLSSession *session,
                          char *buf,
                          size_t len)
 {
-    ssize_t ret = gnutls_record_recv(session->handle, buf, len);
+    ssize_t ret;
+
+#ifdef CONFIG_LINUX_TLS_H
+    if (session->ktlsRxFd >= 0) {
+        return qcrypto_tls_session_read_ktls(session, buf, len);
+    }
+#endif
+
+    ret = gnutls_record_recv(session->handle, buf, len);
 
     if (ret < 0) {
         switch (ret) {
@@ -496,7 +682,7 @@ qcrypto_tls_session_read(QCryptoTLSSession *session,
 size_t
 qcrypto_tls_session_check_pending(QCryptoTLSSession *session)
 {
-    return gnutls_record_check_pending(session->handle);
+    return gnutls_record_check_pending(session->handle) + session->ktlsRxLen;
 }
 
 
@@ -562,6 +748,169 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+bool
+qcrypto_tls_session_get_ktls_requested(QCryptoTLSSession *session)
+{
+    return session->creds->ktls;
+}
+
+
+#ifdef CONFIG_LINUX_TLS_H
+typedef union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+} QCryptoTLSSessionKTLSInfo;
+
+/*
+ * With TLS 1.2 the explicit part of the nonce is chosen by the
+ * sender and gnutls uses the record sequence number, while with
+ * TLS 1.3 the whole nonce is derived from the IV and the kernel
+ * needs the IV bytes following the salt.
+ */
+#define QCRYPTO_TLS_KTLS_FILL_AES_GCM(dst, CIPHER)                       \
+    do {                                                                \
+        if (cipher_key.size != CIPHER##_KEY_SIZE ||                     \
+            iv.size < CIPHER##_SALT_SIZE ||                             \
+            (version == GNUTLS_TLS1_3 &&                                \
+             iv.size != CIPHER##_SALT_SIZE + CIPHER##_IV_SIZE)) {       \
+            goto bad_state;                                             \
+        }                                                               \
+        (dst).info.cipher_type = CIPHER;                                \
+        if (version == GNUTLS_TLS1_2) {                                 \
+            memcpy((dst).iv, seq, CIPHER##_IV_SIZE);                    \
+        } else {                                                        \
+            memcpy((dst).iv, iv.data + CIPHER##_SALT_SIZE,              \
+                   CIPHER##_IV_SIZE);                                   \
+        }                                                               \
+        memcpy((dst).salt, iv.data, CIPHER##_SALT_SIZE);                \
+        memcpy((dst).rec_seq, seq, CIPHER##_REC_SEQ_SIZE);              \
+        memcpy((dst).key, cipher_key.data, CIPHER##_KEY_SIZE);          \
+        len = sizeof(dst);                                              \
+    } while (0)
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session,
+                                int fd,
+                                bool rx,
+                                Error **errp)
+{
+    gnutls_protocol_t version = gnutls_protocol_get_version(session->handle);
+    gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(session->handle);
+    gnutls_datum_t mac_key, iv, cipher_key;
+    unsigned char seq[8];
+    QCryptoTLSSessionKTLSInfo crypto;
+    socklen_t len;
+    int ret;
+
+    if (!session->handshakeComplete) {
+        error_setg(errp, "TLS handshake has not completed");
+        return -1;
+    }
+
+    if (rx && gnutls_record_check_pending(session->handle)) {
+        error_setg(errp, "TLS session has buffered data pending");
+        return -1;
+    }
+
+    if (version != GNUTLS_TLS1_2 && version != GNUTLS_TLS1_3) {
+        error_setg(errp, "Kernel TLS does not support protocol %s",
+                   gnutls_protocol_get_name(version));
+        return -1;
+    }
+
+    ret = gnutls_record_get_state(session->handle, rx,
+                                  &mac_key, &iv, &cipher_key, seq);
+    if (ret < 0) {
+        error_setg(errp, "Cannot get TLS record state: %s",
+                   gnutls_strerror(ret));
+        return -1;
+    }
+
+    memset(&crypto, 0, sizeof(crypto));
+    crypto.info.version = version == GNUTLS_TLS1_2 ?
+        TLS_1_2_VERSION : TLS_1_3_VERSION;
+
+    switch (cipher) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        QCRYPTO_TLS_KTLS_FILL_AES_GCM(crypto.aes_gcm_128,
+                                      TLS_CIPHER_AES_GCM_128);
+        break;
+    case GNUTLS_CIPHER_AES_256_GCM:
+        QCRYPTO_TLS_KTLS_FILL_AES_GCM(crypto.aes_gcm_256,
+                                      TLS_CIPHER_AES_GCM_256);
+        break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+        if (cipher_key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE ||
+            iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE) {
+            goto bad_state;
+        }
+        crypto.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(crypto.chacha20_poly1305.iv, iv.data,
+               TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+        memcpy(crypto.chacha20_poly1305.rec_seq, seq,
+               TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+        memcpy(crypto.chacha20_poly1305.key, cipher_key.data,
+               TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+        len = sizeof(crypto.chacha20_poly1305);
+        break;
+#endif
+    default:
+        error_setg(errp, "Kernel TLS does not support cipher %s",
+                   gnutls_cipher_get_name(cipher));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 &&
+        errno != EEXIST) {
+        error_setg_errno(errp, errno, "Cannot enable kernel TLS on socket");
+        goto error;
+    }
+
+    if (setsockopt(fd, SOL_TLS, rx ? TLS_RX : TLS_TX, &crypto, len) < 0) {
+        error_setg_errno(errp, errno, "Cannot set kernel TLS %s key",
+                         rx ? "receive" : "transmit");
+        goto error;
+    }
+
+    memset(&crypto, 0, sizeof(crypto));
+    if (rx) {
+        session->ktlsRxFd = fd;
+        session->ktlsRxBuf = g_malloc(QCRYPTO_TLS_RECORD_MAX);
+    }
+    trace_qcrypto_tls_session_enable_ktls(session, rx,
+                                          gnutls_cipher_get_name(cipher));
+    return 0;
+
+ bad_state:
+    error_setg(errp, "Unexpected TLS record state for cipher %s",
+               gnutls_cipher_get_name(cipher));
+ error:
+    memset(&crypto, 0, sizeof(crypto));
+    return -1;
+}
+
+#undef QCRYPTO_TLS_KTLS_FILL_AES_GCM
+
+#else /* ! CONFIG_LINUX_TLS_H */
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session G_GNUC_UNUSED,
+                                int fd G_GNUC_UNUSED,
+                                bool rx G_GNUC_UNUSED,
+                                Error **errp)
+{
+    error_setg(errp, "Kernel TLS is not supported on this platform");
+    return -1;
+}
+
+#endif /* ! CONFIG_LINUX_TLS_H */
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -660,4 +1009,22 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+bool
+qcrypto_tls_session_get_ktls_requested(QCryptoTLSSession *sess)
+{
+    return false;
+}
+
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess,
+                                int fd,
+                                bool rx,
+                                Error **errp)
+{
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
 #endif
@@ -499,6 +499,20 @@ SRST
     Show current migration capabilities.
 ERST
 
+    {
+        .name       = "migrate_timeline",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show migration iterations and downtime breakdown",
+        .cmd        = hmp_info_migrate_timeline,
+    },
+
+SRST
+  ``info migrate_timeline``
+    Show the iterations and the downtime breakdown of the current or last
+    outgoing migration.
+ERST
+
     {
         .name       = "migrate_parameters",
         .args_type  = "",
@@ -565,7 +565,8 @@ e1000e_rss_calc_hash(E1000ECore *core,
         return 0;
     }
 
-    return net_rx_pkt_calc_rss_hash(pkt, type, (uint8_t *) &core->mac[RSSRK]);
+    net_toeplitz_set_key(&core->rss_toeplitz, (uint8_t *) &core->mac[RSSRK]);
+    return net_rx_pkt_calc_rss_hash(pkt, type, &core->rss_toeplitz);
 }
 
 static void
@@ -763,15 +764,20 @@ e1000e_rx_wb_interrupt_cause(E1000ECore *core, int queue_idx,
     return (queue_idx == 0) ? E1000_ICR_RXQ0 : E1000_ICR_RXQ1;
 }
 
-static uint32_t
-e1000e_txdesc_writeback(E1000ECore *core, dma_addr_t base,
-                        struct e1000_tx_desc *dp, bool *ide, int queue_idx)
+/*
+ * Update the status of a processed TX descriptor in place.  The caller
+ * is responsible for writing it back to guest memory, which allows the
+ * descriptors of a whole batch to be written with a single DMA access.
+ */
+static bool
+e1000e_txdesc_writeback(E1000ECore *core, struct e1000_tx_desc *dp,
+                        bool *ide, int queue_idx, uint32_t *cause)
 {
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
     if (!(txd_lower & E1000_TXD_CMD_RS) &&
         !(core->mac[IVAR] & E1000_IVAR_TX_INT_EVERY_WB)) {
-        return 0;
+        return false;
     }
 
     *ide = (txd_lower & E1000_TXD_CMD_IDE) ? true : false;
@@ -779,9 +785,8 @@ e1000e_txdesc_writeback(E1000ECore *core, dma_addr_t base,
     txd_upper = le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD;
 
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(core->owner, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
-    return e1000e_tx_wb_interrupt_cause(core, queue_idx);
+    *cause |= e1000e_tx_wb_interrupt_cause(core, queue_idx);
+    return true;
 }
 
 typedef struct E1000ERingInfo {
@@ -825,6 +830,26 @@ e1000e_ring_advance(E1000ECore *core, const E1000ERingInfo *r, uint32_t count)
     }
 }
 
+/*
+ * Number of descriptors available to the device that can be accessed
+ * starting from the head without wrapping around the end of the ring.
+ */
+static inline uint32_t
+e1000e_ring_contig_descr_num(E1000ECore *core, const E1000ERingInfo *r)
+{
+    uint32_t ring_len = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] >= ring_len) {
+        return 1;
+    }
+
+    if (core->mac[r->dh] <= core->mac[r->dt]) {
+        return core->mac[r->dt] - core->mac[r->dh];
+    }
+
+    return ring_len - core->mac[r->dh];
+}
+
 static inline uint32_t
 e1000e_ring_free_descr_num(E1000ECore *core, const E1000ERingInfo *r)
 {
@@ -898,14 +923,18 @@ e1000e_rx_ring_init(E1000ECore *core, E1000E_RxRing *rxr, int idx)
     rxr->i      = &i[idx];
 }
 
+/* Maximum number of TX descriptors fetched with a single DMA access */
+#define E1000E_TX_DESC_BATCH    (32)
+
 static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000E_TX_DESC_BATCH];
     bool ide = false;
     const E1000ERingInfo *txi = txr->i;
     uint32_t cause = E1000_ICS_TXQE;
+    uint32_t i, n, wb_first, wb_last;
 
     if (!(core->mac[TCTL] & E1000_TCTL_EN)) {
         trace_e1000e_tx_disabled();
@@ -914,16 +943,31 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 
     while (!e1000e_ring_empty(core, txi)) {
         base = e1000e_ring_head_descr(core, txi);
+        n = MIN(e1000e_ring_contig_descr_num(core, txi), E1000E_TX_DESC_BATCH);
+
+        pci_dma_read(core->owner, base, desc, n * sizeof(desc[0]));
 
-        pci_dma_read(core->owner, base, &desc, sizeof(desc));
+        wb_first = n;
+        wb_last = 0;
+        for (i = 0; i < n; i++) {
+            trace_e1000e_tx_descr((void *)(intptr_t)desc[i].buffer_addr,
+                                  desc[i].lower.data, desc[i].upper.data);
 
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
-                              desc.lower.data, desc.upper.data);
+            e1000e_process_tx_desc(core, txr->tx, &desc[i], txi->idx);
+            if (e1000e_txdesc_writeback(core, &desc[i], &ide, txi->idx,
+                                        &cause)) {
+                wb_first = MIN(wb_first, i);
+                wb_last = i;
+            }
 
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
-        cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
+            e1000e_ring_advance(core, txi, 1);
+        }
 
-        e1000e_ring_advance(core, txi, 1);
+        if (wb_first < n) {
+            pci_dma_write(core->owner, base + wb_first * sizeof(desc[0]),
+                          &desc[wb_first],
+                          (wb_last - wb_first + 1) * sizeof(desc[0]));
+        }
     }
 
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
@@ -1480,12 +1524,52 @@ e1000e_do_ps(E1000ECore *core, struct NetRxPkt *pkt, size_t *hdr_len)
     return true;
 }
 
+static void
+e1000e_rx_desc_cache_invalidate(E1000ECore *core)
+{
+    int i;
+
+    for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+        core->rx_desc_cache[i].pos = 0;
+        core->rx_desc_cache[i].len = 0;
+    }
+}
+
+/*
+ * Fetch the RX descriptor at the head of the ring.  Like the real device,
+ * prefetch the following descriptors owned by the device so that a burst
+ * of packets costs one DMA access for up to E1000E_RX_DESC_CACHE_SIZE
+ * bytes of descriptors.  The guest does not touch descriptors between
+ * head and tail, so the cache only needs to be dropped when the ring
+ * itself is reprogrammed.
+ */
+static void
+e1000e_rx_desc_fetch(E1000ECore *core, const E1000ERingInfo *rxi,
+                     dma_addr_t base, void *desc, uint32_t len)
+{
+    E1000ERxDescCache *c = &core->rx_desc_cache[rxi->idx];
+
+    if (c->pos + len > c->len || c->addr != base) {
+        uint32_t avail = e1000e_ring_contig_descr_num(core, rxi) *
+                         E1000_RING_DESC_LEN;
+
+        c->len = QEMU_ALIGN_DOWN(MIN(avail, sizeof(c->desc)), len);
+        c->len = MAX(c->len, len);
+        c->pos = 0;
+        c->addr = base;
+        pci_dma_read(core->owner, base, c->desc, c->len);
+    }
+
+    memcpy(desc, c->desc + c->pos, len);
+    c->pos += len;
+    c->addr += len;
+}
+
 static void
 e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
                              const E1000E_RxRing *rxr,
                              const E1000E_RSSInfo *rss_info)
 {
-    PCIDevice *d = core->owner;
     dma_addr_t base;
     union e1000_rx_desc_union desc;
     size_t desc_size;
@@ -1519,7 +1603,7 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
 
         base = e1000e_ring_head_descr(core, rxi);
 
-        pci_dma_read(d, base, &desc, core->rx_desc_len);
+        e1000e_rx_desc_fetch(core, rxi, base, &desc, core->rx_desc_len);
 
         trace_e1000e_rx_descr(rxi->idx, base, core->rx_desc_len);
 
@@ -2395,12 +2479,21 @@ static void
 e1000e_set_dlen(E1000ECore *core, int index, uint32_t val)
 {
     core->mac[index] = val & E1000_XDLEN_MASK;
+    e1000e_rx_desc_cache_invalidate(core);
 }
 
 static void
 e1000e_set_dbal(E1000ECore *core, int index, uint32_t val)
 {
     core->mac[index] = val & E1000_XDBAL_MASK;
+    e1000e_rx_desc_cache_invalidate(core);
+}
+
+static void
+e1000e_set_rdh(E1000ECore *core, int index, uint32_t val)
+{
+    core->mac[index] = val & 0xffff;
+    e1000e_rx_desc_cache_invalidate(core);
 }
 
 static void
@@ -3157,7 +3250,7 @@ static const writeops e1000e_macreg_writeops[] = {
     [MDIC]     = e1000e_set_mdic,
     [ICS]      = e1000e_set_ics,
     [TDH]      = e1000e_set_16bit,
-    [RDH0]     = e1000e_set_16bit,
+    [RDH0]     = e1000e_set_rdh,
     [RDT0]     = e1000e_set_rdt,
     [IMC]      = e1000e_set_imc,
     [IMS]      = e1000e_set_ims,
@@ -3196,7 +3289,7 @@ static const writeops e1000e_macreg_writeops[] = {
     [TDBAL1]   = e1000e_set_dbal,
     [RDBAL0]   = e1000e_set_dbal,
     [RDBAL1]   = e1000e_set_dbal,
-    [RDH1]     = e1000e_set_16bit,
+    [RDH1]     = e1000e_set_rdh,
     [RDT1]     = e1000e_set_rdt,
     [STATUS]   = e1000e_set_status,
     [PBACLR]   = e1000e_set_pbaclr,
@@ -3482,6 +3575,8 @@ static void e1000e_reset(E1000ECore *core, bool sw)
         memset(&core->tx[i].props, 0, sizeof(core->tx[i].props));
         core->tx[i].skip_cp = false;
     }
+
+    e1000e_rx_desc_cache_invalidate(core);
 }
 
 void
@@ -3529,6 +3624,7 @@ e1000e_core_post_load(E1000ECore *core)
      */
     e1000e_intrmgr_resume(core);
     e1000e_autoneg_resume(core);
+    e1000e_rx_desc_cache_invalidate(core);
 
     return 0;
 }
@@ -36,6 +36,8 @@
 #ifndef HW_NET_E1000E_CORE_H
 #define HW_NET_E1000E_CORE_H
 
+#include "net/toeplitz.h"
+
 #define E1000E_PHY_PAGE_SIZE    (0x20)
 #define E1000E_PHY_PAGES        (0x07)
 #define E1000E_MAC_SIZE         (0x8000)
@@ -45,6 +47,16 @@
 
 typedef struct E1000Core E1000ECore;
 
+/* Size of the per-queue RX descriptor prefetch buffer, in bytes */
+#define E1000E_RX_DESC_CACHE_SIZE   (32 * E1000_RING_DESC_LEN)
+
+typedef struct E1000ERxDescCache {
+    uint8_t desc[E1000E_RX_DESC_CACHE_SIZE];
+    dma_addr_t addr;    /* guest address of desc[pos] */
+    uint32_t pos;
+    uint32_t len;
+} E1000ERxDescCache;
+
 enum { PHY_R = BIT(0),
        PHY_W = BIT(1),
        PHY_RW = PHY_R | PHY_W,
@@ -81,6 +93,12 @@ struct E1000Core {
 
     struct NetRxPkt *rx_pkt;
 
+    /* Prefetched RX descriptors, not migrated */
+    E1000ERxDescCache rx_desc_cache[E1000E_NUM_QUEUES];
+
+    /* Expanded copy of the RSSRK registers, not migrated */
+    NetToeplitz rss_toeplitz;
+
     bool has_vnet;
     int max_queue_num;
 
@@ -401,7 +401,8 @@ igb_rss_calc_hash(IGBCore *core, struct NetRxPkt *pkt, E1000E_RSSInfo *info)
         return 0;
     }
 
-    return net_rx_pkt_calc_rss_hash(pkt, type, (uint8_t *) &core->mac[RSSRK]);
+    net_toeplitz_set_key(&core->rss_toeplitz, (uint8_t *) &core->mac[RSSRK]);
+    return net_rx_pkt_calc_rss_hash(pkt, type, &core->rss_toeplitz);
 }
 
 static void
@@ -731,6 +732,26 @@ igb_ring_advance(IGBCore *core, const E1000ERingInfo *r, uint32_t count)
     }
 }
 
+/*
+ * Number of descriptors available to the device that can be accessed
+ * starting from the head without wrapping around the end of the ring.
+ */
+static inline uint32_t
+igb_ring_contig_descr_num(IGBCore *core, const E1000ERingInfo *r)
+{
+    uint32_t ring_len = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] >= ring_len) {
+        return 1;
+    }
+
+    if (core->mac[r->dh] <= core->mac[r->dt]) {
+        return core->mac[r->dt] - core->mac[r->dh];
+    }
+
+    return ring_len - core->mac[r->dh];
+}
+
 static inline uint32_t
 igb_ring_free_descr_num(IGBCore *core, const E1000ERingInfo *r)
 {
@@ -826,39 +847,45 @@ igb_rx_ring_init(IGBCore *core, E1000E_RxRing *rxr, int idx)
     rxr->i      = &i[idx];
 }
 
-static uint32_t
-igb_txdesc_writeback(IGBCore *core, dma_addr_t base,
-                     union e1000_adv_tx_desc *tx_desc,
-                     const E1000ERingInfo *txi)
+/*
+ * Update the status of a processed TX descriptor in place.  The caller
+ * writes back the descriptors, or the head in head write-back mode, once
+ * for the whole batch.
+ */
+static bool
+igb_txdesc_writeback(IGBCore *core, union e1000_adv_tx_desc *tx_desc,
+                     const E1000ERingInfo *txi, uint32_t *eic)
 {
-    PCIDevice *d;
     uint32_t cmd_type_len = le32_to_cpu(tx_desc->read.cmd_type_len);
-    uint64_t tdwba;
-
-    tdwba = core->mac[E1000_TDWBAL(txi->idx) >> 2];
-    tdwba |= (uint64_t)core->mac[E1000_TDWBAH(txi->idx) >> 2] << 32;
+    uint32_t status;
 
     if (!(cmd_type_len & E1000_TXD_CMD_RS)) {
-        return 0;
+        return false;
     }
 
-    d = pcie_sriov_get_vf_at_index(core->owner, txi->idx % 8);
-    if (!d) {
-        d = core->owner;
-    }
+    status = le32_to_cpu(tx_desc->wb.status) | E1000_TXD_STAT_DD;
+    tx_desc->wb.status = cpu_to_le32(status);
+
+    *eic |= igb_tx_wb_eic(core, txi->idx);
+    return true;
+}
+
+static void
+igb_txdesc_writeback_batch(IGBCore *core, PCIDevice *d, dma_addr_t base,
+                           union e1000_adv_tx_desc *desc, uint32_t count,
+                           const E1000ERingInfo *txi)
+{
+    uint64_t tdwba;
+
+    tdwba = core->mac[E1000_TDWBAL(txi->idx) >> 2];
+    tdwba |= (uint64_t)core->mac[E1000_TDWBAH(txi->idx) >> 2] << 32;
 
     if (tdwba & 1) {
         uint32_t buffer = cpu_to_le32(core->mac[txi->dh]);
         pci_dma_write(d, tdwba & ~3, &buffer, sizeof(buffer));
     } else {
-        uint32_t status = le32_to_cpu(tx_desc->wb.status) | E1000_TXD_STAT_DD;
-
-        tx_desc->wb.status = cpu_to_le32(status);
-        pci_dma_write(d, base + offsetof(union e1000_adv_tx_desc, wb),
-            &tx_desc->wb, sizeof(tx_desc->wb));
+        pci_dma_write(d, base, desc, count * sizeof(*desc));
     }
-
-    return igb_tx_wb_eic(core, txi->idx);
 }
 
 static inline bool
@@ -873,14 +900,18 @@ igb_tx_enabled(IGBCore *core, const E1000ERingInfo *txi)
         (core->mac[TXDCTL0 + (qn * 16)] & E1000_TXDCTL_QUEUE_ENABLE);
 }
 
+/* Maximum number of TX descriptors fetched with a single DMA access */
+#define IGB_TX_DESC_BATCH   (32)
+
 static void
 igb_start_xmit(IGBCore *core, const IGB_TxRing *txr)
 {
     PCIDevice *d;
     dma_addr_t base;
-    union e1000_adv_tx_desc desc;
+    union e1000_adv_tx_desc desc[IGB_TX_DESC_BATCH];
     const E1000ERingInfo *txi = txr->i;
     uint32_t eic = 0;
+    uint32_t i, n, wb_first, wb_last;
 
     if (!igb_tx_enabled(core, txi)) {
         trace_e1000e_tx_disabled();
@@ -894,15 +925,31 @@ igb_start_xmit(IGBCore *core, const IGB_TxRing *txr)
 
     while (!igb_ring_empty(core, txi)) {
         base = igb_ring_head_descr(core, txi);
+        n = MIN(igb_ring_contig_descr_num(core, txi), IGB_TX_DESC_BATCH);
+
+        pci_dma_read(d, base, desc, n * sizeof(desc[0]));
+
+        wb_first = n;
+        wb_last = 0;
+        for (i = 0; i < n; i++) {
+            trace_e1000e_tx_descr((void *)(intptr_t)desc[i].read.buffer_addr,
+                                  desc[i].read.cmd_type_len,
+                                  desc[i].wb.status);
+
+            igb_process_tx_desc(core, d, txr->tx, &desc[i], txi->idx);
+            igb_ring_advance(core, txi, 1);
+            if (igb_txdesc_writeback(core, &desc[i], txi, &eic)) {
+                wb_first = MIN(wb_first, i);
+                wb_last = i;
+            }
+        }
 
-        pci_dma_read(d, base, &desc, sizeof(desc));
-
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.read.buffer_addr,
-                              desc.read.cmd_type_len, desc.wb.status);
-
-        igb_process_tx_desc(core, d, txr->tx, &desc, txi->idx);
-        igb_ring_advance(core, txi, 1);
-        eic |= igb_txdesc_writeback(core, base, &desc, txi);
+        if (wb_first < n) {
+            igb_txdesc_writeback_batch(core, d,
+                                       base + wb_first * sizeof(desc[0]),
+                                       &desc[wb_first], wb_last - wb_first + 1,
+                                       txi);
+        }
     }
 
     if (eic) {
@@ -1891,6 +1938,44 @@ igb_write_to_rx_buffers(IGBCore *core,
     igb_write_payload_to_rx_buffers(core, pkt, d, pdma_st, &copy_size);
 }
 
+static void
+igb_rx_desc_cache_invalidate(IGBCore *core)
+{
+    int i;
+
+    for (i = 0; i < IGB_NUM_QUEUES; i++) {
+        core->rx_desc_cache[i].pos = 0;
+        core->rx_desc_cache[i].len = 0;
+    }
+}
+
+/*
+ * Fetch the RX descriptor at the head of the ring, prefetching the
+ * following descriptors owned by the device as the real hardware does.
+ * See e1000e_rx_desc_fetch().
+ */
+static void
+igb_rx_desc_fetch(IGBCore *core, PCIDevice *d, const E1000ERingInfo *rxi,
+                  dma_addr_t base, void *desc, uint32_t len)
+{
+    IGBRxDescCache *c = &core->rx_desc_cache[rxi->idx];
+
+    if (c->pos + len > c->len || c->addr != base) {
+        uint32_t avail = igb_ring_contig_descr_num(core, rxi) *
+                         E1000_RING_DESC_LEN;
+
+        c->len = QEMU_ALIGN_DOWN(MIN(avail, sizeof(c->desc)), len);
+        c->len = MAX(c->len, len);
+        c->pos = 0;
+        c->addr = base;
+        pci_dma_read(d, base, c->desc, c->len);
+    }
+
+    memcpy(desc, c->desc + c->pos, len);
+    c->pos += len;
+    c->addr += len;
+}
+
 static void
 igb_write_packet_to_guest(IGBCore *core, struct NetRxPkt *pkt,
                           const E1000E_RxRing *rxr,
@@ -1929,7 +2014,7 @@ igb_write_packet_to_guest(IGBCore *core, struct NetRxPkt *pkt,
         }
 
         base = igb_ring_head_descr(core, rxi);
-        pci_dma_read(d, base, &desc, rx_desc_len);
+        igb_rx_desc_fetch(core, d, rxi, base, &desc, rx_desc_len);
         trace_e1000e_rx_descr(rxi->idx, base, rx_desc_len);
 
         igb_read_rx_descr(core, &desc, &pdma_st, rxi);
@@ -2792,12 +2877,21 @@ static void
 igb_set_dlen(IGBCore *core, int index, uint32_t val)
 {
     core->mac[index] = val & 0xffff0;
+    igb_rx_desc_cache_invalidate(core);
 }
 
 static void
 igb_set_dbal(IGBCore *core, int index, uint32_t val)
 {
     core->mac[index] = val & E1000_XDBAL_MASK;
+    igb_rx_desc_cache_invalidate(core);
+}
+
+static void
+igb_set_rdh(IGBCore *core, int index, uint32_t val)
+{
+    core->mac[index] = val & 0xffff;
+    igb_rx_desc_cache_invalidate(core);
 }
 
 static void
@@ -3895,22 +3989,22 @@ static const writeops igb_macreg_writeops[] = {
     [TDT15]    = igb_set_tdt,
     [MDIC]     = igb_set_mdic,
     [ICS]      = igb_set_ics,
-    [RDH0]     = igb_set_16bit,
-    [RDH1]     = igb_set_16bit,
-    [RDH2]     = igb_set_16bit,
-    [RDH3]     = igb_set_16bit,
-    [RDH4]     = igb_set_16bit,
-    [RDH5]     = igb_set_16bit,
-    [RDH6]     = igb_set_16bit,
-    [RDH7]     = igb_set_16bit,
-    [RDH8]     = igb_set_16bit,
-    [RDH9]     = igb_set_16bit,
-    [RDH10]    = igb_set_16bit,
-    [RDH11]    = igb_set_16bit,
-    [RDH12]    = igb_set_16bit,
-    [RDH13]    = igb_set_16bit,
-    [RDH14]    = igb_set_16bit,
-    [RDH15]    = igb_set_16bit,
+    [RDH0]     = igb_set_rdh,
+    [RDH1]     = igb_set_rdh,
+    [RDH2]     = igb_set_rdh,
+    [RDH3]     = igb_set_rdh,
+    [RDH4]     = igb_set_rdh,
+    [RDH5]     = igb_set_rdh,
+    [RDH6]     = igb_set_rdh,
+    [RDH7]     = igb_set_rdh,
+    [RDH8]     = igb_set_rdh,
+    [RDH9]     = igb_set_rdh,
+    [RDH10]    = igb_set_rdh,
+    [RDH11]    = igb_set_rdh,
+    [RDH12]    = igb_set_rdh,
+    [RDH13]    = igb_set_rdh,
+    [RDH14]    = igb_set_rdh,
+    [RDH15]    = igb_set_rdh,
     [RDT0]     = igb_set_rdt,
     [RDT1]     = igb_set_rdt,
     [RDT2]     = igb_set_rdt,
@@ -4501,6 +4595,8 @@ static void igb_reset(IGBCore *core, bool sw)
         tx->first = true;
         tx->skip_cp = false;
     }
+
+    igb_rx_desc_cache_invalidate(core);
 }
 
 void
@@ -4548,6 +4644,7 @@ igb_core_post_load(IGBCore *core)
      */
     igb_intrmgr_resume(core);
     igb_autoneg_resume(core);
+    igb_rx_desc_cache_invalidate(core);
 
     return 0;
 }
@@ -40,6 +40,8 @@
 #ifndef HW_NET_IGB_CORE_H
 #define HW_NET_IGB_CORE_H
 
+#include "net/toeplitz.h"
+
 #define E1000E_MAC_SIZE         (0x8000)
 #define IGB_EEPROM_SIZE         (1024)
 
@@ -51,6 +53,16 @@
 
 typedef struct IGBCore IGBCore;
 
+/* Size of the per-queue RX descriptor prefetch buffer, in bytes */
+#define IGB_RX_DESC_CACHE_SIZE  (32 * E1000_RING_DESC_LEN)
+
+typedef struct IGBRxDescCache {
+    uint8_t desc[IGB_RX_DESC_CACHE_SIZE];
+    dma_addr_t addr;    /* guest address of desc[pos] */
+    uint32_t pos;
+    uint32_t len;
+} IGBRxDescCache;
+
 enum { PHY_R = BIT(0),
        PHY_W = BIT(1),
        PHY_RW = PHY_R | PHY_W };
@@ -85,6 +97,12 @@ struct IGBCore {
 
     struct NetRxPkt *rx_pkt;
 
+    /* Prefetched RX descriptors, not migrated */
+    IGBRxDescCache rx_desc_cache[IGB_NUM_QUEUES];
+
+    /* Expanded copy of the RSSRK registers, not migrated */
+    NetToeplitz rss_toeplitz;
+
     bool has_vnet;
     int max_queue_num;
 
@@ -21,6 +21,7 @@
 #include "net_rx_pkt.h"
 #include "net/checksum.h"
 #include "net/tap.h"
+#include "net/toeplitz.h"
 
 struct NetRxPkt {
     struct virtio_net_hdr virt_hdr;
@@ -47,6 +48,17 @@ struct NetRxPkt {
     eth_ip6_hdr_info ip6hdr_info;
     eth_ip4_hdr_info ip4hdr_info;
     eth_l4_hdr_info  l4hdr_info;
+
+    /* Data analyzed by net_rx_pkt_set_protocols(), and its offsets */
+    struct {
+        const void *base;
+        int iovcnt;
+        size_t iovoff;
+        size_t size;
+        size_t l3hdr_off;
+        size_t l4hdr_off;
+        size_t l5hdr_off;
+    } parsed;
 };
 
 void net_rx_pkt_init(struct NetRxPkt **pkt)
@@ -83,12 +95,25 @@ net_rx_pkt_iovec_realloc(struct NetRxPkt *pkt,
     }
 }
 
+static bool
+net_rx_pkt_is_parsed(struct NetRxPkt *pkt,
+                     const struct iovec *iov, int iovcnt,
+                     size_t iovoff, size_t size)
+{
+    return iovcnt > 0 &&
+           pkt->parsed.base == iov[0].iov_base &&
+           pkt->parsed.iovcnt == iovcnt &&
+           pkt->parsed.iovoff == iovoff &&
+           pkt->parsed.size == size;
+}
+
 static void
 net_rx_pkt_pull_data(struct NetRxPkt *pkt,
                         const struct iovec *iov, int iovcnt,
-                        size_t ploff)
+                        size_t iovoff, size_t ploff)
 {
-    uint32_t pllen = iov_size(iov, iovcnt) - ploff;
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t pllen = size - ploff;
 
     if (pkt->ehdr_buf_len) {
         net_rx_pkt_iovec_realloc(pkt, iovcnt + 1);
@@ -107,9 +132,23 @@ net_rx_pkt_pull_data(struct NetRxPkt *pkt,
                                 iov, iovcnt, ploff, pkt->tot_len);
     }
 
-    eth_get_protocols(pkt->vec, pkt->vec_len, 0, &pkt->hasip4, &pkt->hasip6,
-                      &pkt->l3hdr_off, &pkt->l4hdr_off, &pkt->l5hdr_off,
-                      &pkt->ip6hdr_info, &pkt->ip4hdr_info, &pkt->l4hdr_info);
+    if (net_rx_pkt_is_parsed(pkt, iov, iovcnt, iovoff, size)) {
+        /*
+         * The headers were parsed already; the offsets only move back by
+         * the size of the VLAN tag, if one was stripped.
+         */
+        size_t shift = ploff - pkt->ehdr_buf_len;
+
+        pkt->l3hdr_off = pkt->parsed.l3hdr_off - shift;
+        pkt->l4hdr_off = pkt->parsed.l4hdr_off - shift;
+        pkt->l5hdr_off = pkt->parsed.l5hdr_off - shift;
+    } else {
+        eth_get_protocols(pkt->vec, pkt->vec_len, 0,
+                          &pkt->hasip4, &pkt->hasip6,
+                          &pkt->l3hdr_off, &pkt->l4hdr_off, &pkt->l5hdr_off,
+                          &pkt->ip6hdr_info, &pkt->ip4hdr_info,
+                          &pkt->l4hdr_info);
+    }
 
     trace_net_rx_pkt_parsed(pkt->hasip4, pkt->hasip6, pkt->l4hdr_info.proto,
                             pkt->l3hdr_off, pkt->l4hdr_off, pkt->l5hdr_off);
@@ -132,7 +171,7 @@ void net_rx_pkt_attach_iovec(struct NetRxPkt *pkt,
 
     pkt->tci = tci;
 
-    net_rx_pkt_pull_data(pkt, iov, iovcnt, ploff);
+    net_rx_pkt_pull_data(pkt, iov, iovcnt, iovoff, ploff);
 }
 
 void net_rx_pkt_attach_iovec_ex(struct NetRxPkt *pkt,
@@ -151,7 +190,7 @@ void net_rx_pkt_attach_iovec_ex(struct NetRxPkt *pkt,
 
     pkt->tci = tci;
 
-    net_rx_pkt_pull_data(pkt, iov, iovcnt, ploff);
+    net_rx_pkt_pull_data(pkt, iov, iovcnt, iovoff, ploff);
 }
 
 void net_rx_pkt_dump(struct NetRxPkt *pkt)
@@ -196,6 +235,14 @@ void net_rx_pkt_set_protocols(struct NetRxPkt *pkt,
     eth_get_protocols(iov, iovcnt, iovoff, &pkt->hasip4, &pkt->hasip6,
                       &pkt->l3hdr_off, &pkt->l4hdr_off, &pkt->l5hdr_off,
                       &pkt->ip6hdr_info, &pkt->ip4hdr_info, &pkt->l4hdr_info);
+
+    pkt->parsed.base = iovcnt ? iov[0].iov_base : NULL;
+    pkt->parsed.iovcnt = iovcnt;
+    pkt->parsed.iovoff = iovoff;
+    pkt->parsed.size = iov_size(iov, iovcnt);
+    pkt->parsed.l3hdr_off = pkt->l3hdr_off;
+    pkt->parsed.l4hdr_off = pkt->l4hdr_off;
+    pkt->parsed.l5hdr_off = pkt->l5hdr_off;
 }
 
 void net_rx_pkt_get_protocols(struct NetRxPkt *pkt,
@@ -309,12 +356,11 @@ _net_rx_rss_prepare_udp(uint8_t *rss_input,
 uint32_t
 net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
                          NetRxPktRssType type,
-                         uint8_t *key)
+                         const NetToeplitz *toeplitz)
 {
-    uint8_t rss_input[36];
+    uint8_t rss_input[NET_TOEPLITZ_INPUT_MAX];
     size_t rss_length = 0;
-    uint32_t rss_hash = 0;
-    net_toeplitz_key key_data;
+    uint32_t rss_hash;
 
     switch (type) {
     case NetPktRssIpV4:
@@ -379,8 +425,7 @@ net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
         break;
     }
 
-    net_toeplitz_key_init(&key_data, key);
-    net_toeplitz_add(&rss_hash, rss_input, rss_length, &key_data);
+    rss_hash = net_toeplitz_hash(toeplitz, rss_input, rss_length);
 
     trace_net_rx_pkt_rss_hash(rss_length, rss_hash);
 
@@ -19,6 +19,7 @@
 #define NET_RX_PKT_H
 
 #include "net/eth.h"
+#include "net/toeplitz.h"
 
 /* defines to enable packet dump functions */
 /*#define NET_RX_PKT_DEBUG*/
@@ -54,6 +55,10 @@ size_t net_rx_pkt_get_total_len(struct NetRxPkt *pkt);
 /**
  * parse and set packet analysis results
  *
+ * The results are reused, instead of parsing the headers again, if the
+ * same data is then attached with net_rx_pkt_attach_iovec(),
+ * net_rx_pkt_attach_iovec_ex() or net_rx_pkt_attach_data().
+ *
  * @pkt:            packet
  * @iov:            received data scatter-gather list
  * @iovcnt:         number of elements in iov
@@ -136,6 +141,7 @@ typedef enum {
 *
 * @pkt:            packet
 * @type:           RSS hash type
+* @toeplitz:       expanded RSS key
 *
 * Return:  Toeplitz RSS hash.
 *
@@ -143,7 +149,7 @@ typedef enum {
 uint32_t
 net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
                          NetRxPktRssType type,
-                         uint8_t *key);
+                         const NetToeplitz *toeplitz);
 
 /**
 * fetches IP identification for the packet
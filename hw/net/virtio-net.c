@@ -20,6 +20,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/gro.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -31,15 +32,19 @@
 #include "net/vhost_net.h"
 #include "net/announce.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/iothread-vq-mapping.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/misc.h"
 #include "standard-headers/linux/ethtool.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/iothread.h"
+#include "block/aio-wait.h"
 #include "trace.h"
 #include "monitor/qdev.h"
 #include "monitor/monitor.h"
@@ -123,6 +128,21 @@ static int vq2q(int queue_index)
     return queue_index / 2;
 }
 
+static bool virtio_net_dataplane_pause(VirtIONet *n);
+static void virtio_net_dataplane_resume(VirtIONet *n);
+
+/* Queue pairs that run in an IOThread notify the guest through irqfd */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (qemu_in_iothread()) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void flush_or_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -199,8 +219,15 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR) &&
         !virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1) &&
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
+        /* receive_filter() looks at the MAC address */
+        bool paused = virtio_net_dataplane_pause(n);
+
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
+
+        if (paused) {
+            virtio_net_dataplane_resume(n);
+        }
     }
 
     /*
@@ -376,7 +403,7 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -386,6 +413,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
+    bool paused = virtio_net_dataplane_pause(n);
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
@@ -435,6 +463,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    if (paused) {
+        virtio_net_dataplane_resume(n);
+    }
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -552,6 +584,7 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc;
+    bool paused;
 
     /* validate queue_index and skip for cvq */
     if (queue_index >= n->max_queue_pairs * 2) {
@@ -569,7 +602,11 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
         vhost_net_virtqueue_reset(vdev, nc, queue_index);
     }
 
+    paused = virtio_net_dataplane_pause(n);
     flush_or_purge_queued_packets(nc);
+    if (paused) {
+        virtio_net_dataplane_resume(n);
+    }
 }
 
 static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
@@ -599,6 +636,57 @@ static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
     }
 }
 
+/* Free the GRO stage of a queue, and report what it did */
+static void virtio_net_gro_free(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetGROStats stats;
+
+    if (!q->gro) {
+        return;
+    }
+
+    net_gro_get_stats(q->gro, &stats);
+    trace_virtio_net_gro_stats(index, stats.received, stats.coalesced,
+                               stats.bypassed, stats.flushed,
+                               stats.timer_flushes, stats.evictions,
+                               stats.refused, stats.dropped);
+    net_gro_free(q->gro);
+    q->gro = NULL;
+}
+
+static void virtio_net_gro_cleanup(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        virtio_net_gro_free(n, i);
+    }
+}
+
+/*
+ * With host_gro and a peer without vnet header, the device provides the
+ * receive offloads that the guest enabled itself.
+ */
+static void virtio_net_update_gro(VirtIONet *n)
+{
+    unsigned gro_flags = 0;
+
+    if (n->host_gro && !n->has_vnet_hdr &&
+        (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM))) {
+        if (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4)) {
+            gro_flags |= NET_GRO_F_TCPV4;
+        }
+        if (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO6)) {
+            gro_flags |= NET_GRO_F_TCPV6;
+        }
+    }
+    if (gro_flags != n->gro_flags) {
+        n->gro_flags = gro_flags;
+        virtio_net_gro_cleanup(n);
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -631,6 +719,9 @@ static void virtio_net_reset(VirtIODevice *vdev)
     for (i = 0;  i < n->max_queue_pairs; i++) {
         flush_or_purge_queued_packets(qemu_get_subqueue(n->nic, i));
     }
+
+    n->gro_flags = 0;
+    virtio_net_gro_cleanup(n);
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -804,9 +895,15 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        /*
+         * With host_gro the device coalesces TCP segments itself and
+         * hands them to the guest as GSO packets.
+         */
+        if (!n->host_gro) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
 
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_USO);
@@ -1012,11 +1109,14 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
 
-    if (n->has_vnet_hdr) {
+    if (n->has_vnet_hdr || n->host_gro) {
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
+    }
+    if (n->has_vnet_hdr) {
         virtio_net_apply_guest_offloads(n);
     }
+    virtio_net_update_gro(n);
 
     for (i = 0;  i < n->max_queue_pairs; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
@@ -1105,7 +1205,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->host_gro) {
             return VIRTIO_NET_ERR;
         }
 
@@ -1121,7 +1221,10 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
+        virtio_net_update_gro(n);
 
         return VIRTIO_NET_OK;
     } else {
@@ -1384,6 +1487,16 @@ static void virtio_net_unload_ebpf(VirtIONet *n)
     ebpf_rss_unload(&n->ebpf_rss);
 }
 
+/*
+ * Expand the key for software RSS.  Only call this while no queue hashes
+ * packets, the receive path uses the tables without locking.
+ */
+static void virtio_net_set_rss_key(VirtIONet *n)
+{
+    QEMU_BUILD_BUG_ON(sizeof(n->rss_data.key) != NET_TOEPLITZ_KEY_SIZE);
+    net_toeplitz_set_key(&n->rss_data.toeplitz, n->rss_data.key);
+}
+
 static uint16_t virtio_net_handle_rss(VirtIONet *n,
                                       struct iovec *iov,
                                       unsigned int iov_cnt,
@@ -1495,6 +1608,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         err_value = (uint32_t)s;
         goto error;
     }
+    virtio_net_set_rss_key(n);
     n->rss_data.enabled = true;
 
     if (!n->rss_data.populate_hash) {
@@ -1623,7 +1737,10 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
+    /* Control commands change state that the dataplane uses */
+    bool paused = virtio_net_dataplane_pause(n);
 
     for (;;) {
         size_t written;
@@ -1644,6 +1761,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+
+    if (paused) {
+        virtio_net_dataplane_resume(n);
+    }
 }
 
 /* RX */
@@ -1652,7 +1773,12 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    NetGRO *gro = n->vqs[queue_index].gro;
 
+    /* Packets held by GRO were received before the queued ones */
+    if (gro && !net_gro_flush(gro)) {
+        return;
+    }
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -1737,7 +1863,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr *hdr)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -1750,11 +1877,11 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
         }
         iov_from_buf(iov, iov_cnt, 0, buf, sizeof(struct virtio_net_hdr));
     } else {
-        struct virtio_net_hdr hdr = {
+        static const struct virtio_net_hdr none = {
             .flags = 0,
             .gso_type = VIRTIO_NET_HDR_GSO_NONE
         };
-        iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
+        iov_from_buf(iov, iov_cnt, 0, hdr ?: &none, sizeof(none));
     }
 }
 
@@ -1882,7 +2009,7 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     unsigned int index = nc->queue_index, new_index = index;
-    struct NetRxPkt *pkt = n->rx_pkt;
+    struct NetRxPkt *pkt = n->vqs[index].rx_pkt;
     uint8_t net_hash_type;
     uint32_t hash;
     bool hasip4, hasip6;
@@ -1914,7 +2041,7 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
         return n->rss_data.redirect ? n->rss_data.default_queue : -1;
     }
 
-    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, n->rss_data.key);
+    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, &n->rss_data.toeplitz);
 
     if (n->rss_data.populate_hash) {
         virtio_set_packet_hash(buf, reports[net_hash_type], hash);
@@ -1928,8 +2055,13 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
     return (index == new_index) ? -1 : new_index;
 }
 
+/*
+ * @hdr is the header given to the guest when the peer has no vnet header,
+ * NULL for a plain packet.
+ */
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size, bool no_rss)
+                                      size_t size, bool no_rss,
+                                      const struct virtio_net_hdr *hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1948,9 +2080,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 
     if (!no_rss && n->rss_data.enabled && n->rss_data.enabled_software_rss) {
         int index = virtio_net_process_rss(nc, buf, size);
-        if (index >= 0) {
+
+        /* Queues of other IOThreads can't be filled from this thread */
+        if (index >= 0 && n->vqs[index].ctx == q->ctx) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
-            return virtio_net_receive_rcu(nc2, buf, size, true);
+            return virtio_net_receive_rcu(nc2, buf, size, true, hdr);
         }
     }
 
@@ -2011,7 +2145,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, hdr);
             if (n->rss_data.populate_hash) {
                 offset = sizeof(mhdr);
                 iov_from_buf(sg, elem->in_num, offset,
@@ -2053,12 +2187,17 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 
     for (j = 0; j < i; j++) {
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
+        virtqueue_fill(q->rx_vq, elems[j], lens[j], q->rx_batch_used + j);
         g_free(elems[j]);
     }
 
+    if (q->rx_batching) {
+        q->rx_batch_used += i;
+        return size;
+    }
+
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_notify(n, q->rx_vq);
 
     return size;
 
@@ -2076,7 +2215,7 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
 {
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size, false);
+    return virtio_net_receive_rcu(nc, buf, size, false, NULL);
 }
 
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
@@ -2672,28 +2811,142 @@ static ssize_t virtio_net_rsc_receive(NetClientState *nc,
     return virtio_net_do_receive(nc, buf, size);
 }
 
+static ssize_t virtio_net_gro_output(void *opaque, const uint8_t *buf,
+                                     size_t size, const NetGROInfo *info)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    struct virtio_net_hdr hdr = {
+        .flags = 0,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE
+    };
+
+    if (info) {
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.gso_type = info->gso_type;
+        hdr.hdr_len = virtio_tswap16(vdev, info->hdr_len);
+        hdr.gso_size = virtio_tswap16(vdev, info->gso_size);
+        hdr.csum_start = virtio_tswap16(vdev, info->csum_start);
+        hdr.csum_offset = virtio_tswap16(vdev, info->csum_offset);
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    /* 0 if there are not enough buffers, GRO retries from handle_rx */
+    return virtio_net_receive_rcu(nc, buf, size, false, &hdr);
+}
+
+static ssize_t virtio_net_gro_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int ret;
+
+    if (!q->gro) {
+        q->gro = net_gro_new(q->ctx ?: qemu_get_aio_context(), n->rsc_timeout,
+                             n->gro_flags, virtio_net_gro_output, q);
+    }
+
+    /*
+     * Only hold packets that could be delivered right now.  Otherwise the
+     * net layer queues the packet and offers it again once the guest has
+     * refilled the receive queue.
+     */
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (virtio_net_can_receive(nc) &&
+            virtio_net_has_buffers(q, size + n->guest_hdr_len)) {
+            ret = net_gro_receive(q->gro, buf, size);
+            if (ret < 0) {
+                /* Queue the packet behind the held one that was refused */
+                return 0;
+            } else if (ret > 0) {
+                return size;
+            }
+        }
+    }
+
+    return virtio_net_do_receive(nc, buf, size);
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     if ((n->rsc4_enabled || n->rsc6_enabled)) {
         return virtio_net_rsc_receive(nc, buf, size);
+    } else if (n->gro_flags) {
+        return virtio_net_gro_receive(nc, buf, size);
     } else {
         return virtio_net_do_receive(nc, buf, size);
     }
 }
 
+/*
+ * Fill the receive queue with a batch of packets, but update the used ring
+ * and notify the guest only once.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketIov *pkts, int npkts)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    uint8_t *linear = NULL;
+    int i;
+
+    assert(!q->rx_batching);
+    q->rx_batching = true;
+    q->rx_batch_used = 0;
+
+    for (i = 0; i < npkts; i++) {
+        const uint8_t *buf;
+        size_t size;
+        ssize_t ret;
+
+        if (pkts[i].iovcnt == 1) {
+            buf = pkts[i].iov[0].iov_base;
+            size = pkts[i].iov[0].iov_len;
+        } else {
+            size = iov_size(pkts[i].iov, pkts[i].iovcnt);
+            if (!linear) {
+                linear = g_malloc(NET_BUFSIZE);
+            }
+            iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0, linear, size);
+            buf = linear;
+        }
+
+        ret = virtio_net_receive(nc, buf, size);
+        if (ret <= 0) {
+            break;
+        }
+    }
+
+    if (q->gro) {
+        net_gro_flush(q->gro);
+    }
+    q->rx_batching = false;
+    if (q->rx_batch_used) {
+        virtqueue_flush(q->rx_vq, q->rx_batch_used);
+        virtio_net_notify(n, q->rx_vq);
+        q->rx_batch_used = 0;
+    }
+
+    g_free(linear);
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int ret;
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2803,7 +3056,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_notify(n, q->tx_vq);
         g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
@@ -2969,6 +3222,66 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static bool virtio_net_tx_uses_timer(VirtIONet *n)
+{
+    return n->net_conf.tx && !strcmp(n->net_conf.tx, "timer");
+}
+
+/* Create the TX timer or BH in @ctx, or in the main loop if @ctx is NULL */
+static void virtio_net_tx_init(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIONet *n = q->n;
+
+    if (virtio_net_tx_uses_timer(n)) {
+        if (ctx) {
+            q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        virtio_net_tx_timer, q);
+        } else {
+            q->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_tx_timer, q);
+        }
+    } else {
+        MemReentrancyGuard *guard = &DEVICE(n)->mem_reentrancy_guard;
+
+        if (ctx) {
+            q->tx_bh = aio_bh_new_guarded(ctx, virtio_net_tx_bh, q, guard);
+        } else {
+            q->tx_bh = qemu_bh_new_guarded(virtio_net_tx_bh, q, guard);
+        }
+    }
+}
+
+static void virtio_net_tx_cleanup(VirtIONetQueue *q)
+{
+    if (q->tx_timer) {
+        timer_free(q->tx_timer);
+        q->tx_timer = NULL;
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = NULL;
+    }
+}
+
+/*
+ * Move the TX timer or BH to another AioContext.  Must be called from the
+ * AioContext that the TX timer or BH currently runs in.
+ */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    virtio_net_tx_cleanup(q);
+    virtio_net_tx_init(q, ctx);
+
+    /* A pending flush was dropped with the old timer or BH */
+    if (q->tx_waiting) {
+        if (q->tx_timer) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->n->tx_timeout);
+        } else {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2976,23 +3289,19 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
 
-    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+    if (virtio_net_tx_uses_timer(n)) {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_timer);
-        n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                              virtio_net_tx_timer,
-                                              &n->vqs[index]);
     } else {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_bh);
-        n->vqs[index].tx_bh = qemu_bh_new_guarded(virtio_net_tx_bh, &n->vqs[index],
-                                                  &DEVICE(vdev)->mem_reentrancy_guard);
     }
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    virtio_net_tx_init(&n->vqs[index], NULL);
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -3004,14 +3313,9 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     qemu_purge_queued_packets(nc);
 
     virtio_del_queue(vdev, index * 2);
-    if (q->tx_timer) {
-        timer_free(q->tx_timer);
-        q->tx_timer = NULL;
-    } else {
-        qemu_bh_delete(q->tx_bh);
-        q->tx_bh = NULL;
-    }
+    virtio_net_tx_cleanup(q);
     q->tx_waiting = 0;
+    virtio_net_gro_free(n, index);
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
@@ -3060,6 +3364,236 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
     virtio_net_set_queue_pairs(n);
 }
 
+/*
+ * Dataplane
+ *
+ * With iothread-vq-mapping, every queue pair is processed in its IOThread
+ * while ioeventfd is started: the host notifiers of its virtqueues, its TX
+ * timer or BH and the fd handlers of its netdev are all moved there.  The
+ * control virtqueue stays in the main loop.
+ *
+ * A queue pair is either completely in its IOThread or completely in the main
+ * loop, and it is moved from within the IOThread while the main loop waits.
+ * Device state that the dataplane uses is only changed while it is paused,
+ * which moves all queue pairs back to the main loop.
+ */
+
+static int virtio_net_dataplane_queue_pairs(VirtIONet *n)
+{
+    return n->multiqueue ? n->max_queue_pairs : 1;
+}
+
+/* Context: BH in the IOThread of the queue pair */
+static void virtio_net_dataplane_attach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *peer = qemu_get_subqueue(n->nic, q - n->vqs)->peer;
+
+    virtio_net_tx_set_aio_context(q, q->ctx);
+    if (peer) {
+        qemu_net_set_aio_context(peer, q->ctx);
+    }
+
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq), NULL);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq), NULL);
+
+    /*
+     * Neither handler pops all elements, so don't poll.  Attaching the
+     * notifiers also kicks the virtqueues.
+     */
+    virtio_queue_aio_attach_host_notifier_no_poll(q->rx_vq, q->ctx);
+    virtio_queue_aio_attach_host_notifier_no_poll(q->tx_vq, q->ctx);
+}
+
+/* Context: BH in the IOThread of the queue pair */
+static void virtio_net_dataplane_detach_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *peer = qemu_get_subqueue(n->nic, q - n->vqs)->peer;
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, q->ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, q->ctx);
+
+    /* Pending notifications are picked up by the main loop */
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                               virtio_queue_host_notifier_read);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                               virtio_queue_host_notifier_read);
+
+    if (peer) {
+        qemu_net_set_aio_context(peer, NULL);
+    }
+    virtio_net_tx_set_aio_context(q, NULL);
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_attach(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < virtio_net_dataplane_queue_pairs(n); i++) {
+        aio_wait_bh_oneshot(n->vqs[i].ctx, virtio_net_dataplane_attach_bh,
+                            &n->vqs[i]);
+    }
+    n->dataplane_started = true;
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_detach(VirtIONet *n)
+{
+    int i;
+
+    n->dataplane_started = false;
+    for (i = 0; i < virtio_net_dataplane_queue_pairs(n); i++) {
+        aio_wait_bh_oneshot(n->vqs[i].ctx, virtio_net_dataplane_detach_bh,
+                            &n->vqs[i]);
+    }
+}
+
+/*
+ * Move all queue pairs back to the main loop so that device state can be
+ * changed safely.  Returns true if virtio_net_dataplane_resume() must be
+ * called afterwards.
+ *
+ * Context: BQL held
+ */
+static bool virtio_net_dataplane_pause(VirtIONet *n)
+{
+    if (!n->dataplane_started) {
+        return false;
+    }
+
+    virtio_net_dataplane_detach(n);
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_resume(VirtIONet *n)
+{
+    virtio_net_dataplane_attach(n);
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_net_dataplane_queue_pairs(n) * 2 + 1;
+    Error *local_err = NULL;
+    int i, r;
+
+    if (!n->net_conf.iothread_vq_mapping_list) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    /* Filters may have been added to the netdevs since realize */
+    for (i = 0; i < virtio_net_dataplane_queue_pairs(n); i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (peer && !qemu_net_can_set_aio_context(peer, &local_err)) {
+            error_prepend(&local_err, "virtio-net dataplane disabled: ");
+            warn_report_err(local_err);
+            return virtio_device_start_ioeventfd_impl(vdev);
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return r;
+    }
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r < 0) {
+        k->set_guest_notifiers(qbus->parent, nvqs, false);
+        return r;
+    }
+
+    virtio_net_dataplane_attach(n);
+    return 0;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_net_dataplane_queue_pairs(n) * 2 + 1;
+
+    if (!n->dataplane_started) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    virtio_net_dataplane_detach(n);
+    virtio_device_stop_ioeventfd_impl(vdev);
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+}
+
+/* Context: BQL held */
+static bool virtio_net_vq_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThreadVirtQueueMappingList *list = n->net_conf.iothread_vq_mapping_list;
+    g_autofree AioContext **ctx = NULL;
+    int i;
+
+    if (!list) {
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp, "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        error_setg(errp, "iothread-vq-mapping is not supported together "
+                   "with guest_rsc_ext");
+        return false;
+    }
+
+    for (i = 0; i < n->max_ncs; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!peer) {
+            continue;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread-vq-mapping is not supported with vhost");
+            return false;
+        }
+        if (!qemu_net_can_set_aio_context(peer, errp)) {
+            return false;
+        }
+    }
+
+    /* vqs in the mapping are queue pair indices */
+    ctx = g_new(AioContext *, n->max_queue_pairs);
+    if (!iothread_vq_mapping_apply(list, ctx, n->max_queue_pairs, errp)) {
+        return false;
+    }
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        n->vqs[i].ctx = ctx[i];
+    }
+    return true;
+}
+
 static int virtio_net_post_load_device(void *opaque, int version_id)
 {
     VirtIONet *n = opaque;
@@ -3121,6 +3655,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     }
 
     if (n->rss_data.enabled) {
+        virtio_net_set_rss_key(n);
         n->rss_data.enabled_software_rss = n->rss_data.populate_hash;
         if (!n->rss_data.populate_hash) {
             if (!virtio_net_attach_epbf_rss(n)) {
@@ -3155,6 +3690,7 @@ static int virtio_net_post_load_virtio(VirtIODevice *vdev)
     if (peer_has_vnet_hdr(n)) {
         virtio_net_apply_guest_offloads(n);
     }
+    virtio_net_update_gro(n);
 
     return 0;
 }
@@ -3404,6 +3940,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3732,6 +4269,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
+    if (!virtio_net_vq_aio_context_init(n, errp)) {
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
 
@@ -3809,7 +4351,9 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
 
-    net_rx_pkt_init(&n->rx_pkt);
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        net_rx_pkt_init(&n->vqs[i].rx_pkt);
+    }
 
     if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
         virtio_net_load_ebpf(n, errp);
@@ -3852,11 +4396,16 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     /* delete also control vq */
     virtio_del_queue(vdev, max_queue_pairs * 2);
     qemu_announce_timer_del(&n->announce_timer, false);
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        net_rx_pkt_uninit(n->vqs[i].rx_pkt);
+    }
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
-    net_rx_pkt_uninit(n->rx_pkt);
+    if (n->net_conf.iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(n->net_conf.iothread_vq_mapping_list);
+    }
     virtio_cleanup(vdev);
 }
 
@@ -3980,6 +4529,7 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
+    DEFINE_PROP_BOOL("host_gro", VirtIONet, host_gro, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -4001,6 +4551,8 @@ static Property virtio_net_properties[] = {
                       VIRTIO_NET_F_GUEST_USO6, true),
     DEFINE_PROP_BIT64("host_uso", VirtIONet, host_features,
                       VIRTIO_NET_F_HOST_USO, true),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         net_conf.iothread_vq_mapping_list),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -4014,6 +4566,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     set_bit(DEVICE_CATEGORY_NETWORK, dc->categories);
     vdc->realize = virtio_net_device_realize;
     vdc->unrealize = virtio_net_device_unrealize;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->get_config = virtio_net_get_config;
     vdc->set_config = virtio_net_set_config;
     vdc->get_features = virtio_net_get_features;
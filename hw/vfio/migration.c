@@ -10,6 +10,7 @@
 #include "qemu/osdep.h"
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
+#include "qemu/lockable.h"
 #include "qemu/units.h"
 #include "qemu/error-report.h"
 #include <linux/vfio.h>
@@ -41,12 +42,17 @@
  * The beginning of state information is marked by _DEV_CONFIG_STATE,
  * _DEV_SETUP_STATE, or _DEV_DATA_STATE, respectively. The end of a
  * certain state information is marked by _END_OF_STATE.
+ *
+ * _DEV_DATA_STATE_MULTIFD marks data sent as buffers over multifd
+ * channels. It is followed by the number of buffers once all of them
+ * have been queued.
  */
 #define VFIO_MIG_FLAG_END_OF_STATE      (0xffffffffef100001ULL)
 #define VFIO_MIG_FLAG_DEV_CONFIG_STATE  (0xffffffffef100002ULL)
 #define VFIO_MIG_FLAG_DEV_SETUP_STATE   (0xffffffffef100003ULL)
 #define VFIO_MIG_FLAG_DEV_DATA_STATE    (0xffffffffef100004ULL)
 #define VFIO_MIG_FLAG_DEV_INIT_DATA_SENT (0xffffffffef100005ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_STATE_MULTIFD (0xffffffffef100006ULL)
 
 /*
  * This is an arbitrary size based on migration of mlx5 devices, where typically
@@ -389,6 +395,72 @@ static ssize_t vfio_save_block(QEMUFile *f, VFIOMigration *migration)
     return qemu_file_get_error(f) ?: data_size;
 }
 
+static bool vfio_multifd_transfer_enabled(VFIODevice *vbasedev)
+{
+    return vbasedev->migration_multifd_transfer &&
+           multifd_device_state_supported() &&
+           !runstate_check(RUN_STATE_SAVE_VM);
+}
+
+/*
+ * Queue the remaining device data as buffers on the multifd channels.
+ * Reading the next chunk from the device overlaps with sending the
+ * previous ones.
+ */
+static int vfio_save_complete_precopy_multifd(QEMUFile *f,
+                                              VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    Error *local_err = NULL;
+    uint32_t idx = 0;
+    int ret;
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE_MULTIFD);
+    /* Let the destination start writing buffers as soon as they arrive */
+    ret = qemu_fflush(f);
+    if (ret) {
+        return ret;
+    }
+
+    while (true) {
+        g_autofree char *buf = g_malloc(migration->data_buffer_size);
+        ssize_t data_size;
+
+        data_size = read(migration->data_fd, buf,
+                         migration->data_buffer_size);
+        if (data_size < 0) {
+            if (errno == ENOMSG) {
+                break;
+            }
+            return -errno;
+        }
+        if (data_size == 0) {
+            break;
+        }
+
+        ret = qemu_savevm_queue_state_buffer(vbasedev, idx,
+                                             g_steal_pointer(&buf),
+                                             data_size, &local_err);
+        if (ret) {
+            error_report_err(local_err);
+            return ret;
+        }
+        bytes_transferred += data_size;
+
+        trace_vfio_save_block_multifd(vbasedev->name, idx, data_size);
+        idx++;
+    }
+
+    /* The channels are shut down as soon as the migration completes */
+    if (multifd_device_state_flush()) {
+        return -EIO;
+    }
+
+    qemu_put_be64(f, idx);
+
+    return qemu_file_get_error(f);
+}
+
 static void vfio_update_estimated_pending_data(VFIOMigration *migration,
                                                uint64_t data_size)
 {
@@ -450,6 +522,14 @@ static int vfio_save_prepare(void *opaque, Error **errp)
         return -EOPNOTSUPP;
     }
 
+    if (vbasedev->migration_multifd_transfer &&
+        !multifd_device_state_supported()) {
+        error_setg(errp,
+                   "%s: x-migration-multifd-transfer requires multifd "
+                   "migration without mapped-ram", vbasedev->name);
+        return -EOPNOTSUPP;
+    }
+
     return 0;
 }
 
@@ -641,12 +721,19 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
         return ret;
     }
 
-    do {
-        data_size = vfio_save_block(f, vbasedev->migration);
-        if (data_size < 0) {
-            return data_size;
+    if (vfio_multifd_transfer_enabled(vbasedev)) {
+        ret = vfio_save_complete_precopy_multifd(f, vbasedev);
+        if (ret) {
+            return ret;
         }
-    } while (data_size);
+    } else {
+        do {
+            data_size = vfio_save_block(f, vbasedev->migration);
+            if (data_size < 0) {
+                return data_size;
+            }
+        } while (data_size);
+    }
 
     qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
     ret = qemu_file_get_error(f);
@@ -674,21 +761,149 @@ static void vfio_save_state(QEMUFile *f, void *opaque)
 static int vfio_load_setup(QEMUFile *f, void *opaque, Error **errp)
 {
     VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+
+    WITH_QEMU_LOCK_GUARD(&migration->load_bufs_mutex) {
+        migration->load_bufs =
+            g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                  (GDestroyNotify)g_bytes_unref);
+        migration->load_bufs_next = 0;
+        migration->load_bufs_ready = false;
+        migration->load_bufs_ret = 0;
+    }
 
     return vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_RESUMING,
-                                    vbasedev->migration->device_state, errp);
+                                    migration->device_state, errp);
 }
 
 static int vfio_load_cleanup(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
 
+    WITH_QEMU_LOCK_GUARD(&migration->load_bufs_mutex) {
+        g_clear_pointer(&migration->load_bufs, g_hash_table_destroy);
+    }
     vfio_migration_cleanup(vbasedev);
     trace_vfio_load_cleanup(vbasedev->name);
 
     return 0;
 }
 
+/*
+ * Write the buffers received so far to the device, in index order and
+ * only once the main stream reached them.  Called with load_bufs_mutex
+ * held.
+ */
+static int vfio_load_bufs_write_locked(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    GBytes *bytes;
+
+    while (migration->load_bufs_ready && !migration->load_bufs_ret) {
+        gpointer key = GUINT_TO_POINTER(migration->load_bufs_next);
+        const void *data;
+        gsize size;
+
+        bytes = g_hash_table_lookup(migration->load_bufs, key);
+        if (!bytes) {
+            break;
+        }
+
+        data = g_bytes_get_data(bytes, &size);
+        if (qemu_write_full(migration->data_fd, data, size) != size) {
+            migration->load_bufs_ret = errno ? -errno : -EIO;
+        }
+        trace_vfio_load_state_device_buffer(vbasedev->name,
+                                            migration->load_bufs_next, size,
+                                            migration->load_bufs_ret);
+
+        g_hash_table_remove(migration->load_bufs, key);
+        migration->load_bufs_next++;
+        qemu_cond_broadcast(&migration->load_bufs_cond);
+    }
+
+    return migration->load_bufs_ret;
+}
+
+static int vfio_load_state_buffer(void *opaque, uint32_t idx, char *buf,
+                                  size_t len, Error **errp)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    gpointer key = GUINT_TO_POINTER(idx);
+    int ret;
+
+    QEMU_LOCK_GUARD(&migration->load_bufs_mutex);
+
+    if (!migration->load_bufs || idx < migration->load_bufs_next ||
+        g_hash_table_contains(migration->load_bufs, key)) {
+        g_free(buf);
+        error_setg(errp, "%s: unexpected state buffer %u", vbasedev->name,
+                   idx);
+        return -EINVAL;
+    }
+
+    g_hash_table_insert(migration->load_bufs, key, g_bytes_new_take(buf, len));
+
+    ret = vfio_load_bufs_write_locked(vbasedev);
+    if (ret) {
+        error_setg_errno(errp, -ret, "%s: failed to load state buffer",
+                         vbasedev->name);
+    }
+
+    return ret;
+}
+
+/*
+ * The multifd receive threads keep adding buffers while we wait here,
+ * and write them to the device once ready is set.
+ */
+static int vfio_load_state_multifd(QEMUFile *f, VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    uint64_t count;
+    int ret = 0;
+
+    if (!multifd_device_state_supported()) {
+        error_report("%s: received multifd data without multifd",
+                     vbasedev->name);
+        return -EINVAL;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&migration->load_bufs_mutex) {
+        migration->load_bufs_ready = true;
+        ret = vfio_load_bufs_write_locked(vbasedev);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    count = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&migration->load_bufs_mutex) {
+        while (migration->load_bufs_next < count &&
+               !migration->load_bufs_ret) {
+            if (multifd_recv_device_state_aborted()) {
+                ret = -EIO;
+                break;
+            }
+            qemu_cond_timedwait(&migration->load_bufs_cond,
+                                &migration->load_bufs_mutex, 100);
+        }
+        ret = ret ?: migration->load_bufs_ret;
+        migration->load_bufs_ready = false;
+    }
+
+    trace_vfio_load_state_multifd(vbasedev->name, count, ret);
+
+    return ret;
+}
+
 static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
 {
     VFIODevice *vbasedev = opaque;
@@ -729,6 +944,14 @@ static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
             }
             break;
         }
+        case VFIO_MIG_FLAG_DEV_DATA_STATE_MULTIFD:
+        {
+            ret = vfio_load_state_multifd(f, vbasedev);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
         case VFIO_MIG_FLAG_DEV_INIT_DATA_SENT:
         {
             if (!vfio_precopy_supported(vbasedev) ||
@@ -782,6 +1005,7 @@ static const SaveVMHandlers savevm_vfio_handlers = {
     .load_cleanup = vfio_load_cleanup,
     .load_state = vfio_load_state,
     .switchover_ack_needed = vfio_switchover_ack_needed,
+    .load_state_buffer = vfio_load_state_buffer,
 };
 
 /* ---------------------------------------------------------------------- */
@@ -872,6 +1096,8 @@ static int vfio_migration_state_notifier(NotifierWithReturn *notifier,
 
 static void vfio_migration_free(VFIODevice *vbasedev)
 {
+    qemu_mutex_destroy(&vbasedev->migration->load_bufs_mutex);
+    qemu_cond_destroy(&vbasedev->migration->load_bufs_cond);
     g_free(vbasedev->migration);
     vbasedev->migration = NULL;
 }
@@ -944,6 +1170,8 @@ static int vfio_migration_init(VFIODevice *vbasedev)
     migration->device_state = VFIO_DEVICE_STATE_RUNNING;
     migration->data_fd = -1;
     migration->mig_flags = mig_flags;
+    qemu_mutex_init(&migration->load_bufs_mutex);
+    qemu_cond_init(&migration->load_bufs_cond);
 
     vbasedev->dirty_pages_supported = vfio_dma_logging_supported(vbasedev);
 
@@ -20,6 +20,7 @@
 #include "qemu/coroutine-core.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "block/graph-lock.h"
@@ -122,6 +123,9 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+/* Number of buckets in the AIO engine batch size histogram */
+#define AIO_BATCH_HIST_BUCKETS 8
+
 struct AioContext {
     GSource source;
 
@@ -236,6 +240,12 @@ struct AioContext {
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
+    /*
+     * Number of batches submitted by the AIO engine, by size, see
+     * aio_context_account_batch().  Written by the event loop thread only.
+     */
+    Stat64 aio_batch_hist[AIO_BATCH_HIST_BUCKETS];
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -706,6 +716,16 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
  */
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
 
+/**
+ * aio_context_account_batch:
+ * @ctx: the aio context
+ * @n: number of requests that the AIO engine submitted in one system call
+ *
+ * Element i of ctx->aio_batch_hist counts batches of 2^i to 2^(i+1) - 1
+ * requests; the last element also counts all larger batches.
+ */
+void aio_context_account_batch(AioContext *ctx, unsigned int n);
+
 /**
  * aio_context_set_thread_pool_params:
  * @ctx: the aio context
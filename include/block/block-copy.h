@@ -100,4 +100,19 @@ BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+typedef struct BlockCopyStats {
+    /* Maximum size of the last copy task, adapted to the performance */
+    int64_t chunk_size;
+    /* Average duration of recent copy tasks, in nanoseconds */
+    int64_t latency;
+    /* Block status queries sent to the source */
+    uint64_t status_queries;
+    /* Tasks that got their block status from the prefetched extents */
+    uint64_t status_prefetched;
+    /* Tasks that span several block status extents */
+    uint64_t coalesced;
+} BlockCopyStats;
+
+void block_copy_get_stats(BlockCopyState *s, BlockCopyStats *stats);
+
 #endif /* BLOCK_COPY_H */
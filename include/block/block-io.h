@@ -360,8 +360,16 @@ int co_wrapper_mixed_bdrv_rdlock
 bdrv_truncate(BdrvChild *child, int64_t offset, bool exact,
               PreallocMode prealloc, BdrvRequestFlags flags, Error **errp);
 
+/*
+ * The units of done and total_work_size may be chosen arbitrarily by the
+ * block driver; total_work_size may change during the course of the check
+ */
+typedef void BlockDriverCheckStatusCB(BlockDriverState *bs, int64_t done,
+                                      int64_t total_work_size, void *opaque);
+
 int co_wrapper_mixed_bdrv_rdlock
-bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix);
+bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix,
+           BlockDriverCheckStatusCB *status_cb, void *cb_opaque);
 
 /* Invalidate any cached metadata used by image formats */
 int co_wrapper_mixed_bdrv_rdlock
@@ -57,6 +57,7 @@
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_DEDUP             "dedup"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -768,10 +769,12 @@ struct BlockDriver {
 
     /*
      * Returns 0 for completed check, -errno for internal errors.
-     * The check results are stored in result.
+     * The check results are stored in result.  status_cb may be NULL;
+     * drivers that do not report progress can ignore it.
      */
     int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_check)(
-        BlockDriverState *bs, BdrvCheckResult *result, BdrvCheckMode fix);
+        BlockDriverState *bs, BdrvCheckResult *result, BdrvCheckMode fix,
+        BlockDriverCheckStatusCB *status_cb, void *cb_opaque);
 
     void coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_debug_event)(
         BlockDriverState *bs, BlkdebugEvent event);
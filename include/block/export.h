@@ -29,6 +29,12 @@ typedef struct BlockExportDriver {
      */
     size_t instance_size;
 
+    /*
+     * True if the driver can process requests in several AioContexts at
+     * once, i.e. accepts the iothreads option.
+     */
+    bool supports_multithread;
+
     /* Creates and starts a new block export */
     int (*create)(BlockExport *, BlockExportOptions *, Error **);
 
@@ -73,6 +79,14 @@ struct BlockExport {
     /* The AioContext whose lock protects this BlockExport object. */
     AioContext *ctx;
 
+    /*
+     * The AioContexts of the iothreads given with the iothreads option, in
+     * the order in which they were given.  Only set for drivers that support
+     * multithreading, NULL otherwise.
+     */
+    AioContext **multithread_ctxs;
+    size_t multithread_count;
+
     /* The block device to export */
     BlockBackend *blk;
 
@@ -245,6 +245,20 @@ int qemu_chr_fe_write(CharBackend *be, const uint8_t *buf, int len);
  */
 int qemu_chr_fe_write_all(CharBackend *be, const uint8_t *buf, int len);
 
+/**
+ * qemu_chr_fe_writev_all:
+ * @iov: the data
+ * @iovcnt: the number of elements in @iov
+ *
+ * Like @qemu_chr_fe_write_all, but gather the data from @iov.  Backends
+ * that support it send the whole vector at once, for example with a
+ * single sendmsg() call on a socket.  This function is thread-safe.
+ *
+ * Returns: the number of bytes consumed (0 if no associated Chardev)
+ */
+int qemu_chr_fe_writev_all(CharBackend *be, const struct iovec *iov,
+                           int iovcnt);
+
 /**
  * qemu_chr_fe_read_all:
  * @buf: the data buffer
@@ -332,4 +332,44 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_get_ktls_requested:
+ * @sess: the TLS session object
+ *
+ * Check whether the credentials used by the session asked
+ * for the record layer to be offloaded to the kernel once
+ * the handshake completes.
+ *
+ * Returns: true if kernel TLS offload was requested
+ */
+bool qcrypto_tls_session_get_ktls_requested(QCryptoTLSSession *sess);
+
+/**
+ * qcrypto_tls_session_enable_ktls:
+ * @sess: the TLS session object
+ * @fd: the TCP socket carrying the session
+ * @rx: true for the receive direction, false for transmit
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Hand the negotiated record keys and sequence number for
+ * one direction of the session over to the kernel TLS layer
+ * of @fd. This may only be called once the handshake has
+ * completed. On success, the kernel owns the record state
+ * for that direction. For transmit, the caller must stop
+ * using qcrypto_tls_session_write() and write to @fd
+ * directly. For receive, qcrypto_tls_session_read() keeps
+ * working but reads from @fd instead of calling the read
+ * function; it drops TLS 1.3 session tickets and turns a
+ * close_notify alert into end of file.
+ *
+ * On failure nothing has been changed for that direction,
+ * so the caller can keep using the session in userspace.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess,
+                                    int fd,
+                                    bool rx,
+                                    Error **errp);
+
 #endif /* QCRYPTO_TLSSESSION_H */
@@ -71,6 +71,13 @@ typedef struct VFIOMigration {
     uint64_t precopy_init_size;
     uint64_t precopy_dirty_size;
     bool initial_data_sent;
+    /* Stop-copy buffers received over multifd, indexed by sequence */
+    QemuMutex load_bufs_mutex;
+    QemuCond load_bufs_cond;
+    GHashTable *load_bufs;
+    uint32_t load_bufs_next;
+    bool load_bufs_ready;
+    int load_bufs_ret;
 } VFIOMigration;
 
 struct VFIOGroup;
@@ -116,6 +123,7 @@ typedef struct VFIODevice {
     bool ram_block_discard_allowed;
     OnOffAuto enable_migration;
     bool migration_events;
+    bool migration_multifd_transfer;
     VFIODeviceOps *ops;
     unsigned int num_irqs;
     unsigned int num_regions;
@@ -20,8 +20,10 @@
 #include "net/announce.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "qapi/qapi-types-virtio.h"
 
 #include "ebpf/ebpf_rss.h"
+#include "net/toeplitz.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 OBJECT_DECLARE_SIMPLE_TYPE(VirtIONet, VIRTIO_NET)
@@ -56,6 +58,7 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -146,6 +149,8 @@ typedef struct VirtioNetRssData {
     bool    populate_hash;
     uint32_t hash_types;
     uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    /* @key expanded for software RSS, not migrated */
+    NetToeplitz toeplitz;
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
@@ -161,6 +166,14 @@ typedef struct VirtIONetQueue {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    /* IOThread that processes the queue pair, NULL for the main loop */
+    AioContext *ctx;
+    struct NetRxPkt *rx_pkt;
+    /* Used ring updates deferred until the end of a receive batch */
+    bool rx_batching;
+    unsigned rx_batch_used;
+    /* Receive coalescing for peers without a vnet header, created lazily */
+    struct NetGRO *gro;
 } VirtIONetQueue;
 
 struct VirtIONet {
@@ -182,6 +195,9 @@ struct VirtIONet {
     uint32_t rsc_timeout;
     uint8_t rsc4_enabled;
     uint8_t rsc6_enabled;
+    bool host_gro;
+    /* NET_GRO_F_* flags of the enabled GRO stage, 0 if disabled */
+    unsigned gro_flags;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
@@ -191,6 +207,11 @@ struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    /*
+     * With iothread-vq-mapping, queue pairs are only processed in their
+     * IOThreads while this is set.
+     */
+    bool dataplane_started;
     struct {
         uint32_t in_use;
         uint32_t first_multi;
@@ -223,7 +244,6 @@ struct VirtIONet {
     bool primary_opts_from_json;
     NotifierWithReturn migration_state;
     VirtioNetRssData rss_data;
-    struct NetRxPkt *rx_pkt;
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
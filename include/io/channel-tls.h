@@ -49,6 +49,8 @@ struct QIOChannelTLS {
     QCryptoTLSSession *session;
     QIOChannelShutdown shutdown;
     guint hs_ioc_tag;
+    bool ktls_tx;
+    bool ktls_rx;
 };
 
 /**
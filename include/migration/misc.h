@@ -111,4 +111,12 @@ bool migration_in_bg_snapshot(void);
 /* migration/block-dirty-bitmap.c */
 void dirty_bitmap_mig_init(void);
 
+/* migration/multifd.c */
+/* True if device state buffers can be sent over multifd channels */
+bool multifd_device_state_supported(void);
+/* Wait until the device state buffers queued so far have been sent */
+int multifd_device_state_flush(void);
+/* True if the multifd receive side is gone, e.g. due to an error */
+bool multifd_recv_device_state_aborted(void);
+
 #endif
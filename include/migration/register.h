@@ -275,6 +275,25 @@ typedef struct SaveVMHandlers {
      * otherwise
      */
     bool (*switchover_ack_needed)(void *opaque);
+
+    /**
+     * @load_state_buffer
+     *
+     * Load a buffer sent with qemu_savevm_queue_state_buffer() on the
+     * source.  Runs outside the BQL, in a multifd receive thread.
+     * Buffers travel over several channels, so they can arrive in any
+     * order and concurrently with @load_state on the main stream.
+     *
+     * @opaque: data pointer passed to register_savevm_live()
+     * @idx: index of the buffer given on the source
+     * @buf: buffer contents, ownership is transferred to the handler
+     * @len: size of @buf
+     * @errp: pointer to Error*, to store an error if it happens.
+     *
+     * Returns zero to indicate success and negative for error
+     */
+    int (*load_state_buffer)(void *opaque, uint32_t idx, char *buf,
+                             size_t len, Error **errp);
 } SaveVMHandlers;
 
 /**
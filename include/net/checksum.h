@@ -26,6 +26,12 @@ struct iovec;
 #define CSUM_UDP    0x04
 #define CSUM_ALL    (CSUM_IP | CSUM_TCP | CSUM_UDP)
 
+/*
+ * Return the ones' complement sum of @buf, as big-endian 16-bit words.  @seq
+ * is the offset of @buf in the checksummed data, only its parity matters.
+ * The result fits in 16 bits, so that partial sums can be added together
+ * before net_checksum_finish().
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
@@ -64,48 +70,13 @@ uint32_t net_checksum_add_iov(const struct iovec *iov,
                               uint32_t iov_off, uint32_t size,
                               uint32_t csum_offset);
 
-typedef struct toeplitz_key_st {
-    uint32_t leftmost_32_bits;
-    uint8_t *next_byte;
-} net_toeplitz_key;
-
-static inline
-void net_toeplitz_key_init(net_toeplitz_key *key, uint8_t *key_bytes)
-{
-    key->leftmost_32_bits = be32_to_cpu(*(uint32_t *)key_bytes);
-    key->next_byte = key_bytes + sizeof(uint32_t);
-}
-
-static inline
-void net_toeplitz_add(uint32_t *result,
-                      uint8_t *input,
-                      uint32_t len,
-                      net_toeplitz_key *key)
-{
-    register uint32_t accumulator = *result;
-    register uint32_t leftmost_32_bits = key->leftmost_32_bits;
-    register uint32_t byte;
-
-    for (byte = 0; byte < len; byte++) {
-        register uint8_t input_byte = input[byte];
-        register uint8_t key_byte = *(key->next_byte++);
-        register uint8_t bit;
-
-        for (bit = 0; bit < 8; bit++) {
-            if (input_byte & (1 << 7)) {
-                accumulator ^= leftmost_32_bits;
-            }
-
-            leftmost_32_bits =
-                (leftmost_32_bits << 1) | ((key_byte & (1 << 7)) >> 7);
-
-            input_byte <<= 1;
-            key_byte <<= 1;
-        }
-    }
-
-    key->leftmost_32_bits = leftmost_32_bits;
-    *result = accumulator;
-}
+/**
+ * test_net_checksum_next_accel:
+ *
+ * Switch to the next slower implementation of the vectorized kernel used
+ * by net_checksum_add_cont().  Return false if the portable implementation
+ * is already in use.  For use by tests and benchmarks only.
+ */
+bool test_net_checksum_next_accel(void);
 
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -45,6 +45,12 @@ struct NetFilterClass {
     FilterHandleEvent *handle_event;
     /* mandatory */
     FilterReceiveIOV *receive_iov;
+
+    /*
+     * Set if receive_iov can be called from the iothread of a netdev that
+     * was moved out of the main loop with qemu_net_set_aio_context().
+     */
+    bool supports_iothread;
 };
 
 
@@ -0,0 +1,106 @@
+/*
+ * Generic receive offload
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "block/aio.h"
+
+typedef struct NetGRO NetGRO;
+
+/* Flags for net_gro_new() */
+#define NET_GRO_F_TCPV4     (1 << 0)
+#define NET_GRO_F_TCPV6     (1 << 1)
+
+/*
+ * Description of a packet produced by coalescing several TCP segments.
+ *
+ * The IP header of the packet covers the whole payload.  The TCP checksum
+ * field holds the pseudo-header checksum only, as for a packet whose
+ * checksum still has to be computed: the receiver should report it as
+ * VIRTIO_NET_HDR_F_NEEDS_CSUM with the given @csum_start and @csum_offset.
+ * All merged segments had a valid checksum.
+ */
+typedef struct NetGROInfo {
+    uint8_t gso_type;       /* VIRTIO_NET_HDR_GSO_TCPV4 or _TCPV6 */
+    uint16_t gso_size;      /* payload of the largest merged segment */
+    uint16_t hdr_len;       /* Ethernet, IP and TCP headers */
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t segments;
+} NetGROInfo;
+
+typedef struct NetGROStats {
+    uint64_t received;      /* packets offered to net_gro_receive() */
+    uint64_t coalesced;     /* packets merged into a held one */
+    uint64_t bypassed;      /* packets that were not TCP candidates */
+    uint64_t flushed;       /* packets delivered from the flow table */
+    uint64_t timer_flushes;
+    uint64_t evictions;     /* flows flushed on a hash collision */
+    uint64_t dropped;       /* flushed packets dropped by the receiver */
+    uint64_t refused;       /* flushes the receiver could not take yet */
+} NetGROStats;
+
+/*
+ * Deliver a packet that leaves the GRO stage.  @info is NULL if the packet
+ * is the unmodified original.  Returns the size of the packet, a negative
+ * value if the receiver dropped it, or 0 if the receiver cannot take it
+ * right now.  In the latter case the packet stays held and the GRO stage
+ * takes no more packets until net_gro_flush() delivers it.
+ */
+typedef ssize_t (NetGROOutput)(void *opaque, const uint8_t *buf, size_t size,
+                               const NetGROInfo *info);
+
+/**
+ * net_gro_new:
+ * @ctx: AioContext in which packets are received and the flush timer runs
+ * @timeout_ns: maximum time a packet is held, in nanoseconds of
+ *     QEMU_CLOCK_VIRTUAL
+ * @flags: NET_GRO_F_* flags, the kinds of packets the receiver accepts
+ * @output: function that delivers packets leaving the GRO stage
+ * @opaque: argument for @output
+ *
+ * Create a GRO stage that coalesces consecutive TCP segments of the same
+ * flow, carried in untagged Ethernet frames over IPv4 or IPv6.
+ */
+NetGRO *net_gro_new(AioContext *ctx, int64_t timeout_ns, unsigned flags,
+                    NetGROOutput *output, void *opaque);
+
+/**
+ * net_gro_free:
+ *
+ * Drop the held packets and free @gro.  Call net_gro_flush() first to
+ * deliver them.
+ */
+void net_gro_free(NetGRO *gro);
+
+/**
+ * net_gro_receive:
+ *
+ * Offer the Ethernet frame @buf to the GRO stage.  Returns 1 if the
+ * packet was consumed: it is held or was merged into a held packet, and
+ * will be passed to the output function later.  Returns 0 if the caller
+ * must deliver the packet itself, right away; any held packet of the same
+ * flow has already been delivered in that case, so that the flow stays in
+ * order.  Returns -EBUSY if the receiver refused a held packet: the caller
+ * must offer @buf again after net_gro_flush() succeeds.
+ */
+int net_gro_receive(NetGRO *gro, const uint8_t *buf, size_t size);
+
+/**
+ * net_gro_flush:
+ *
+ * Deliver all held packets, for example at the end of a receive batch.
+ * Returns false if the receiver refused one; the packets that were not
+ * delivered stay held, and net_gro_flush() must be called again once the
+ * receiver can take packets.
+ */
+bool net_gro_flush(NetGRO *gro);
+
+void net_gro_get_stats(NetGRO *gro, NetGROStats *stats);
+
+#endif /* QEMU_NET_GRO_H */
@@ -2,6 +2,7 @@
 #define QEMU_NET_H
 
 #include "qemu/queue.h"
+#include "block/aio.h"
 #include "qapi/qapi-types-net.h"
 #include "net/queue.h"
 #include "hw/qdev-properties-system.h"
@@ -49,6 +50,7 @@ typedef int (NetLoad)(NetClientState *);
 typedef void (NetStop)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const NetPacketIov *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -69,6 +71,7 @@ typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
 typedef bool (NetCheckPeerType)(NetClientState *, ObjectClass *, Error **);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -76,6 +79,14 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /*
+     * Receive several packets at once.  Return the number of packets
+     * received or dropped.  Returning less than the number of packets
+     * means that no more can be received for now, like returning 0 from
+     * receive: qemu_flush_queued_packets() must be called once it is
+     * possible again.  Optional, receive_iov or receive are used otherwise.
+     */
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetStart *start;
     NetLoad *load;
@@ -98,6 +109,12 @@ typedef struct NetClientInfo {
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
     NetCheckPeerType *check_peer_type;
+    /*
+     * Move the fd handlers of the backend to the given AioContext (NULL for
+     * the main loop) and set nc->ctx.  Backends that implement this must
+     * register their fd handlers with qemu_net_set_fd_handler().
+     */
+    NetSetAioContext *set_aio_context;
 } NetClientInfo;
 
 struct NetClientState {
@@ -118,6 +135,8 @@ struct NetClientState {
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
     bool is_datapath;
+    /* Where the fd handlers of the backend run, NULL for the main loop */
+    AioContext *ctx;
     QTAILQ_HEAD(, NetFilterState) filters;
 };
 
@@ -174,6 +193,8 @@ int qemu_can_receive_packet(NetClientState *nc);
 int qemu_can_send_packet(NetClientState *nc);
 ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
+int qemu_sendv_packet_batch(NetClientState *sender, const NetPacketIov *pkts,
+                            int npkts, NetPacketSent *sent_cb);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
@@ -187,6 +208,10 @@ ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
+void qemu_net_set_fd_handler(NetClientState *nc, int fd, IOHandler *fd_read,
+                             IOHandler *fd_write, void *opaque);
+bool qemu_net_can_set_aio_context(NetClientState *nc, Error **errp);
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_set_info_str(NetClientState *nc,
                        const char *fmt, ...) G_GNUC_PRINTF(2, 3);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
@@ -30,8 +30,42 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a batch, see qemu_sendv_packet_batch() */
+typedef struct NetPacketIov {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketIov;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/*
+ * The single iovec of the packet points to the data of a NetPacketBuf.
+ * Code that passes on a copy of the data must clear this flag.
+ */
+#define QEMU_NET_PACKET_FLAG_SHARED  (1 << 1)
+
+/*
+ * Reference-counted copy of a packet.  Filters that keep packets beyond
+ * their receive_iov hook share one NetPacketBuf, and pass it on with
+ * QEMU_NET_PACKET_FLAG_SHARED so that later filters can take a reference
+ * instead of copying the data again.  The data must not be modified.
+ */
+typedef struct NetPacketBuf {
+    int refcnt;
+    size_t size;
+    uint8_t data[];
+} NetPacketBuf;
+
+NetPacketBuf *net_packet_buf_ref(NetPacketBuf *buf);
+void net_packet_buf_unref(NetPacketBuf *buf);
+
+/*
+ * Return a reference to the NetPacketBuf backing @iov if @flags has
+ * QEMU_NET_PACKET_FLAG_SHARED, or else a new NetPacketBuf holding a copy
+ * of @iov.
+ */
+NetPacketBuf *net_packet_buf_get(unsigned flags,
+                                 const struct iovec *iov, int iovcnt);
 
 /* Returns:
  *   >0 - success
@@ -44,6 +78,13 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Returns the number of packets delivered or dropped, see NetReceiveBatch */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       unsigned flags,
+                                       const NetPacketIov *pkts,
+                                       int npkts,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -53,6 +94,12 @@ void qemu_net_queue_append_iov(NetQueue *queue,
                                int iovcnt,
                                NetPacketSent *sent_cb);
 
+void qemu_net_queue_append_buf(NetQueue *queue,
+                               NetClientState *sender,
+                               unsigned flags,
+                               NetPacketBuf *buf,
+                               NetPacketSent *sent_cb);
+
 void qemu_del_net_queue(NetQueue *queue);
 
 ssize_t qemu_net_queue_receive(NetQueue *queue,
@@ -77,6 +124,14 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIov *pkts,
+                              int npkts,
+                              NetQueueDeliverBatchFunc *deliver_batch,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -0,0 +1,53 @@
+/*
+ * Toeplitz hash used for receive side scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_TOEPLITZ_H
+#define QEMU_NET_TOEPLITZ_H
+
+/* Longest RSS key, enough to hash NET_TOEPLITZ_INPUT_MAX bytes */
+#define NET_TOEPLITZ_KEY_SIZE   40
+
+/* IPv6 addresses and L4 ports */
+#define NET_TOEPLITZ_INPUT_MAX  36
+
+/*
+ * A Toeplitz key expanded into per-byte lookup tables: table[i][b] is the
+ * contribution of byte value b at offset i of the input, so that hashing
+ * takes one lookup per input byte instead of one step per input bit.
+ */
+typedef struct NetToeplitz {
+    bool valid;
+    uint8_t key[NET_TOEPLITZ_KEY_SIZE];
+    uint32_t table[NET_TOEPLITZ_INPUT_MAX][256];
+} NetToeplitz;
+
+/**
+ * net_toeplitz_set_key:
+ *
+ * Load the NET_TOEPLITZ_KEY_SIZE bytes at @key into @t.  The tables are
+ * only rebuilt if the key changed, so devices whose key lives in guest
+ * visible registers can call this before every hash.  It must not run
+ * while another thread hashes with @t.
+ */
+void net_toeplitz_set_key(NetToeplitz *t, const uint8_t *key);
+
+static inline uint32_t net_toeplitz_hash(const NetToeplitz *t,
+                                         const uint8_t *input, size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    assert(t->valid && len <= NET_TOEPLITZ_INPUT_MAX);
+
+    for (i = 0; i < len; i++) {
+        hash ^= t->table[i][input[i]];
+    }
+
+    return hash;
+}
+
+#endif /* QEMU_NET_TOEPLITZ_H */
@@ -350,4 +350,14 @@ bool hbitmap_status(const HBitmap *hb, int64_t start, int64_t count,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch to the next slower implementation of the vectorized kernels
+ * used for merging, counting and searching.  Return
+ * false if the portable implementation is already in use.  For use
+ * by tests and benchmarks only.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -16,6 +16,7 @@
 #include "io/channel-file.h"
 #include "io/net-listener.h"
 #include "qapi/error.h"
+#include "qemu/thread.h"
 #include "standard-headers/linux/virtio_blk.h"
 
 /* A kick fd that we monitor on behalf of libvhost-user */
@@ -24,6 +25,8 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    /* Set by remove_watch() with the lock of the virtqueue held */
+    bool removed;
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -31,7 +34,8 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks run in the given AioContext. Virtqueue kicks run in the same
+ * AioContext, or are spread over several AioContexts if @vq_ctxs is given.
  */
 typedef struct {
     QIONetListener *listener;
@@ -40,6 +44,23 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
+    /*
+     * If not NULL, virtqueue i is processed in vq_ctxs[i % num_vq_ctxs]
+     * instead of ctx. Owned by the caller of vhost_user_server_start().
+     */
+    AioContext **vq_ctxs;
+    size_t num_vq_ctxs;
+
+    /*
+     * One lock per virtqueue, held while the virtqueue is processed. Message
+     * processing holds all of them, because it may change any virtqueue and
+     * the guest memory map.
+     */
+    QemuRecMutex *vq_locks;
+
+    /* Protects vu_fd_watches */
+    QemuMutex watches_lock;
+
     unsigned int in_flight; /* atomic */
 
     /* Protected by ctx lock */
@@ -57,6 +78,8 @@ typedef struct {
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext **vq_ctxs,
+                             size_t num_vq_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
@@ -67,6 +90,9 @@ void vhost_user_server_inc_in_flight(VuServer *server);
 void vhost_user_server_dec_in_flight(VuServer *server);
 bool vhost_user_server_has_in_flight(VuServer *server);
 
+void vhost_user_server_lock_queue(VuServer *server, VuVirtq *vq);
+void vhost_user_server_unlock_queue(VuServer *server, VuVirtq *vq);
+
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
@@ -22,6 +22,7 @@
 #include "qapi/error.h"
 #include "qemu/module.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 #include "qemu/atomic.h"
 
@@ -155,6 +156,43 @@ static gboolean qio_channel_tls_handshake_io(QIOChannel *ioc,
                                              GIOCondition condition,
                                              gpointer user_data);
 
+/*
+ * Move the record layer into the kernel if the credentials asked
+ * for it. Each direction falls back to gnutls independently when
+ * the kernel refuses the negotiated protocol or cipher.
+ */
+static void qio_channel_tls_enable_ktls(QIOChannelTLS *ioc)
+{
+    Error *err = NULL;
+    int fd;
+
+    if (!qcrypto_tls_session_get_ktls_requested(ioc->session)) {
+        return;
+    }
+
+    if (!object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        trace_qio_channel_tls_ktls_fallback(ioc, "transport is not a socket");
+        return;
+    }
+    fd = QIO_CHANNEL_SOCKET(ioc->master)->fd;
+
+    if (qcrypto_tls_session_enable_ktls(ioc->session, fd, false, &err) < 0) {
+        trace_qio_channel_tls_ktls_fallback(ioc, error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    ioc->ktls_tx = true;
+
+    if (qcrypto_tls_session_enable_ktls(ioc->session, fd, true, &err) < 0) {
+        trace_qio_channel_tls_ktls_fallback(ioc, error_get_pretty(err));
+        error_free(err);
+    } else {
+        ioc->ktls_rx = true;
+    }
+
+    trace_qio_channel_tls_ktls_enabled(ioc, ioc->ktls_tx, ioc->ktls_rx);
+}
+
 static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
                                            QIOTask *task,
                                            GMainContext *context)
@@ -178,6 +216,7 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             qio_task_set_error(task, err);
         } else {
             trace_qio_channel_tls_credentials_allow(ioc);
+            qio_channel_tls_enable_ktls(ioc);
         }
         qio_task_complete(task);
     } else {
@@ -314,6 +353,11 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
     size_t i;
     ssize_t done = 0;
 
+    if (tioc->ktls_tx) {
+        return qio_channel_writev_full(tioc->master, iov, niov,
+                                       fds, nfds, flags, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
@@ -344,6 +344,8 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    uint64List **hist_tail;
+    int i;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -358,6 +360,14 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_shrink = iothread->poll_shrink;
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
 
+    hist_tail = &info->aio_batch_histogram;
+    for (i = 0; i < AIO_BATCH_HIST_BUCKETS; i++) {
+        uint64_t n = iothread->ctx ?
+            stat64_get(&iothread->ctx->aio_batch_hist[i]) : 0;
+
+        QAPI_LIST_APPEND(hist_tail, n);
+    }
+
     QAPI_LIST_APPEND(*tail, info);
     return 0;
 }
@@ -19,6 +19,8 @@
 #include "qemu/rcu_queue.h"
 #include "qemu/main-loop.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "qapi/clone-visitor.h"
 #include "ram.h"
 #include "trace.h"
 #include "dirtyrate.h"
@@ -290,6 +292,12 @@ query_dirty_rate_info(TimeUnit calc_time_unit)
         if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
             info->sample_pages = 0;
         }
+
+        if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING &&
+            DirtyStat.page_sampling.heatmap) {
+            info->heatmap = QAPI_CLONE(DirtyRateHeatmap,
+                                       DirtyStat.page_sampling.heatmap);
+        }
     }
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
@@ -309,6 +317,7 @@ static void init_dirtyrate_stat(struct DirtyRateConfig config)
         DirtyStat.page_sampling.total_dirty_samples = 0;
         DirtyStat.page_sampling.total_sample_count = 0;
         DirtyStat.page_sampling.total_block_mem_MB = 0;
+        DirtyStat.page_sampling.heatmap = NULL;
         break;
     case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
         DirtyStat.dirty_ring.nvcpu = -1;
@@ -326,6 +335,11 @@ static void cleanup_dirtyrate_stat(struct DirtyRateConfig config)
         free(DirtyStat.dirty_ring.rates);
         DirtyStat.dirty_ring.rates = NULL;
     }
+
+    if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        qapi_free_DirtyRateHeatmap(DirtyStat.page_sampling.heatmap);
+        DirtyStat.page_sampling.heatmap = NULL;
+    }
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
@@ -459,6 +473,7 @@ static void free_ramblock_dirty_info(struct RamblockDirtyInfo *infos, int count)
     for (i = 0; i < count; i++) {
         g_free(infos[i].sample_page_vfn);
         g_free(infos[i].hash_result);
+        g_free(infos[i].dirty_rounds);
     }
     g_free(infos);
 }
@@ -512,6 +527,13 @@ static bool record_ramblock_hash_info(struct RamblockDirtyInfo **block_dinfo,
         if (!save_ramblock_hash(info)) {
             goto out;
         }
+        if (config.heatmap_rounds && info->sample_pages_count) {
+            info->dirty_rounds = g_try_new0(uint8_t, info->sample_pages_count);
+            if (!info->dirty_rounds) {
+                index++;
+                goto out;
+            }
+        }
         index++;
     }
     ret = true;
@@ -522,6 +544,12 @@ out:
     return ret;
 }
 
+/*
+ * In heatmap mode this is called at the end of every round: the
+ * hash is refreshed so that the next round only sees new writes,
+ * and a page counts towards the dirty rate if it was dirtied in
+ * any of the rounds.
+ */
 static void calc_page_dirty_rate(struct RamblockDirtyInfo *info)
 {
     uint32_t hash;
@@ -531,7 +559,15 @@ static void calc_page_dirty_rate(struct RamblockDirtyInfo *info)
         hash = get_ramblock_vfn_hash(info, info->sample_page_vfn[i]);
         if (hash != info->hash_result[i]) {
             trace_calc_page_dirty_rate(info->idstr, hash, info->hash_result[i]);
-            info->sample_dirty_count++;
+            if (!info->dirty_rounds) {
+                info->sample_dirty_count++;
+                continue;
+            }
+            if (!info->dirty_rounds[i]) {
+                info->sample_dirty_count++;
+            }
+            info->dirty_rounds[i]++;
+            info->hash_result[i] = hash;
         }
     }
 }
@@ -562,6 +598,105 @@ find_block_matched(RAMBlock *block, int count,
     return &infos[i];
 }
 
+static void compare_page_hash_round(struct RamblockDirtyInfo *info,
+                                    int block_count)
+{
+    struct RamblockDirtyInfo *block_dinfo = NULL;
+    RAMBlock *block = NULL;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (skip_sample_ramblock(block)) {
+            continue;
+        }
+        block_dinfo = find_block_matched(block, block_count, info);
+        if (block_dinfo == NULL) {
+            continue;
+        }
+        calc_page_dirty_rate(block_dinfo);
+    }
+}
+
+/*
+ * Turn the per-sample round counters into a histogram of how much
+ * memory was dirtied in how many rounds, and into the dirty ratio of
+ * each region of @config->heatmap_granularity bytes.  Every sampled
+ * page stands for an equal share of its RAMBlock.
+ */
+static DirtyRateHeatmap *
+build_dirtyrate_heatmap(struct RamblockDirtyInfo *infos, int block_count,
+                        struct DirtyRateConfig *config)
+{
+    DirtyRateHeatmap *heatmap = g_new0(DirtyRateHeatmap, 1);
+    DirtyRateHeatmapBucketList **bucket_tail = &heatmap->histogram;
+    DirtyRateHeatmapRegionList **region_tail = &heatmap->regions;
+    uint64_t granularity = config->heatmap_granularity;
+    uint32_t rounds = config->heatmap_rounds;
+    g_autofree double *sizes = g_new0(double, rounds + 1);
+    uint32_t r;
+    int i;
+
+    heatmap->rounds = rounds;
+    heatmap->granularity = granularity;
+
+    for (i = 0; i < block_count; i++) {
+        struct RamblockDirtyInfo *info = &infos[i];
+        uint64_t length = info->ramblock_pages << qemu_target_page_bits();
+        uint64_t nregions = DIV_ROUND_UP(length, granularity);
+        g_autofree uint32_t *samples = NULL;
+        g_autofree uint32_t *dirty = NULL;
+        double page_share;
+        uint64_t region;
+        uint64_t j;
+
+        if (!info->dirty_rounds) {
+            continue;
+        }
+
+        page_share = (double)length / info->sample_pages_count;
+        samples = g_new0(uint32_t, nregions);
+        dirty = g_new0(uint32_t, nregions);
+
+        for (j = 0; j < info->sample_pages_count; j++) {
+            uint8_t n = info->dirty_rounds[j];
+
+            region = (info->sample_page_vfn[j] << qemu_target_page_bits()) /
+                     granularity;
+            sizes[n] += page_share;
+            samples[region]++;
+            dirty[region] += n;
+        }
+
+        for (region = 0; region < nregions; region++) {
+            DirtyRateHeatmapRegion *hr;
+
+            if (!dirty[region]) {
+                continue;
+            }
+
+            hr = g_new0(DirtyRateHeatmapRegion, 1);
+            hr->block = g_strdup(info->idstr);
+            hr->offset = region * granularity;
+            hr->length = MIN(granularity, length - hr->offset);
+            hr->dirty_ratio = (uint64_t)dirty[region] * 100 /
+                              ((uint64_t)samples[region] * rounds);
+            QAPI_LIST_APPEND(region_tail, hr);
+        }
+    }
+
+    for (r = 0; r <= rounds; r++) {
+        DirtyRateHeatmapBucket *bucket = g_new0(DirtyRateHeatmapBucket, 1);
+
+        bucket->rounds = r;
+        bucket->size = sizes[r];
+        if (r) {
+            heatmap->working_set_size += bucket->size;
+        }
+        QAPI_LIST_APPEND(bucket_tail, bucket);
+    }
+
+    return heatmap;
+}
+
 static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
                                   int block_count)
 {
@@ -688,6 +823,7 @@ static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
     int64_t initial_time;
+    uint32_t round;
 
     rcu_read_lock();
     initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -697,6 +833,16 @@ static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
     }
     rcu_read_unlock();
 
+    for (round = 1; round < config.heatmap_rounds; round++) {
+        dirty_stat_wait(config.calc_time_ms * round / config.heatmap_rounds,
+                        initial_time);
+
+        rcu_read_lock();
+        compare_page_hash_round(block_dinfo, block_count);
+        rcu_read_unlock();
+        trace_dirtyrate_heatmap_round(round);
+    }
+
     DirtyStat.calc_time_ms = dirty_stat_wait(config.calc_time_ms,
                                              initial_time);
 
@@ -707,6 +853,11 @@ static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 
     update_dirtyrate(DirtyStat.calc_time_ms);
 
+    if (config.heatmap_rounds) {
+        DirtyStat.page_sampling.heatmap =
+            build_dirtyrate_heatmap(block_dinfo, block_count, &config);
+    }
+
 out:
     rcu_read_unlock();
     free_ramblock_dirty_info(block_dinfo, block_count);
@@ -757,6 +908,10 @@ void qmp_calc_dirty_rate(int64_t calc_time,
                          int64_t sample_pages,
                          bool has_mode,
                          DirtyRateMeasureMode mode,
+                         bool has_heatmap_rounds,
+                         int64_t heatmap_rounds,
+                         bool has_heatmap_granularity,
+                         uint64_t heatmap_granularity,
                          Error **errp)
 {
     static struct DirtyRateConfig config;
@@ -803,6 +958,38 @@ void qmp_calc_dirty_rate(int64_t calc_time,
         sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
     }
 
+    if (has_heatmap_rounds && mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        error_setg(errp, "heatmap-rounds is used only in page-sampling mode");
+        return;
+    }
+
+    if (has_heatmap_granularity && !has_heatmap_rounds) {
+        error_setg(errp, "heatmap-granularity requires heatmap-rounds");
+        return;
+    }
+
+    if (has_heatmap_rounds) {
+        if (heatmap_rounds < MIN_HEATMAP_ROUNDS ||
+            heatmap_rounds > MAX_HEATMAP_ROUNDS) {
+            error_setg(errp, "heatmap-rounds is out of range[%d, %d].",
+                       MIN_HEATMAP_ROUNDS, MAX_HEATMAP_ROUNDS);
+            return;
+        }
+    } else {
+        heatmap_rounds = 0;
+    }
+
+    if (has_heatmap_granularity) {
+        if (heatmap_granularity < MIN_HEATMAP_GRANULARITY ||
+            !is_power_of_2(heatmap_granularity)) {
+            error_setg(errp, "heatmap-granularity must be a power of two "
+                       "of at least %llu bytes", MIN_HEATMAP_GRANULARITY);
+            return;
+        }
+    } else {
+        heatmap_granularity = DIRTYRATE_DEFAULT_HEATMAP_GRANULARITY;
+    }
+
     /*
      * dirty ring mode only works when kvm dirty ring is enabled.
      * on the contrary, dirty bitmap mode is not.
@@ -829,6 +1016,8 @@ void qmp_calc_dirty_rate(int64_t calc_time,
     config.calc_time_ms = calc_time_ms;
     config.sample_pages_per_gigabytes = sample_pages;
     config.mode = mode;
+    config.heatmap_rounds = heatmap_rounds;
+    config.heatmap_granularity = heatmap_granularity;
 
     cleanup_dirtyrate_stat(config);
 
@@ -880,11 +1069,25 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
                                rate->value->dirty_rate);
             }
         }
+        if (info->heatmap) {
+            DirtyRateHeatmapBucketList *bucket;
+
+            monitor_printf(mon, "Working set: %"PRIu64" (MB) over %"PRIu32
+                           " rounds\n", info->heatmap->working_set_size >> 20,
+                           info->heatmap->rounds);
+            for (bucket = info->heatmap->histogram; bucket;
+                 bucket = bucket->next) {
+                monitor_printf(mon, "Dirty in %"PRIu32" rounds: %"PRIu64
+                               " (MB)\n", bucket->value->rounds,
+                               bucket->value->size >> 20);
+            }
+        }
     } else {
         monitor_printf(mon, "(not ready)\n");
     }
 
     qapi_free_DirtyRateVcpuList(info->vcpu_dirty_rate);
+    qapi_free_DirtyRateHeatmap(info->heatmap);
     g_free(info);
 }
 
@@ -919,6 +1122,8 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
                         false, TIME_UNIT_SECOND, /* calc-time-unit */
                         has_sample_pages, sample_pages,
                         true, mode,
+                        false, 0, /* heatmap-rounds */
+                        false, 0, /* heatmap-granularity */
                         &err);
     if (err) {
         hmp_handle_error(mon, err);
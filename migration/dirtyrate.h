@@ -44,10 +44,21 @@
 #define MIN_SAMPLE_PAGE_COUNT                     128
 #define MAX_SAMPLE_PAGE_COUNT                     16384
 
+/*
+ * Allowed range of rounds for the dirty page heatmap, and default
+ * size of its regions.
+ */
+#define MIN_HEATMAP_ROUNDS                        2
+#define MAX_HEATMAP_ROUNDS                        64
+#define MIN_HEATMAP_GRANULARITY                   (1ULL << 20)
+#define DIRTYRATE_DEFAULT_HEATMAP_GRANULARITY     (1ULL << 30)
+
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t calc_time_ms; /* desired calculation time (in milliseconds) */
     DirtyRateMeasureMode mode; /* mode of dirtyrate measurement */
+    uint32_t heatmap_rounds; /* rounds of heatmap sampling, 0 if disabled */
+    uint64_t heatmap_granularity; /* heatmap region size in bytes */
 };
 
 /*
@@ -61,12 +72,14 @@ struct RamblockDirtyInfo {
     uint64_t sample_pages_count; /* count of sampled pages */
     uint64_t sample_dirty_count; /* count of dirty pages we measure */
     uint32_t *hash_result; /* array of hash result for sampled pages */
+    uint8_t *dirty_rounds; /* rounds each sampled page was dirty in */
 };
 
 typedef struct SampleVMStat {
     uint64_t total_dirty_samples; /* total dirty sampled page */
     uint64_t total_sample_count; /* total sampled pages */
     uint64_t total_block_mem_MB; /* size of total sampled pages in MB */
+    DirtyRateHeatmap *heatmap; /* dirty frequency, NULL if not requested */
 } SampleVMStat;
 
 /*
@@ -229,6 +229,49 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_timeline(Monitor *mon, const QDict *qdict)
+{
+    g_autoptr(MigrationTimeline) info = qmp_query_migrate_timeline(NULL);
+    MigrationTimelineIterationList *it;
+    MigrationTimelinePhaseList *phase;
+
+    if (info->dropped) {
+        monitor_printf(mon, "(%" PRIu64 " older iterations dropped)\n",
+                       info->dropped);
+    }
+
+    for (it = info->iterations; it; it = it->next) {
+        MigrationTimelineIteration *iter = it->value;
+        uint64List *pages;
+
+        monitor_printf(mon, "iteration %" PRIu64 ": start %" PRId64
+                       " us, duration %" PRId64 " us, sync %" PRId64
+                       " us, dirty %" PRIu64 ", normal %" PRIu64
+                       ", zero %" PRIu64 ", prepare %" PRId64 " us\n",
+                       iter->iteration, iter->start, iter->duration,
+                       iter->sync_time, iter->dirty_pages,
+                       iter->normal_pages, iter->zero_pages,
+                       iter->prepare_time);
+        monitor_printf(mon, "  channel pages:");
+        for (pages = iter->channel_pages; pages; pages = pages->next) {
+            monitor_printf(mon, " %" PRIu64, pages->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    if (info->downtime) {
+        monitor_printf(mon, "downtime: start %" PRId64 " us, duration %"
+                       PRId64 " us\n", info->downtime->start,
+                       info->downtime->duration);
+        for (phase = info->downtime->phases; phase; phase = phase->next) {
+            monitor_printf(mon, "  %s: start %" PRId64 " us, duration %"
+                           PRId64 " us\n",
+                           MigrationDowntimePhase_str(phase->value->phase),
+                           phase->value->start, phase->value->duration);
+        }
+    }
+}
+
 void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
 {
     MigrationParameters *params;
@@ -66,6 +66,7 @@
 #include "sysemu/dirtylimit.h"
 #include "qemu/sockets.h"
 #include "sysemu/kvm.h"
+#include "timeline.h"
 
 #define NOTIFIER_ELEM_INIT(array, elem)    \
     [elem] = NOTIFIER_WITH_RETURN_LIST_INITIALIZER((array)[elem])
@@ -113,6 +114,7 @@ static void migration_downtime_start(MigrationState *s)
 {
     trace_vmstate_downtime_checkpoint("src-downtime-start");
     s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    migration_timeline_downtime_start();
 }
 
 static void migration_downtime_end(MigrationState *s)
@@ -126,6 +128,7 @@ static void migration_downtime_end(MigrationState *s)
     if (!s->downtime) {
         s->downtime = now - s->downtime_start;
     }
+    migration_timeline_downtime_end();
 
     trace_vmstate_downtime_checkpoint("src-downtime-end");
 }
@@ -192,6 +195,7 @@ static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
 
 static int migration_stop_vm(MigrationState *s, RunState state)
 {
+    int64_t start = timeline_now();
     int ret;
 
     migration_downtime_start(s);
@@ -200,6 +204,7 @@ static int migration_stop_vm(MigrationState *s, RunState state)
     global_state_store();
 
     ret = vm_stop_force_state(state);
+    migration_timeline_phase(MIGRATION_DOWNTIME_PHASE_VCPU_STOP, start);
 
     trace_vmstate_downtime_checkpoint("src-vm-stopped");
     trace_migration_completion_vm_stop(ret);
@@ -1663,6 +1668,8 @@ int migrate_init(MigrationState *s, Error **errp)
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     s->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    migration_timeline_reset(migrate_multifd() ?
+                             migrate_multifd_channels() : 0);
     s->total_time = 0;
     s->vm_old_state = -1;
     s->iteration_initial_bytes = 0;
@@ -2782,8 +2789,15 @@ static void migration_completion(MigrationState *s)
         goto fail;
     }
 
-    if (close_return_path_on_source(s)) {
-        goto fail;
+    if (s->rp_state.rp_thread_created) {
+        int64_t start = timeline_now();
+
+        /* The destination shuts the return path once it loaded everything */
+        if (close_return_path_on_source(s)) {
+            goto fail;
+        }
+        migration_timeline_phase(MIGRATION_DOWNTIME_PHASE_DESTINATION_LOAD,
+                                 start);
     }
 
     if (qemu_file_get_error(s->to_dst_file)) {
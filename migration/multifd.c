@@ -20,13 +20,16 @@
 #include "qapi/error.h"
 #include "file.h"
 #include "migration.h"
+#include "migration/misc.h"
 #include "migration-stats.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "savevm.h"
 #include "threadinfo.h"
+#include "timeline.h"
 #include "options.h"
 #include "qemu/yank.h"
 #include "io/channel-file.h"
@@ -77,6 +80,12 @@ struct {
      * We will use atomic operations.  Only valid values are 0 and 1.
      */
     int exiting;
+    /*
+     * Number of device state buffers queued but not written yet, and
+     * the event set when it drops to zero or when multifd exits.
+     */
+    int device_state_pending;
+    QemuEvent device_state_sent;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_send_state;
@@ -432,6 +441,41 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
                        p->flags, p->next_packet_size);
 }
 
+static int multifd_recv_unfill_device_state(MultiFDRecvParams *p,
+                                            Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    MultiFDDeviceState_t *state = &p->device_state;
+
+    if (p->flags != MULTIFD_FLAG_DEVICE_STATE) {
+        error_setg(errp, "multifd: received device state packet "
+                   "with unexpected flags %x", p->flags);
+        return -1;
+    }
+
+    if (p->normal_num || p->zero_num) {
+        error_setg(errp, "multifd: received device state packet "
+                   "with %u normal pages and %u zero pages",
+                   p->normal_num, p->zero_num);
+        return -1;
+    }
+
+    if (p->next_packet_size > MULTIFD_DEVICE_STATE_MAX_SIZE) {
+        error_setg(errp, "multifd: received device state packet "
+                   "with size %u and maximum size %u",
+                   p->next_packet_size, MULTIFD_DEVICE_STATE_MAX_SIZE);
+        return -1;
+    }
+
+    /* make sure that idstr is 0 terminated */
+    packet->ramblock[255] = 0;
+    pstrcpy(state->idstr, sizeof(state->idstr), packet->ramblock);
+    state->instance_id = be32_to_cpu(packet->instance_id);
+    state->idx = be64_to_cpu(packet->state_idx);
+
+    return 0;
+}
+
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -492,6 +536,10 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
                        p->flags, p->next_packet_size);
 
+    if (p->flags & MULTIFD_FLAG_DEVICE_STATE) {
+        return multifd_recv_unfill_device_state(p, errp);
+    }
+
     if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
@@ -543,6 +591,15 @@ static bool multifd_recv_should_exit(void)
     return qatomic_read(&multifd_recv_state->exiting);
 }
 
+/*
+ * Device state buffers are loaded by the receive threads, so whoever
+ * waits for them must stop once the threads are told to quit.
+ */
+bool multifd_recv_device_state_aborted(void)
+{
+    return !multifd_recv_state || multifd_recv_should_exit();
+}
+
 /*
  * The migration thread can wait on either of the two semaphores.  This
  * function can be used to kick the main thread out of waiting on either of
@@ -553,36 +610,22 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
 {
     qemu_sem_post(&p->sem_sync);
     qemu_sem_post(&multifd_send_state->channels_ready);
+    qemu_event_set(&multifd_send_state->device_state_sent);
 }
 
 /*
- * How we use multifd_send_state->pages and channel->pages?
- *
- * We create a pages for each channel, and a main one.  Each time that
- * we need to send a batch of pages we interchange the ones between
- * multifd_send_state and the channel that is sending it.  There are
- * two reasons for that:
- *    - to not have to do so many mallocs during migration
- *    - to make easier to know what to free at the end of migration
- *
- * This way we always know who is the owner of each "pages" struct,
- * and we don't need any locking.  It belongs to the migration thread
- * or to the channel thread.  Switching is safe because the migration
- * thread is using the channel mutex when changing it, and the channel
- * have to had finish with its own, otherwise pending_job can't be
- * false.
+ * Pick the next idle channel, waiting until at least one is ready.
  *
- * Returns true if succeed, false otherwise.
+ * Returns NULL if multifd is exiting.
  */
-static bool multifd_send_pages(void)
+static MultiFDSendParams *multifd_send_get_channel(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
 
     if (multifd_send_should_exit()) {
-        return false;
+        return NULL;
     }
 
     /* We wait here, until at least one channel is ready */
@@ -596,7 +639,7 @@ static bool multifd_send_pages(void)
     next_channel %= migrate_multifd_channels();
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
         if (multifd_send_should_exit()) {
-            return false;
+            return NULL;
         }
         p = &multifd_send_state->params[i];
         /*
@@ -614,6 +657,39 @@ static bool multifd_send_pages(void)
      * qatomic_store_release() in multifd_send_thread().
      */
     smp_mb_acquire();
+
+    return p;
+}
+
+/*
+ * How we use multifd_send_state->pages and channel->pages?
+ *
+ * We create a pages for each channel, and a main one.  Each time that
+ * we need to send a batch of pages we interchange the ones between
+ * multifd_send_state and the channel that is sending it.  There are
+ * two reasons for that:
+ *    - to not have to do so many mallocs during migration
+ *    - to make easier to know what to free at the end of migration
+ *
+ * This way we always know who is the owner of each "pages" struct,
+ * and we don't need any locking.  It belongs to the migration thread
+ * or to the channel thread.  Switching is safe because the migration
+ * thread is using the channel mutex when changing it, and the channel
+ * have to had finish with its own, otherwise pending_job can't be
+ * false.
+ *
+ * Returns true if succeed, false otherwise.
+ */
+static bool multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    p = multifd_send_get_channel();
+    if (!p) {
+        return false;
+    }
+
     assert(!p->pages->num);
     multifd_send_state->pages = p->pages;
     p->pages = pages;
@@ -627,6 +703,82 @@ static bool multifd_send_pages(void)
     return true;
 }
 
+/*
+ * Queue a device state buffer on the next idle channel.  The buffer
+ * is sent as a single packet, outside of the main migration stream,
+ * and the destination hands it to the load_state_buffer() handler of
+ * the section identified by @idstr and @instance_id.
+ *
+ * Ownership of @data is transferred to multifd, even on failure.
+ *
+ * Returns true if succeed, false otherwise.
+ */
+bool multifd_queue_device_state(const char *idstr, uint32_t instance_id,
+                                uint32_t idx, char *data, size_t len)
+{
+    MultiFDDeviceState_t *state;
+    MultiFDSendParams *p;
+
+    assert(len <= MULTIFD_DEVICE_STATE_MAX_SIZE);
+
+    p = multifd_send_get_channel();
+    if (!p) {
+        g_free(data);
+        return false;
+    }
+
+    state = g_new0(MultiFDDeviceState_t, 1);
+    pstrcpy(state->idstr, sizeof(state->idstr), idstr);
+    state->instance_id = instance_id;
+    state->idx = idx;
+    state->buf = data;
+    state->buf_len = len;
+
+    assert(!p->pages->num && !p->device_state);
+    p->device_state = state;
+    qatomic_inc(&multifd_send_state->device_state_pending);
+    /*
+     * Making sure p->device_state is setup before marking
+     * pending_job=true. Pairs with the qatomic_load_acquire() in
+     * multifd_send_thread().
+     */
+    qatomic_store_release(&p->pending_job, true);
+    qemu_sem_post(&p->sem);
+
+    return true;
+}
+
+/*
+ * Device state buffers need packets, so the mapped-ram format, which
+ * writes pages directly at their file offsets, cannot carry them.
+ */
+bool multifd_device_state_supported(void)
+{
+    return migrate_multifd() && !migrate_mapped_ram();
+}
+
+/*
+ * Wait until all device state buffers queued so far have been written
+ * to their channels.  The channels are shut down once the migration
+ * completes, so a device must call this before its save handler
+ * returns, or its last buffers may never be sent.
+ *
+ * Returns 0 on success, -1 if multifd is exiting.
+ */
+int multifd_device_state_flush(void)
+{
+    while (true) {
+        qemu_event_reset(&multifd_send_state->device_state_sent);
+        if (multifd_send_should_exit()) {
+            return -1;
+        }
+        if (!qatomic_read(&multifd_send_state->device_state_pending)) {
+            return 0;
+        }
+        qemu_event_wait(&multifd_send_state->device_state_sent);
+    }
+}
+
 static inline bool multifd_queue_empty(MultiFDPages_t *pages)
 {
     return pages->num == 0;
@@ -714,6 +866,7 @@ static void multifd_send_terminate_threads(void)
      * always set it.
      */
     qatomic_set(&multifd_send_state->exiting, 1);
+    qemu_event_set(&multifd_send_state->device_state_sent);
 
     /*
      * Firstly, kick all threads out; no matter whether they are just idle,
@@ -780,6 +933,11 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     p->name = NULL;
     multifd_pages_clear(p->pages);
     p->pages = NULL;
+    if (p->device_state) {
+        g_free(p->device_state->buf);
+        g_free(p->device_state);
+        p->device_state = NULL;
+    }
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
@@ -796,6 +954,7 @@ static void multifd_send_cleanup_state(void)
     socket_cleanup_outgoing_migration();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_event_destroy(&multifd_send_state->device_state_sent);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -898,6 +1057,50 @@ int multifd_send_sync_main(void)
     return 0;
 }
 
+static int multifd_send_device_state(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDDeviceState_t *state = p->device_state;
+    MultiFDPacket_t *packet = p->packet;
+    struct iovec iov[2];
+    int ret;
+
+    p->flags = MULTIFD_FLAG_DEVICE_STATE;
+    p->next_packet_size = state->buf_len;
+    multifd_send_fill_packet(p);
+    strncpy(packet->ramblock, state->idstr, sizeof(packet->ramblock));
+    packet->instance_id = cpu_to_be32(state->instance_id);
+    packet->state_idx = cpu_to_be64(state->idx);
+
+    trace_multifd_send_device_state(p->id, state->idstr, state->instance_id,
+                                    state->idx, state->buf_len);
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = p->packet_len;
+    iov[1].iov_base = state->buf;
+    iov[1].iov_len = state->buf_len;
+    /*
+     * The buffer is freed right after the write, so never use
+     * zero-copy here.
+     */
+    ret = qio_channel_writev_all(p->c, iov, 2, errp);
+    if (ret == 0) {
+        stat64_add(&mig_stats.multifd_bytes, p->packet_len + state->buf_len);
+        if (qatomic_dec_fetch(&multifd_send_state->device_state_pending) == 0) {
+            qemu_event_set(&multifd_send_state->device_state_sent);
+        }
+    }
+
+    packet->instance_id = 0;
+    packet->state_idx = 0;
+    p->flags = 0;
+    p->next_packet_size = 0;
+    g_free(state->buf);
+    g_free(state);
+    p->device_state = NULL;
+
+    return ret;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -927,11 +1130,25 @@ static void *multifd_send_thread(void *opaque)
         }
 
         /*
-         * Read pending_job flag before p->pages.  Pairs with the
-         * qatomic_store_release() in multifd_send_pages().
+         * Read pending_job flag before p->pages and p->device_state.
+         * Pairs with the qatomic_store_release() in multifd_send_pages()
+         * and multifd_queue_device_state().
          */
-        if (qatomic_load_acquire(&p->pending_job)) {
+        if (qatomic_load_acquire(&p->pending_job) && p->device_state) {
+            ret = multifd_send_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+
+            /*
+             * Making sure p->device_state is cleared before saying
+             * "we're free".  Pairs with the smp_mb_acquire() in
+             * multifd_send_get_channel().
+             */
+            qatomic_store_release(&p->pending_job, false);
+        } else if (qatomic_load_acquire(&p->pending_job)) {
             MultiFDPages_t *pages = p->pages;
+            int64_t prepare_time = timeline_now();
 
             p->iovs_num = 0;
             assert(pages->num);
@@ -940,6 +1157,7 @@ static void *multifd_send_thread(void *opaque)
             if (ret != 0) {
                 break;
             }
+            prepare_time = timeline_now() - prepare_time;
 
             if (migrate_mapped_ram()) {
                 ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
@@ -958,6 +1176,8 @@ static void *multifd_send_thread(void *opaque)
                        p->next_packet_size + p->packet_len);
             stat64_add(&mig_stats.normal_pages, pages->normal_num);
             stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+            migration_timeline_channel_sent(p->id, pages->normal_num,
+                                            prepare_time);
 
             multifd_pages_reset(p->pages);
             p->next_packet_size = 0;
@@ -965,7 +1185,7 @@ static void *multifd_send_thread(void *opaque)
             /*
              * Making sure p->pages is published before saying "we're
              * free".  Pairs with the smp_mb_acquire() in
-             * multifd_send_pages().
+             * multifd_send_get_channel().
              */
             qatomic_store_release(&p->pending_job, false);
         } else {
@@ -1162,6 +1382,7 @@ bool multifd_send_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_created, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_event_init(&multifd_send_state->device_state_sent, false);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
 
@@ -1456,6 +1677,27 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Read the payload of a device state packet and pass it on to the
+ * section it belongs to.
+ */
+static int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDDeviceState_t *state = &p->device_state;
+    g_autofree char *buf = g_malloc(p->next_packet_size);
+
+    if (qio_channel_read_all(p->c, buf, p->next_packet_size, errp)) {
+        return -1;
+    }
+
+    trace_multifd_recv_device_state(p->id, state->idstr, state->instance_id,
+                                    state->idx, p->next_packet_size);
+
+    return qemu_loadvm_load_state_buffer(state->idstr, state->instance_id,
+                                         state->idx, g_steal_pointer(&buf),
+                                         p->next_packet_size, errp);
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1520,7 +1762,12 @@ static void *multifd_recv_thread(void *opaque)
             has_data = !!p->data->size;
         }
 
-        if (has_data) {
+        if (flags & MULTIFD_FLAG_DEVICE_STATE) {
+            ret = multifd_recv_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else if (has_data) {
             ret = multifd_recv_state->ops->recv(p, &local_err);
             if (ret != 0) {
                 break;
@@ -28,6 +28,8 @@ void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 int multifd_send_sync_main(void);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
+bool multifd_queue_device_state(const char *idstr, uint32_t instance_id,
+                                uint32_t idx, char *data, size_t len);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
@@ -41,6 +43,16 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
 
+/*
+ * The packet carries a device state buffer instead of pages.  The
+ * ramblock field holds the idstr of the section, and next_packet_size
+ * bytes of opaque device data follow the header.
+ */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 4)
+
+/* Upper bound for the payload of a device state packet */
+#define MULTIFD_DEVICE_STATE_MAX_SIZE (16 * 1024 * 1024)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -57,8 +69,11 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
-    uint64_t unused64[3];    /* Reserved for future use */
+    /* section instance id, only for device state packets */
+    uint32_t instance_id;
+    /* buffer index within the section, only for device state packets */
+    uint64_t state_idx;
+    uint64_t unused64[2];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
@@ -80,6 +95,17 @@ typedef struct {
     RAMBlock *block;
 } MultiFDPages_t;
 
+typedef struct {
+    /* section the buffer belongs to */
+    char idstr[256];
+    uint32_t instance_id;
+    /* index of the buffer within the section */
+    uint32_t idx;
+    /* opaque device data */
+    char *buf;
+    size_t buf_len;
+} MultiFDDeviceState_t;
+
 struct MultiFDRecvData {
     void *opaque;
     size_t size;
@@ -135,6 +161,11 @@ typedef struct {
      * pending_job != 0 -> multifd_channel can use it.
      */
     MultiFDPages_t *pages;
+    /*
+     * Device state buffer to send instead of 'pages'.  Owned like
+     * 'pages', and NULL unless the pending job is a device state one.
+     */
+    MultiFDDeviceState_t *device_state;
 
     /* thread local variables. No locking required */
 
@@ -218,6 +249,8 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* header of the device state packet being received */
+    MultiFDDeviceState_t device_state;
     /* used for de-compression methods */
     void *compress_data;
 } MultiFDRecvParams;
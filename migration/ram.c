@@ -56,6 +56,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "timeline.h"
 #include "sysemu/runstate.h"
 #include "rdma.h"
 #include "options.h"
@@ -1045,6 +1046,7 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
     RAMBlock *block;
     int64_t end_time;
+    int64_t sync_start = timeline_now();
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
 
@@ -1066,6 +1068,7 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    migration_timeline_iteration(sync_start, rs->migration_dirty_pages);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -38,8 +38,10 @@
 #include "migration/global_state.h"
 #include "migration/channel-block.h"
 #include "ram.h"
+#include "multifd.h"
 #include "qemu-file.h"
 #include "savevm.h"
+#include "timeline.h"
 #include "postcopy-ram.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
@@ -1603,6 +1605,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
+    int64_t start;
     int ret;
     Error *local_err = NULL;
     bool in_postcopy = migration_in_postcopy();
@@ -1616,24 +1619,32 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     cpu_synchronize_all_states();
 
     if (!in_postcopy || iterable_only) {
+        start = timeline_now();
         ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
         if (ret) {
             return ret;
         }
+        migration_timeline_phase(MIGRATION_DOWNTIME_PHASE_RAM_TAIL, start);
     }
 
     if (iterable_only) {
         goto flush;
     }
 
+    start = timeline_now();
     ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
                                                           inactivate_disks);
     if (ret) {
         return ret;
     }
+    migration_timeline_phase(MIGRATION_DOWNTIME_PHASE_DEVICE_SAVE, start);
 
 flush:
-    return qemu_fflush(f);
+    start = timeline_now();
+    ret = qemu_fflush(f);
+    migration_timeline_phase(MIGRATION_DOWNTIME_PHASE_NETWORK_FLUSH, start);
+
+    return ret;
 }
 
 /* Give an estimate of the amount left to be transferred,
@@ -1697,6 +1708,7 @@ void qemu_savevm_state_cleanup(void)
             se->ops->save_cleanup(se->opaque);
         }
     }
+    vmstate_plan_cache_clear();
 }
 
 static int qemu_savevm_state(QEMUFile *f, Error **errp)
@@ -3064,6 +3076,71 @@ int qemu_loadvm_approve_switchover(void)
     return migrate_send_rp_switchover_ack(mis);
 }
 
+/*
+ * Send a buffer of the section registered with @opaque over a multifd
+ * channel.  Ownership of @buf is transferred, even on failure.
+ */
+int qemu_savevm_queue_state_buffer(void *opaque, uint32_t idx, char *buf,
+                                   size_t len, Error **errp)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->ops && se->opaque == opaque) {
+            break;
+        }
+    }
+
+    if (!se) {
+        g_free(buf);
+        error_setg(errp, "No section registered for state buffer");
+        return -EINVAL;
+    }
+
+    if (len > MULTIFD_DEVICE_STATE_MAX_SIZE) {
+        g_free(buf);
+        error_setg(errp, "State buffer of section %s too large: %zu bytes",
+                   se->idstr, len);
+        return -EINVAL;
+    }
+
+    if (!multifd_queue_device_state(se->idstr, se->instance_id, idx,
+                                    buf, len)) {
+        error_setg(errp, "Failed to queue state buffer of section %s",
+                   se->idstr);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand a buffer received outside of the main stream to its section.
+ * Called from the multifd receive threads, without the BQL.
+ * Ownership of @buf is transferred, even on failure.
+ */
+int qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
+                                  uint32_t idx, char *buf, size_t len,
+                                  Error **errp)
+{
+    SaveStateEntry *se = find_se(idstr, instance_id);
+
+    if (!se) {
+        g_free(buf);
+        error_setg(errp, "Unknown section %s instance %u for state buffer",
+                   idstr, instance_id);
+        return -EINVAL;
+    }
+
+    if (!se->ops || !se->ops->load_state_buffer) {
+        g_free(buf);
+        error_setg(errp, "Section %s does not accept state buffers", idstr);
+        return -EINVAL;
+    }
+
+    return se->ops->load_state_buffer(se->opaque, idx, buf, len, errp);
+}
+
 bool save_snapshot(const char *name, bool overwrite, const char *vmstate,
                   bool has_devices, strList *devices, Error **errp)
 {
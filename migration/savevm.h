@@ -67,7 +67,14 @@ void qemu_loadvm_state_cleanup(void);
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
 int qemu_load_device_state(QEMUFile *f);
 int qemu_loadvm_approve_switchover(void);
+int qemu_savevm_queue_state_buffer(void *opaque, uint32_t idx, char *buf,
+                                   size_t len, Error **errp);
+int qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
+                                  uint32_t idx, char *buf, size_t len,
+                                  Error **errp);
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         bool in_postcopy, bool inactivate_disks);
 
+void vmstate_plan_cache_clear(void);
+
 #endif
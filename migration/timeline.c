@@ -0,0 +1,283 @@
+/*
+ * Migration timeline
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "migration-stats.h"
+#include "timeline.h"
+#include "trace.h"
+
+/* Multifd channel ids are 8 bits */
+#define MIGRATION_TIMELINE_MAX_CHANNELS 256
+
+typedef struct {
+    uint64_t iteration;
+    int64_t start;
+    int64_t sync_time;
+    uint64_t dirty_pages;
+    /* Counters at the start of the iteration */
+    uint64_t normal_pages;
+    uint64_t zero_pages;
+    uint64_t prepare_time;
+} MigrationTimelineEntry;
+
+typedef struct {
+    bool valid;
+    int64_t start;
+    int64_t duration;
+} MigrationTimelineDowntimePhase;
+
+static struct {
+    /* Protects everything below */
+    QemuMutex lock;
+    /* timeline_now() when the migration started */
+    int64_t start;
+    /* Same, in microseconds since the Epoch */
+    int64_t start_real;
+    /* Number of multifd channels, 0 without multifd */
+    unsigned int channels;
+    /* Number of iterations recorded since the start */
+    uint64_t count;
+    MigrationTimelineEntry entries[MIGRATION_TIMELINE_SIZE];
+    /* Per channel pages at the start of each entry */
+    uint64_t *channel_pages;
+    /* timeline_now() values, 0 if not reached yet */
+    int64_t downtime_start;
+    int64_t downtime_end;
+    MigrationTimelineDowntimePhase phases[MIGRATION_DOWNTIME_PHASE__MAX];
+} timeline;
+
+/* Updated by the multifd send threads without taking the lock */
+static Stat64 timeline_channel_pages[MIGRATION_TIMELINE_MAX_CHANNELS];
+static Stat64 timeline_prepare_time;
+
+static void __attribute__((__constructor__)) migration_timeline_init(void)
+{
+    qemu_mutex_init(&timeline.lock);
+}
+
+static unsigned int timeline_channel_slots(void)
+{
+    return MAX(timeline.channels, 1);
+}
+
+static uint64_t timeline_channel_pages_get(unsigned int channel)
+{
+    /* Without multifd, everything goes through the main channel */
+    if (!timeline.channels) {
+        return stat64_get(&mig_stats.normal_pages);
+    }
+    return stat64_get(&timeline_channel_pages[channel]);
+}
+
+void migration_timeline_reset(unsigned int channels)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&timeline.lock);
+
+    timeline.start = timeline_now();
+    timeline.start_real = g_get_real_time();
+    timeline.channels = MIN(channels, MIGRATION_TIMELINE_MAX_CHANNELS);
+    timeline.count = 0;
+    g_free(timeline.channel_pages);
+    timeline.channel_pages = g_new0(uint64_t, MIGRATION_TIMELINE_SIZE *
+                                              timeline_channel_slots());
+    timeline.downtime_start = 0;
+    timeline.downtime_end = 0;
+    memset(timeline.phases, 0, sizeof(timeline.phases));
+
+    for (i = 0; i < MIGRATION_TIMELINE_MAX_CHANNELS; i++) {
+        stat64_set(&timeline_channel_pages[i], 0);
+    }
+    stat64_set(&timeline_prepare_time, 0);
+}
+
+void migration_timeline_iteration(int64_t sync_start, uint64_t dirty_pages)
+{
+    unsigned int slot, i;
+    MigrationTimelineEntry *entry;
+    uint64_t *channel_pages;
+
+    QEMU_LOCK_GUARD(&timeline.lock);
+
+    if (!timeline.channel_pages) {
+        return;
+    }
+
+    slot = timeline.count % MIGRATION_TIMELINE_SIZE;
+    entry = &timeline.entries[slot];
+    entry->iteration = stat64_get(&mig_stats.dirty_sync_count);
+    entry->start = sync_start - timeline.start;
+    entry->sync_time = timeline_now() - sync_start;
+    entry->dirty_pages = dirty_pages;
+    entry->normal_pages = stat64_get(&mig_stats.normal_pages);
+    entry->zero_pages = stat64_get(&mig_stats.zero_pages);
+    entry->prepare_time = stat64_get(&timeline_prepare_time);
+
+    channel_pages = &timeline.channel_pages[slot * timeline_channel_slots()];
+    for (i = 0; i < timeline_channel_slots(); i++) {
+        channel_pages[i] = timeline_channel_pages_get(i);
+    }
+
+    timeline.count++;
+
+    trace_migration_timeline_iteration(entry->iteration, entry->sync_time,
+                                       dirty_pages);
+}
+
+void migration_timeline_channel_sent(uint8_t channel, uint64_t normal_pages,
+                                     int64_t prepare_time)
+{
+    stat64_add(&timeline_channel_pages[channel], normal_pages);
+    stat64_add(&timeline_prepare_time, prepare_time);
+}
+
+void migration_timeline_downtime_start(void)
+{
+    QEMU_LOCK_GUARD(&timeline.lock);
+
+    timeline.downtime_start = timeline_now();
+    timeline.downtime_end = 0;
+    memset(timeline.phases, 0, sizeof(timeline.phases));
+}
+
+void migration_timeline_downtime_end(void)
+{
+    QEMU_LOCK_GUARD(&timeline.lock);
+
+    /* Postcopy ends the downtime before the migration completes */
+    if (timeline.downtime_start && !timeline.downtime_end) {
+        timeline.downtime_end = timeline_now();
+        trace_migration_timeline_downtime(timeline.downtime_end -
+                                          timeline.downtime_start);
+    }
+}
+
+void migration_timeline_phase(MigrationDowntimePhase phase, int64_t start)
+{
+    MigrationTimelineDowntimePhase *p = &timeline.phases[phase];
+    int64_t now = timeline_now();
+
+    QEMU_LOCK_GUARD(&timeline.lock);
+
+    /* Only the downtime of a migration is broken down */
+    if (!timeline.downtime_start || timeline.downtime_end) {
+        return;
+    }
+
+    p->valid = true;
+    p->start = start - timeline.start;
+    p->duration = now - start;
+
+    trace_migration_timeline_phase(MigrationDowntimePhase_str(phase),
+                                   p->duration);
+}
+
+static MigrationTimelineIteration *
+timeline_get_iteration(uint64_t n, int64_t now)
+{
+    MigrationTimelineIteration *info = g_new0(MigrationTimelineIteration, 1);
+    unsigned int slot = n % MIGRATION_TIMELINE_SIZE;
+    unsigned int next_slot = (n + 1) % MIGRATION_TIMELINE_SIZE;
+    MigrationTimelineEntry *entry = &timeline.entries[slot];
+    MigrationTimelineEntry *next = &timeline.entries[next_slot];
+    uint64_t *pages = &timeline.channel_pages[slot * timeline_channel_slots()];
+    uint64_t *next_pages = NULL;
+    uint64List **tail = &info->channel_pages;
+    unsigned int i;
+
+    info->iteration = entry->iteration;
+    info->start = entry->start;
+    info->sync_time = entry->sync_time;
+    info->dirty_pages = entry->dirty_pages;
+
+    if (n + 1 < timeline.count) {
+        /* Closed iteration, the next one holds the end counters */
+        next_pages = &timeline.channel_pages[next_slot *
+                                             timeline_channel_slots()];
+        info->duration = next->start - entry->start;
+        info->normal_pages = next->normal_pages - entry->normal_pages;
+        info->zero_pages = next->zero_pages - entry->zero_pages;
+        info->prepare_time = next->prepare_time - entry->prepare_time;
+    } else {
+        info->duration = now - timeline.start - entry->start;
+        info->normal_pages = stat64_get(&mig_stats.normal_pages) -
+                             entry->normal_pages;
+        info->zero_pages = stat64_get(&mig_stats.zero_pages) -
+                           entry->zero_pages;
+        info->prepare_time = stat64_get(&timeline_prepare_time) -
+                             entry->prepare_time;
+    }
+
+    for (i = 0; i < timeline_channel_slots(); i++) {
+        uint64_t end = next_pages ? next_pages[i] :
+                                    timeline_channel_pages_get(i);
+
+        QAPI_LIST_APPEND(tail, end - pages[i]);
+    }
+
+    return info;
+}
+
+static MigrationDowntimeBreakdown *timeline_get_downtime(int64_t now)
+{
+    MigrationDowntimeBreakdown *info = g_new0(MigrationDowntimeBreakdown, 1);
+    MigrationTimelinePhaseList **tail = &info->phases;
+    int i;
+
+    info->start = timeline.downtime_start - timeline.start;
+    info->duration = (timeline.downtime_end ?: now) - timeline.downtime_start;
+
+    for (i = 0; i < MIGRATION_DOWNTIME_PHASE__MAX; i++) {
+        MigrationTimelinePhase *phase;
+
+        if (!timeline.phases[i].valid) {
+            continue;
+        }
+
+        phase = g_new0(MigrationTimelinePhase, 1);
+        phase->phase = i;
+        phase->start = timeline.phases[i].start;
+        phase->duration = timeline.phases[i].duration;
+        QAPI_LIST_APPEND(tail, phase);
+    }
+
+    return info;
+}
+
+MigrationTimeline *qmp_query_migrate_timeline(Error **errp)
+{
+    MigrationTimeline *info = g_new0(MigrationTimeline, 1);
+    MigrationTimelineIterationList **tail = &info->iterations;
+    int64_t now = timeline_now();
+    uint64_t n;
+
+    QEMU_LOCK_GUARD(&timeline.lock);
+
+    if (!timeline.channel_pages) {
+        return info;
+    }
+
+    info->start = timeline.start_real;
+    info->dropped = timeline.count > MIGRATION_TIMELINE_SIZE ?
+                    timeline.count - MIGRATION_TIMELINE_SIZE : 0;
+
+    for (n = info->dropped; n < timeline.count; n++) {
+        QAPI_LIST_APPEND(tail, timeline_get_iteration(n, now));
+    }
+
+    if (timeline.downtime_start) {
+        info->downtime = timeline_get_downtime(now);
+    }
+
+    return info;
+}
@@ -0,0 +1,76 @@
+/*
+ * Migration timeline
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_TIMELINE_H
+#define QEMU_MIGRATION_TIMELINE_H
+
+#include "qemu/timer.h"
+#include "qapi/qapi-types-migration.h"
+
+/*
+ * Number of iterations kept in the ring buffer.  Older iterations are
+ * dropped, only their count is reported.
+ */
+#define MIGRATION_TIMELINE_SIZE 256
+
+/**
+ * migration_timeline_reset: Start a new timeline
+ *
+ * Called when an outgoing migration starts.
+ *
+ * @channels: number of multifd channels, 0 without multifd
+ */
+void migration_timeline_reset(unsigned int channels);
+
+/**
+ * migration_timeline_iteration: Start a new iteration
+ *
+ * Called after each dirty bitmap sync.
+ *
+ * @sync_start: start of the bitmap sync, from timeline_now()
+ * @dirty_pages: pages left dirty after the sync
+ */
+void migration_timeline_iteration(int64_t sync_start, uint64_t dirty_pages);
+
+/**
+ * migration_timeline_channel_sent: Account a packet sent by a channel
+ *
+ * Called from the multifd send threads.
+ *
+ * @channel: multifd channel id
+ * @normal_pages: non-zero pages in the packet
+ * @prepare_time: time spent preparing (e.g. compressing) the packet, in
+ *                microseconds
+ */
+void migration_timeline_channel_sent(uint8_t channel, uint64_t normal_pages,
+                                     int64_t prepare_time);
+
+/**
+ * migration_timeline_downtime_start: The source stopped the guest
+ */
+void migration_timeline_downtime_start(void);
+
+/**
+ * migration_timeline_downtime_end: The downtime is over for the source
+ */
+void migration_timeline_downtime_end(void);
+
+/**
+ * migration_timeline_phase: Record a phase of the downtime
+ *
+ * @phase: which phase
+ * @start: start of the phase, from timeline_now()
+ */
+void migration_timeline_phase(MigrationDowntimePhase phase, int64_t start);
+
+/* Clock used for the timeline, in microseconds */
+static inline int64_t timeline_now(void)
+{
+    return qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+}
+
+#endif
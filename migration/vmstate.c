@@ -18,7 +18,10 @@
 #include "qapi/qmp/json-writer.h"
 #include "qemu-file.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/thread.h"
 #include "trace.h"
 
 static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
@@ -88,6 +91,112 @@ static int vmstate_size(void *opaque, const VMStateField *field)
     return size;
 }
 
+/*
+ * Arrays of plain integers, such as register files, make up a large
+ * part of many devices' state.  On the wire they are the big-endian
+ * encoding of each element back to back, so they can be converted in
+ * chunks and passed to QEMUFile in one call, rather than going
+ * through one put/get callback per element and one byte at a time.
+ *
+ * Returns the element width if @field can be handled this way, or 0.
+ */
+static int vmstate_batch_width(const VMStateField *field, int n_elems,
+                               int size)
+{
+    const VMStateInfo *info = field->info;
+    int width;
+
+    if (n_elems < 2 ||
+        field->flags & (VMS_STRUCT | VMS_VSTRUCT | VMS_ARRAY_OF_POINTER)) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        width = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        width = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        width = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        width = 8;
+    } else {
+        return 0;
+    }
+
+    return size == width ? width : 0;
+}
+
+#define VMSTATE_BATCH_CHUNK 4096
+
+static void vmstate_put_batch(QEMUFile *f, const void *elems, int n_elems,
+                              int width)
+{
+    uint8_t buf[VMSTATE_BATCH_CHUNK];
+    size_t total = (size_t)n_elems * width;
+    size_t done, chunk, j;
+
+    if (width == 1) {
+        qemu_put_buffer(f, elems, total);
+        return;
+    }
+
+    for (done = 0; done < total; done += chunk) {
+        chunk = MIN(total - done, sizeof(buf));
+        for (j = 0; j < chunk; j += width) {
+            const void *src = elems + done + j;
+
+            switch (width) {
+            case 2:
+                stw_be_p(buf + j, lduw_he_p(src));
+                break;
+            case 4:
+                stl_be_p(buf + j, ldl_he_p(src));
+                break;
+            default:
+                stq_be_p(buf + j, ldq_he_p(src));
+                break;
+            }
+        }
+        qemu_put_buffer(f, buf, chunk);
+    }
+}
+
+static void vmstate_get_batch(QEMUFile *f, void *elems, int n_elems,
+                              int width)
+{
+    uint8_t buf[VMSTATE_BATCH_CHUNK];
+    size_t total = (size_t)n_elems * width;
+    size_t done, chunk, j;
+
+    if (width == 1) {
+        qemu_get_buffer(f, elems, total);
+        return;
+    }
+
+    for (done = 0; done < total; done += chunk) {
+        chunk = MIN(total - done, sizeof(buf));
+        if (qemu_get_buffer(f, buf, chunk) != chunk) {
+            /* The file error is set, the caller picks it up */
+            return;
+        }
+        for (j = 0; j < chunk; j += width) {
+            void *dst = elems + done + j;
+
+            switch (width) {
+            case 2:
+                stw_he_p(dst, lduw_be_p(buf + j));
+                break;
+            case 4:
+                stl_he_p(dst, ldl_be_p(buf + j));
+                break;
+            default:
+                stq_he_p(dst, ldq_be_p(buf + j));
+                break;
+            }
+        }
+    }
+}
+
 static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
                                  void *opaque)
 {
@@ -134,12 +243,25 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             void *first_elem = opaque + field->offset;
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int batch_width = vmstate_batch_width(field, n_elems, size);
 
             vmstate_handle_alloc(first_elem, field, opaque);
             if (field->flags & VMS_POINTER) {
                 first_elem = *(void **)first_elem;
                 assert(first_elem || !n_elems || !size);
             }
+            if (batch_width) {
+                vmstate_get_batch(f, first_elem, n_elems, batch_width);
+                ret = qemu_file_get_error(f);
+                if (ret < 0) {
+                    error_report("Failed to load %s:%s", vmsd->name,
+                                 field->name);
+                    trace_vmstate_load_field_error(field->name, ret);
+                    return ret;
+                }
+                field++;
+                continue;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *curr_elem = first_elem + size * i;
 
@@ -268,32 +390,102 @@ static bool vmsd_can_compress(const VMStateField *field)
     return true;
 }
 
+/*
+ * The parts of the JSON description of a field that only depend on the
+ * VMStateDescription.  Working them out means scanning all the fields
+ * of the description (and of nested structs) for each field, which
+ * adds up to a noticeable share of downtime with many devices, so
+ * they are computed once per description and cached until the save
+ * is cleaned up.
+ */
+typedef struct VMStateFieldPlan {
+    char *desc_name;
+    bool can_compress;
+} VMStateFieldPlan;
+
+typedef struct VMStatePlan {
+    int n_fields;
+    VMStateFieldPlan field_plans[];
+} VMStatePlan;
+
+static void vmstate_plan_free(gpointer data)
+{
+    VMStatePlan *plan = data;
+    int i;
+
+    for (i = 0; i < plan->n_fields; i++) {
+        g_free(plan->field_plans[i].desc_name);
+    }
+    g_free(plan);
+}
+
+static QemuMutex vmstate_plan_lock;
+static GHashTable *vmstate_plans;
+
+static void __attribute__((__constructor__)) vmstate_plan_init(void)
+{
+    qemu_mutex_init(&vmstate_plan_lock);
+    vmstate_plans = g_hash_table_new_full(NULL, NULL, NULL,
+                                          vmstate_plan_free);
+}
+
+void vmstate_plan_cache_clear(void)
+{
+    QEMU_LOCK_GUARD(&vmstate_plan_lock);
+    g_hash_table_remove_all(vmstate_plans);
+}
+
+static const VMStatePlan *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    VMStatePlan *plan;
+    int i, n_fields = 0;
+
+    QEMU_LOCK_GUARD(&vmstate_plan_lock);
+
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (plan) {
+        return plan;
+    }
+
+    for (field = vmsd->fields; field->name; field++) {
+        n_fields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + n_fields * sizeof(VMStateFieldPlan));
+    plan->n_fields = n_fields;
+    for (i = 0, field = vmsd->fields; i < n_fields; i++, field++) {
+        VMStateFieldPlan *fplan = &plan->field_plans[i];
+
+        /* Field name is not unique, need to make it unique */
+        if (!vmfield_name_is_unique(vmsd->fields, field)) {
+            fplan->desc_name = g_strdup_printf("%s[%d]", field->name,
+                                vmfield_name_num(vmsd->fields, field));
+        } else {
+            fplan->desc_name = g_strdup(field->name);
+        }
+        fplan->can_compress = vmsd_can_compress(field);
+    }
+    g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+
+    return plan;
+}
+
 static void vmsd_desc_field_start(const VMStateDescription *vmsd,
                                   JSONWriter *vmdesc,
-                                  const VMStateField *field, int i, int max)
+                                  const VMStateField *field,
+                                  const VMStateFieldPlan *fplan,
+                                  int i, int max)
 {
-    char *name, *old_name;
     bool is_array = max > 1;
-    bool can_compress = vmsd_can_compress(field);
 
     if (!vmdesc) {
         return;
     }
 
-    name = g_strdup(field->name);
-
-    /* Field name is not unique, need to make it unique */
-    if (!vmfield_name_is_unique(vmsd->fields, field)) {
-        int num = vmfield_name_num(vmsd->fields, field);
-        old_name = name;
-        name = g_strdup_printf("%s[%d]", name, num);
-        g_free(old_name);
-    }
-
     json_writer_start_object(vmdesc, NULL);
-    json_writer_str(vmdesc, "name", name);
+    json_writer_str(vmdesc, "name", fplan->desc_name);
     if (is_array) {
-        if (can_compress) {
+        if (fplan->can_compress) {
             json_writer_int64(vmdesc, "array_len", max);
         } else {
             json_writer_int64(vmdesc, "index", i);
@@ -304,8 +496,6 @@ static void vmsd_desc_field_start(const VMStateDescription *vmsd,
     if (field->flags & VMS_STRUCT) {
         json_writer_start_object(vmdesc, "struct");
     }
-
-    g_free(name);
 }
 
 static void vmsd_desc_field_end(const VMStateDescription *vmsd,
@@ -353,6 +543,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
 {
     int ret = 0;
     const VMStateField *field = vmsd->fields;
+    const VMStatePlan *plan = vmdesc ? vmstate_get_plan(vmsd) : NULL;
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -376,6 +567,9 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
             void *first_elem = opaque + field->offset;
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int batch_width = vmstate_batch_width(field, n_elems, size);
+            const VMStateFieldPlan *fplan =
+                plan ? &plan->field_plans[field - vmsd->fields] : NULL;
             uint64_t old_offset, written_bytes;
             JSONWriter *vmdesc_loop = vmdesc;
 
@@ -384,10 +578,19 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                 first_elem = *(void **)first_elem;
                 assert(first_elem || !n_elems || !size);
             }
+            /* Described per element if the array can't be compressed */
+            if (batch_width && (!fplan || fplan->can_compress)) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, fplan, 0, n_elems);
+                vmstate_put_batch(f, first_elem, n_elems, batch_width);
+                vmsd_desc_field_end(vmsd, vmdesc, field, size, 0);
+                field++;
+                continue;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *curr_elem = first_elem + size * i;
 
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+                vmsd_desc_field_start(vmsd, vmdesc_loop, field, fplan,
+                                      i, n_elems);
                 old_offset = qemu_file_transferred(f);
                 if (field->flags & VMS_ARRAY_OF_POINTER) {
                     assert(curr_elem);
@@ -422,7 +625,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                 vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
 
                 /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
+                if (vmdesc_loop && fplan->can_compress) {
                     vmdesc_loop = NULL;
                 }
             }
@@ -218,6 +218,7 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
     IOThreadInfoList *info;
     IOThreadInfo *value;
+    uint64List *hist;
 
     for (info = info_list; info; info = info->next) {
         value = info->value;
@@ -228,6 +229,11 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        monitor_printf(mon, "  aio-batch-histogram=");
+        for (hist = value->aio_batch_histogram; hist; hist = hist->next) {
+            monitor_printf(mon, "%" PRIu64 "%s", hist->value,
+                           hist->next ? "," : "\n");
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -56,16 +56,29 @@ typedef struct AFXDPState {
 
 #define AF_XDP_BATCH_SIZE 64
 
+/* Maximum number of batches received in one call of the fd_read handler */
+#define AF_XDP_MAX_BATCHES 4
+
 static void af_xdp_send(void *opaque);
 static void af_xdp_writable(void *opaque);
 
 /* Set the event-loop handlers for the af-xdp backend. */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
-    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
-                        s->read_poll ? af_xdp_send : NULL,
-                        s->write_poll ? af_xdp_writable : NULL,
-                        s);
+    qemu_net_set_fd_handler(&s->nc, xsk_socket__fd(s->xsk),
+                            s->read_poll ? af_xdp_send : NULL,
+                            s->write_poll ? af_xdp_writable : NULL,
+                            s);
+}
+
+/* Move the event-loop handlers to another AioContext. */
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_net_set_fd_handler(nc, xsk_socket__fd(s->xsk), NULL, NULL, NULL);
+    nc->ctx = ctx;
+    af_xdp_update_fd_handler(s);
 }
 
 /* Update the read handler. */
@@ -139,48 +152,121 @@ static void af_xdp_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t af_xdp_receive(NetClientState *nc,
-                              const uint8_t *buf, size_t size)
+/*
+ * Copy a packet into a tx descriptor.  Descriptors are only reserved here,
+ * af_xdp_tx_submit() passes them to the kernel.  Returns false if there is
+ * no buffer or no space in the tx ring.
+ */
+static bool af_xdp_tx_packet(AFXDPState *s, const struct iovec *iov,
+                             int iovcnt, size_t size)
 {
-    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
     struct xdp_desc *desc;
     uint32_t idx;
-    void *data;
-
-    /* Try to recover buffers that are already sent. */
-    af_xdp_complete_tx(s);
-
-    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
-        /* We can't transmit packet this size... */
-        return size;
-    }
 
     if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
         /*
-         * Out of buffers or space in tx ring.  Poll until we can write.
-         * This will also kick the Tx, if it was waiting on CQ.
+         * The kernel stops consuming the tx ring while the completion ring
+         * is full, so reap completions before giving up.
          */
-        af_xdp_write_poll(s, true);
-        return 0;
+        af_xdp_complete_tx(s);
+        if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+            /*
+             * Out of buffers or space in tx ring.  Poll until we can write.
+             * This will also kick the Tx, if it was waiting on CQ.
+             */
+            af_xdp_write_poll(s, true);
+            return false;
+        }
     }
 
     desc = xsk_ring_prod__tx_desc(&s->tx, idx);
     desc->addr = s->pool[--s->n_pool];
     desc->len = size;
 
-    data = xsk_umem__get_data(s->buffer, desc->addr);
-    memcpy(data, buf, size);
+    iov_to_buf(iov, iovcnt, 0, xsk_umem__get_data(s->buffer, desc->addr),
+               size);
+    return true;
+}
+
+static void af_xdp_tx_submit(AFXDPState *s, uint32_t n)
+{
+    if (!n) {
+        return;
+    }
 
-    xsk_ring_prod__submit(&s->tx, 1);
-    s->outstanding_tx++;
+    xsk_ring_prod__submit(&s->tx, n);
+    s->outstanding_tx += n;
 
     if (xsk_ring_prod__needs_wakeup(&s->tx)) {
         af_xdp_write_poll(s, true);
     }
+}
+
+/*
+ * Recover buffers that are already sent once per call of the receive
+ * callbacks rather than for every packet.  Do it whenever completions
+ * are pending, not only when the pool runs low: with a large pool the
+ * completion ring could otherwise fill up and stall transmission.
+ */
+static void af_xdp_tx_reclaim(AFXDPState *s)
+{
+    if (s->n_pool <= AF_XDP_BATCH_SIZE || xsk_cons_nb_avail(&s->cq, 1)) {
+        af_xdp_complete_tx(s);
+    }
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    af_xdp_tx_reclaim(s);
+
+    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+        /* We can't transmit packet this size... */
+        return size;
+    }
 
+    if (!af_xdp_tx_packet(s, &iov, 1, size)) {
+        return 0;
+    }
+
+    af_xdp_tx_submit(s, 1);
     return size;
 }
 
+/* Fill tx descriptors for the whole batch, but kick the kernel only once. */
+static int af_xdp_receive_batch(NetClientState *nc, const NetPacketIov *pkts,
+                                int npkts)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    uint32_t n_tx = 0;
+    int i;
+
+    af_xdp_tx_reclaim(s);
+
+    for (i = 0; i < npkts; i++) {
+        size_t size = iov_size(pkts[i].iov, pkts[i].iovcnt);
+
+        if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+            /* We can't transmit packet this size... */
+            continue;
+        }
+
+        if (!af_xdp_tx_packet(s, pkts[i].iov, pkts[i].iovcnt, size)) {
+            break;
+        }
+        n_tx++;
+    }
+
+    af_xdp_tx_submit(s, n_tx);
+    return i;
+}
+
 /*
  * Complete a previous send (backend --> guest) and enable the
  * fd_read callback.
@@ -196,6 +282,11 @@ static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
 {
     uint32_t i, idx = 0;
 
+    /* Transmitted buffers are recovered lazily, pick them up now. */
+    if (s->n_pool < n + 1) {
+        af_xdp_complete_tx(s);
+    }
+
     /* Leave one packet for Tx, just in case. */
     if (s->n_pool < n + 1) {
         n = s->n_pool;
@@ -216,45 +307,75 @@ static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
     }
 }
 
-static void af_xdp_send(void *opaque)
+/*
+ * Pass up to AF_XDP_BATCH_SIZE packets to the peer.  Return the number of
+ * descriptors consumed from the rx ring.
+ */
+static uint32_t af_xdp_send_batch(AFXDPState *s)
 {
-    uint32_t i, n_rx, idx = 0;
-    AFXDPState *s = opaque;
+    struct iovec iov[AF_XDP_BATCH_SIZE];
+    NetPacketIov pkts[AF_XDP_BATCH_SIZE];
+    uint64_t addrs[AF_XDP_BATCH_SIZE];
+    uint32_t i, n_rx, n_sent, idx = 0;
 
     n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
     if (!n_rx) {
-        return;
+        return 0;
     }
 
     for (i = 0; i < n_rx; i++) {
         const struct xdp_desc *desc;
-        struct iovec iov;
 
         desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
 
-        iov.iov_base = xsk_umem__get_data(s->buffer, desc->addr);
-        iov.iov_len = desc->len;
+        iov[i].iov_base = xsk_umem__get_data(s->buffer, desc->addr);
+        iov[i].iov_len = desc->len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+        addrs[i] = desc->addr;
+    }
 
-        s->pool[s->n_pool++] = desc->addr;
+    n_sent = qemu_sendv_packet_batch(&s->nc, pkts, n_rx,
+                                     af_xdp_send_completed);
+    if (n_sent < n_rx) {
+        /*
+         * The peer does not receive anymore.  Packet is queued, stop
+         * reading from the backend until af_xdp_send_completed().
+         */
+        af_xdp_read_poll(s, false);
 
-        if (!qemu_sendv_packet_async(&s->nc, &iov, 1,
-                                     af_xdp_send_completed)) {
-            /*
-             * The peer does not receive anymore.  Packet is queued, stop
-             * reading from the backend until af_xdp_send_completed().
-             */
-            af_xdp_read_poll(s, false);
+        /* Return unused descriptors to not break the ring cache. */
+        xsk_ring_cons__cancel(&s->rx, n_rx - n_sent - 1);
+        n_rx = n_sent + 1;
+    }
 
-            /* Return unused descriptors to not break the ring cache. */
-            xsk_ring_cons__cancel(&s->rx, n_rx - i - 1);
-            n_rx = i + 1;
-            break;
-        }
+    /* The packets have been copied by the peer or the queue. */
+    for (i = 0; i < n_rx; i++) {
+        s->pool[s->n_pool++] = addrs[i];
     }
 
     /* Release actually sent descriptors and try to re-fill. */
     xsk_ring_cons__release(&s->rx, n_rx);
     af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+
+    return n_rx;
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    int i;
+
+    /*
+     * Drain several batches per wakeup while the peer keeps up, so that the
+     * cost of polling is spread over more packets.  Stop if the peer is
+     * full, read polling is disabled then.
+     */
+    for (i = 0; i < AF_XDP_MAX_BATCHES && s->read_poll; i++) {
+        if (af_xdp_send_batch(s) < AF_XDP_BATCH_SIZE) {
+            break;
+        }
+    }
 }
 
 /* Flush and close. */
@@ -323,7 +444,7 @@ static int af_xdp_umem_create(AFXDPState *s, int sock_fd, Error **errp)
 
     s->pool = g_new(uint64_t, n_descs);
     /* Fill the pool in the opposite order, because it's a LIFO queue. */
-    for (i = n_descs; i >= 0; i--) {
+    for (i = n_descs - 1; i >= 0; i--) {
         s->pool[i] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
     }
     s->n_pool = n_descs;
@@ -401,8 +522,10 @@ static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
     .size = sizeof(AFXDPState),
     .receive = af_xdp_receive,
+    .receive_batch = af_xdp_receive_batch,
     .poll = af_xdp_poll,
     .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
 };
 
 static int *parse_socket_fds(const char *sock_fds_str,
@@ -499,6 +622,8 @@ int net_init_af_xdp(const Netdev *netdev,
             error_propagate(errp, err);
             goto err;
         }
+
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
     }
 
     if (nc0) {
@@ -511,8 +636,6 @@ int net_init_af_xdp(const Netdev *netdev,
         }
     }
 
-    af_xdp_read_poll(s, true); /* Initially only poll for reads. */
-
     return 0;
 
 err:
@@ -16,27 +16,205 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "net/checksum.h"
 #include "net/eth.h"
+#include "host/cpuinfo.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The ones' complement sum does not depend on the byte order of the words
+ * being added, except that the result comes out byte-swapped (RFC 1071).
+ * It also does not change if pairs of 16-bit words are added as 32-bit
+ * words and the result is folded.  So the kernels below simply add
+ * host-endian 32-bit words into 64-bit accumulators, which vectorizes
+ * well, and net_checksum_add_cont() folds and swaps the result.
+ *
+ * The kernels are called with an even @len.
+ */
+typedef uint64_t (*net_checksum_accel_fn)(const uint8_t *buf, size_t len);
+
+/* Below this size the indirect call costs more than vectorization saves */
+#define NET_CHECKSUM_ACCEL_MIN 64
+
+static uint64_t net_checksum_int(const uint8_t *buf, size_t len)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t w = ldq_he_p(buf + i);
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+        sum += (w & 0xffffffff) + (w >> 32);
+    }
+    if (i + 4 <= len) {
+        sum += ldl_he_p(buf + i);
+        i += 4;
     }
     if (i < len) {
-        sum1 += (uint32_t)buf[i];
+        sum += lduw_he_p(buf + i);
     }
+    return sum;
+}
 
-    if (seq & 1) {
-        return sum1 + (sum2 << 8);
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#include <immintrin.h>
+
+static uint64_t __attribute__((target("sse2")))
+net_checksum_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    uint64_t lanes[2];
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i w = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(w, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(w, zero));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + net_checksum_int(buf + i, len - i);
+}
+
+#ifdef CONFIG_AVX2_OPT
+static uint64_t __attribute__((target("avx2")))
+net_checksum_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    uint64_t lanes[4];
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i w = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(w, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(w, zero));
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           net_checksum_int(buf + i, len - i);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+static net_checksum_accel_fn const accel_table[] = {
+    net_checksum_int,
+    net_checksum_sse2,
+#ifdef CONFIG_AVX2_OPT
+    net_checksum_avx2,
+#endif
+};
+
+static unsigned best_accel(void)
+{
+    unsigned info = cpuinfo_init();
+
+#ifdef CONFIG_AVX2_OPT
+    if (info & CPUINFO_AVX2) {
+        return 2;
+    }
+#endif
+    return info & CPUINFO_SSE2 ? 1 : 0;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static uint64_t net_checksum_neon(const uint8_t *buf, size_t len)
+{
+    uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        /* Pairwise add the 32-bit words into the 64-bit accumulators */
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(buf + i)));
+        acc1 = vpadalq_u32(acc1,
+                           vreinterpretq_u32_u8(vld1q_u8(buf + i + 16)));
+    }
+
+    return vaddvq_u64(vaddq_u64(acc0, acc1)) +
+           net_checksum_int(buf + i, len - i);
+}
+
+#define best_accel() 1
+static net_checksum_accel_fn const accel_table[] = {
+    net_checksum_int,
+    net_checksum_neon,
+};
+#else
+#define best_accel() 0
+static net_checksum_accel_fn const accel_table[1] = {
+    net_checksum_int,
+};
+#endif
+
+static net_checksum_accel_fn net_checksum_accel;
+static unsigned accel_index;
+
+bool test_net_checksum_next_accel(void)
+{
+    if (accel_index != 0) {
+        net_checksum_accel = accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    net_checksum_accel = accel_table[accel_index];
+}
+
+/* Fold to 16 bits; the result is only zero if @sum is zero */
+static uint32_t net_checksum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    size_t even_len;
+    uint64_t sum64;
+    uint32_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    even_len = len & ~1;
+    if (even_len < NET_CHECKSUM_ACCEL_MIN) {
+        sum64 = net_checksum_int(buf, even_len);
     } else {
-        return sum2 + (sum1 << 8);
+        sum64 = net_checksum_accel(buf, even_len);
+    }
+
+    /* Convert the sum of host-endian words to big endian */
+    sum = net_checksum_fold(sum64);
+    if (!HOST_BIG_ENDIAN) {
+        sum = bswap16(sum);
+    }
+    if (len & 1) {
+        sum = net_checksum_fold(sum + ((uint32_t)buf[len - 1] << 8));
+    }
+
+    /* Data that starts at an odd offset has its bytes swapped */
+    if (seq & 1) {
+        sum = bswap16(sum);
     }
+    return sum;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
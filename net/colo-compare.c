@@ -16,6 +16,7 @@
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-net.h"
 #include "net/net.h"
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
@@ -32,6 +33,9 @@
 
 #include "block/aio-wait.h"
 #include "qemu/coroutine.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "qemu/xxhash.h"
 
 #define TYPE_COLO_COMPARE "colo-compare"
 typedef struct CompareState CompareState;
@@ -52,6 +56,7 @@ static NotifierList colo_compare_notifiers =
 
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
+#define MAX_WORKERS 64
 
 /* #define DEBUG_COLO_PACKETS */
 
@@ -101,6 +106,37 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * Connections are spread over shards by the hash of their key.  Without
+ * workers there is a single shard that is compared in the iothread.  With
+ * workers, each shard is compared in its own thread, and the packets to
+ * send are handed back to the iothread, which owns the chardevs.
+ */
+typedef struct CompareShard {
+    struct CompareState *s;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /* Protects the whole shard against the worker */
+    QemuMutex lock;
+    QemuThread thread;
+    QemuCond cond;
+    /* Packets waiting for the worker, element type: Packet */
+    GQueue pri_input;
+    GQueue sec_input;
+    /* Primary packets to send from the iothread, element type: Packet */
+    GQueue output;
+    /* Request a checkpoint from the iothread */
+    bool notify;
+    bool stopping;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -121,13 +157,10 @@ struct CompareState {
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    /* Number of worker threads, 0 to compare in the iothread */
+    uint32_t workers;
+    CompareShard *shards;
+    uint32_t n_shards;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -135,6 +168,14 @@ struct CompareState {
 
     QEMUBH *event_bh;
     enum colo_event event;
+    /* Sends the output of the workers */
+    QEMUBH *output_bh;
+
+    /* Statistics for query-colo-compare */
+    Stat64 compared;
+    Stat64 miscompares;
+    Stat64 latency_total_ns;
+    Stat64 latency_max_ns;
 
     QTAILQ_ENTRY(CompareState) next;
 };
@@ -192,6 +233,23 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
+/*
+ * Called when a shard finds that the primary and secondary packets
+ * differ.  Workers leave the notification to the iothread.
+ */
+static void colo_compare_miscompare(CompareShard *sh)
+{
+    CompareState *s = sh->s;
+
+    stat64_add(&s->miscompares, 1);
+    if (s->workers) {
+        sh->notify = true;
+        qemu_bh_schedule(s->output_bh);
+    } else {
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
 /* Use restricted to colo_insert_packet() */
 static gint seq_sorter(Packet *a, Packet *b, gpointer data)
 {
@@ -216,6 +274,59 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     pkt->flags = tcphd->th_flags;
 }
 
+/*
+ * The queue is sorted from the highest sequence number at the head to the
+ * lowest at the tail.  In-order packets go to the head, and retransmitted
+ * ones usually to the tail, so check both ends before walking the queue.
+ */
+static void colo_insert_sorted(GQueue *queue, Packet *pkt)
+{
+    Packet *tail = g_queue_peek_tail(queue);
+
+    if (tail && seq_sorter(tail, pkt, NULL) < 0) {
+        g_queue_push_tail(queue, pkt);
+    } else {
+        g_queue_insert_sorted(queue, pkt, (GCompareDataFunc)seq_sorter, NULL);
+    }
+}
+
+/* Offset of the data that is compared for non-TCP packets */
+static uint16_t colo_packet_compare_offset(Packet *pkt)
+{
+    switch (pkt->ip->ip_p) {
+    case IPPROTO_UDP:
+    case IPPROTO_ICMP:
+        return (pkt->ip->ip_hl << 2) + ETH_HLEN + pkt->vnet_hdr_len;
+    default:
+        return pkt->vnet_hdr_len;
+    }
+}
+
+/*
+ * Hash the size and both ends of the compared data.  Packets with
+ * different hashes can not match, so most candidates are ruled out
+ * without comparing their payload.
+ */
+static uint32_t colo_packet_hash(Packet *pkt)
+{
+    uint16_t offset = colo_packet_compare_offset(pkt);
+    uint64_t head[2] = { 0, 0 }, tail[2] = { 0, 0 };
+    const uint8_t *data = pkt->data;
+    size_t len, n;
+
+    if (pkt->size <= offset) {
+        return pkt->size;
+    }
+
+    len = pkt->size - offset;
+    n = MIN(len, sizeof(head));
+    memcpy(head, data + offset, n);
+    memcpy(tail, data + pkt->size - n, n);
+
+    return qemu_xxhash8(head[0], head[1], tail[0], tail[1] ^ (tail[1] >> 32),
+                        pkt->size);
+}
+
 /*
  * Return 1 on success, if return 0 means the
  * packet will be dropped
@@ -225,11 +336,9 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     if (g_queue_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            colo_insert_sorted(queue, pkt);
         } else {
+            pkt->payload_hash = colo_packet_hash(pkt);
             g_queue_push_tail(queue, pkt);
         }
         return 1;
@@ -237,40 +346,21 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
-/*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
- */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+/* Add a parsed packet to its connection in the shard */
+static Connection *packet_enqueue(CompareShard *sh, int mode, Packet *pkt)
 {
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
     int ret;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
-    }
     fill_connection_key(pkt, &key, false);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(sh->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &sh->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&sh->conn_list, conn);
         conn->processing = true;
     }
 
@@ -287,9 +377,7 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
         pkt = NULL;
     }
 
-    *con = conn;
-
-    return 0;
+    return conn;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -297,7 +385,7 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
     ret = compare_chr_send(s,
@@ -313,6 +401,24 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     packet_destroy_partial(pkt, NULL);
 }
 
+/* Release a primary packet once the secondary has sent the same data */
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    CompareState *s = sh->s;
+    int64_t latency = qemu_clock_get_ns(QEMU_CLOCK_HOST) - pkt->creation_ns;
+
+    stat64_add(&s->compared, 1);
+    stat64_add(&s->latency_total_ns, MAX(latency, 0));
+    stat64_max(&s->latency_max_ns, MAX(latency, 0));
+
+    if (s->workers) {
+        g_queue_push_tail(&sh->output, pkt);
+        qemu_bh_schedule(s->output_bh);
+    } else {
+        colo_send_primary_pkt(s, pkt);
+    }
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -396,7 +502,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -428,13 +534,13 @@ sec:
     spkt = g_queue_pop_tail(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -474,7 +580,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             g_queue_push_tail(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -483,7 +589,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -496,7 +602,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_miscompare(sh);
     }
 }
 
@@ -653,16 +759,42 @@ out:
 static void colo_old_packet_check(void *opaque)
 {
     CompareState *s = opaque;
+    GList *found = NULL;
+    uint32_t i;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    for (i = 0; i < s->n_shards && !found; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        found = g_queue_find_custom(&sh->conn_list, s,
+                    (GCompareFunc)colo_old_packet_check_one_conn);
+        qemu_mutex_unlock(&sh->lock);
+    }
+}
+
+/* Like g_queue_find_custom(), but skip packets whose hash differs */
+static GList *colo_find_secondary_pkt(Connection *conn, Packet *ppkt,
+                                      int (*HandlePacket)(Packet *spkt,
+                                      Packet *ppkt))
+{
+    GList *l;
+
+    for (l = conn->secondary_list.head; l; l = l->next) {
+        Packet *spkt = l->data;
+
+        if (spkt->payload_hash == ppkt->payload_hash &&
+            !HandlePacket(spkt, ppkt)) {
+            return l;
+        }
+    }
+    return NULL;
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -672,11 +804,10 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_tail(&conn->primary_list);
-        result = g_queue_find_custom(&conn->secondary_list,
-                 pkt, (GCompareFunc)HandlePacket);
+        result = colo_find_secondary_pkt(conn, pkt, HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(sh, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -689,7 +820,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_tail(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_miscompare(sh);
             break;
         }
     }
@@ -703,25 +834,118 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
 
+static void *colo_compare_worker(void *opaque)
+{
+    CompareShard *sh = opaque;
+    Packet *pkt;
+
+    qemu_mutex_lock(&sh->lock);
+    while (!sh->stopping) {
+        if (g_queue_is_empty(&sh->pri_input) &&
+            g_queue_is_empty(&sh->sec_input)) {
+            qemu_cond_wait(&sh->cond, &sh->lock);
+            continue;
+        }
+
+        while ((pkt = g_queue_pop_head(&sh->pri_input))) {
+            colo_compare_connection(packet_enqueue(sh, PRIMARY_IN, pkt), sh);
+        }
+        while ((pkt = g_queue_pop_head(&sh->sec_input))) {
+            colo_compare_connection(packet_enqueue(sh, SECONDARY_IN, pkt), sh);
+        }
+    }
+    qemu_mutex_unlock(&sh->lock);
+
+    return NULL;
+}
+
+/* Called from the iothread to send the packets released by the workers */
+static void colo_compare_output_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    uint32_t i;
+
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+        GQueue output = G_QUEUE_INIT;
+        bool notify;
+        Packet *pkt;
+
+        qemu_mutex_lock(&sh->lock);
+        output = sh->output;
+        g_queue_init(&sh->output);
+        notify = sh->notify;
+        sh->notify = false;
+        qemu_mutex_unlock(&sh->lock);
+
+        while ((pkt = g_queue_pop_head(&output))) {
+            colo_send_primary_pkt(s, pkt);
+        }
+        if (notify) {
+            colo_compare_inconsistency_notify(s);
+        }
+    }
+}
+
+/*
+ * Return 0 on success, if return -1 means the pkt
+ * is unsupported(arp and ipv6) and will be sent later
+ */
+static int compare_packet_in(CompareState *s, int mode, SocketReadState *rs)
+{
+    ConnectionKey key;
+    CompareShard *sh;
+    GQueue *input;
+    Packet *pkt;
+
+    pkt = packet_new(rs->buf, rs->packet_len, rs->vnet_hdr_len);
+    if (parse_packet_early(pkt)) {
+        packet_destroy(pkt, NULL);
+        return -1;
+    }
+
+    fill_connection_key(pkt, &key, false);
+    sh = &s->shards[connection_key_hash(&key) % s->n_shards];
+
+    qemu_mutex_lock(&sh->lock);
+    if (!s->workers) {
+        /* compare packet in the specified connection */
+        colo_compare_connection(packet_enqueue(sh, mode, pkt), sh);
+    } else {
+        input = mode == PRIMARY_IN ? &sh->pri_input : &sh->sec_input;
+        if (g_queue_get_length(input) > max_queue_size) {
+            trace_colo_compare_drop_packet(colo_mode[mode],
+                "worker queue size too big, drop packet");
+            packet_destroy(pkt, NULL);
+        } else {
+            g_queue_push_tail(input, pkt);
+            qemu_cond_signal(&sh->cond);
+        }
+    }
+    qemu_mutex_unlock(&sh->lock);
+
+    return 0;
+}
+
 static void coroutine_fn _compare_chr_send(void *opaque)
 {
     SendCo *sendco = opaque;
@@ -944,7 +1168,7 @@ static void colo_compare_timer_del(CompareState *s)
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
+static void colo_compare_flush(CompareState *s);
 
 static void colo_compare_handle_event(void *opaque)
 {
@@ -952,7 +1176,7 @@ static void colo_compare_handle_event(void *opaque)
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -987,6 +1211,7 @@ static void colo_compare_iothread(CompareState *s)
 
     colo_compare_timer_init(s);
     s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
+    s->output_bh = aio_bh_new(ctx, colo_compare_output_bh, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1121,6 +1346,34 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->workers;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > MAX_WORKERS) {
+        error_setg(errp, "Property '%s.%s' must not be greater than %d",
+                   object_get_typename(obj), name, MAX_WORKERS);
+        return;
+    }
+    s->workers = value;
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1150,9 +1403,8 @@ static void set_max_queue_size(Object *obj, Visitor *v,
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (compare_packet_in(s, PRIMARY_IN, pri_rs)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1160,22 +1412,15 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (compare_packet_in(s, SECONDARY_IN, sec_rs)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -1197,7 +1442,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1241,6 +1486,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    uint32_t i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -1312,15 +1558,33 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
+    s->n_shards = MAX(s->workers, 1);
+    s->shards = g_new0(CompareShard, s->n_shards);
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *sh = &s->shards[i];
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      NULL);
+        sh->s = s;
+        g_queue_init(&sh->conn_list);
+        sh->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                           connection_key_equal,
+                                                           g_free,
+                                                           NULL);
+        qemu_mutex_init(&sh->lock);
+        qemu_cond_init(&sh->cond);
+        g_queue_init(&sh->pri_input);
+        g_queue_init(&sh->sec_input);
+        g_queue_init(&sh->output);
+    }
 
     colo_compare_iothread(s);
 
+    for (i = 0; i < s->workers; i++) {
+        g_autofree char *name = g_strdup_printf("colo-cmp-%u", i);
+
+        qemu_thread_create(&s->shards[i].thread, name, colo_compare_worker,
+                           &s->shards[i], QEMU_THREAD_JOINABLE);
+    }
+
     qemu_mutex_lock(&colo_compare_mutex);
     if (!colo_compare_active) {
         qemu_mutex_init(&event_mtx);
@@ -1355,6 +1619,70 @@ static void colo_flush_packets(void *opaque, void *user_data)
     }
 }
 
+/* Called from the iothread with the shard locked */
+static void colo_compare_shard_flush(CompareShard *sh)
+{
+    CompareState *s = sh->s;
+    Packet *pkt;
+
+    /* Packets released by the worker are older than those still queued */
+    while ((pkt = g_queue_pop_head(&sh->output))) {
+        colo_send_primary_pkt(s, pkt);
+    }
+    sh->notify = false;
+
+    g_queue_foreach(&sh->conn_list, colo_flush_packets, s);
+
+    while ((pkt = g_queue_pop_head(&sh->pri_input))) {
+        compare_chr_send(s,
+                         pkt->data,
+                         pkt->size,
+                         pkt->vnet_hdr_len,
+                         false,
+                         true);
+        packet_destroy_partial(pkt, NULL);
+    }
+    while ((pkt = g_queue_pop_head(&sh->sec_input))) {
+        packet_destroy(pkt, NULL);
+    }
+}
+
+/* Send all primary packets and drop the secondary ones */
+static void colo_compare_flush(CompareState *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->n_shards; i++) {
+        qemu_mutex_lock(&s->shards[i].lock);
+        colo_compare_shard_flush(&s->shards[i]);
+        qemu_mutex_unlock(&s->shards[i].lock);
+    }
+}
+
+ColoCompareInfoList *qmp_query_colo_compare(Error **errp)
+{
+    ColoCompareInfoList *head = NULL, **tail = &head;
+    CompareState *s;
+
+    qemu_mutex_lock(&colo_compare_mutex);
+    QTAILQ_FOREACH(s, &net_compares, next) {
+        ColoCompareInfo *info = g_new0(ColoCompareInfo, 1);
+        uint64_t compared = stat64_get(&s->compared);
+
+        info->id = g_strdup(object_get_canonical_path_component(OBJECT(s)));
+        info->workers = s->workers;
+        info->compared = compared;
+        info->miscompares = stat64_get(&s->miscompares);
+        info->latency_avg_ns = compared ?
+            stat64_get(&s->latency_total_ns) / compared : 0;
+        info->latency_max_ns = stat64_get(&s->latency_max_ns);
+        QAPI_LIST_APPEND(tail, info);
+    }
+    qemu_mutex_unlock(&colo_compare_mutex);
+
+    return head;
+}
+
 static void colo_compare_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
@@ -1392,6 +1720,10 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "workers", "uint32",
+                        compare_get_workers,
+                        compare_set_workers, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1411,6 +1743,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1435,7 +1768,21 @@ static void colo_compare_finalize(Object *obj)
 
     colo_compare_timer_del(s);
 
+    /* The workers schedule output_bh, stop them first */
+    for (i = 0; i < s->n_shards && i < s->workers; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        qemu_mutex_lock(&sh->lock);
+        sh->stopping = true;
+        qemu_cond_signal(&sh->cond);
+        qemu_mutex_unlock(&sh->lock);
+        qemu_thread_join(&sh->thread);
+    }
+
     qemu_bh_delete(s->event_bh);
+    if (s->output_bh) {
+        qemu_bh_delete(s->output_bh);
+    }
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
@@ -1444,18 +1791,23 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    colo_compare_flush(s);
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        g_queue_clear(&sh->conn_list);
+        g_hash_table_destroy(sh->connection_track_table);
+        qemu_cond_destroy(&sh->cond);
+        qemu_mutex_destroy(&sh->lock);
     }
+    g_free(s->shards);
 
     object_unref(OBJECT(s->iothread));
 
@@ -168,7 +168,8 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
 
     pkt->data = g_memdup(data, size);
     pkt->size = size;
-    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->creation_ns = qemu_clock_get_ns(QEMU_CLOCK_HOST);
+    pkt->creation_ms = pkt->creation_ns / SCALE_MS;
     pkt->vnet_hdr_len = vnet_hdr_len;
 
     return pkt;
@@ -184,7 +185,8 @@ Packet *packet_new_nocopy(void *data, int size, int vnet_hdr_len)
 
     pkt->data = data;
     pkt->size = size;
-    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->creation_ns = qemu_clock_get_ns(QEMU_CLOCK_HOST);
+    pkt->creation_ms = pkt->creation_ns / SCALE_MS;
     pkt->vnet_hdr_len = vnet_hdr_len;
 
     return pkt;
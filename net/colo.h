@@ -44,6 +44,8 @@ typedef struct Packet {
     int size;
     /* Time of packet creation, in wall clock ms */
     int64_t creation_ms;
+    /* Time of packet creation, in wall clock ns */
+    int64_t creation_ns;
     /* Get vnet_hdr_len from filter */
     uint32_t vnet_hdr_len;
     uint32_t tcp_seq; /* sequence number */
@@ -55,6 +57,8 @@ typedef struct Packet {
     /* record the payload offset(the length that has been compared) */
     uint16_t offset;
     uint8_t flags; /* Flags(aka Control bits) */
+    /* hash of the compared data, used to skip mismatching candidates */
+    uint32_t payload_hash;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -52,10 +52,19 @@ static void net_dgram_writable(void *opaque);
 
 static void net_dgram_update_fd_handler(NetDgramState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll ? net_dgram_send : NULL,
-                        s->write_poll ? net_dgram_writable : NULL,
-                        s);
+    qemu_net_set_fd_handler(&s->nc, s->fd,
+                            s->read_poll ? net_dgram_send : NULL,
+                            s->write_poll ? net_dgram_writable : NULL,
+                            s);
+}
+
+static void net_dgram_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetDgramState *s = DO_UPCAST(NetDgramState, nc, nc);
+
+    qemu_net_set_fd_handler(nc, s->fd, NULL, NULL, NULL);
+    nc->ctx = ctx;
+    net_dgram_update_fd_handler(s);
 }
 
 static void net_dgram_read_poll(NetDgramState *s, bool enable)
@@ -254,6 +263,7 @@ static NetClientInfo net_dgram_socket_info = {
     .size = sizeof(NetDgramState),
     .receive = net_dgram_receive,
     .cleanup = net_dgram_cleanup,
+    .set_aio_context = net_dgram_set_aio_context,
 };
 
 static NetDgramState *net_dgram_fd_init(NetClientState *peer,
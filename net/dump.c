@@ -247,6 +247,7 @@ static void filter_dump_class_init(ObjectClass *oc, void *data)
     nfc->setup = filter_dump_setup;
     nfc->cleanup = filter_dump_cleanup;
     nfc->receive_iov = filter_dump_receive_iov;
+    nfc->supports_iothread = true;
 }
 
 static const TypeInfo filter_dump_info = {
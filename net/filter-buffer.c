@@ -64,6 +64,8 @@ static ssize_t filter_buffer_receive_iov(NetFilterState *nf,
                                          NetPacketSent *sent_cb)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
+    NetPacketBuf *buf;
+    size_t size;
 
     /*
      * We return size when buffer a packet, the sender will take it as
@@ -79,9 +81,11 @@ static ssize_t filter_buffer_receive_iov(NetFilterState *nf,
      * the packets without caring about the receiver. This is suboptimal.
      * May need more thoughts (e.g keeping sent_cb).
      */
-    qemu_net_queue_append_iov(s->incoming_queue, sender, flags,
-                              iov, iovcnt, NULL);
-    return iov_size(iov, iovcnt);
+    buf = net_packet_buf_get(flags, iov, iovcnt);
+    size = buf->size;
+    qemu_net_queue_append_buf(s->incoming_queue, sender, flags, buf, NULL);
+    net_packet_buf_unref(buf);
+    return size;
 }
 
 static void filter_buffer_cleanup(NetFilterState *nf)
@@ -45,25 +45,28 @@ struct MirrorState {
 
 typedef struct FilterSendCo {
     MirrorState *s;
-    char *buf;
-    ssize_t size;
+    const struct iovec *iov;
+    int iovcnt;
     bool done;
     int ret;
 } FilterSendCo;
 
 static int _filter_send(MirrorState *s,
-                       char *buf,
-                       ssize_t size)
+                       const struct iovec *iov,
+                       int iovcnt)
 {
     NetFilterState *nf = NETFILTER(s);
-    int ret = 0;
-    uint32_t len = 0;
+    g_autofree struct iovec *msg = g_new(struct iovec, iovcnt + 2);
+    ssize_t size = iov_size(iov, iovcnt);
+    uint32_t len, vnet_hdr_len;
+    int msgcnt = 0;
+    int ret;
 
+    /* Send the lengths and the packet with a single writev */
     len = htonl(size);
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
-    }
+    msg[msgcnt].iov_base = &len;
+    msg[msgcnt].iov_len = sizeof(len);
+    msgcnt++;
 
     if (s->vnet_hdr) {
         /*
@@ -71,56 +74,48 @@ static int _filter_send(MirrorState *s,
          * module(like colo-compare) know how to parse net
          * packet correctly.
          */
-        ssize_t vnet_hdr_len;
-
-        vnet_hdr_len = nf->netdev->vnet_hdr_len;
-
-        len = htonl(vnet_hdr_len);
-        ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-        if (ret != sizeof(len)) {
-            goto err;
-        }
+        vnet_hdr_len = htonl(nf->netdev->vnet_hdr_len);
+        msg[msgcnt].iov_base = &vnet_hdr_len;
+        msg[msgcnt].iov_len = sizeof(vnet_hdr_len);
+        msgcnt++;
     }
 
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)buf, size);
-    if (ret != size) {
-        goto err;
+    memcpy(&msg[msgcnt], iov, iovcnt * sizeof(*iov));
+    msgcnt += iovcnt;
+
+    ret = qemu_chr_fe_writev_all(&s->chr_out, msg, msgcnt);
+    if (ret != iov_size(msg, msgcnt)) {
+        return ret < 0 ? ret : -EIO;
     }
 
     return size;
-
-err:
-    return ret < 0 ? ret : -EIO;
 }
 
 static void coroutine_fn filter_send_co(void *opaque)
 {
     FilterSendCo *data = opaque;
 
-    data->ret = _filter_send(data->s, data->buf, data->size);
+    data->ret = _filter_send(data->s, data->iov, data->iovcnt);
     data->done = true;
-    g_free(data->buf);
     aio_wait_kick();
 }
 
+/*
+ * The packet is not copied: @iov stays valid because we wait for the
+ * coroutine to finish.
+ */
 static int filter_send(MirrorState *s,
                        const struct iovec *iov,
                        int iovcnt)
 {
-    ssize_t size = iov_size(iov, iovcnt);
-    char *buf = NULL;
-
-    if (!size) {
+    if (!iov_size(iov, iovcnt)) {
         return 0;
     }
 
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-
     FilterSendCo data = {
         .s = s,
-        .size = size,
-        .buf = buf,
+        .iov = iov,
+        .iovcnt = iovcnt,
         .ret = 0,
     };
 
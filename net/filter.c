@@ -17,6 +17,7 @@
 #include "qom/object_interfaces.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
+#include "block/aio-wait.h"
 #include "net/colo.h"
 #include "migration/colo.h"
 
@@ -214,6 +215,40 @@ static void netfilter_init(Object *obj)
     nf->position = g_strdup("tail");
 }
 
+static void netfilter_insert(NetFilterState *nf, NetFilterState *position)
+{
+    if (position) {
+        if (nf->insert_before_flag) {
+            QTAILQ_INSERT_BEFORE(position, nf, next);
+        } else {
+            QTAILQ_INSERT_AFTER(&nf->netdev->filters, position, nf, next);
+        }
+    } else if (!strcmp(nf->position, "head")) {
+        QTAILQ_INSERT_HEAD(&nf->netdev->filters, nf, next);
+    } else if (!strcmp(nf->position, "tail")) {
+        QTAILQ_INSERT_TAIL(&nf->netdev->filters, nf, next);
+    }
+}
+
+typedef struct NetFilterInsertData {
+    NetFilterState *nf;
+    NetFilterState *position;
+} NetFilterInsertData;
+
+static void netfilter_insert_bh(void *opaque)
+{
+    NetFilterInsertData *data = opaque;
+
+    netfilter_insert(data->nf, data->position);
+}
+
+static void netfilter_remove_bh(void *opaque)
+{
+    NetFilterState *nf = opaque;
+
+    QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+}
+
 static void netfilter_complete(UserCreatable *uc, Error **errp)
 {
     NetFilterState *nf = NETFILTER(uc);
@@ -245,6 +280,12 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    if (ncs[0]->ctx && !nfc->supports_iothread) {
+        error_setg(errp, "netdev '%s' is processed in an iothread, which this "
+                   "filter does not support", nf->netdev_id);
+        return;
+    }
+
     if (strcmp(nf->position, "head") && strcmp(nf->position, "tail")) {
         Object *container;
         Object *obj;
@@ -290,16 +331,16 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         }
     }
 
-    if (position) {
-        if (nf->insert_before_flag) {
-            QTAILQ_INSERT_BEFORE(position, nf, next);
-        } else {
-            QTAILQ_INSERT_AFTER(&nf->netdev->filters, position, nf, next);
-        }
-    } else if (!strcmp(nf->position, "head")) {
-        QTAILQ_INSERT_HEAD(&nf->netdev->filters, nf, next);
-    } else if (!strcmp(nf->position, "tail")) {
-        QTAILQ_INSERT_TAIL(&nf->netdev->filters, nf, next);
+    /* The filter list of a netdev is only accessed in its AioContext */
+    if (nf->netdev->ctx) {
+        NetFilterInsertData data = {
+            .nf = nf,
+            .position = position,
+        };
+
+        aio_wait_bh_oneshot(nf->netdev->ctx, netfilter_insert_bh, &data);
+    } else {
+        netfilter_insert(nf, position);
     }
 }
 
@@ -308,6 +349,11 @@ static void netfilter_finalize(Object *obj)
     NetFilterState *nf = NETFILTER(obj);
     NetFilterClass *nfc = NETFILTER_GET_CLASS(obj);
 
+    /* Stop using the filter before cleaning it up */
+    if (nf->netdev && nf->netdev->ctx && QTAILQ_IN_USE(nf, next)) {
+        aio_wait_bh_oneshot(nf->netdev->ctx, netfilter_remove_bh, nf);
+    }
+
     if (nfc->cleanup) {
         nfc->cleanup(nf);
     }
@@ -0,0 +1,515 @@
+/*
+ * Generic receive offload
+ *
+ * Backends such as af-xdp, socket or l2tpv3 deliver one MTU-sized frame
+ * per packet.  Merging consecutive TCP segments of a flow into one large
+ * packet lets a NIC model that supports receive segmentation offloads
+ * (for example virtio-net with GUEST_TSO4/6) hand fewer, larger packets
+ * to the guest, which means fewer descriptors and notifications.
+ *
+ * Packets are hashed on their addresses and ports into a small flow
+ * table.  Each slot holds at most one packet, to which following segments
+ * of the same flow are appended.  A held packet is flushed when a segment
+ * cannot be merged, when it reaches the maximum IP datagram size, when a
+ * segment carries PSH or is shorter than the previous ones, and at the
+ * latest when the flush timer expires.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qemu/xxhash.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/gro.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "trace.h"
+
+/* Number of flows that can be held at the same time, at most 64 */
+#define NET_GRO_FLOWS           64
+
+#define NET_GRO_MAX_IP_LEN      0xffff
+#define NET_GRO_BUF_SIZE \
+    (ETH_HLEN + sizeof(struct ip6_header) + NET_GRO_MAX_IP_LEN)
+
+/* TCP flags of segments that can be merged */
+#define NET_GRO_TCP_FLAGS       (TH_ACK | TH_PUSH)
+
+typedef struct NetGROPacket {
+    const uint8_t *buf;
+    size_t size;            /* up to the end of the IP datagram */
+    bool ipv6;
+    uint16_t l4_off;
+    uint16_t hdr_len;
+    uint16_t payload;
+    uint32_t seq;
+    uint8_t flags;
+} NetGROPacket;
+
+typedef struct NetGROFlow {
+    uint8_t *buf;
+    size_t size;
+    bool ipv6;
+    uint16_t l4_off;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t segments;
+    uint32_t next_seq;
+} NetGROFlow;
+
+struct NetGRO {
+    NetGROOutput *output;
+    void *opaque;
+    int64_t timeout_ns;
+    unsigned flags;
+    QEMUTimer *timer;
+
+    /* Bitmap of the slots in @flows that hold a packet */
+    uint64_t active;
+    /* Set if the output refused a packet, until net_gro_flush() succeeds */
+    bool blocked;
+    NetGROFlow flows[NET_GRO_FLOWS];
+
+    NetGROStats stats;
+};
+
+QEMU_BUILD_BUG_ON(NET_GRO_FLOWS > 64 ||
+                  (NET_GRO_FLOWS & (NET_GRO_FLOWS - 1)));
+
+static const uint8_t *net_gro_addrs(const uint8_t *buf, bool ipv6,
+                                    size_t *len)
+{
+    if (ipv6) {
+        *len = 2 * sizeof(struct in6_address);
+        return buf + ETH_HLEN + offsetof(struct ip6_header, ip6_src);
+    }
+
+    *len = 2 * sizeof(uint32_t);
+    return buf + ETH_HLEN + offsetof(struct ip_header, ip_src);
+}
+
+static uint32_t net_gro_pseudo_sum(const uint8_t *buf, bool ipv6,
+                                   uint16_t l4_len)
+{
+    const uint8_t *addrs;
+    size_t len;
+
+    addrs = net_gro_addrs(buf, ipv6, &len);
+    return net_checksum_add(len, (uint8_t *)addrs) + IP_PROTO_TCP + l4_len;
+}
+
+/* Parse an untagged Ethernet frame carrying a TCP segment */
+static bool net_gro_parse(NetGRO *gro, const uint8_t *buf, size_t size,
+                          NetGROPacket *p)
+{
+    const struct tcp_header *tcp;
+    size_t ip_len, tcp_len;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    switch (lduw_be_p(buf + offsetof(struct eth_header, h_proto))) {
+    case ETH_P_IP: {
+        const struct ip_header *ip = (const void *)(buf + ETH_HLEN);
+
+        if (!(gro->flags & NET_GRO_F_TCPV4) ||
+            size < ETH_HLEN + sizeof(*ip) + sizeof(*tcp)) {
+            return false;
+        }
+
+        /* No IP options, they would have to be compared too */
+        if (ip->ip_ver_len != ((IP_HEADER_VERSION_4 << 4) |
+                               (sizeof(*ip) >> 2)) ||
+            ip->ip_p != IP_PROTO_TCP || IP4_IS_FRAGMENT(ip)) {
+            return false;
+        }
+
+        ip_len = lduw_be_p(&ip->ip_len);
+        if (ip_len < sizeof(*ip) + sizeof(*tcp) || ETH_HLEN + ip_len > size) {
+            return false;
+        }
+
+        if (net_raw_checksum((uint8_t *)ip, sizeof(*ip))) {
+            return false;
+        }
+
+        p->ipv6 = false;
+        p->l4_off = ETH_HLEN + sizeof(*ip);
+        p->size = ETH_HLEN + ip_len;
+        break;
+    }
+    case ETH_P_IPV6: {
+        const struct ip6_header *ip6 = (const void *)(buf + ETH_HLEN);
+
+        if (!(gro->flags & NET_GRO_F_TCPV6) ||
+            size < ETH_HLEN + sizeof(*ip6) + sizeof(*tcp)) {
+            return false;
+        }
+
+        /* No extension headers */
+        if ((ip6->ip6_ctlun.ip6_un2_vfc >> 4) != IP_HEADER_VERSION_6 ||
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt != IP_PROTO_TCP) {
+            return false;
+        }
+
+        ip_len = lduw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+        if (ip_len < sizeof(*tcp) ||
+            ETH_HLEN + sizeof(*ip6) + ip_len > size) {
+            return false;
+        }
+
+        p->ipv6 = true;
+        p->l4_off = ETH_HLEN + sizeof(*ip6);
+        p->size = p->l4_off + ip_len;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    tcp = (const void *)(buf + p->l4_off);
+    tcp_len = TCP_HEADER_DATA_OFFSET(tcp);
+    if (tcp_len < sizeof(*tcp) || p->l4_off + tcp_len > p->size) {
+        return false;
+    }
+
+    p->buf = buf;
+    p->hdr_len = p->l4_off + tcp_len;
+    p->payload = p->size - p->hdr_len;
+    p->seq = ldl_be_p(&tcp->th_seq);
+    p->flags = lduw_be_p(&tcp->th_offset_flags) & 0xff;
+    return true;
+}
+
+/*
+ * Only data segments with a valid checksum are merged; the checksum of
+ * the merged packet is not verified by anybody else.
+ */
+static bool net_gro_candidate(const NetGROPacket *p)
+{
+    uint16_t l4_len = p->size - p->l4_off;
+    uint32_t sum;
+
+    if (!p->payload || (p->flags & ~NET_GRO_TCP_FLAGS) ||
+        !(p->flags & TH_ACK)) {
+        return false;
+    }
+
+    sum = net_gro_pseudo_sum(p->buf, p->ipv6, l4_len) +
+          net_checksum_add(l4_len, (uint8_t *)p->buf + p->l4_off);
+    return net_checksum_finish(sum) == 0;
+}
+
+static uint32_t net_gro_hash(const NetGROPacket *p)
+{
+    const uint8_t *addrs;
+    uint32_t ports = ldl_he_p(p->buf + p->l4_off);
+    size_t len;
+
+    addrs = net_gro_addrs(p->buf, p->ipv6, &len);
+    if (p->ipv6) {
+        return qemu_xxhash5(ldq_he_p(addrs) ^ ldq_he_p(addrs + 8),
+                            ldq_he_p(addrs + 16) ^ ldq_he_p(addrs + 24),
+                            ports);
+    }
+
+    return qemu_xxhash5(ldq_he_p(addrs), 0, ports);
+}
+
+static bool net_gro_same_flow(const NetGROFlow *f, const NetGROPacket *p)
+{
+    const uint8_t *addrs;
+    size_t len;
+
+    if (f->ipv6 != p->ipv6) {
+        return false;
+    }
+
+    addrs = net_gro_addrs(p->buf, p->ipv6, &len);
+    return !memcmp(addrs, net_gro_addrs(f->buf, f->ipv6, &len), len) &&
+           ldl_he_p(f->buf + f->l4_off) == ldl_he_p(p->buf + p->l4_off);
+}
+
+/* Check that the headers of @p only differ where merging allows it */
+static bool net_gro_headers_match(const NetGROFlow *f, const NetGROPacket *p)
+{
+    const struct tcp_header *ftcp = (const void *)(f->buf + f->l4_off);
+    const struct tcp_header *ptcp = (const void *)(p->buf + p->l4_off);
+
+    if (p->ipv6) {
+        const struct ip6_header *fip = (const void *)(f->buf + ETH_HLEN);
+        const struct ip6_header *pip = (const void *)(p->buf + ETH_HLEN);
+
+        if (fip->ip6_ctlun.ip6_un1.ip6_un1_flow !=
+            pip->ip6_ctlun.ip6_un1.ip6_un1_flow ||
+            fip->ip6_ctlun.ip6_un1.ip6_un1_hlim !=
+            pip->ip6_ctlun.ip6_un1.ip6_un1_hlim) {
+            return false;
+        }
+    } else {
+        const struct ip_header *fip = (const void *)(f->buf + ETH_HLEN);
+        const struct ip_header *pip = (const void *)(p->buf + ETH_HLEN);
+
+        if (fip->ip_tos != pip->ip_tos || fip->ip_ttl != pip->ip_ttl ||
+            fip->ip_off != pip->ip_off) {
+            return false;
+        }
+    }
+
+    /* Same acknowledgment and the same options, timestamps included */
+    return ftcp->th_ack == ptcp->th_ack &&
+           !memcmp(f->buf + f->l4_off + sizeof(*ftcp),
+                   p->buf + p->l4_off + sizeof(*ptcp),
+                   f->hdr_len - f->l4_off - sizeof(*ftcp));
+}
+
+/* Value of the IP length field of the held packet */
+static size_t net_gro_ip_len(const NetGROFlow *f)
+{
+    if (f->ipv6) {
+        return f->size - f->l4_off;
+    }
+
+    return f->size - ETH_HLEN;
+}
+
+static bool net_gro_merge(NetGROFlow *f, const NetGROPacket *p)
+{
+    struct tcp_header *tcp = (void *)(f->buf + f->l4_off);
+
+    if (p->seq != f->next_seq || p->payload > f->gso_size ||
+        p->hdr_len != f->hdr_len || !net_gro_headers_match(f, p) ||
+        net_gro_ip_len(f) + p->payload > NET_GRO_MAX_IP_LEN) {
+        return false;
+    }
+
+    memcpy(f->buf + f->size, p->buf + p->hdr_len, p->payload);
+    f->size += p->payload;
+    f->next_seq += p->payload;
+    f->segments++;
+
+    /* Take the window and PSH of the last segment */
+    tcp->th_win = ((const struct tcp_header *)(p->buf + p->l4_off))->th_win;
+    if (p->flags & TH_PUSH) {
+        stw_be_p(&tcp->th_offset_flags,
+                 lduw_be_p(&tcp->th_offset_flags) | TH_PUSH);
+    }
+
+    return true;
+}
+
+/* Fix up the headers of a merged packet */
+static void net_gro_finalize(NetGROFlow *f, NetGROInfo *info)
+{
+    struct tcp_header *tcp = (void *)(f->buf + f->l4_off);
+    uint16_t l4_len = f->size - f->l4_off;
+
+    if (f->ipv6) {
+        struct ip6_header *ip6 = (void *)(f->buf + ETH_HLEN);
+
+        stw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen, net_gro_ip_len(f));
+        info->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    } else {
+        struct ip_header *ip = (void *)(f->buf + ETH_HLEN);
+
+        stw_be_p(&ip->ip_len, net_gro_ip_len(f));
+        ip->ip_sum = 0;
+        stw_be_p(&ip->ip_sum, net_raw_checksum((uint8_t *)ip, sizeof(*ip)));
+        info->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    }
+
+    stw_be_p(&tcp->th_sum,
+             (uint16_t)~net_checksum_finish(net_gro_pseudo_sum(f->buf,
+                                                               f->ipv6,
+                                                               l4_len)));
+
+    info->gso_size = f->gso_size;
+    info->hdr_len = f->hdr_len;
+    info->csum_start = f->l4_off;
+    info->csum_offset = offsetof(struct tcp_header, th_sum);
+    info->segments = f->segments;
+}
+
+/*
+ * Returns false if the output refused the packet, which then stays held.
+ * Finalizing the headers again when it is retried gives the same result.
+ */
+static bool net_gro_flush_flow(NetGRO *gro, unsigned idx)
+{
+    NetGROFlow *f = &gro->flows[idx];
+    NetGROInfo info;
+    ssize_t ret;
+
+    trace_net_gro_flush(gro, idx, f->segments, f->size);
+    if (f->segments > 1) {
+        net_gro_finalize(f, &info);
+        ret = gro->output(gro->opaque, f->buf, f->size, &info);
+    } else {
+        ret = gro->output(gro->opaque, f->buf, f->size, NULL);
+    }
+
+    if (ret == 0) {
+        trace_net_gro_flush_refused(gro, idx);
+        gro->stats.refused++;
+        gro->blocked = true;
+        return false;
+    }
+
+    gro->active &= ~BIT_ULL(idx);
+    gro->stats.flushed++;
+    if (ret < 0) {
+        trace_net_gro_flush_dropped(gro, idx, ret);
+        gro->stats.dropped++;
+    }
+    return true;
+}
+
+static void net_gro_hold(NetGRO *gro, unsigned idx, const NetGROPacket *p)
+{
+    NetGROFlow *f = &gro->flows[idx];
+
+    if (!f->buf) {
+        f->buf = g_malloc(NET_GRO_BUF_SIZE);
+    }
+
+    memcpy(f->buf, p->buf, p->size);
+    f->size = p->size;
+    f->ipv6 = p->ipv6;
+    f->l4_off = p->l4_off;
+    f->hdr_len = p->hdr_len;
+    f->gso_size = p->payload;
+    f->segments = 1;
+    f->next_seq = p->seq + p->payload;
+
+    if (!gro->active) {
+        timer_mod(gro->timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + gro->timeout_ns);
+    }
+    gro->active |= BIT_ULL(idx);
+}
+
+int net_gro_receive(NetGRO *gro, const uint8_t *buf, size_t size)
+{
+    NetGROPacket p;
+    NetGROFlow *f;
+    unsigned idx;
+    bool held;
+
+    if (gro->blocked) {
+        return -EBUSY;
+    }
+
+    if (!net_gro_parse(gro, buf, size, &p)) {
+        gro->stats.received++;
+        gro->stats.bypassed++;
+        return 0;
+    }
+
+    idx = net_gro_hash(&p) & (NET_GRO_FLOWS - 1);
+    f = &gro->flows[idx];
+    held = (gro->active & BIT_ULL(idx)) && net_gro_same_flow(f, &p);
+
+    if (!net_gro_candidate(&p)) {
+        /* Keep the flow in order: the held packet goes first */
+        if (held && !net_gro_flush_flow(gro, idx)) {
+            return -EBUSY;
+        }
+        gro->stats.received++;
+        gro->stats.bypassed++;
+        return 0;
+    }
+
+    if (held) {
+        if (net_gro_merge(f, &p)) {
+            gro->stats.received++;
+            gro->stats.coalesced++;
+            if ((p.flags & TH_PUSH) || p.payload < f->gso_size ||
+                net_gro_ip_len(f) + f->gso_size > NET_GRO_MAX_IP_LEN) {
+                /* If refused, the merged packet is retried later */
+                net_gro_flush_flow(gro, idx);
+            }
+            return 1;
+        }
+        if (!net_gro_flush_flow(gro, idx)) {
+            return -EBUSY;
+        }
+    } else if (gro->active & BIT_ULL(idx)) {
+        trace_net_gro_evict(gro, idx);
+        if (!net_gro_flush_flow(gro, idx)) {
+            return -EBUSY;
+        }
+        gro->stats.evictions++;
+    }
+
+    gro->stats.received++;
+
+    /* Nothing can follow a PSH segment, do not delay it */
+    if (p.flags & TH_PUSH) {
+        return 0;
+    }
+
+    net_gro_hold(gro, idx, &p);
+    return 1;
+}
+
+bool net_gro_flush(NetGRO *gro)
+{
+    gro->blocked = false;
+    while (gro->active) {
+        if (!net_gro_flush_flow(gro, ctz64(gro->active))) {
+            /* The receiver calls net_gro_flush() again when it can */
+            timer_del(gro->timer);
+            return false;
+        }
+    }
+    timer_del(gro->timer);
+    return true;
+}
+
+static void net_gro_timer_cb(void *opaque)
+{
+    NetGRO *gro = opaque;
+
+    trace_net_gro_timer_flush(gro, gro->active);
+    gro->stats.timer_flushes++;
+    net_gro_flush(gro);
+}
+
+NetGRO *net_gro_new(AioContext *ctx, int64_t timeout_ns, unsigned flags,
+                    NetGROOutput *output, void *opaque)
+{
+    NetGRO *gro = g_new0(NetGRO, 1);
+
+    gro->output = output;
+    gro->opaque = opaque;
+    gro->timeout_ns = timeout_ns;
+    gro->flags = flags;
+    gro->timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                               net_gro_timer_cb, gro);
+    return gro;
+}
+
+void net_gro_free(NetGRO *gro)
+{
+    int i;
+
+    if (!gro) {
+        return;
+    }
+
+    timer_free(gro->timer);
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        g_free(gro->flows[i].buf);
+    }
+    g_free(gro);
+}
+
+void net_gro_get_stats(NetGRO *gro, NetGROStats *stats)
+{
+    *stats = gro->stats;
+}
@@ -137,10 +137,19 @@ static void l2tpv3_writable(void *opaque);
 
 static void l2tpv3_update_fd_handler(NetL2TPV3State *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll ? net_l2tpv3_send : NULL,
-                        s->write_poll ? l2tpv3_writable : NULL,
-                        s);
+    qemu_net_set_fd_handler(&s->nc, s->fd,
+                            s->read_poll ? net_l2tpv3_send : NULL,
+                            s->write_poll ? l2tpv3_writable : NULL,
+                            s);
+}
+
+static void l2tpv3_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+
+    qemu_net_set_fd_handler(nc, s->fd, NULL, NULL, NULL);
+    nc->ctx = ctx;
+    l2tpv3_update_fd_handler(s);
 }
 
 static void l2tpv3_read_poll(NetL2TPV3State *s, bool enable)
@@ -515,6 +524,7 @@ static NetClientInfo net_l2tpv3_info = {
     .receive_iov = net_l2tpv3_receive_dgram_iov,
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
+    .set_aio_context = l2tpv3_set_aio_context,
 };
 
 int net_init_l2tpv3(const Netdev *netdev,
@@ -48,6 +48,7 @@
 #include "qemu/qemu-print.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "block/aio-wait.h"
 #include "qemu/keyval.h"
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
@@ -384,6 +385,9 @@ static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
 
+    /* Backends unregister their fd handlers from the main loop */
+    qemu_net_set_aio_context(nc, NULL);
+
     if (nc->info->cleanup) {
         nc->info->cleanup(nc);
     }
@@ -710,6 +714,82 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
+/*
+ * Like qemu_set_fd_handler(), but registers the handlers in the AioContext
+ * of @nc if it has been moved out of the main loop.
+ */
+void qemu_net_set_fd_handler(NetClientState *nc, int fd, IOHandler *fd_read,
+                             IOHandler *fd_write, void *opaque)
+{
+    if (nc->ctx) {
+        aio_set_fd_handler(nc->ctx, fd, fd_read, fd_write, NULL, NULL, opaque);
+    } else {
+        qemu_set_fd_handler(fd, fd_read, fd_write, opaque);
+    }
+}
+
+bool qemu_net_can_set_aio_context(NetClientState *nc, Error **errp)
+{
+    NetFilterState *nf;
+
+    if (!nc->info->set_aio_context) {
+        error_setg(errp, "netdev '%s' does not support iothreads", nc->name);
+        return false;
+    }
+
+    QTAILQ_FOREACH(nf, &nc->filters, next) {
+        if (!NETFILTER_GET_CLASS(nf)->supports_iothread) {
+            error_setg(errp, "filter '%s' of netdev '%s' does not support "
+                       "iothreads",
+                       object_get_canonical_path_component(OBJECT(nf)),
+                       nc->name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+typedef struct NetSetAioContextData {
+    NetClientState *nc;
+    AioContext *ctx;
+} NetSetAioContextData;
+
+static void qemu_net_set_aio_context_bh(void *opaque)
+{
+    NetSetAioContextData *data = opaque;
+
+    data->nc->info->set_aio_context(data->nc, data->ctx);
+}
+
+/*
+ * Move the fd handlers of @nc to @ctx, or back to the main loop if @ctx is
+ * NULL.  The backend must support it, see qemu_net_can_set_aio_context().
+ *
+ * Called with the BQL held, or from the current AioContext of @nc while the
+ * main loop waits for it.  If @nc is currently in another iothread, the
+ * handlers are moved from within that iothread so that they are not removed
+ * while they run.
+ */
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSetAioContextData data = {
+        .nc = nc,
+        .ctx = ctx,
+    };
+
+    if (nc->ctx == ctx) {
+        return;
+    }
+
+    if (nc->ctx && nc->ctx != qemu_get_current_aio_context()) {
+        aio_wait_bh_oneshot(nc->ctx, qemu_net_set_aio_context_bh, &data);
+    } else {
+        nc->info->set_aio_context(nc, ctx);
+    }
+    assert(nc->ctx == ctx);
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -900,6 +980,91 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     unsigned flags,
+                                     const NetPacketIov *pkts,
+                                     int npkts,
+                                     void *opaque)
+{
+    MemReentrancyGuard *owned_reentrancy_guard;
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return npkts;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->type != NET_CLIENT_DRIVER_NIC ||
+        qemu_get_nic(nc)->reentrancy_guard->engaged_in_io) {
+        owned_reentrancy_guard = NULL;
+    } else {
+        owned_reentrancy_guard = qemu_get_nic(nc)->reentrancy_guard;
+        owned_reentrancy_guard->engaged_in_io = true;
+    }
+
+    ret = nc->info->receive_batch(nc, pkts, npkts);
+
+    if (owned_reentrancy_guard) {
+        owned_reentrancy_guard->engaged_in_io = false;
+    }
+
+    if (ret < npkts) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Send several packets at once.  If the peer implements receive_batch and
+ * no filters are attached, the whole batch goes through the queue and the
+ * peer in one call.  Otherwise the packets are sent one by one.
+ *
+ * Returns the number of packets sent or dropped.  If that is less than
+ * @npkts, the first packet that was not sent has been queued and the sender
+ * must not send more until @sent_cb is called, as if
+ * qemu_sendv_packet_async() had returned 0 for it.  Without @sent_cb,
+ * packets that can not be sent are queued or dropped and @npkts is
+ * returned.
+ */
+int qemu_sendv_packet_batch(NetClientState *sender, const NetPacketIov *pkts,
+                            int npkts, NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    bool batch;
+    int i;
+
+    if (sender->link_down || !peer) {
+        return npkts;
+    }
+
+    /* Filters see one packet at a time */
+    batch = peer->info->receive_batch &&
+            QTAILQ_EMPTY(&sender->filters) && QTAILQ_EMPTY(&peer->filters);
+    for (i = 0; i < npkts && batch; i++) {
+        batch = iov_size(pkts[i].iov, pkts[i].iovcnt) <= NET_BUFSIZE;
+    }
+
+    if (batch) {
+        return qemu_net_queue_send_batch(peer->incoming_queue, sender,
+                                         QEMU_NET_PACKET_FLAG_NONE,
+                                         pkts, npkts,
+                                         qemu_deliver_packet_batch, sent_cb);
+    }
+
+    for (i = 0; i < npkts; i++) {
+        if (!qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                     sent_cb) && sent_cb) {
+            return i;
+        }
+    }
+    return npkts;
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
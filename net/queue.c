@@ -23,6 +23,8 @@
 
 #include "qemu/osdep.h"
 #include "net/queue.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
 #include "qemu/queue.h"
 #include "net/net.h"
 
@@ -46,6 +48,8 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    /* If not NULL, holds the data instead of @data */
+    NetPacketBuf *buf;
     uint8_t data[];
 };
 
@@ -60,6 +64,46 @@ struct NetQueue {
     unsigned delivering : 1;
 };
 
+NetPacketBuf *net_packet_buf_ref(NetPacketBuf *buf)
+{
+    qatomic_inc(&buf->refcnt);
+    return buf;
+}
+
+void net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (buf && qatomic_fetch_dec(&buf->refcnt) == 1) {
+        g_free(buf);
+    }
+}
+
+NetPacketBuf *net_packet_buf_get(unsigned flags,
+                                 const struct iovec *iov, int iovcnt)
+{
+    NetPacketBuf *buf;
+    size_t size;
+
+    if (flags & QEMU_NET_PACKET_FLAG_SHARED) {
+        assert(iovcnt == 1);
+        buf = container_of(iov[0].iov_base, NetPacketBuf, data);
+        assert(buf->size == iov[0].iov_len);
+        return net_packet_buf_ref(buf);
+    }
+
+    size = iov_size(iov, iovcnt);
+    buf = g_malloc(sizeof(NetPacketBuf) + size);
+    buf->refcnt = 1;
+    buf->size = size;
+    iov_to_buf(iov, iovcnt, 0, buf->data, size);
+    return buf;
+}
+
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    net_packet_buf_unref(packet->buf);
+    g_free(packet);
+}
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
@@ -84,7 +128,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
 
     g_free(queue);
@@ -104,9 +148,10 @@ static void qemu_net_queue_append(NetQueue *queue,
     }
     packet = g_malloc(sizeof(NetPacket) + size);
     packet->sender = sender;
-    packet->flags = flags;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_SHARED;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->buf = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -134,8 +179,9 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     packet = g_malloc(sizeof(NetPacket) + max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
-    packet->flags = flags;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_SHARED;
     packet->size = 0;
+    packet->buf = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -148,6 +194,30 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+/* Queue a reference to @buf, the caller keeps its own reference */
+void qemu_net_queue_append_buf(NetQueue *queue,
+                               NetClientState *sender,
+                               unsigned flags,
+                               NetPacketBuf *buf,
+                               NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        return; /* drop if queue full and no callback */
+    }
+
+    packet = g_new(NetPacket, 1);
+    packet->sender = sender;
+    packet->sent_cb = sent_cb;
+    packet->flags = flags | QEMU_NET_PACKET_FLAG_SHARED;
+    packet->size = buf->size;
+    packet->buf = net_packet_buf_ref(buf);
+
+    queue->nq_count++;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -254,6 +324,48 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Deliver a batch of packets with @deliver_batch, which is called with the
+ * opaque pointer of @queue.  Returns the number of packets delivered or
+ * dropped.  If that is less than @npkts, the first packet that was not
+ * delivered is queued and the sender must wait for @sent_cb before sending
+ * again.  Without @sent_cb all remaining packets are queued, or dropped if
+ * the queue is full, and @npkts is returned.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIov *pkts,
+                              int npkts,
+                              NetQueueDeliverBatchFunc *deliver_batch,
+                              NetPacketSent *sent_cb)
+{
+    int i, n = 0;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        queue->delivering = 1;
+        n = deliver_batch(sender, flags, pkts, npkts, queue->opaque);
+        queue->delivering = 0;
+
+        if (n == npkts) {
+            qemu_net_queue_flush(queue);
+            return n;
+        }
+    }
+
+    if (sent_cb) {
+        qemu_net_queue_append_iov(queue, sender, flags,
+                                  pkts[n].iov, pkts[n].iovcnt, sent_cb);
+        return n;
+    }
+
+    for (i = n; i < npkts; i++) {
+        qemu_net_queue_append_iov(queue, sender, flags,
+                                  pkts[i].iov, pkts[i].iovcnt, NULL);
+    }
+    return npkts;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -265,7 +377,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(packet);
         }
     }
 }
@@ -286,7 +398,8 @@ bool qemu_net_queue_flush(NetQueue *queue)
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     packet->buf ? packet->buf->data
+                                                 : packet->data,
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
@@ -298,7 +411,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
     return true;
 }
@@ -39,7 +39,9 @@
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "qemu/defer-call.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 
@@ -47,6 +49,49 @@
 
 #include "net/vhost_net.h"
 
+#ifdef CONFIG_TAP_IO_URING
+#include <poll.h>
+#include <liburing.h>
+
+#define TAP_URING_ENTRIES   256
+#define TAP_URING_RX_BUFS   64      /* must be a power of two */
+#define TAP_URING_TX_SLOTS  128
+#define TAP_URING_BGID      0
+
+/* user_data of the requests; tx requests add the slot index */
+enum {
+    TAP_URING_RX = 1,
+    TAP_URING_KICK,
+    TAP_URING_TX,
+};
+
+typedef struct TapUringRxPending {
+    uint16_t bid;
+    int len;
+} TapUringRxPending;
+
+typedef struct TapUring {
+    struct io_uring ring;
+
+    /* Multishot read into a ring of provided buffers */
+    struct io_uring_buf_ring *br;
+    uint8_t *rx_bufs;
+    bool rx_armed;
+
+    /* Buffers filled while the peer was not receiving, in order */
+    TapUringRxPending rx_pending[TAP_URING_RX_BUFS];
+    unsigned rx_pending_head;
+    unsigned rx_npending;
+
+    /* Packets being written; the sender's buffer is copied */
+    uint8_t *tx_bufs[TAP_URING_TX_SLOTS];
+    size_t tx_lens[TAP_URING_TX_SLOTS];
+    unsigned tx_free[TAP_URING_TX_SLOTS];
+    unsigned n_tx_free;
+    bool tx_blocked;
+} TapUring;
+#endif
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -62,6 +107,9 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+#ifdef CONFIG_TAP_IO_URING
+    TapUring *uring;
+#endif
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -69,13 +117,43 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+#ifdef CONFIG_TAP_IO_URING
+static void tap_uring_update(TAPState *s);
+static ssize_t tap_uring_write_packet(TAPState *s, const struct iovec *iov,
+                                      int iovcnt);
+#endif
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+#ifdef CONFIG_TAP_IO_URING
+    if (s->uring) {
+        tap_uring_update(s);
+        return;
+    }
+#endif
+    qemu_net_set_fd_handler(&s->nc, s->fd,
+                            s->read_poll && s->enabled ? tap_send : NULL,
+                            s->write_poll && s->enabled ? tap_writable : NULL,
+                            s);
+}
+
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+#ifdef CONFIG_TAP_IO_URING
+    if (s->uring) {
+        /* Requests in flight complete into the ring and are reaped later */
+        qemu_net_set_fd_handler(nc, s->uring->ring.ring_fd, NULL, NULL, NULL);
+        nc->ctx = ctx;
+        tap_update_fd_handler(s);
+        return;
+    }
+#endif
+
+    qemu_net_set_fd_handler(nc, s->fd, NULL, NULL, NULL);
+    nc->ctx = ctx;
+    tap_update_fd_handler(s);
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -103,6 +181,12 @@ static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt
 {
     ssize_t len;
 
+#ifdef CONFIG_TAP_IO_URING
+    if (s->uring) {
+        return tap_uring_write_packet(s, iov, iovcnt);
+    }
+#endif
+
     len = RETRY_ON_EINTR(writev(s->fd, iov, iovcnt));
 
     if (len == -1 && errno == EAGAIN) {
@@ -133,6 +217,46 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+/* Like tap_receive_iov(), but sets up the header iovec once per batch */
+static int tap_receive_batch(NetClientState *nc, const NetPacketIov *pkts,
+                             int npkts)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    g_autofree struct iovec *iov_copy = NULL;
+    struct virtio_net_hdr_mrg_rxbuf hdr = { };
+    int i, max_iovcnt = 0;
+
+    /* With io_uring, submit the writes of the whole batch at once */
+    defer_call_begin();
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        for (i = 0; i < npkts; i++) {
+            max_iovcnt = MAX(max_iovcnt, pkts[i].iovcnt);
+        }
+        iov_copy = g_new(struct iovec, max_iovcnt + 1);
+        iov_copy[0].iov_base = &hdr;
+        iov_copy[0].iov_len =  s->host_vnet_hdr_len;
+    }
+
+    for (i = 0; i < npkts; i++) {
+        const struct iovec *iovp = pkts[i].iov;
+        int iovcnt = pkts[i].iovcnt;
+
+        if (iov_copy) {
+            memcpy(&iov_copy[1], iovp, iovcnt * sizeof(*iovp));
+            iovp = iov_copy;
+            iovcnt++;
+        }
+
+        if (tap_write_packet(s, iovp, iovcnt) == 0) {
+            break;
+        }
+    }
+
+    defer_call_end();
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -181,6 +305,27 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Pass a packet read from the tap device to the peer */
+static ssize_t tap_send_packet(TAPState *s, uint8_t *buf, int size)
+{
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
+
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
+        }
+    }
+
+    return qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -188,28 +333,12 @@ static void tap_send(void *opaque)
     int packets = 0;
 
     while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
-
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
-
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
-            }
-        }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+        size = tap_send_packet(s, s->buf, size);
         if (size == 0) {
             tap_read_poll(s, false);
             break;
@@ -230,6 +359,338 @@ static void tap_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_TAP_IO_URING
+static struct io_uring_sqe *tap_uring_get_sqe(TapUring *u, unsigned n)
+{
+    /* Linked requests must be submitted together */
+    if (io_uring_sq_space_left(&u->ring) < n) {
+        io_uring_submit(&u->ring);
+    }
+    return io_uring_get_sqe(&u->ring);
+}
+
+static void tap_uring_submit(void *opaque)
+{
+    TAPState *s = opaque;
+
+    io_uring_submit(&s->uring->ring);
+}
+
+/* Make the completion handler run even if no request completes */
+static void tap_uring_kick(TAPState *s)
+{
+    struct io_uring_sqe *sqe = tap_uring_get_sqe(s->uring, 1);
+
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data64(sqe, TAP_URING_KICK);
+    io_uring_submit(&s->uring->ring);
+}
+
+static void tap_uring_arm_rx(TAPState *s)
+{
+    TapUring *u = s->uring;
+    struct io_uring_sqe *sqe = tap_uring_get_sqe(u, 1);
+
+    /* tap is not a socket, so use a multishot read rather than recv */
+    io_uring_prep_read_multishot(sqe, s->fd, 0, 0, TAP_URING_BGID);
+    io_uring_sqe_set_data64(sqe, TAP_URING_RX);
+    io_uring_submit(&u->ring);
+    u->rx_armed = true;
+}
+
+static void tap_uring_recycle(TapUring *u, uint16_t bid)
+{
+    io_uring_buf_ring_add(u->br, u->rx_bufs + bid * NET_BUFSIZE, NET_BUFSIZE,
+                          bid, io_uring_buf_ring_mask(TAP_URING_RX_BUFS), 0);
+    io_uring_buf_ring_advance(u->br, 1);
+}
+
+/*
+ * The buffer can be reused as soon as the packet is sent, because the
+ * queue copies packets that the peer does not receive immediately.
+ */
+static void tap_uring_rx(TAPState *s, uint16_t bid, int len)
+{
+    TapUring *u = s->uring;
+    ssize_t size;
+
+    size = tap_send_packet(s, u->rx_bufs + bid * NET_BUFSIZE, len);
+    tap_uring_recycle(u, bid);
+    if (size == 0) {
+        tap_read_poll(s, false);
+    }
+}
+
+static void tap_uring_rx_complete(TAPState *s, int res, unsigned flags,
+                                  int *budget)
+{
+    TapUring *u = s->uring;
+    TapUringRxPending *p;
+    uint16_t bid;
+
+    /*
+     * The multishot read ends on errors, most commonly when it runs out
+     * of buffers.  It is armed again once buffers have been recycled.
+     */
+    if (!(flags & IORING_CQE_F_MORE)) {
+        u->rx_armed = false;
+    }
+    if (res <= 0 || !(flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (s->read_poll && !u->rx_npending && *budget > 0) {
+        (*budget)--;
+        tap_uring_rx(s, bid, res);
+        return;
+    }
+
+    /* Keep the buffer until the peer receives again */
+    assert(u->rx_npending < TAP_URING_RX_BUFS);
+    p = &u->rx_pending[(u->rx_pending_head + u->rx_npending) %
+                       TAP_URING_RX_BUFS];
+    p->bid = bid;
+    p->len = res;
+    u->rx_npending++;
+}
+
+static void tap_uring_rx_flush_pending(TAPState *s, int *budget)
+{
+    TapUring *u = s->uring;
+
+    while (s->read_poll && u->rx_npending && *budget > 0) {
+        TapUringRxPending *p = &u->rx_pending[u->rx_pending_head];
+
+        u->rx_pending_head = (u->rx_pending_head + 1) % TAP_URING_RX_BUFS;
+        u->rx_npending--;
+        (*budget)--;
+        tap_uring_rx(s, p->bid, p->len);
+    }
+}
+
+static void tap_uring_prep_write(TAPState *s, unsigned slot, bool wait)
+{
+    TapUring *u = s->uring;
+    struct io_uring_sqe *sqe = tap_uring_get_sqe(u, wait ? 2 : 1);
+
+    if (wait) {
+        /* The tap device is non-blocking, wait until it is writable */
+        io_uring_prep_poll_add(sqe, s->fd, POLLOUT);
+        io_uring_sqe_set_data64(sqe, TAP_URING_KICK);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+
+    io_uring_prep_write(sqe, s->fd, u->tx_bufs[slot], u->tx_lens[slot], 0);
+    io_uring_sqe_set_data64(sqe, TAP_URING_TX + slot);
+}
+
+static void tap_uring_tx_complete(TAPState *s, unsigned slot, int res)
+{
+    TapUring *u = s->uring;
+
+    if (res == -EAGAIN) {
+        tap_uring_prep_write(s, slot, true);
+        defer_call(tap_uring_submit, s);
+        return;
+    }
+
+    /* Like writev() errors, failed writes drop the packet */
+    g_free(u->tx_bufs[slot]);
+    u->tx_bufs[slot] = NULL;
+    u->tx_free[u->n_tx_free++] = slot;
+}
+
+static void tap_uring_reap(TAPState *s, int *budget)
+{
+    TapUring *u = s->uring;
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        unsigned flags = cqe->flags;
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&u->ring, cqe);
+
+        if (data == TAP_URING_RX) {
+            tap_uring_rx_complete(s, res, flags, budget);
+        } else if (data >= TAP_URING_TX) {
+            tap_uring_tx_complete(s, data - TAP_URING_TX, res);
+        }
+    }
+}
+
+static void tap_uring_completion(void *opaque)
+{
+    TAPState *s = opaque;
+    TapUring *u = s->uring;
+    /* Limit the packets per callback like tap_send() does */
+    int budget = 50;
+
+    defer_call_begin();
+
+    tap_uring_rx_flush_pending(s, &budget);
+    tap_uring_reap(s, &budget);
+
+    if (u->tx_blocked && u->n_tx_free) {
+        u->tx_blocked = false;
+        qemu_flush_queued_packets(&s->nc);
+    }
+
+    if (s->read_poll && s->enabled) {
+        if (!u->rx_armed) {
+            tap_uring_arm_rx(s);
+        }
+        if (u->rx_npending) {
+            tap_uring_kick(s);
+        }
+    }
+
+    defer_call_end();
+}
+
+static void tap_uring_cancel(TAPState *s, unsigned flags, uint64_t data)
+{
+    struct io_uring_sync_cancel_reg reg = {
+        .addr = data,
+        .flags = flags,
+        .timeout = { .tv_sec = -1, .tv_nsec = -1 },
+    };
+
+    io_uring_register_sync_cancel(&s->uring->ring, &reg);
+}
+
+static void tap_uring_update(TAPState *s)
+{
+    TapUring *u = s->uring;
+    int budget = 0;
+
+    if (!s->enabled) {
+        /* Stop reading from a disabled queue, but keep what was read */
+        if (u->rx_armed) {
+            tap_uring_cancel(s, 0, TAP_URING_RX);
+            tap_uring_reap(s, &budget);
+            u->rx_armed = false;
+        }
+        qemu_net_set_fd_handler(&s->nc, u->ring.ring_fd, NULL, NULL, NULL);
+        return;
+    }
+
+    /* write_poll is not used, tx completions resume the queue */
+    qemu_net_set_fd_handler(&s->nc, u->ring.ring_fd, tap_uring_completion,
+                            NULL, s);
+    if (s->read_poll) {
+        if (!u->rx_armed) {
+            tap_uring_arm_rx(s);
+        }
+        if (u->rx_npending) {
+            tap_uring_kick(s);
+        }
+    }
+}
+
+static ssize_t tap_uring_write_packet(TAPState *s, const struct iovec *iov,
+                                      int iovcnt)
+{
+    TapUring *u = s->uring;
+    size_t len = iov_size(iov, iovcnt);
+    unsigned slot;
+
+    if (!u->n_tx_free) {
+        /* Resumed by tap_uring_completion() */
+        u->tx_blocked = true;
+        return 0;
+    }
+
+    slot = u->tx_free[--u->n_tx_free];
+    u->tx_bufs[slot] = g_malloc(len);
+    u->tx_lens[slot] = len;
+    iov_to_buf(iov, iovcnt, 0, u->tx_bufs[slot], len);
+
+    tap_uring_prep_write(s, slot, false);
+    defer_call(tap_uring_submit, s);
+    return len;
+}
+
+static bool tap_uring_init(TAPState *s, Error **errp)
+{
+    TapUring *u = g_new0(TapUring, 1);
+    struct io_uring_probe *probe;
+    bool supported;
+    unsigned i;
+    int ret;
+
+    ret = io_uring_queue_init(TAP_URING_ENTRIES, &u->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to init io_uring");
+        g_free(u);
+        return false;
+    }
+
+    probe = io_uring_get_probe_ring(&u->ring);
+    supported = probe &&
+                io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT);
+    io_uring_free_probe(probe);
+    if (!supported) {
+        error_setg(errp, "io_uring multishot read is not supported "
+                   "by the host kernel");
+        goto fail;
+    }
+
+    u->br = io_uring_setup_buf_ring(&u->ring, TAP_URING_RX_BUFS,
+                                    TAP_URING_BGID, 0, &ret);
+    if (!u->br) {
+        error_setg_errno(errp, -ret, "failed to register io_uring buffers");
+        goto fail;
+    }
+
+    u->rx_bufs = g_malloc(TAP_URING_RX_BUFS * NET_BUFSIZE);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        tap_uring_recycle(u, i);
+    }
+    for (i = 0; i < TAP_URING_TX_SLOTS; i++) {
+        u->tx_free[u->n_tx_free++] = TAP_URING_TX_SLOTS - 1 - i;
+    }
+
+    /* Switch from the fd handler to the ring */
+    qemu_net_set_fd_handler(&s->nc, s->fd, NULL, NULL, NULL);
+    s->uring = u;
+    tap_update_fd_handler(s);
+    return true;
+
+fail:
+    io_uring_queue_exit(&u->ring);
+    g_free(u);
+    return false;
+}
+
+static void tap_uring_cleanup(TAPState *s)
+{
+    TapUring *u = s->uring;
+    unsigned i;
+
+    if (!u) {
+        return;
+    }
+
+    qemu_net_set_fd_handler(&s->nc, u->ring.ring_fd, NULL, NULL, NULL);
+    tap_uring_cancel(s, IORING_ASYNC_CANCEL_ANY, 0);
+
+    io_uring_free_buf_ring(&u->ring, u->br, TAP_URING_RX_BUFS,
+                           TAP_URING_BGID);
+    io_uring_queue_exit(&u->ring);
+
+    for (i = 0; i < TAP_URING_TX_SLOTS; i++) {
+        g_free(u->tx_bufs[i]);
+    }
+    g_free(u->rx_bufs);
+    g_free(u);
+    s->uring = NULL;
+}
+#endif
+
 static bool tap_has_ufo(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -358,6 +819,9 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_TAP_IO_URING
+    tap_uring_cleanup(s);
+#endif
     close(s->fd);
     s->fd = -1;
 }
@@ -392,6 +856,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_batch = tap_receive_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -406,6 +871,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -705,6 +1171,8 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 {
     Error *err = NULL;
     TAPState *s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
+    bool vhost = tap->has_vhost ? tap->vhost :
+        vhostfdname || (tap->has_vhostforce && tap->vhostforce);
     int vhostfd;
 
     tap_set_sndbuf(s->fd, tap, &err);
@@ -728,8 +1196,19 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         }
     }
 
-    if (tap->has_vhost ? tap->vhost :
-        vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
+#ifdef CONFIG_TAP_IO_URING
+    if (tap->has_io_uring && tap->io_uring) {
+        if (vhost) {
+            error_setg(errp, "io-uring=on is not valid with vhost");
+            goto failed;
+        }
+        if (!tap_uring_init(s, errp)) {
+            goto failed;
+        }
+    }
+#endif
+
+    if (vhost) {
         VhostNetOptions options;
 
         options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
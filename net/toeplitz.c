@@ -0,0 +1,46 @@
+/*
+ * Toeplitz hash used for receive side scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "net/toeplitz.h"
+
+void net_toeplitz_set_key(NetToeplitz *t, const uint8_t *key)
+{
+    /* Padding for the 64-bit loads of the last input byte */
+    uint8_t k[NET_TOEPLITZ_KEY_SIZE + sizeof(uint64_t)] = { 0 };
+    size_t i;
+    int bit;
+
+    if (t->valid && !memcmp(t->key, key, NET_TOEPLITZ_KEY_SIZE)) {
+        return;
+    }
+
+    memcpy(t->key, key, NET_TOEPLITZ_KEY_SIZE);
+    memcpy(k, key, NET_TOEPLITZ_KEY_SIZE);
+
+    for (i = 0; i < NET_TOEPLITZ_INPUT_MAX; i++) {
+        uint32_t *table = t->table[i];
+        uint64_t window = ldq_be_p(&k[i]);
+        uint32_t contrib[8];
+        unsigned v;
+
+        /* Input bit 7 - bit selects the 32 key bits starting at that bit */
+        for (bit = 0; bit < 8; bit++) {
+            contrib[7 - bit] = window << bit >> 32;
+        }
+
+        table[0] = 0;
+        for (v = 1; v < 256; v++) {
+            bit = ctz32(v);
+            table[v] = table[v & (v - 1)] ^ contrib[bit];
+        }
+    }
+
+    t->valid = true;
+}
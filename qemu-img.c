@@ -668,16 +668,24 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
     }
 }
 
+static void check_status_cb(BlockDriverState *bs,
+                            int64_t done, int64_t total_work_size,
+                            void *opaque)
+{
+    qemu_progress_print(100.f * done / total_work_size, 0);
+}
+
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
                    const char *fmt,
-                   int fix)
+                   int fix,
+                   BlockDriverCheckStatusCB *status_cb)
 {
     int ret;
     BdrvCheckResult result;
 
-    ret = bdrv_check(bs, &result, fix);
+    ret = bdrv_check(bs, &result, fix, status_cb, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -728,6 +736,7 @@ static int img_check(int argc, char **argv)
     bool writethrough;
     ImageCheck *check;
     bool quiet = false;
+    bool progress = false;
     bool image_opts = false;
     bool force_share = false;
 
@@ -747,7 +756,7 @@ static int img_check(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:r:T:qU",
+        c = getopt_long(argc, argv, ":hf:r:T:pqU",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -783,6 +792,9 @@ static int img_check(int argc, char **argv)
         case 'T':
             cache = optarg;
             break;
+        case 'p':
+            progress = true;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -824,8 +836,19 @@ static int img_check(int argc, char **argv)
     }
     bs = blk_bs(blk);
 
+    /* Progress output would mix with the JSON on stdout */
+    if (quiet || output_format == OFORMAT_JSON) {
+        progress = false;
+    }
+    qemu_progress_init(progress, 1.f);
+    qemu_progress_print(0.f, 100);
+
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    ret = collect_image_check(bs, check, filename, fmt, fix,
+                              &check_status_cb);
+
+    qemu_progress_print(100.f, 0);
+    qemu_progress_end();
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -854,7 +877,7 @@ static int img_check(int argc, char **argv)
 
         qapi_free_ImageCheck(check);
         check = g_new0(ImageCheck, 1);
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt, 0, NULL);
 
         check->leaks_fixed          = leaks_fixed;
         check->has_leaks_fixed      = has_leaks_fixed;
@@ -2831,7 +2831,11 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n]"
+#ifdef CONFIG_TAP_IO_URING
+    "[,io-uring=on|off]"
+#endif
+    "\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -2854,6 +2858,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to specify the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+#ifdef CONFIG_TAP_IO_URING
+    "                use 'io-uring=on' to read and write packets with io_uring\n"
+#endif
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -3238,6 +3245,11 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    ``io-uring=on`` makes QEMU read packets with an io_uring multishot
+    read and submit writes in batches, which reduces the number of
+    system calls per packet when vhost is not used.  This requires
+    Linux 6.7 or newer.
+
     Examples:
 
     .. parsed-literal::
@@ -3454,6 +3466,19 @@ SRST
         |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
             -netdev af-xdp,id=n1,ifname=eth0,queues=4
 
+    Every queue has its own AF_XDP socket.  When the peer is a virtio-net
+    device with 'iothread-vq-mapping', each socket is serviced in the
+    IOThread of the corresponding queue pair instead of the main loop.
+
+    .. parsed-literal::
+
+        |qemu_system| linux.img -object iothread,id=io0 \\
+            -object iothread,id=io1 \\
+            -device '{"driver":"virtio-net-pci","netdev":"n1","mq":true,
+                      "iothread-vq-mapping":[{"iothread":"io0"},
+                                             {"iothread":"io1"}]}' \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2
+
     'start-queue' option can be specified if a particular range of queues
     [m, m + n] should be in use.  For example, this is may be necessary in
     order to use certain NICs in native mode.  Kernel allows the driver to
@@ -54,7 +54,8 @@ void replay_net_packet_event(ReplayNetState *rns, unsigned flags,
                              const struct iovec *iov, int iovcnt)
 {
     NetEvent *event = g_new(NetEvent, 1);
-    event->flags = flags;
+    /* The copy is not a NetPacketBuf, it must not be passed on as shared */
+    event->flags = flags & ~QEMU_NET_PACKET_FLAG_SHARED;
     event->data = g_malloc(iov_size(iov, iovcnt));
     event->size = iov_size(iov, iovcnt);
     event->id = rns->id;
@@ -94,7 +95,7 @@ void *replay_event_net_load(void)
     NetEvent *event = g_new(NetEvent, 1);
 
     event->id = replay_get_byte();
-    event->flags = replay_get_dword();
+    event->flags = replay_get_dword() & ~QEMU_NET_PACKET_FLAG_SHARED;
     replay_get_array_alloc(&event->data, &event->size);
 
     return event;
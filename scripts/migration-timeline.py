@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Convert the migration timeline to the Chrome trace event format
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# The output can be loaded in chrome://tracing or https://ui.perfetto.dev.
+#
+# Usage:
+#   migration-timeline.py /path/to/qmp.sock > timeline.json
+#   migration-timeline.py --input reply.json > timeline.json
+#
+# where reply.json holds the result of query-migrate-timeline.
+
+import argparse
+import json
+import os
+import sys
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'python'))
+
+
+TID_ITERATIONS = 1
+TID_SYNC = 2
+TID_DOWNTIME = 3
+TID_PHASES = 4
+
+
+def thread_name(tid, name):
+    return {'name': 'thread_name', 'ph': 'M', 'pid': 1, 'tid': tid,
+            'args': {'name': name}}
+
+
+def span(tid, name, start, duration, args=None):
+    event = {'name': name, 'ph': 'X', 'pid': 1, 'tid': tid,
+             'ts': start, 'dur': duration}
+    if args:
+        event['args'] = args
+    return event
+
+
+def counter(name, ts, values):
+    return {'name': name, 'ph': 'C', 'pid': 1, 'ts': ts, 'args': values}
+
+
+def convert(timeline):
+    events = [
+        thread_name(TID_ITERATIONS, 'iterations'),
+        thread_name(TID_SYNC, 'dirty bitmap sync'),
+        thread_name(TID_DOWNTIME, 'downtime'),
+        thread_name(TID_PHASES, 'downtime phases'),
+    ]
+
+    for it in timeline['iterations']:
+        start = it['start']
+        events.append(span(TID_ITERATIONS, 'iteration %d' % it['iteration'],
+                           start, it['duration'], {
+                               'dirty-pages': it['dirty-pages'],
+                               'normal-pages': it['normal-pages'],
+                               'zero-pages': it['zero-pages'],
+                               'prepare-time': it['prepare-time'],
+                           }))
+        events.append(span(TID_SYNC, 'sync', start, it['sync-time']))
+        channels = {'channel %d' % i: pages
+                    for i, pages in enumerate(it['channel-pages'])}
+        events.append(counter('channel pages', start, channels))
+        events.append(counter('pages', start, {
+            'normal': it['normal-pages'],
+            'zero': it['zero-pages'],
+        }))
+
+    downtime = timeline.get('downtime')
+    if downtime:
+        events.append(span(TID_DOWNTIME, 'downtime', downtime['start'],
+                           downtime['duration']))
+        for phase in downtime['phases']:
+            events.append(span(TID_PHASES, phase['phase'], phase['start'],
+                               phase['duration']))
+
+    return {
+        'traceEvents': events,
+        'displayTimeUnit': 'ms',
+        'otherData': {'migration-start': timeline['start']},
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Export the migration timeline as a Chrome trace')
+    parser.add_argument('socket', nargs='?', help='QMP socket of the source')
+    parser.add_argument('--input', help='saved query-migrate-timeline result')
+    parser.add_argument('-o', '--output', help='output file (default stdout)')
+    args = parser.parse_args()
+
+    if args.input:
+        with open(args.input, encoding='utf-8') as f:
+            timeline = json.load(f)
+        # Accept a whole QMP reply as well
+        timeline = timeline.get('return', timeline)
+    elif args.socket:
+        # pylint: disable=import-outside-toplevel
+        from qemu.qmp.legacy import QEMUMonitorProtocol
+
+        qmp = QEMUMonitorProtocol(args.socket)
+        qmp.connect()
+        timeline = qmp.cmd('query-migrate-timeline')
+        qmp.close()
+    else:
+        parser.error('a QMP socket or --input is required')
+
+    trace = convert(timeline)
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8') as f:
+            json.dump(trace, f, indent=1)
+    else:
+        json.dump(trace, sys.stdout, indent=1)
+        sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()
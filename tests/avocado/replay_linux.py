@@ -31,6 +31,8 @@ class ReplayLinux(LinuxTest):
     hdd = 'ide-hd'
     cd = 'ide-cd'
     bus = 'ide'
+    # Network filters, in the order they are attached to the netdev
+    filters = ('filter-replay,id=replay,netdev=vnet',)
 
     def setUp(self):
         # LinuxTest does many replay-incompatible things, but includes
@@ -64,7 +66,8 @@ def launch_and_wait(self, record, args, shift):
         vm.add_args('-m', '1024')
         vm.add_args('-netdev', 'user,id=vnet,hostfwd=:127.0.0.1:0-:22',
                     '-device', 'virtio-net,netdev=vnet')
-        vm.add_args('-object', 'filter-replay,id=replay,netdev=vnet')
+        for f in self.filters:
+            vm.add_args('-object', f)
         if args:
             vm.add_args(*args)
         self.vm_add_disk(vm, self.boot_path, 0, self.hdd)
@@ -155,6 +158,32 @@ def test_pc_q35(self):
         """
         self.run_rr(shift=3)
 
+@skipUnless(os.getenv('AVOCADO_TIMEOUT_EXPECTED'), 'Test might timeout')
+class ReplayLinuxX8664FilterBuffer(ReplayLinux):
+    """
+    :avocado: tags=arch:x86_64
+    :avocado: tags=virtio
+    :avocado: tags=accel:tcg
+    """
+
+    hdd = 'virtio-blk-pci'
+    cd = 'virtio-blk-pci'
+    bus = None
+
+    # The first filter-buffer passes shared packets to filter-replay, the
+    # second one keeps the packets that filter-replay injects on replay
+    filters = ('filter-buffer,id=buf0,netdev=vnet,interval=1000',
+               'filter-replay,id=replay,netdev=vnet',
+               'filter-buffer,id=buf1,netdev=vnet,interval=1000')
+
+    chksum = 'e3c1b309d9203604922d6e255c2c5d098a309c2d46215d8fc026954f3c5c27a0'
+
+    def test_pc_q35(self):
+        """
+        :avocado: tags=machine:q35
+        """
+        self.run_rr(shift=3)
+
 @skipUnless(os.getenv('AVOCADO_TIMEOUT_EXPECTED'), 'Test might timeout')
 class ReplayLinuxAarch64(ReplayLinux):
     """
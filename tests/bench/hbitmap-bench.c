@@ -0,0 +1,105 @@
+/*
+ * QEMU HBitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+/* One bit per 64 KiB cluster of a 16 TiB disk */
+#define BITMAP_SIZE (1ULL << 28)
+
+typedef struct HBitmapBench {
+    const char *name;
+    void (*run)(HBitmap *a, HBitmap *b, uint8_t *buf);
+} HBitmapBench;
+
+/* Set every other run of 64 KiB bits, so that half of the bitmap is dirty */
+static void bench_fill(HBitmap *hb)
+{
+    uint64_t run = 64 * KiB;
+    uint64_t i;
+
+    for (i = 0; i < BITMAP_SIZE; i += 2 * run) {
+        hbitmap_set(hb, i, run);
+    }
+}
+
+static void bench_merge(HBitmap *a, HBitmap *b, uint8_t *buf)
+{
+    hbitmap_merge(a, b, a);
+}
+
+static void bench_count(HBitmap *a, HBitmap *b, uint8_t *buf)
+{
+    /* Recomputes the count of the whole bitmap */
+    hbitmap_deserialize_finish(a);
+}
+
+static void bench_next_zero(HBitmap *a, HBitmap *b, uint8_t *buf)
+{
+    int64_t start = 0;
+    int64_t count;
+
+    while (hbitmap_next_dirty_area(a, start, BITMAP_SIZE, INT64_MAX,
+                                   &start, &count)) {
+        start += count;
+    }
+}
+
+static void bench_serialize(HBitmap *a, HBitmap *b, uint8_t *buf)
+{
+    hbitmap_serialize_part(a, buf, 0, BITMAP_SIZE);
+}
+
+static const HBitmapBench benchs[] = {
+    { "merge", bench_merge },
+    { "count", bench_count },
+    { "next-zero", bench_next_zero },
+    { "serialize", bench_serialize },
+};
+
+static void test(const void *opaque)
+{
+    HBitmap *a = hbitmap_alloc(BITMAP_SIZE, 0);
+    HBitmap *b = hbitmap_alloc(BITMAP_SIZE, 0);
+    uint8_t *buf = g_malloc(hbitmap_serialization_size(a, 0, BITMAP_SIZE));
+    int accel_index = 0;
+
+    bench_fill(a);
+    hbitmap_set(b, BITMAP_SIZE / 3, BITMAP_SIZE / 3);
+
+    do {
+        if (accel_index != 0) {
+            g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        }
+        for (int i = 0; i < ARRAY_SIZE(benchs); i++) {
+            double total = 0.0;
+
+            g_test_timer_start();
+            do {
+                benchs[i].run(a, b, buf);
+                total += BITMAP_SIZE / 8;
+            } while (g_test_timer_elapsed() < 0.5);
+
+            total /= MiB;
+            g_test_message("hbitmap %-9s #%d: %8.0f MB/sec", benchs[i].name,
+                           accel_index, total / g_test_timer_last());
+        }
+        accel_index++;
+    } while (test_hbitmap_next_accel());
+
+    g_free(buf);
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/hbitmap/speed", NULL, test);
+    return g_test_run();
+}
@@ -130,6 +130,109 @@ static void e1000e_receive_verify(QE1000E *d, int *test_sockets, QGuestAllocator
     guest_free(alloc, data);
 }
 
+/* Descriptors queued at once, several bursts wrap around the rings */
+#define E1000E_BURST_LEN    (100)
+#define E1000E_BURST_COUNT  (3)
+
+static void e1000e_send_burst_verify(QE1000E *d, int *test_sockets,
+                                     QGuestAllocator *alloc)
+{
+    struct e1000_tx_desc descr[E1000E_BURST_LEN];
+    char buffer[64];
+    int i, ret;
+    uint32_t recv_len;
+
+    /* Prepare test data buffer */
+    uint64_t data = guest_alloc(alloc, sizeof(buffer));
+    memwrite(data, &packet, sizeof(packet));
+
+    /* Prepare TX descriptors */
+    memset(descr, 0, sizeof(descr));
+    for (i = 0; i < E1000E_BURST_LEN; i++) {
+        descr[i].buffer_addr = cpu_to_le64(data);
+        descr[i].lower.data = cpu_to_le32(E1000_TXD_CMD_RS   |
+                                          E1000_TXD_CMD_EOP  |
+                                          E1000_TXD_CMD_DEXT |
+                                          E1000_TXD_DTYP_D   |
+                                          sizeof(buffer));
+    }
+
+    /* Put all descriptors to the ring with a single tail update */
+    e1000e_tx_ring_push_burst(d, descr, E1000E_BURST_LEN);
+
+    /* Wait for TX WB interrupt */
+    e1000e_wait_isr(d, E1000E_TX0_MSG_ID);
+
+    for (i = 0; i < E1000E_BURST_LEN; i++) {
+        /* Check DD bit */
+        g_assert_cmphex(le32_to_cpu(descr[i].upper.data) & E1000_TXD_STAT_DD,
+                        ==, E1000_TXD_STAT_DD);
+
+        /* Check data sent to the backend */
+        ret = recv(test_sockets[0], &recv_len, sizeof(recv_len), MSG_WAITALL);
+        g_assert_cmpint(ret, == , sizeof(recv_len));
+        ret = recv(test_sockets[0], buffer, sizeof(buffer), MSG_WAITALL);
+        g_assert_cmpint(ret, ==, sizeof(buffer));
+        g_assert_false(memcmp(buffer, &packet, sizeof(packet)));
+    }
+
+    /* Free test data buffer */
+    guest_free(alloc, data);
+}
+
+static void e1000e_receive_burst_verify(QE1000E *d, int *test_sockets,
+                                        QGuestAllocator *alloc)
+{
+    union e1000_rx_desc_extended descr[E1000E_BURST_LEN];
+
+    struct eth_header test_iov = packet;
+    int len = htonl(sizeof(packet));
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        },{
+            .iov_base = &test_iov,
+            .iov_len = sizeof(packet),
+        },
+    };
+
+    char buffer[64];
+    int i, ret;
+
+    /* Send a burst of dummy packets to device's socket */
+    for (i = 0; i < E1000E_BURST_LEN; i++) {
+        ret = iov_send(test_sockets[0], iov, 2, 0,
+                       sizeof(len) + sizeof(packet));
+        g_assert_cmpint(ret, == , sizeof(packet) + sizeof(len));
+    }
+
+    /* Prepare test data buffers */
+    uint64_t data = guest_alloc(alloc, E1000E_BURST_LEN * sizeof(buffer));
+
+    /* Prepare RX descriptors */
+    memset(descr, 0, sizeof(descr));
+    for (i = 0; i < E1000E_BURST_LEN; i++) {
+        descr[i].read.buffer_addr = cpu_to_le64(data + i * sizeof(buffer));
+    }
+
+    /* Put all descriptors to the ring and wait for the last one */
+    e1000e_rx_ring_push_burst(d, descr, E1000E_BURST_LEN);
+
+    for (i = 0; i < E1000E_BURST_LEN; i++) {
+        /* Check DD bit */
+        g_assert_cmphex(le32_to_cpu(descr[i].wb.upper.status_error) &
+            E1000_RXD_STAT_DD, ==, E1000_RXD_STAT_DD);
+
+        /* Check data sent to the backend */
+        memread(data + i * sizeof(buffer), buffer, sizeof(buffer));
+        g_assert_false(memcmp(buffer, &packet, sizeof(packet)));
+    }
+
+    /* Free test data buffers */
+    guest_free(alloc, data);
+}
+
 static void test_e1000e_init(void *obj, void *data, QGuestAllocator * alloc)
 {
     /* init does nothing */
@@ -188,6 +291,74 @@ static void test_e1000e_multiple_transfers(void *obj, void *data,
 
 }
 
+static void test_e1000e_burst_transfers(void *obj, void *data,
+                                        QGuestAllocator *alloc)
+{
+    QE1000E_PCI *e1000e = obj;
+    QE1000E *d = &e1000e->e1000e;
+    QOSGraphObject *e_object = obj;
+    QPCIDevice *dev = e_object->get_driver(e_object, "pci-device");
+    int i;
+
+    /* FIXME: add spapr support */
+    if (qpci_check_buggy_msi(dev)) {
+        return;
+    }
+
+    for (i = 0; i < E1000E_BURST_COUNT; i++) {
+        e1000e_send_burst_verify(d, data, alloc);
+        e1000e_receive_burst_verify(d, data, alloc);
+    }
+}
+
+/* Time spent on each direction of the burst benchmark */
+#define E1000E_BENCH_SECS   (1.0)
+
+static void e1000e_bench_bursts(const char *dir,
+                                void (*burst)(QE1000E *, int *,
+                                              QGuestAllocator *),
+                                QE1000E *d, int *test_sockets,
+                                QGuestAllocator *alloc)
+{
+    double total = 0.0;
+
+    g_test_timer_start();
+    do {
+        burst(d, test_sockets, alloc);
+        total += E1000E_BURST_LEN;
+    } while (g_test_timer_elapsed() < E1000E_BENCH_SECS);
+
+    g_test_message("e1000e %s burst of %d: %.0f packets/sec", dir,
+                   E1000E_BURST_LEN, total / g_test_timer_last());
+}
+
+/*
+ * Packet rate of TX and RX bursts, with the test as packet generator.
+ * The qtest protocol round trips bound the absolute numbers, so they are
+ * only useful to compare builds.  Run qos-test with "-m perf".
+ */
+static void test_e1000e_burst_bench(void *obj, void *data,
+                                    QGuestAllocator *alloc)
+{
+    QE1000E_PCI *e1000e = obj;
+    QE1000E *d = &e1000e->e1000e;
+    QOSGraphObject *e_object = obj;
+    QPCIDevice *dev = e_object->get_driver(e_object, "pci-device");
+
+    if (!g_test_perf()) {
+        g_test_skip("only runs with -m perf");
+        return;
+    }
+
+    /* FIXME: add spapr support */
+    if (qpci_check_buggy_msi(dev)) {
+        return;
+    }
+
+    e1000e_bench_bursts("TX", e1000e_send_burst_verify, d, data, alloc);
+    e1000e_bench_bursts("RX", e1000e_receive_burst_verify, d, data, alloc);
+}
+
 static void test_e1000e_hotplug(void *obj, void *data, QGuestAllocator * alloc)
 {
     QTestState *qts = global_qtest;  /* TODO: get rid of global_qtest here */
@@ -236,6 +407,10 @@ static void register_e1000e_test(void)
     qos_add_test("rx", "e1000e", test_e1000e_rx, &opts);
     qos_add_test("multiple_transfers", "e1000e",
                       test_e1000e_multiple_transfers, &opts);
+    qos_add_test("burst_transfers", "e1000e",
+                      test_e1000e_burst_transfers, &opts);
+    qos_add_test("burst_bench", "e1000e",
+                      test_e1000e_burst_bench, &opts);
     qos_add_test("hotplug", "e1000e", test_e1000e_hotplug, &opts);
 }
 
@@ -70,6 +70,77 @@ void e1000e_rx_ring_push(QE1000E *d, void *descr)
                   descr, E1000_RING_DESC_LEN);
 }
 
+static void e1000e_ring_write_burst(QE1000E_PCI *d_pci, uint64_t ring,
+                                    uint32_t tail, uint32_t len,
+                                    void *descr, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        qtest_memwrite(d_pci->pci_dev.bus->qts,
+                       ring + ((tail + i) % len) * E1000_RING_DESC_LEN,
+                       descr + i * E1000_RING_DESC_LEN, E1000_RING_DESC_LEN);
+    }
+}
+
+static void e1000e_ring_read_burst(QE1000E_PCI *d_pci, uint64_t ring,
+                                   uint32_t tail, uint32_t len,
+                                   void *descr, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        qtest_memread(d_pci->pci_dev.bus->qts,
+                      ring + ((tail + i) % len) * E1000_RING_DESC_LEN,
+                      descr + i * E1000_RING_DESC_LEN, E1000_RING_DESC_LEN);
+    }
+}
+
+void e1000e_tx_ring_push_burst(QE1000E *d, void *descr, int count)
+{
+    QE1000E_PCI *d_pci = container_of(d, QE1000E_PCI, e1000e);
+    uint32_t tail = e1000e_macreg_read(d, E1000_TDT);
+    uint32_t len = e1000e_macreg_read(d, E1000_TDLEN) / E1000_RING_DESC_LEN;
+
+    e1000e_ring_write_burst(d_pci, d->tx_ring, tail, len, descr, count);
+    e1000e_macreg_write(d, E1000_TDT, (tail + count) % len);
+
+    /* Read WB data for the packets transmitted */
+    e1000e_ring_read_burst(d_pci, d->tx_ring, tail, len, descr, count);
+}
+
+void e1000e_rx_ring_push_burst(QE1000E *d, void *descr, int count)
+{
+    QE1000E_PCI *d_pci = container_of(d, QE1000E_PCI, e1000e);
+    uint32_t tail = e1000e_macreg_read(d, E1000_RDT);
+    uint32_t len = e1000e_macreg_read(d, E1000_RDLEN) / E1000_RING_DESC_LEN;
+    uint64_t last = d->rx_ring + ((tail + count - 1) % len) *
+                    E1000_RING_DESC_LEN;
+    guint64 end_time = g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND;
+    uint32_t status;
+
+    e1000e_ring_write_burst(d_pci, d->rx_ring, tail, len, descr, count);
+    e1000e_macreg_write(d, E1000_RDT, (tail + count) % len);
+
+    /*
+     * Packets beyond the first one are picked up from the backend by the
+     * main loop, wait until the last descriptor has been written back.
+     */
+    do {
+        /* wb.upper.status_error */
+        qtest_memread(d_pci->pci_dev.bus->qts, last + 8,
+                      &status, sizeof(status));
+        if (le32_to_cpu(status) & E1000_RXD_STAT_DD) {
+            e1000e_ring_read_burst(d_pci, d->rx_ring, tail, len,
+                                   descr, count);
+            return;
+        }
+        qtest_clock_step(d_pci->pci_dev.bus->qts, 10000);
+    } while (g_get_monotonic_time() < end_time);
+
+    g_error("Timeout expired");
+}
+
 static void e1000e_foreach_callback(QPCIDevice *dev, int devfn, void *data)
 {
     QPCIDevice *res = data;
@@ -57,5 +57,7 @@ static inline uint32_t e1000e_macreg_read(QE1000E *d, uint32_t reg)
 void e1000e_wait_isr(QE1000E *d, uint16_t msg_id);
 void e1000e_tx_ring_push(QE1000E *d, void *descr);
 void e1000e_rx_ring_push(QE1000E *d, void *descr);
+void e1000e_tx_ring_push_burst(QE1000E *d, void *descr, int count);
+void e1000e_rx_ring_push_burst(QE1000E *d, void *descr, int count);
 
 #endif
@@ -295,6 +295,22 @@ static void read_blocktime(QTestState *who)
     qobject_unref(rsp_return);
 }
 
+static void check_migration_timeline(QTestState *who)
+{
+    QDict *rsp, *downtime;
+    QList *iterations;
+
+    rsp = qtest_qmp_assert_success_ref(
+        who, "{ 'execute': 'query-migrate-timeline' }");
+    iterations = qdict_get_qlist(rsp, "iterations");
+    g_assert(iterations && !qlist_empty(iterations));
+    downtime = qdict_get_qdict(rsp, "downtime");
+    g_assert(downtime);
+    g_assert(qdict_get_qlist(downtime, "phases"));
+    g_assert_cmpint(qdict_get_int(downtime, "duration"), >=, 0);
+    qobject_unref(rsp);
+}
+
 /*
  * Wait for two changes in the migration pass count, but bail if we stop.
  */
@@ -1686,6 +1702,8 @@ static void test_precopy_common(MigrateCommon *args)
 
             wait_for_stop(from, &src_state);
 
+            check_migration_timeline(from);
+
         } else {
             wait_for_migration_complete(from);
             /*
@@ -2676,6 +2694,42 @@ static void test_multifd_tcp_uri_none(void)
     test_precopy_common(&args);
 }
 
+/*
+ * VFIO stop-copy data sent over the multifd channels.  This needs a
+ * migratable VFIO device for each side, for example two VFs of the
+ * same adapter: QTEST_VFIO_MIGRATION_DEVICES=0000:3b:00.2,0000:3b:00.3
+ */
+static void test_multifd_tcp_vfio_device_state(void)
+{
+    const char *devices = g_getenv("QTEST_VFIO_MIGRATION_DEVICES");
+    g_auto(GStrv) hosts = NULL;
+    g_autofree char *opts_source = NULL;
+    g_autofree char *opts_target = NULL;
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+    };
+
+    if (devices) {
+        hosts = g_strsplit(devices, ",", 2);
+    }
+    if (!hosts || !hosts[0] || !hosts[1]) {
+        g_test_skip("QTEST_VFIO_MIGRATION_DEVICES needs two host devices");
+        return;
+    }
+
+    opts_source = g_strdup_printf("-device vfio-pci,host=%s,"
+                                  "x-migration-multifd-transfer=on",
+                                  hosts[0]);
+    opts_target = g_strdup_printf("-device vfio-pci,host=%s,"
+                                  "x-migration-multifd-transfer=on",
+                                  hosts[1]);
+    args.start.opts_source = opts_source;
+    args.start.opts_target = opts_target;
+
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zero_page_legacy(void)
 {
     MigrateCommon args = {
@@ -3219,6 +3273,66 @@ static void test_vcpu_dirty_limit(void)
     dirtylimit_stop_vm(vm);
 }
 
+/*
+ * The guest keeps dirtying its test memory, so a page sampling
+ * measurement split into rounds must find part of it dirty.
+ */
+static void test_dirty_rate_heatmap(void)
+{
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp_return, *heatmap, *rsp;
+    QList *histogram;
+    const QListEntry *entry;
+    uint64_t working_set = 0;
+    int64_t rounds = 0;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    wait_for_serial("src_serial");
+
+    /* The heatmap is only available in page sampling mode */
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                    "'arguments': { 'calc-time': 1,"
+                    "'mode': 'dirty-bitmap',"
+                    "'heatmap-rounds': 4 }}");
+    qmp_expect_error_and_unref(rsp, "GenericError");
+
+    qtest_qmp_assert_success(from,
+                             "{ 'execute': 'calc-dirty-rate',"
+                             "'arguments': { 'calc-time': 1,"
+                             "'heatmap-rounds': 4 }}");
+    wait_for_calc_dirtyrate_complete(from, 1);
+
+    rsp_return = query_dirty_rate(from);
+    g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==, "measured");
+    heatmap = qdict_get_qdict(rsp_return, "heatmap");
+    g_assert(heatmap);
+    g_assert_cmpint(qdict_get_int(heatmap, "rounds"), ==, 4);
+    g_assert_cmpint(qdict_get_int(heatmap, "granularity"), ==, 1ULL << 30);
+
+    histogram = qdict_get_qlist(heatmap, "histogram");
+    for (entry = qlist_first(histogram); entry;
+         entry = qlist_next(entry)) {
+        QDict *bucket = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert_cmpint(qdict_get_int(bucket, "rounds"), ==, rounds);
+        if (rounds++) {
+            working_set += qdict_get_int(bucket, "size");
+        }
+    }
+    g_assert_cmpint(rounds, ==, 5);
+    g_assert_cmpint(working_set, >, 0);
+    g_assert_cmpint(qdict_get_int(heatmap, "working-set-size"), ==,
+                    working_set);
+    g_assert(!qlist_empty(qdict_get_qlist(heatmap, "regions")));
+
+    qobject_unref(rsp_return);
+    test_migrate_end(from, to, false);
+}
+
 static void migrate_dirty_limit_wait_showup(QTestState *from,
                                             const int64_t period,
                                             const int64_t value)
@@ -3447,6 +3561,8 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     migration_test_add("/migration/bad_dest", test_baddest);
+    migration_test_add("/migration/dirty_rate/heatmap",
+                       test_dirty_rate_heatmap);
 #ifndef _WIN32
     migration_test_add("/migration/analyze-script", test_analyze_script);
 #endif
@@ -3616,6 +3732,8 @@ int main(int argc, char **argv)
                        test_multifd_tcp_channels_none);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/legacy",
                        test_multifd_tcp_zero_page_legacy);
+    migration_test_add("/migration/multifd/tcp/plain/vfio-device-state",
+                       test_multifd_tcp_vfio_device_state);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
     migration_test_add("/migration/multifd/tcp/plain/cancel",
@@ -0,0 +1,219 @@
+/*
+ * QTest testcase for colo-compare
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qemu/iov.h"
+#include "net/eth.h"
+
+#define NCONNS 16
+#define PKT_SIZE (sizeof(struct eth_header) + sizeof(struct ip_header) + \
+                  sizeof(struct udp_header) + 8)
+
+typedef struct TestState {
+    QTestState *qts;
+    int pri[2], sec[2], out[2];
+} TestState;
+
+/* A UDP packet of connection @port whose payload is @data */
+static void build_packet(uint8_t *buf, uint16_t port, const char *data)
+{
+    struct eth_header *eh = (struct eth_header *)buf;
+    struct ip_header *ip = (struct ip_header *)(eh + 1);
+    struct udp_header *udp = (struct udp_header *)(ip + 1);
+
+    memset(buf, 0, PKT_SIZE);
+    memset(eh->h_dest, 0xff, ETH_ALEN);
+    eh->h_proto = cpu_to_be16(ETH_P_IP);
+
+    ip->ip_ver_len = IP_HEADER_VERSION_4 << 4 | sizeof(*ip) / 4;
+    ip->ip_len = cpu_to_be16(PKT_SIZE - sizeof(*eh));
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_UDP;
+    ip->ip_src = cpu_to_be32(0x0a000001);
+    ip->ip_dst = cpu_to_be32(0x0a000002);
+
+    udp->uh_sport = cpu_to_be16(port);
+    udp->uh_dport = cpu_to_be16(7);
+    udp->uh_ulen = cpu_to_be16(sizeof(*udp) + 8);
+    memcpy(udp + 1, data, strnlen(data, 8));
+}
+
+/* colo-compare frames packets with their length */
+static void send_packet(int fd, const uint8_t *buf)
+{
+    uint32_t len = htonl(PKT_SIZE);
+    struct iovec iov[] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = (void *)buf, .iov_len = PKT_SIZE },
+    };
+    ssize_t ret;
+
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + PKT_SIZE);
+    g_assert_cmpint(ret, ==, sizeof(len) + PKT_SIZE);
+}
+
+static void recv_packet(int fd, uint8_t *buf)
+{
+    uint32_t len;
+    ssize_t ret;
+
+    ret = recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    g_assert_cmpint(ntohl(len), ==, PKT_SIZE);
+    ret = recv(fd, buf, PKT_SIZE, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, PKT_SIZE);
+}
+
+static QDict *query_colo_compare(QTestState *qts)
+{
+    QDict *rsp, *info;
+    QList *list;
+
+    rsp = qtest_qmp(qts, "{'execute': 'query-colo-compare'}");
+    list = qdict_get_qlist(rsp, "return");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    info = qobject_to(QDict, qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(info, "id"), ==, "comp0");
+    qobject_ref(info);
+    qobject_unref(rsp);
+    return info;
+}
+
+static void test_start(TestState *t, uint32_t workers)
+{
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, t->pri), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, t->sec), !=, -1);
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, t->out), !=, -1);
+
+    t->qts = qtest_initf(
+        "-chardev socket,id=pri0,fd=%d "
+        "-chardev socket,id=sec0,fd=%d "
+        "-chardev socket,id=out0,fd=%d "
+        "-object iothread,id=iothread0 "
+        "-object colo-compare,id=comp0,primary_in=pri0,secondary_in=sec0,"
+        "outdev=out0,iothread=iothread0,workers=%u",
+        t->pri[1], t->sec[1], t->out[1], workers);
+}
+
+static void test_end(TestState *t)
+{
+    qtest_quit(t->qts);
+    close(t->pri[0]);
+    close(t->pri[1]);
+    close(t->sec[0]);
+    close(t->sec[1]);
+    close(t->out[0]);
+    close(t->out[1]);
+}
+
+/*
+ * Primary packets are released once the secondary sends the same data, in
+ * order for each connection.  With workers, connections are compared in
+ * different threads, so packets of different connections may be reordered.
+ */
+static void test_compare(const void *opaque)
+{
+    uint32_t workers = GPOINTER_TO_UINT(opaque);
+    uint8_t pkt[PKT_SIZE], buf[PKT_SIZE];
+    unsigned next[NCONNS] = { 0 };
+    TestState t;
+    QDict *info;
+    int i, round;
+
+    test_start(&t, workers);
+
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < NCONNS; i++) {
+            char data[9];
+
+            snprintf(data, sizeof(data), "pkt%u", round);
+            build_packet(pkt, 1000 + i, data);
+            send_packet(t.pri[0], pkt);
+            send_packet(t.sec[0], pkt);
+        }
+    }
+
+    for (i = 0; i < 2 * NCONNS; i++) {
+        struct udp_header *udp;
+        char data[9];
+        int conn;
+
+        recv_packet(t.out[0], buf);
+        udp = (struct udp_header *)(buf + sizeof(struct eth_header) +
+                                    sizeof(struct ip_header));
+        conn = be16_to_cpu(udp->uh_sport) - 1000;
+        g_assert_cmpint(conn, >=, 0);
+        g_assert_cmpint(conn, <, NCONNS);
+
+        snprintf(data, sizeof(data), "pkt%u", next[conn]++);
+        build_packet(pkt, 1000 + conn, data);
+        g_assert_cmpmem(buf, PKT_SIZE, pkt, PKT_SIZE);
+    }
+
+    info = query_colo_compare(t.qts);
+    g_assert_cmpint(qdict_get_int(info, "workers"), ==, workers);
+    g_assert_cmpint(qdict_get_int(info, "compared"), ==, 2 * NCONNS);
+    g_assert_cmpint(qdict_get_int(info, "miscompares"), ==, 0);
+    g_assert_cmpint(qdict_get_int(info, "latency-avg-ns"), <=,
+                    qdict_get_int(info, "latency-max-ns"));
+    qobject_unref(info);
+
+    test_end(&t);
+}
+
+/* Packets that differ are counted and are not released */
+static void test_miscompare(const void *opaque)
+{
+    uint32_t workers = GPOINTER_TO_UINT(opaque);
+    uint8_t pkt[PKT_SIZE];
+    gint64 end;
+    TestState t;
+    QDict *info;
+
+    test_start(&t, workers);
+
+    build_packet(pkt, 1000, "primary");
+    send_packet(t.pri[0], pkt);
+    build_packet(pkt, 1000, "second");
+    send_packet(t.sec[0], pkt);
+
+    end = g_get_monotonic_time() + 30 * G_USEC_PER_SEC;
+    for (;;) {
+        info = query_colo_compare(t.qts);
+        if (qdict_get_int(info, "miscompares")) {
+            break;
+        }
+        qobject_unref(info);
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+        g_usleep(10 * 1000);
+    }
+    g_assert_cmpint(qdict_get_int(info, "miscompares"), ==, 1);
+    g_assert_cmpint(qdict_get_int(info, "compared"), ==, 0);
+    qobject_unref(info);
+
+    g_assert_cmpint(recv(t.out[0], pkt, PKT_SIZE, MSG_DONTWAIT), ==, -1);
+
+    test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_data_func("/colo-compare/compare", GUINT_TO_POINTER(0),
+                        test_compare);
+    qtest_add_data_func("/colo-compare/compare/workers", GUINT_TO_POINTER(4),
+                        test_compare);
+    qtest_add_data_func("/colo-compare/miscompare", GUINT_TO_POINTER(0),
+                        test_miscompare);
+    qtest_add_data_func("/colo-compare/miscompare/workers",
+                        GUINT_TO_POINTER(4), test_miscompare);
+    return g_test_run();
+}
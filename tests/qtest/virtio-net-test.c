@@ -15,6 +15,13 @@
 #include "hw/virtio/virtio-net.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
+#include "net/eth.h"
+
+#ifdef CONFIG_LINUX
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <netpacket/packet.h>
+#endif
 
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
@@ -261,6 +268,320 @@ static void announce_self(void *obj, void *data, QGuestAllocator *t_alloc)
     };
 }
 
+/*
+ * Hotplug device net1 on @netdev, optionally with its queue pair in
+ * iothread0, and set up its RX, TX and control virtqueues in @vqs.
+ */
+static QVirtioPCIDevice *hotplug_started(QVirtioPCIDevice *pdev1,
+                                         const char *netdev, bool iothread,
+                                         QGuestAllocator *t_alloc,
+                                         QVirtQueue **vqs)
+{
+    QTestState *qts = pdev1->pdev->bus->qts;
+    QVirtioPCIDevice *pdev;
+    QVirtioDevice *dev;
+    uint64_t features;
+    int i;
+
+    if (iothread) {
+        qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                             "{'addr': %s, 'netdev': %s, "
+                             "'iothread-vq-mapping': "
+                             "[{'iothread': 'iothread0'}]}",
+                             stringify(PCI_SLOT_HP) ".0", netdev);
+    } else {
+        qtest_qmp_device_add(qts, "virtio-net-pci", "net1",
+                             "{'addr': %s, 'netdev': %s}",
+                             stringify(PCI_SLOT_HP) ".0", netdev);
+    }
+
+    pdev = virtio_pci_new(pdev1->pdev->bus,
+                          &(QPCIAddress) {
+                              .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0)
+                          });
+    g_assert_nonnull(pdev);
+    qos_object_start_hw(&pdev->obj);
+    dev = &pdev->vdev;
+
+    features = qvirtio_get_features(dev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_NET_F_MQ));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < 3; i++) {
+        vqs[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev);
+    return pdev;
+}
+
+static void hot_unplug(QVirtioPCIDevice *pdev, QGuestAllocator *t_alloc,
+                       QVirtQueue **vqs)
+{
+    QTestState *qts = pdev->pdev->bus->qts;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        qvirtqueue_cleanup(pdev->vdev.bus, vqs[i], t_alloc);
+    }
+    qvirtio_pci_device_disable(pdev);
+    qos_object_destroy(&pdev->obj);
+
+    if (!strcmp(qtest_get_arch(), "i386") ||
+        !strcmp(qtest_get_arch(), "x86_64")) {
+        qpci_unplug_acpi_device_test(qts, "net1", PCI_SLOT_HP);
+    }
+}
+
+/*
+ * Hotplug a device whose queue pair runs in an IOThread and pass a packet in
+ * each direction through a dgram netdev.  The netdev is then processed in the
+ * IOThread, so filters that don't support this must be refused.
+ */
+static void iothread_vq_mapping(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev1 = obj;
+    QTestState *qts = pdev1->pdev->bus->qts;
+    QVirtioPCIDevice *pdev;
+    QVirtioDevice *dev;
+    QVirtQueue *vqs[3];
+    uint64_t req_addr;
+    uint32_t free_head;
+    char test[] = "TEST";
+    char buffer[64];
+    QDict *rsp;
+    int *sv = data;
+    int ret;
+
+    if (pdev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    pdev = hotplug_started(pdev1, "hs1", true, t_alloc, vqs);
+    dev = &pdev->vdev;
+
+    /* RX */
+    req_addr = guest_alloc(t_alloc, 64);
+    free_head = qvirtqueue_add(qts, vqs[0], req_addr, 64, true, false);
+    qvirtqueue_kick(qts, dev, vqs[0], free_head);
+
+    ret = send(sv[2], test, sizeof(test), 0);
+    g_assert_cmpint(ret, ==, sizeof(test));
+
+    qvirtio_wait_used_elem(qts, dev, vqs[0], free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(test));
+    g_assert_cmpstr(buffer, ==, "TEST");
+
+    /* TX */
+    memset(buffer, 0, sizeof(buffer));
+    memwrite(req_addr, buffer, VNET_HDR_SIZE);
+    memwrite(req_addr + VNET_HDR_SIZE, test, sizeof(test));
+    free_head = qvirtqueue_add(qts, vqs[1], req_addr,
+                               VNET_HDR_SIZE + sizeof(test), false, false);
+    qvirtqueue_kick(qts, dev, vqs[1], free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vqs[1], free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    guest_free(t_alloc, req_addr);
+
+    ret = recv(sv[2], buffer, sizeof(buffer), 0);
+    g_assert_cmpint(ret, ==, sizeof(test));
+    g_assert_cmpstr(buffer, ==, "TEST");
+
+    /* filter-mirror waits for its chardev in the main loop */
+    rsp = qtest_qmp(qts, "{'execute': 'object-add', 'arguments': {"
+                    "'qom-type': 'filter-mirror', 'id': 'mirror0', "
+                    "'netdev': 'hs1', 'outdev': 'mirror0'}}");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    hot_unplug(pdev, t_alloc, vqs);
+}
+
+#ifdef CONFIG_LINUX
+#define ETH_P_TEST 0x88b5   /* IEEE 802 local experimental */
+
+/*
+ * Create a tap interface, bring it up and open a packet socket on it, which
+ * needs CAP_NET_ADMIN and CAP_NET_RAW.  Returns the tap fd, or -1 if that is
+ * not possible.
+ */
+static int tap_open_with_socket(int *sock)
+{
+    struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_TEST),
+    };
+    struct timeval tv = { .tv_sec = QVIRTIO_NET_TIMEOUT_US / 1000000 };
+    int fd, ctl;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        goto fail;
+    }
+
+    ctl = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctl < 0) {
+        goto fail;
+    }
+    if (ioctl(ctl, SIOCGIFFLAGS, &ifr) < 0) {
+        close(ctl);
+        goto fail;
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(ctl, SIOCSIFFLAGS, &ifr) < 0) {
+        close(ctl);
+        goto fail;
+    }
+    close(ctl);
+
+    *sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_TEST));
+    if (*sock < 0) {
+        goto fail;
+    }
+    sll.sll_ifindex = if_nametoindex(ifr.ifr_name);
+    if (bind(*sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        close(*sock);
+        goto fail;
+    }
+    setsockopt(*sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static void tap_test_frame(uint8_t *frame, size_t size)
+{
+    struct eth_header *eh = (struct eth_header *)frame;
+
+    memset(frame, 0, size);
+    memset(eh->h_dest, 0xff, ETH_ALEN);
+    memcpy(eh->h_source, "\x52\x54\x00\x12\x34\x57", ETH_ALEN);
+    eh->h_proto = htons(ETH_P_TEST);
+    memcpy(frame + sizeof(*eh), "TEST", 5);
+}
+
+/*
+ * Pass a packet in each direction through a tap netdev with io-uring=on.
+ * The kernel may send its own packets on the interface as well, so look
+ * for the test packet among the received ones.
+ */
+static void tap_io_uring(QVirtioPCIDevice *pdev1, QGuestAllocator *t_alloc,
+                         bool iothread)
+{
+    QTestState *qts = pdev1->pdev->bus->qts;
+    QVirtioPCIDevice *pdev;
+    QVirtioDevice *dev;
+    QVirtQueue *vqs[3];
+    uint8_t frame[ETH_ZLEN], buffer[2048];
+    struct sockaddr_ll sll;
+    socklen_t sll_len;
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    QDict *rsp;
+    int fd, sock;
+    bool found;
+    int i, ret;
+
+    if (pdev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    fd = tap_open_with_socket(&sock);
+    if (fd < 0) {
+        g_test_skip("cannot create a tap interface");
+        return;
+    }
+
+    rsp = qtest_qmp_fds(qts, &fd, 1, "{'execute': 'getfd', "
+                        "'arguments': {'fdname': 'tapfd'}}");
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+    close(fd);
+
+    rsp = qtest_qmp(qts, "{'execute': 'netdev_add', 'arguments': {"
+                    "'type': 'tap', 'id': 'tap0', 'fd': 'tapfd', "
+                    "'io-uring': true}}");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        close(sock);
+        g_test_skip("tap io_uring mode is not supported");
+        return;
+    }
+    qobject_unref(rsp);
+
+    pdev = hotplug_started(pdev1, "tap0", iothread, t_alloc, vqs);
+    dev = &pdev->vdev;
+    req_addr = guest_alloc(t_alloc, sizeof(buffer));
+
+    /* RX */
+    tap_test_frame(frame, sizeof(frame));
+    ret = send(sock, frame, sizeof(frame), 0);
+    g_assert_cmpint(ret, ==, sizeof(frame));
+
+    found = false;
+    for (i = 0; i < 16 && !found; i++) {
+        free_head = qvirtqueue_add(qts, vqs[0], req_addr, sizeof(buffer),
+                                   true, false);
+        qvirtqueue_kick(qts, dev, vqs[0], free_head);
+        qvirtio_wait_used_elem(qts, dev, vqs[0], free_head, &len,
+                               QVIRTIO_NET_TIMEOUT_US);
+        g_assert_cmpint(len, >=, VNET_HDR_SIZE + sizeof(frame));
+        memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(frame));
+        found = !memcmp(buffer, frame, sizeof(frame));
+    }
+    g_assert_true(found);
+
+    /* TX */
+    frame[sizeof(struct eth_header)] = 't';
+    memset(buffer, 0, VNET_HDR_SIZE);
+    memcpy(buffer + VNET_HDR_SIZE, frame, sizeof(frame));
+    memwrite(req_addr, buffer, VNET_HDR_SIZE + sizeof(frame));
+    free_head = qvirtqueue_add(qts, vqs[1], req_addr,
+                               VNET_HDR_SIZE + sizeof(frame), false, false);
+    qvirtqueue_kick(qts, dev, vqs[1], free_head);
+    qvirtio_wait_used_elem(qts, dev, vqs[1], free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+
+    /* Skip the frame that was sent by the test */
+    do {
+        sll_len = sizeof(sll);
+        ret = recvfrom(sock, buffer, sizeof(buffer), 0,
+                       (struct sockaddr *)&sll, &sll_len);
+        g_assert_cmpint(ret, >, 0);
+    } while (sll.sll_pkttype == PACKET_OUTGOING);
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    g_assert_cmpmem(buffer, ret, frame, sizeof(frame));
+
+    guest_free(t_alloc, req_addr);
+    close(sock);
+    hot_unplug(pdev, t_alloc, vqs);
+}
+
+static void tap_io_uring_main_loop(void *obj, void *data,
+                                   QGuestAllocator *t_alloc)
+{
+    tap_io_uring(obj, t_alloc, false);
+}
+
+static void tap_io_uring_iothread(void *obj, void *data,
+                                  QGuestAllocator *t_alloc)
+{
+    tap_io_uring(obj, t_alloc, true);
+}
+#endif /* CONFIG_LINUX */
+
 static void virtio_net_test_cleanup(void *sockets)
 {
     int *sv = sockets;
@@ -285,6 +606,39 @@ static void *virtio_net_test_setup(GString *cmd_line, void *arg)
     return sv;
 }
 
+static void virtio_net_iothread_test_cleanup(void *sockets)
+{
+    int *sv = sockets;
+
+    close(sv[0]);
+    close(sv[2]);
+    qos_invalidate_command_line();
+    close(sv[1]);
+    close(sv[3]);
+    g_free(sv);
+}
+
+/* sv[0] and sv[1] are for netdev hs0, sv[2] and sv[3] for hs1 */
+static void *virtio_net_iothread_test_setup(GString *cmd_line, void *arg)
+{
+    int ret;
+    int *sv = g_new(int, 4);
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_DGRAM, 0, &sv[2]);
+    g_assert_cmpint(ret, !=, -1);
+
+    g_string_append_printf(cmd_line,
+                           " -netdev socket,fd=%d,id=hs0"
+                           " -object iothread,id=iothread0"
+                           " -netdev dgram,id=hs1,local.type=fd,local.str=%d"
+                           " -chardev null,id=mirror0 ", sv[1], sv[3]);
+
+    g_test_queue_destroy(virtio_net_iothread_test_cleanup, sv);
+    return sv;
+}
+
 #endif /* _WIN32 */
 
 static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -328,6 +682,18 @@ static void register_virtio_net_test(void)
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
+
+    opts.before = virtio_net_iothread_test_setup;
+    qos_add_test("iothread-vq-mapping", "virtio-net-pci", iothread_vq_mapping,
+                 &opts);
+#ifdef CONFIG_LINUX
+    qos_add_test("tap-io-uring/iothread", "virtio-net-pci",
+                 tap_io_uring_iothread, &opts);
+
+    opts.before = virtio_net_test_setup;
+    qos_add_test("tap-io-uring/main-loop", "virtio-net-pci",
+                 tap_io_uring_main_loop, &opts);
+#endif
 #endif
 
     /* These tests do not need a loopback backend.  */
@@ -825,6 +825,35 @@ static void test_worker_thread_co_enter(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+static void test_account_batch(void)
+{
+    static const struct {
+        unsigned int n;
+        int bucket;
+    } batches[] = {
+        { 1, 0 }, { 2, 1 }, { 3, 1 }, { 4, 2 }, { 127, 6 }, { 128, 7 },
+        { 1024, 7 },
+    };
+    uint64_t expected[AIO_BATCH_HIST_BUCKETS];
+    int i;
+
+    for (i = 0; i < AIO_BATCH_HIST_BUCKETS; i++) {
+        expected[i] = stat64_get(&ctx->aio_batch_hist[i]);
+    }
+
+    /* Empty batches are not counted */
+    aio_context_account_batch(ctx, 0);
+
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        aio_context_account_batch(ctx, batches[i].n);
+        expected[batches[i].bucket]++;
+    }
+
+    for (i = 0; i < AIO_BATCH_HIST_BUCKETS; i++) {
+        g_assert_cmpuint(stat64_get(&ctx->aio_batch_hist[i]), ==, expected[i]);
+    }
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -850,6 +879,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
+    g_test_add_func("/aio/account-batch",           test_account_batch);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
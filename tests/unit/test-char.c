@@ -164,6 +164,17 @@ static void char_ringbuf_test(void)
     g_assert_cmpstr(data, ==, "");
     g_free(data);
 
+    /* ringbuf has no chr_writev, each element is written separately */
+    ret = qemu_chr_fe_writev_all(&be, (struct iovec[]) {
+                                     { .iov_base = (void *)"ab", .iov_len = 2 },
+                                     { .iov_base = (void *)"c", .iov_len = 1 },
+                                 }, 2);
+    g_assert_cmpint(ret, ==, 3);
+
+    data = qmp_ringbuf_read("ringbuf-label", 4, false, 0, &error_abort);
+    g_assert_cmpstr(data, ==, "bc");
+    g_free(data);
+
     qemu_chr_fe_deinit(&be, true);
 
     /* check alias */
@@ -760,6 +771,7 @@ typedef struct {
     SocketAddress *addr;
     bool wait_connected;
     bool fd_pass;
+    bool writev;
 } CharSocketServerTestConfig;
 
 
@@ -842,8 +854,18 @@ static void char_socket_server_test(gconstpointer opaque)
     data.event = -1;
 
     /* Send a greeting to the client */
-    ret = qemu_chr_fe_write_all(&be, (const uint8_t *)SOCKET_PING,
-                                sizeof(SOCKET_PING));
+    if (config->writev) {
+        char *ping = (char *)SOCKET_PING;
+        struct iovec iov[] = {
+            { .iov_base = ping, .iov_len = 2 },
+            { .iov_base = ping + 2, .iov_len = sizeof(SOCKET_PING) - 2 },
+        };
+
+        ret = qemu_chr_fe_writev_all(&be, iov, ARRAY_SIZE(iov));
+    } else {
+        ret = qemu_chr_fe_write_all(&be, (const uint8_t *)SOCKET_PING,
+                                    sizeof(SOCKET_PING));
+    }
     g_assert_cmpint(ret, ==, sizeof(SOCKET_PING));
     g_assert(data.event == -1);
 
@@ -1508,6 +1530,8 @@ int main(int argc, char **argv)
         { addr, false, true };                                          \
     static CharSocketServerTestConfig server4 ## name =                 \
         { addr, true, true };                                           \
+    static CharSocketServerTestConfig server5 ## name =                 \
+        { addr, false, false, true };                                   \
     g_test_add_data_func("/char/socket/server/mainloop/" # name,        \
                          &server1 ##name, char_socket_server_test);     \
     g_test_add_data_func("/char/socket/server/wait-conn/" # name,       \
@@ -1515,7 +1539,9 @@ int main(int argc, char **argv)
     g_test_add_data_func("/char/socket/server/mainloop-fdpass/" # name, \
                          &server3 ##name, char_socket_server_test);     \
     g_test_add_data_func("/char/socket/server/wait-conn-fdpass/" # name, \
-                         &server4 ##name, char_socket_server_test)
+                         &server4 ##name, char_socket_server_test);     \
+    g_test_add_data_func("/char/socket/server/mainloop-writev/" # name, \
+                         &server5 ##name, char_socket_server_test)
 
 #define SOCKET_CLIENT_TEST(name, addr)                                  \
     static CharSocketClientTestConfig client1 ## name =                 \
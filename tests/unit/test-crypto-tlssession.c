@@ -31,6 +31,14 @@
 #include "qemu/sockets.h"
 #include "authz/list.h"
 
+#ifdef CONFIG_LINUX_TLS_H
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 #define WORKDIR "tests/test-crypto-tlssession-work/"
 #define PSKFILE WORKDIR "keys.psk"
 #define KEYFILE WORKDIR "key-ctx.pem"
@@ -70,6 +78,42 @@ static QCryptoTLSCreds *test_tls_creds_psk_create(
 }
 
 
+static void test_tls_session_handshake(QCryptoTLSSession *clientSess,
+                                       QCryptoTLSSession *serverSess)
+{
+    bool clientShake = false;
+    bool serverShake = false;
+
+    /*
+     * Loop around & around doing handshake on each session
+     * until we get an error, or the handshake completes.
+     * This relies on the sockets being nonblocking to avoid
+     * deadlocking ourselves upon handshake
+     */
+    do {
+        int rv;
+        if (!serverShake) {
+            rv = qcrypto_tls_session_handshake(serverSess,
+                                               &error_abort);
+            g_assert(rv >= 0);
+            if (qcrypto_tls_session_get_handshake_status(serverSess) ==
+                QCRYPTO_TLS_HANDSHAKE_COMPLETE) {
+                serverShake = true;
+            }
+        }
+        if (!clientShake) {
+            rv = qcrypto_tls_session_handshake(clientSess,
+                                               &error_abort);
+            g_assert(rv >= 0);
+            if (qcrypto_tls_session_get_handshake_status(clientSess) ==
+                QCRYPTO_TLS_HANDSHAKE_COMPLETE) {
+                clientShake = true;
+            }
+        }
+    } while (!clientShake || !serverShake);
+}
+
+
 static void test_crypto_tls_session_psk(void)
 {
     QCryptoTLSCreds *clientCreds;
@@ -77,8 +121,6 @@ static void test_crypto_tls_session_psk(void)
     QCryptoTLSSession *clientSess = NULL;
     QCryptoTLSSession *serverSess = NULL;
     int channel[2];
-    bool clientShake = false;
-    bool serverShake = false;
     int ret;
 
     /* We'll use this for our fake client-server connection */
@@ -124,34 +166,8 @@ static void test_crypto_tls_session_psk(void)
                                       testWrite, testRead,
                                       &channel[1]);
 
-    /*
-     * Finally we loop around & around doing handshake on each
-     * session until we get an error, or the handshake completes.
-     * This relies on the socketpair being nonblocking to avoid
-     * deadlocking ourselves upon handshake
-     */
-    do {
-        int rv;
-        if (!serverShake) {
-            rv = qcrypto_tls_session_handshake(serverSess,
-                                               &error_abort);
-            g_assert(rv >= 0);
-            if (qcrypto_tls_session_get_handshake_status(serverSess) ==
-                QCRYPTO_TLS_HANDSHAKE_COMPLETE) {
-                serverShake = true;
-            }
-        }
-        if (!clientShake) {
-            rv = qcrypto_tls_session_handshake(clientSess,
-                                               &error_abort);
-            g_assert(rv >= 0);
-            if (qcrypto_tls_session_get_handshake_status(clientSess) ==
-                QCRYPTO_TLS_HANDSHAKE_COMPLETE) {
-                clientShake = true;
-            }
-        }
-    } while (!clientShake || !serverShake);
-
+    /* Finally we do the handshake on both sessions */
+    test_tls_session_handshake(clientSess, serverSess);
 
     /* Finally make sure the server & client validation is successful. */
     g_assert(qcrypto_tls_session_check_credentials(serverSess,
@@ -170,6 +186,143 @@ static void test_crypto_tls_session_psk(void)
 }
 
 
+#ifdef CONFIG_LINUX_TLS_H
+static void test_ktls_send_record(int fd, uint8_t type,
+                                  const void *data, size_t len)
+{
+    char control[CMSG_SPACE(sizeof(type))];
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(type));
+    *CMSG_DATA(cmsg) = type;
+
+    g_assert_cmpint(sendmsg(fd, &msg, 0), ==, len);
+}
+
+/*
+ * The client hands its receive side to the kernel, and the
+ * server injects control records through its kernel transmit
+ * side in between application data.
+ */
+static void test_crypto_tls_session_ktls(void)
+{
+    static const uint8_t tickets[] = {
+        4, 0, 0, 2, 0xaa, 0xbb,       /* NewSessionTicket */
+        4, 0, 0, 0,                   /* NewSessionTicket */
+    };
+    static const uint8_t key_update[] = { 24, 0, 0, 1, 0 };
+    static const uint8_t close_notify[] = { 1, 0 };
+    QCryptoTLSCreds *clientCreds;
+    QCryptoTLSCreds *serverCreds;
+    QCryptoTLSSession *clientSess = NULL;
+    QCryptoTLSSession *serverSess = NULL;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    Error *err = NULL;
+    int channel[2];
+    int listener;
+    char *buf;
+
+    /* Kernel TLS needs a TCP connection */
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(listener >= 0);
+    g_assert(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(listener, (struct sockaddr *)&addr, &addrlen) == 0);
+    g_assert(listen(listener, 1) == 0);
+    channel[1] = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(channel[1] >= 0);
+    g_assert(connect(channel[1], (struct sockaddr *)&addr, addrlen) == 0);
+    channel[0] = accept(listener, NULL, NULL);
+    g_assert(channel[0] >= 0);
+    close(listener);
+
+    qemu_socket_set_nonblock(channel[0]);
+    qemu_socket_set_nonblock(channel[1]);
+
+    clientCreds = test_tls_creds_psk_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
+        WORKDIR);
+    serverCreds = test_tls_creds_psk_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
+        WORKDIR);
+
+    clientSess = qcrypto_tls_session_new(
+        clientCreds, NULL, NULL,
+        QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT, &error_abort);
+    serverSess = qcrypto_tls_session_new(
+        serverCreds, NULL, NULL,
+        QCRYPTO_TLS_CREDS_ENDPOINT_SERVER, &error_abort);
+
+    qcrypto_tls_session_set_callbacks(serverSess,
+                                      testWrite, testRead,
+                                      &channel[0]);
+    qcrypto_tls_session_set_callbacks(clientSess,
+                                      testWrite, testRead,
+                                      &channel[1]);
+
+    test_tls_session_handshake(clientSess, serverSess);
+
+    if (qcrypto_tls_session_enable_ktls(serverSess, channel[0],
+                                        false, &err) < 0 ||
+        qcrypto_tls_session_enable_ktls(clientSess, channel[1],
+                                        true, &err) < 0) {
+        g_test_skip(error_get_pretty(err));
+        error_free(err);
+        goto cleanup;
+    }
+
+    qemu_socket_set_block(channel[0]);
+    qemu_socket_set_block(channel[1]);
+
+    test_ktls_send_record(channel[0], 22, tickets, sizeof(tickets));
+    g_assert_cmpint(write(channel[0], "hello", 5), ==, 5);
+    g_assert_cmpint(write(channel[0], "world", 5), ==, 5);
+    test_ktls_send_record(channel[0], 22, key_update, sizeof(key_update));
+    test_ktls_send_record(channel[0], 21, close_notify, sizeof(close_notify));
+
+    /* Short reads go through the session's bounce buffer */
+    buf = g_malloc(16384);
+    g_assert_cmpint(qcrypto_tls_session_read(clientSess, buf, 3), ==, 3);
+    g_assert(memcmp(buf, "hel", 3) == 0);
+    g_assert_cmpint(qcrypto_tls_session_check_pending(clientSess), ==, 2);
+    g_assert_cmpint(qcrypto_tls_session_read(clientSess, buf, 16), ==, 2);
+    g_assert(memcmp(buf, "lo", 2) == 0);
+
+    /* Large reads land directly in the caller's buffer */
+    g_assert_cmpint(qcrypto_tls_session_read(clientSess, buf, 16384), ==, 5);
+    g_assert(memcmp(buf, "world", 5) == 0);
+
+    g_assert_cmpint(qcrypto_tls_session_read(clientSess, buf, 16384), ==, -1);
+    g_assert_cmpint(errno, ==, ENOTSUP);
+
+    g_assert_cmpint(qcrypto_tls_session_read(clientSess, buf, 16), ==, 0);
+    g_free(buf);
+
+ cleanup:
+    object_unparent(OBJECT(serverCreds));
+    object_unparent(OBJECT(clientCreds));
+
+    qcrypto_tls_session_free(serverSess);
+    qcrypto_tls_session_free(clientSess);
+
+    close(channel[0]);
+    close(channel[1]);
+}
+#endif
+
+
 struct QCryptoTLSSessionTestData {
     const char *servercacrt;
     const char *clientcacrt;
@@ -406,6 +559,10 @@ int main(int argc, char **argv)
     /* Simple initial test using Pre-Shared Keys. */
     g_test_add_func("/qcrypto/tlssession/psk",
                     test_crypto_tls_session_psk);
+#ifdef CONFIG_LINUX_TLS_H
+    g_test_add_func("/qcrypto/tlssession/ktls",
+                    test_crypto_tls_session_ktls);
+#endif
 
     /* More complex tests using X.509 certificates. */
 # define TEST_SESS_REG(name, caCrt,                                     \
@@ -1042,6 +1042,48 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void hbitmap_test_merge_and_check(TestHBitmapData *data)
+{
+    HBitmap *b;
+    int64_t i;
+
+    /* Long runs of ones exercise the vectorized search for zeroes */
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, L2 + 3);
+    hbitmap_test_set(data, L2 * 2 + 5, 7 * L1);
+
+    b = hbitmap_alloc(data->size, 0);
+    hbitmap_set(b, L2 + 3, L1 * 3 - 9);
+    hbitmap_set(b, data->size - 3, 3);
+    for (i = L2 + 3; i < L2 + 3 + L1 * 3 - 9; i++) {
+        data->bits[i >> LOG_BITS_PER_LONG] |= 1UL << (i & (BITS_PER_LONG - 1));
+    }
+    for (i = data->size - 3; i < data->size; i++) {
+        data->bits[i >> LOG_BITS_PER_LONG] |= 1UL << (i & (BITS_PER_LONG - 1));
+    }
+
+    hbitmap_merge(data->hb, b, data->hb);
+    hbitmap_free(b);
+    hbitmap_test_check(data, 0);
+
+    for (i = 0; i < data->size; i += L2 - 1) {
+        test_hbitmap_next_x_check(data, i);
+    }
+
+    /* Bits past the end of the bitmap must not be counted */
+    hbitmap_deserialize_ones(data->hb, 0, data->size, true);
+    g_assert_cmpuint(hbitmap_count(data->hb), ==, data->size);
+
+    hbitmap_test_teardown(data, NULL);
+}
+
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    do {
+        hbitmap_test_merge_and_check(data);
+    } while (test_hbitmap_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1155,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    /* Must be last, it switches to the slowest kernels */
+    hbitmap_test_add("/hbitmap/merge/accel", test_hbitmap_accel);
+
     g_test_run();
 
     return 0;
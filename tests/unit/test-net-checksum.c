@@ -0,0 +1,135 @@
+/*
+ * Internet checksum tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE (64 * KiB + 64)
+
+static uint8_t *buf;
+
+/*
+ * Straightforward implementation of RFC 1071: add the data as big-endian
+ * 16-bit words, padding an odd trailing byte with zero, and fold.
+ */
+static uint32_t ref_checksum_add(const uint8_t *data, size_t len)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (i < len) {
+        sum += data[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static void test_lengths(void)
+{
+    /* Cover the scalar tail and the vector kernels, odd lengths included */
+    static const size_t big[] = { 1499, 1500, 9001, 64 * KiB - 1, 64 * KiB };
+    size_t off, len;
+    int i;
+
+    for (off = 0; off < 16; off++) {
+        for (len = 0; len <= 300; len++) {
+            g_assert_cmphex(net_checksum_add(len, buf + off), ==,
+                            ref_checksum_add(buf + off, len));
+        }
+        for (i = 0; i < ARRAY_SIZE(big); i++) {
+            g_assert_cmphex(net_checksum_add(big[i], buf + off), ==,
+                            ref_checksum_add(buf + off, big[i]));
+        }
+    }
+}
+
+static void test_cont(void)
+{
+    size_t len = 1500, split;
+
+    /* Data that starts at an odd offset in the packet */
+    for (split = 0; split <= 130; split++) {
+        uint32_t sum;
+
+        sum = net_checksum_add_cont(split, buf + 1, 0) +
+              net_checksum_add_cont(len - split, buf + 1 + split, split);
+        g_assert_cmphex(net_checksum_finish(sum), ==,
+                        net_checksum_finish(ref_checksum_add(buf + 1, len)));
+    }
+}
+
+static void test_iov(void)
+{
+    struct iovec iov[8];
+    uint8_t *flat = g_malloc(BUF_SIZE);
+    int round;
+
+    for (round = 0; round < 200; round++) {
+        size_t pos = g_test_rand_int_range(0, 16);
+        size_t total = 0;
+        uint32_t iov_off, size, sum;
+        int i;
+
+        /* Random, mostly odd, chunk sizes at random alignments */
+        for (i = 0; i < ARRAY_SIZE(iov); i++) {
+            size_t len = g_test_rand_int_range(1, 2 * KiB);
+
+            iov[i].iov_base = buf + pos;
+            iov[i].iov_len = len;
+            pos += len + g_test_rand_int_range(0, 4);
+            total += len;
+        }
+
+        iov_off = g_test_rand_int_range(0, total / 2);
+        size = g_test_rand_int_range(0, total - iov_off + 1);
+
+        iov_to_buf(iov, ARRAY_SIZE(iov), 0, flat, total);
+        sum = net_checksum_add_iov(iov, ARRAY_SIZE(iov), iov_off, size, 0);
+        g_assert_cmphex(net_checksum_finish(sum), ==,
+                        net_checksum_finish(ref_checksum_add(flat + iov_off,
+                                                             size)));
+    }
+
+    g_free(flat);
+}
+
+static void test_checksum(void)
+{
+    /* Check each implementation of the vectorized kernel */
+    do {
+        test_lengths();
+        test_cont();
+        test_iov();
+    } while (test_net_checksum_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    buf = g_malloc(BUF_SIZE);
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf[i] = g_test_rand_int();
+    }
+
+    g_test_add_func("/net/checksum", test_checksum);
+    ret = g_test_run();
+
+    g_free(buf);
+    return ret;
+}
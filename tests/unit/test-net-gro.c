@@ -0,0 +1,391 @@
+/*
+ * Generic receive offload tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/gro.h"
+#include "standard-headers/linux/virtio_net.h"
+
+#define MSS             1000
+#define IP4_HDR_LEN     (ETH_HLEN + sizeof(struct ip_header))
+#define IP6_HDR_LEN     (ETH_HLEN + sizeof(struct ip6_header))
+#define TCP_HDR_LEN     sizeof(struct tcp_header)
+#define FRAME_SIZE      (IP6_HDR_LEN + TCP_HDR_LEN + 0x10000)
+
+/* A packet passed to the output function */
+typedef struct Output {
+    uint8_t *buf;
+    size_t size;
+    bool merged;
+    NetGROInfo info;
+} Output;
+
+static GArray *outputs;
+static bool refuse;
+static uint8_t payload[0x10000];
+
+static ssize_t output(void *opaque, const uint8_t *buf, size_t size,
+                      const NetGROInfo *info)
+{
+    Output o = {
+        .size = size,
+        .merged = info,
+    };
+
+    if (refuse) {
+        return 0;
+    }
+    o.buf = g_memdup2(buf, size);
+    if (info) {
+        o.info = *info;
+    }
+    g_array_append_val(outputs, o);
+    return size;
+}
+
+static void clear_outputs(void)
+{
+    int i;
+
+    for (i = 0; i < outputs->len; i++) {
+        g_free(g_array_index(outputs, Output, i).buf);
+    }
+    g_array_set_size(outputs, 0);
+}
+
+static NetGRO *gro_new(void)
+{
+    clear_outputs();
+    refuse = false;
+    return net_gro_new(qemu_get_aio_context(), 10 * SCALE_MS,
+                       NET_GRO_F_TCPV4 | NET_GRO_F_TCPV6, output, NULL);
+}
+
+static uint32_t pseudo_sum(const uint8_t *frame, bool ipv6, uint16_t l4_len)
+{
+    if (ipv6) {
+        return net_checksum_add(32, (uint8_t *)frame + ETH_HLEN +
+                                offsetof(struct ip6_header, ip6_src)) +
+               IP_PROTO_TCP + l4_len;
+    }
+    return net_checksum_add(8, (uint8_t *)frame + ETH_HLEN +
+                            offsetof(struct ip_header, ip_src)) +
+           IP_PROTO_TCP + l4_len;
+}
+
+/*
+ * Build a TCP segment with valid checksums carrying @len bytes of
+ * @payload from offset @seq.  Returns the size of the frame.
+ */
+static size_t build_segment(uint8_t *frame, bool ipv6, uint32_t seq,
+                            size_t len, uint8_t flags)
+{
+    size_t l4_off = ipv6 ? IP6_HDR_LEN : IP4_HDR_LEN;
+    uint16_t l4_len = TCP_HDR_LEN + len;
+    struct eth_header *eh = (struct eth_header *)frame;
+    struct tcp_header *tcp = (struct tcp_header *)(frame + l4_off);
+
+    memset(frame, 0, l4_off + TCP_HDR_LEN);
+    memset(eh->h_dest, 0x02, ETH_ALEN);
+    memset(eh->h_source, 0x04, ETH_ALEN);
+
+    if (ipv6) {
+        struct ip6_header *ip6 = (struct ip6_header *)(eh + 1);
+
+        stw_be_p(&eh->h_proto, ETH_P_IPV6);
+        ip6->ip6_ctlun.ip6_un2_vfc = IP_HEADER_VERSION_6 << 4;
+        stw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen, l4_len);
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IP_PROTO_TCP;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = 64;
+        ip6->ip6_src.s6_addr[0] = 0xfd;
+        ip6->ip6_src.s6_addr[15] = 1;
+        ip6->ip6_dst.s6_addr[0] = 0xfd;
+        ip6->ip6_dst.s6_addr[15] = 2;
+    } else {
+        struct ip_header *ip = (struct ip_header *)(eh + 1);
+
+        stw_be_p(&eh->h_proto, ETH_P_IP);
+        ip->ip_ver_len = IP_HEADER_VERSION_4 << 4 | sizeof(*ip) >> 2;
+        stw_be_p(&ip->ip_len, sizeof(*ip) + l4_len);
+        ip->ip_ttl = 64;
+        ip->ip_p = IP_PROTO_TCP;
+        stl_be_p(&ip->ip_src, 0x0a000001);
+        stl_be_p(&ip->ip_dst, 0x0a000002);
+        stw_be_p(&ip->ip_sum, net_raw_checksum((uint8_t *)ip, sizeof(*ip)));
+    }
+
+    stw_be_p(&tcp->th_sport, 12345);
+    stw_be_p(&tcp->th_dport, 80);
+    stl_be_p(&tcp->th_seq, seq);
+    stl_be_p(&tcp->th_ack, 1);
+    stw_be_p(&tcp->th_offset_flags, (TCP_HDR_LEN / 4) << 12 | flags);
+    stw_be_p(&tcp->th_win, 1000);
+    memcpy(tcp + 1, payload + seq, len);
+
+    stw_be_p(&tcp->th_sum,
+             net_checksum_finish(pseudo_sum(frame, ipv6, l4_len) +
+                                 net_checksum_add(l4_len, (uint8_t *)tcp)));
+    return l4_off + l4_len;
+}
+
+static int receive_segment(NetGRO *gro, bool ipv6, uint32_t seq, size_t len,
+                           uint8_t flags)
+{
+    g_autofree uint8_t *frame = g_malloc(FRAME_SIZE);
+    size_t size = build_segment(frame, ipv6, seq, len, flags);
+
+    return net_gro_receive(gro, frame, size);
+}
+
+/*
+ * Check that output @i is a packet with @nsegs segments of @mss bytes
+ * that carries the payload from offset @seq, and complete its checksum
+ * as the guest would for VIRTIO_NET_HDR_F_NEEDS_CSUM.
+ */
+static uint8_t output_tcp_flags(int i, bool ipv6)
+{
+    Output *o = &g_array_index(outputs, Output, i);
+    struct tcp_header *tcp = (struct tcp_header *)
+        (o->buf + (ipv6 ? IP6_HDR_LEN : IP4_HDR_LEN));
+
+    return lduw_be_p(&tcp->th_offset_flags) & 0xff;
+}
+
+static void check_output(int i, bool ipv6, uint32_t seq, size_t len,
+                         unsigned nsegs, size_t mss)
+{
+    Output *o = &g_array_index(outputs, Output, i);
+    size_t l4_off = ipv6 ? IP6_HDR_LEN : IP4_HDR_LEN;
+    uint16_t l4_len = o->size - l4_off;
+    struct tcp_header *tcp = (struct tcp_header *)(o->buf + l4_off);
+    uint32_t sum;
+
+    g_assert_cmpint(o->size, ==, l4_off + TCP_HDR_LEN + len);
+    g_assert_cmpint(ldl_be_p(&tcp->th_seq), ==, seq);
+    g_assert_cmpmem(tcp + 1, len, payload + seq, len);
+
+    if (ipv6) {
+        struct ip6_header *ip6 = (struct ip6_header *)(o->buf + ETH_HLEN);
+
+        g_assert_cmpint(lduw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen), ==,
+                        l4_len);
+    } else {
+        struct ip_header *ip = (struct ip_header *)(o->buf + ETH_HLEN);
+
+        g_assert_cmpint(lduw_be_p(&ip->ip_len), ==,
+                        sizeof(*ip) + l4_len);
+        g_assert_cmphex(net_raw_checksum((uint8_t *)ip, sizeof(*ip)), ==, 0);
+    }
+
+    if (nsegs == 1) {
+        g_assert_false(o->merged);
+    } else {
+        g_assert_true(o->merged);
+        g_assert_cmpint(o->info.gso_type, ==,
+                        ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                             : VIRTIO_NET_HDR_GSO_TCPV4);
+        g_assert_cmpint(o->info.gso_size, ==, mss);
+        g_assert_cmpint(o->info.hdr_len, ==, l4_off + TCP_HDR_LEN);
+        g_assert_cmpint(o->info.segments, ==, nsegs);
+        g_assert_cmpint(o->info.csum_start, ==, l4_off);
+        g_assert_cmpint(o->info.csum_offset, ==,
+                        offsetof(struct tcp_header, th_sum));
+
+        /* The checksum field holds the pseudo-header checksum */
+        sum = net_checksum_add(l4_len, (uint8_t *)tcp);
+        stw_be_p(&tcp->th_sum, net_checksum_finish(sum));
+    }
+
+    sum = pseudo_sum(o->buf, ipv6, l4_len) +
+          net_checksum_add(l4_len, (uint8_t *)tcp);
+    g_assert_cmphex(net_checksum_finish(sum), ==, 0);
+}
+
+static void test_merge(const void *opaque)
+{
+    bool ipv6 = GPOINTER_TO_INT(opaque);
+    NetGRO *gro = gro_new();
+    NetGROStats stats;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpint(receive_segment(gro, ipv6, i * MSS, MSS, TH_ACK),
+                        ==, 1);
+    }
+    g_assert_cmpint(outputs->len, ==, 0);
+
+    g_assert_true(net_gro_flush(gro));
+    g_assert_cmpint(outputs->len, ==, 1);
+    check_output(0, ipv6, 0, 4 * MSS, 4, MSS);
+
+    net_gro_get_stats(gro, &stats);
+    g_assert_cmpint(stats.received, ==, 4);
+    g_assert_cmpint(stats.coalesced, ==, 3);
+    g_assert_cmpint(stats.flushed, ==, 1);
+    net_gro_free(gro);
+}
+
+/* A held packet is flushed once it can not grow further */
+static void test_max_size(void)
+{
+    NetGRO *gro = gro_new();
+    int i, n = (0xffff - sizeof(struct ip_header) - TCP_HDR_LEN) / MSS;
+
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(receive_segment(gro, false, i * MSS, MSS, TH_ACK),
+                        ==, 1);
+    }
+    g_assert_cmpint(outputs->len, ==, 1);
+    check_output(0, false, 0, n * MSS, n, MSS);
+    net_gro_free(gro);
+}
+
+static void test_psh(void)
+{
+    NetGRO *gro = gro_new();
+
+    /* Not delayed if there is nothing to merge with */
+    g_assert_cmpint(receive_segment(gro, false, 0, MSS, TH_ACK | TH_PUSH),
+                    ==, 0);
+    g_assert_cmpint(outputs->len, ==, 0);
+
+    /* Merged and flushed right away */
+    g_assert_cmpint(receive_segment(gro, false, MSS, MSS, TH_ACK), ==, 1);
+    g_assert_cmpint(receive_segment(gro, false, 2 * MSS, MSS,
+                                    TH_ACK | TH_PUSH), ==, 1);
+    g_assert_cmpint(outputs->len, ==, 1);
+    check_output(0, false, MSS, 2 * MSS, 2, MSS);
+    g_assert_cmphex(output_tcp_flags(0, false), ==, TH_ACK | TH_PUSH);
+    net_gro_free(gro);
+}
+
+/* Segments that can not be merged go after the held packet of the flow */
+static void test_fin(void)
+{
+    NetGRO *gro = gro_new();
+
+    g_assert_cmpint(receive_segment(gro, false, 0, MSS, TH_ACK), ==, 1);
+    g_assert_cmpint(receive_segment(gro, false, MSS, MSS, TH_ACK), ==, 1);
+    g_assert_cmpint(receive_segment(gro, false, 2 * MSS, MSS,
+                                    TH_ACK | TH_FIN), ==, 0);
+    g_assert_cmpint(outputs->len, ==, 1);
+    check_output(0, false, 0, 2 * MSS, 2, MSS);
+    net_gro_free(gro);
+}
+
+static void test_out_of_order(void)
+{
+    NetGRO *gro = gro_new();
+
+    g_assert_cmpint(receive_segment(gro, false, 0, MSS, TH_ACK), ==, 1);
+    g_assert_cmpint(receive_segment(gro, false, 2 * MSS, MSS, TH_ACK), ==, 1);
+    g_assert_cmpint(outputs->len, ==, 1);
+    check_output(0, false, 0, MSS, 1, MSS);
+
+    /* A short segment ends the packet */
+    g_assert_cmpint(receive_segment(gro, false, 3 * MSS, MSS / 2, TH_ACK),
+                    ==, 1);
+    g_assert_cmpint(outputs->len, ==, 2);
+    check_output(1, false, 2 * MSS, MSS + MSS / 2, 2, MSS);
+    net_gro_free(gro);
+}
+
+static void test_bad_checksum(void)
+{
+    g_autofree uint8_t *frame = g_malloc(FRAME_SIZE);
+    NetGRO *gro = gro_new();
+    size_t size;
+
+    size = build_segment(frame, false, 0, MSS, TH_ACK);
+    frame[size - 1] ^= 1;
+    g_assert_cmpint(net_gro_receive(gro, frame, size), ==, 0);
+    g_assert_true(net_gro_flush(gro));
+    g_assert_cmpint(outputs->len, ==, 0);
+    net_gro_free(gro);
+}
+
+/* A packet that the receiver refuses is kept until it can be delivered */
+static void test_refused(void)
+{
+    NetGRO *gro = gro_new();
+    NetGROStats stats;
+
+    g_assert_cmpint(receive_segment(gro, false, 0, MSS, TH_ACK), ==, 1);
+    g_assert_cmpint(receive_segment(gro, false, MSS, MSS, TH_ACK), ==, 1);
+
+    refuse = true;
+    g_assert_false(net_gro_flush(gro));
+    g_assert_cmpint(receive_segment(gro, false, 2 * MSS, MSS, TH_ACK),
+                    ==, -EBUSY);
+    g_assert_false(net_gro_flush(gro));
+
+    refuse = false;
+    g_assert_true(net_gro_flush(gro));
+    g_assert_cmpint(outputs->len, ==, 1);
+    check_output(0, false, 0, 2 * MSS, 2, MSS);
+
+    g_assert_cmpint(receive_segment(gro, false, 2 * MSS, MSS, TH_ACK), ==, 1);
+    g_assert_true(net_gro_flush(gro));
+    g_assert_cmpint(outputs->len, ==, 2);
+    check_output(1, false, 2 * MSS, MSS, 1, MSS);
+
+    net_gro_get_stats(gro, &stats);
+    g_assert_cmpint(stats.refused, ==, 2);
+    g_assert_cmpint(stats.flushed, ==, 2);
+    g_assert_cmpint(stats.dropped, ==, 0);
+    net_gro_free(gro);
+}
+
+static void test_timer(void)
+{
+    NetGRO *gro = gro_new();
+    NetGROStats stats;
+
+    g_assert_cmpint(receive_segment(gro, false, 0, MSS, TH_ACK), ==, 1);
+    while (!outputs->len) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    check_output(0, false, 0, MSS, 1, MSS);
+
+    net_gro_get_stats(gro, &stats);
+    g_assert_cmpint(stats.timer_flushes, ==, 1);
+    net_gro_free(gro);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    g_test_init(&argc, &argv, NULL);
+    qemu_init_main_loop(&error_abort);
+    qemu_clock_enable(QEMU_CLOCK_VIRTUAL, true);
+
+    outputs = g_array_new(false, false, sizeof(Output));
+    for (i = 0; i < sizeof(payload); i++) {
+        payload[i] = g_test_rand_int();
+    }
+
+    g_test_add_data_func("/net/gro/merge/ipv4", GINT_TO_POINTER(false),
+                         test_merge);
+    g_test_add_data_func("/net/gro/merge/ipv6", GINT_TO_POINTER(true),
+                         test_merge);
+    g_test_add_func("/net/gro/max-size", test_max_size);
+    g_test_add_func("/net/gro/flush/psh", test_psh);
+    g_test_add_func("/net/gro/flush/fin", test_fin);
+    g_test_add_func("/net/gro/flush/out-of-order", test_out_of_order);
+    g_test_add_func("/net/gro/flush/timer", test_timer);
+    g_test_add_func("/net/gro/bad-checksum", test_bad_checksum);
+    g_test_add_func("/net/gro/refused", test_refused);
+
+    return g_test_run();
+}
@@ -0,0 +1,359 @@
+/*
+ * Network packet queue tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+#define NPKTS 4
+
+static NetClientState sender;
+static bool can_send;
+
+/* Ids of the delivered packets, in order */
+static GByteArray *delivered;
+static int batch_calls;
+static int batch_accept;
+static bool accept_iov;
+
+static int sent_calls;
+static ssize_t sent_ret;
+
+/* Flags of the last packet passed to deliver() */
+static unsigned deliver_flags;
+/* If set, deliver() keeps a reference to the packet, like filter-buffer */
+static bool keep;
+static NetPacketBuf *kept;
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    g_assert(nc == &sender);
+    return can_send;
+}
+
+/* Every packet is two bytes: its id and the packet size */
+static void record(const struct iovec *iov, int iovcnt)
+{
+    uint8_t data[2];
+
+    g_assert_cmpint(iov_size(iov, iovcnt), ==, sizeof(data));
+    iov_to_buf(iov, iovcnt, 0, data, sizeof(data));
+    g_assert_cmpint(data[1], ==, sizeof(data));
+    g_byte_array_append(delivered, data, 1);
+}
+
+static ssize_t deliver(NetClientState *nc, unsigned flags,
+                       const struct iovec *iov, int iovcnt, void *opaque)
+{
+    g_assert(nc == &sender);
+    if (!accept_iov) {
+        return 0;
+    }
+    record(iov, iovcnt);
+    deliver_flags = flags;
+    if (keep) {
+        g_assert_null(kept);
+        kept = net_packet_buf_get(flags, iov, iovcnt);
+    }
+    return iov_size(iov, iovcnt);
+}
+
+static int deliver_batch(NetClientState *nc, unsigned flags,
+                         const NetPacketIov *pkts, int npkts, void *opaque)
+{
+    int i, n = MIN(npkts, batch_accept);
+
+    g_assert(nc == &sender);
+    batch_calls++;
+    for (i = 0; i < n; i++) {
+        record(pkts[i].iov, pkts[i].iovcnt);
+    }
+    return n;
+}
+
+static void sent_cb(NetClientState *nc, ssize_t ret)
+{
+    g_assert(nc == &sender);
+    sent_calls++;
+    sent_ret = ret;
+}
+
+/* Packet data is split across two iovecs */
+static uint8_t pkt_data[NPKTS][2];
+static struct iovec pkt_iov[NPKTS][2];
+static NetPacketIov batch[NPKTS];
+
+static NetQueue *setup(void)
+{
+    int i;
+
+    for (i = 0; i < NPKTS; i++) {
+        pkt_data[i][0] = i;
+        pkt_data[i][1] = sizeof(pkt_data[i]);
+        pkt_iov[i][0] = (struct iovec) { &pkt_data[i][0], 1 };
+        pkt_iov[i][1] = (struct iovec) { &pkt_data[i][1], 1 };
+        batch[i] = (NetPacketIov) { pkt_iov[i], 2 };
+    }
+
+    can_send = true;
+    accept_iov = true;
+    batch_accept = NPKTS;
+    batch_calls = 0;
+    sent_calls = 0;
+    sent_ret = -1;
+    deliver_flags = 0;
+    keep = false;
+    kept = NULL;
+    g_byte_array_set_size(delivered, 0);
+
+    return qemu_new_net_queue(deliver, NULL);
+}
+
+static void assert_delivered(const char *ids, size_t n)
+{
+    g_assert_cmpmem(delivered->data, delivered->len, ids, n);
+}
+
+static void test_send_batch(void)
+{
+    NetQueue *queue = setup();
+
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &sender, 0, batch, NPKTS,
+                                              deliver_batch, sent_cb),
+                    ==, NPKTS);
+    g_assert_cmpint(batch_calls, ==, 1);
+    g_assert_cmpint(sent_calls, ==, 0);
+    assert_delivered("\0\1\2\3", 4);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_send_batch_partial(void)
+{
+    NetQueue *queue = setup();
+
+    /* The first packet that is not delivered is queued */
+    batch_accept = 2;
+    accept_iov = false;
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &sender, 0, batch, NPKTS,
+                                              deliver_batch, sent_cb),
+                    ==, 2);
+    assert_delivered("\0\1", 2);
+
+    /* ... and @sent_cb is called once it is */
+    g_assert_false(qemu_net_queue_flush(queue));
+    g_assert_cmpint(sent_calls, ==, 0);
+
+    accept_iov = true;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(sent_calls, ==, 1);
+    g_assert_cmpint(sent_ret, ==, 2);
+    assert_delivered("\0\1\2", 3);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_send_batch_no_cb(void)
+{
+    NetQueue *queue = setup();
+
+    /* Without a callback all the remaining packets are queued */
+    batch_accept = 1;
+    accept_iov = false;
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &sender, 0, batch, NPKTS,
+                                              deliver_batch, NULL),
+                    ==, NPKTS);
+    assert_delivered("\0", 1);
+
+    accept_iov = true;
+    g_assert_true(qemu_net_queue_flush(queue));
+    assert_delivered("\0\1\2\3", 4);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_send_batch_cannot_send(void)
+{
+    NetQueue *queue = setup();
+
+    can_send = false;
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &sender, 0, batch, NPKTS,
+                                              deliver_batch, sent_cb),
+                    ==, 0);
+    g_assert_cmpint(batch_calls, ==, 0);
+    g_assert_cmpint(delivered->len, ==, 0);
+
+    can_send = true;
+    g_assert_true(qemu_net_queue_flush(queue));
+    g_assert_cmpint(sent_calls, ==, 1);
+    assert_delivered("\0", 1);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_send_batch_flush(void)
+{
+    NetQueue *queue = setup();
+
+    /* Packets queued before are flushed after a successful batch */
+    can_send = false;
+    g_assert_cmpint(qemu_net_queue_send_iov(queue, &sender, 0, pkt_iov[3], 2,
+                                            NULL),
+                    ==, 0);
+
+    can_send = true;
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &sender, 0, batch, 3,
+                                              deliver_batch, sent_cb),
+                    ==, 3);
+    assert_delivered("\0\1\2\3", 4);
+
+    qemu_del_net_queue(queue);
+}
+
+/* A receiver that sends a batch while it is being delivered to */
+static NetQueue *reentrant_queue;
+
+static int deliver_batch_reentrant(NetClientState *nc, unsigned flags,
+                                   const NetPacketIov *pkts, int npkts,
+                                   void *opaque)
+{
+    /* The nested batch is queued, it must not overtake this one */
+    g_assert_cmpint(qemu_net_queue_send_batch(reentrant_queue, &sender, 0,
+                                              batch + 2, 2, deliver_batch,
+                                              NULL),
+                    ==, 2);
+    g_assert_cmpint(batch_calls, ==, 0);
+    return deliver_batch(nc, flags, pkts, npkts, opaque);
+}
+
+static void test_send_batch_reentrant(void)
+{
+    NetQueue *queue = setup();
+
+    reentrant_queue = queue;
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &sender, 0, batch, 2,
+                                              deliver_batch_reentrant, NULL),
+                    ==, 2);
+    assert_delivered("\0\1\2\3", 4);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_buf_get(void)
+{
+    NetQueue *queue = setup();
+    NetPacketBuf *buf, *shared;
+    struct iovec iov;
+
+    /* A packet that is not shared is copied */
+    buf = net_packet_buf_get(0, pkt_iov[1], 2);
+    g_assert_cmpint(buf->refcnt, ==, 1);
+    g_assert_cmpmem(buf->data, buf->size, pkt_data[1], sizeof(pkt_data[1]));
+
+    /* A shared one gets a reference to the buffer that backs it */
+    iov = (struct iovec) { buf->data, buf->size };
+    shared = net_packet_buf_get(QEMU_NET_PACKET_FLAG_SHARED, &iov, 1);
+    g_assert(shared == buf);
+    g_assert_cmpint(buf->refcnt, ==, 2);
+
+    net_packet_buf_unref(shared);
+    g_assert_cmpint(buf->refcnt, ==, 1);
+    net_packet_buf_unref(buf);
+    net_packet_buf_unref(NULL);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_append_buf(void)
+{
+    NetQueue *queue = setup();
+    NetPacketBuf *buf = net_packet_buf_get(0, pkt_iov[2], 2);
+
+    /* The queue holds its own reference */
+    qemu_net_queue_append_buf(queue, &sender, 0, buf, sent_cb);
+    g_assert_cmpint(buf->refcnt, ==, 2);
+
+    /* ... which it keeps until the packet is delivered */
+    accept_iov = false;
+    g_assert_false(qemu_net_queue_flush(queue));
+    g_assert_cmpint(buf->refcnt, ==, 2);
+
+    /* The receiver can share the buffer instead of copying it */
+    accept_iov = true;
+    keep = true;
+    g_assert_true(qemu_net_queue_flush(queue));
+    assert_delivered("\2", 1);
+    g_assert_cmphex(deliver_flags, ==, QEMU_NET_PACKET_FLAG_SHARED);
+    g_assert(kept == buf);
+    g_assert_cmpint(sent_calls, ==, 1);
+    g_assert_cmpint(sent_ret, ==, 2);
+    g_assert_cmpint(buf->refcnt, ==, 2);
+    net_packet_buf_unref(kept);
+
+    /* Deleting the queue drops the references of the queued packets */
+    qemu_net_queue_append_buf(queue, &sender, 0, buf, NULL);
+    g_assert_cmpint(buf->refcnt, ==, 2);
+    qemu_del_net_queue(queue);
+    g_assert_cmpint(buf->refcnt, ==, 1);
+
+    net_packet_buf_unref(buf);
+}
+
+/* A queue that copies a shared packet does not pass it on as shared */
+static void test_append_iov_shared(void)
+{
+    NetQueue *queue = setup();
+    NetPacketBuf *buf = net_packet_buf_get(0, pkt_iov[3], 2);
+    struct iovec iov = { buf->data, buf->size };
+
+    can_send = false;
+    g_assert_cmpint(qemu_net_queue_send_iov(queue, &sender,
+                                            QEMU_NET_PACKET_FLAG_SHARED,
+                                            &iov, 1, NULL),
+                    ==, 0);
+    g_assert_cmpint(buf->refcnt, ==, 1);
+    net_packet_buf_unref(buf);
+
+    can_send = true;
+    keep = true;
+    g_assert_true(qemu_net_queue_flush(queue));
+    assert_delivered("\3", 1);
+    g_assert_cmphex(deliver_flags, ==, 0);
+    g_assert(kept != buf);
+    g_assert_cmpint(kept->refcnt, ==, 1);
+    net_packet_buf_unref(kept);
+
+    qemu_del_net_queue(queue);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    delivered = g_byte_array_new();
+
+    g_test_add_func("/net/queue/send-batch", test_send_batch);
+    g_test_add_func("/net/queue/send-batch/partial", test_send_batch_partial);
+    g_test_add_func("/net/queue/send-batch/no-cb", test_send_batch_no_cb);
+    g_test_add_func("/net/queue/send-batch/cannot-send",
+                    test_send_batch_cannot_send);
+    g_test_add_func("/net/queue/send-batch/flush", test_send_batch_flush);
+    g_test_add_func("/net/queue/send-batch/reentrant",
+                    test_send_batch_reentrant);
+    g_test_add_func("/net/queue/buf/get", test_buf_get);
+    g_test_add_func("/net/queue/buf/append", test_append_buf);
+    g_test_add_func("/net/queue/buf/append-iov-shared",
+                    test_append_iov_shared);
+    ret = g_test_run();
+
+    g_byte_array_unref(delivered);
+    return ret;
+}
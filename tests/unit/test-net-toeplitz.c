@@ -0,0 +1,232 @@
+/*
+ * Toeplitz RSS hash tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/eth.h"
+#include "net/toeplitz.h"
+#include "../hw/net/net_rx_pkt.h"
+
+/* Key and vectors of the Microsoft RSS verification suite */
+static const uint8_t key[NET_TOEPLITZ_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct RssVector {
+    bool ipv6;
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t ip_hash;
+    uint32_t l4_hash;
+} RssVector;
+
+static const RssVector vectors[] = {
+    { false, { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { false, { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { false, { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { false, { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { false, { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+    /* 3ffe:2501:200:1fff::7 -> 3ffe:2501:200:3::1 */
+    { true,
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+        0, 0, 0, 0, 0, 0, 0, 0x07 },
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+        0, 0, 0, 0, 0, 0, 0, 0x01 },
+      2794, 1766, 0x2cc18cd5, 0x40207d3d },
+    /* 3ffe:501:8::260:97ff:fe40:efab -> ff02::1 */
+    { true,
+      { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+        0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+      { 0xff, 0x02, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0x01 },
+      14230, 4739, 0x0f0c461c, 0xdde51bbf },
+    /* 3ffe:1900:4545:3:200:f8ff:fe21:67cf -> fe80::200:f8ff:fe21:67cf */
+    { true,
+      { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      44251, 38024, 0x4b61e985, 0x02d1feef },
+};
+
+static void test_hash(void)
+{
+    g_autofree NetToeplitz *t = g_new0(NetToeplitz, 1);
+    uint8_t input[NET_TOEPLITZ_INPUT_MAX];
+    size_t addr_len, len;
+    int i;
+
+    net_toeplitz_set_key(t, key);
+    for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+        const RssVector *v = &vectors[i];
+
+        addr_len = v->ipv6 ? 16 : 4;
+        memcpy(input, v->src, addr_len);
+        memcpy(input + addr_len, v->dst, addr_len);
+        len = 2 * addr_len;
+        g_assert_cmphex(net_toeplitz_hash(t, input, len), ==, v->ip_hash);
+
+        stw_be_p(input + len, v->sport);
+        stw_be_p(input + len + 2, v->dport);
+        g_assert_cmphex(net_toeplitz_hash(t, input, len + 4), ==,
+                        v->l4_hash);
+    }
+}
+
+/* Setting a key again only rebuilds the tables if it changed */
+static void test_set_key(void)
+{
+    g_autofree NetToeplitz *t = g_new0(NetToeplitz, 1);
+    uint8_t other[NET_TOEPLITZ_KEY_SIZE];
+    const RssVector *v = &vectors[0];
+    uint8_t input[8];
+
+    memcpy(input, v->src, 4);
+    memcpy(input + 4, v->dst, 4);
+
+    memset(other, 0, sizeof(other));
+    net_toeplitz_set_key(t, other);
+    g_assert_cmphex(net_toeplitz_hash(t, input, sizeof(input)), ==, 0);
+
+    net_toeplitz_set_key(t, key);
+    g_assert_cmphex(net_toeplitz_hash(t, input, sizeof(input)), ==,
+                    v->ip_hash);
+    net_toeplitz_set_key(t, key);
+    g_assert_cmphex(net_toeplitz_hash(t, input, sizeof(input)), ==,
+                    v->ip_hash);
+}
+
+static size_t build_frame(uint8_t *frame, const RssVector *v, uint8_t proto)
+{
+    struct eth_header *eh = (struct eth_header *)frame;
+    size_t l4_off, l4_len;
+
+    l4_len = proto == IP_PROTO_TCP ? sizeof(struct tcp_header)
+                                   : sizeof(struct udp_header);
+
+    memset(frame, 0, ETH_HLEN);
+    if (v->ipv6) {
+        struct ip6_header *ip6 = (struct ip6_header *)(eh + 1);
+
+        stw_be_p(&eh->h_proto, ETH_P_IPV6);
+        memset(ip6, 0, sizeof(*ip6));
+        ip6->ip6_ctlun.ip6_un2_vfc = IP_HEADER_VERSION_6 << 4;
+        stw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen, l4_len);
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = proto;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = 64;
+        memcpy(&ip6->ip6_src, v->src, sizeof(ip6->ip6_src));
+        memcpy(&ip6->ip6_dst, v->dst, sizeof(ip6->ip6_dst));
+        l4_off = ETH_HLEN + sizeof(*ip6);
+    } else {
+        struct ip_header *ip = (struct ip_header *)(eh + 1);
+
+        stw_be_p(&eh->h_proto, ETH_P_IP);
+        memset(ip, 0, sizeof(*ip));
+        ip->ip_ver_len = IP_HEADER_VERSION_4 << 4 | sizeof(*ip) >> 2;
+        stw_be_p(&ip->ip_len, sizeof(*ip) + l4_len);
+        ip->ip_ttl = 64;
+        ip->ip_p = proto;
+        memcpy(&ip->ip_src, v->src, sizeof(ip->ip_src));
+        memcpy(&ip->ip_dst, v->dst, sizeof(ip->ip_dst));
+        l4_off = ETH_HLEN + sizeof(*ip);
+    }
+
+    memset(frame + l4_off, 0, l4_len);
+    if (proto == IP_PROTO_TCP) {
+        struct tcp_header *tcp = (struct tcp_header *)(frame + l4_off);
+
+        stw_be_p(&tcp->th_sport, v->sport);
+        stw_be_p(&tcp->th_dport, v->dport);
+        stw_be_p(&tcp->th_offset_flags,
+                 (sizeof(*tcp) / 4) << 12 | TH_ACK);
+    } else {
+        struct udp_header *udp = (struct udp_header *)(frame + l4_off);
+
+        stw_be_p(&udp->uh_sport, v->sport);
+        stw_be_p(&udp->uh_dport, v->dport);
+        stw_be_p(&udp->uh_ulen, l4_len);
+    }
+
+    return l4_off + l4_len;
+}
+
+/* The input that net_rx_pkt builds from the parsed headers */
+static void test_rx_pkt(void)
+{
+    g_autofree NetToeplitz *t = g_new0(NetToeplitz, 1);
+    uint8_t frame[ETH_HLEN + sizeof(struct ip6_header) +
+                  sizeof(struct tcp_header)];
+    struct NetRxPkt *pkt;
+    size_t size;
+    int i;
+
+    net_toeplitz_set_key(t, key);
+    net_rx_pkt_init(&pkt);
+
+    for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+        const RssVector *v = &vectors[i];
+
+        size = build_frame(frame, v, IP_PROTO_TCP);
+        net_rx_pkt_attach_data(pkt, frame, size, false);
+        if (v->ipv6) {
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV6, t),
+                            ==, v->ip_hash);
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV6Ex,
+                                                     t),
+                            ==, v->ip_hash);
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV6Tcp,
+                                                     t),
+                            ==, v->l4_hash);
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt,
+                                                     NetPktRssIpV6TcpEx, t),
+                            ==, v->l4_hash);
+        } else {
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV4, t),
+                            ==, v->ip_hash);
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV4Tcp,
+                                                     t),
+                            ==, v->l4_hash);
+        }
+
+        size = build_frame(frame, v, IP_PROTO_UDP);
+        net_rx_pkt_attach_data(pkt, frame, size, false);
+        if (v->ipv6) {
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV6Udp,
+                                                     t),
+                            ==, v->l4_hash);
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt,
+                                                     NetPktRssIpV6UdpEx, t),
+                            ==, v->l4_hash);
+        } else {
+            g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV4Udp,
+                                                     t),
+                            ==, v->l4_hash);
+        }
+    }
+
+    net_rx_pkt_uninit(pkt);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/toeplitz/hash", test_hash);
+    g_test_add_func("/net/toeplitz/set-key", test_set_key);
+    g_test_add_func("/net/toeplitz/rx-pkt", test_rx_pkt);
+    return g_test_run();
+}
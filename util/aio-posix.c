@@ -21,6 +21,7 @@
 #include "qemu/rcu_queue.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qemu/defer-call.h"
 #include "trace.h"
 #include "aio-posix.h"
 
@@ -619,6 +620,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
     assert(in_aio_context_home_thread(ctx == iohandler_get_aio_context() ?
                                       qemu_get_aio_context() : ctx));
 
+    /* A nested aio_poll() may wait for I/O deferred by its caller */
+    defer_call_flush();
+
     qemu_lockcnt_inc(&ctx->list_lock);
 
     if (ctx->poll_max_ns) {
@@ -719,8 +723,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    /*
+     * Run all handlers in one defer_call() section, so that the I/O requests
+     * they start are submitted as a single batch. For example, this combines
+     * the requests from all ready virtqueues that are handled by this thread.
+     */
+    defer_call_begin();
     progress |= aio_bh_poll(ctx);
     progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
+    defer_call_end();
 
     aio_free_deleted_handlers(ctx);
 
@@ -30,6 +30,7 @@
 #include "block/graph-lock.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 #include "qemu/rcu_queue.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine_int.h"
@@ -742,6 +743,18 @@ void qemu_set_current_aio_context(AioContext *ctx)
     set_my_aiocontext(ctx);
 }
 
+void aio_context_account_batch(AioContext *ctx, unsigned int n)
+{
+    int bucket;
+
+    if (n == 0) {
+        return;
+    }
+
+    bucket = MIN(31 - clz32(n), AIO_BATCH_HIST_BUCKETS - 1);
+    stat64_add(&ctx->aio_batch_hist[bucket], 1);
+}
+
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
                                         int64_t max, Error **errp)
 {
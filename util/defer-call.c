@@ -154,3 +154,33 @@ void defer_call_end(void)
      */
     g_array_set_size(array, 0);
 }
+
+/**
+ * defer_call_flush: Run pending defer_call() functions now
+ *
+ * Code that blocks inside a defer_call_begin()/defer_call_end() section, like
+ * a nested event loop, must call this first. Otherwise it could wait for I/O
+ * whose submission is deferred until the end of the section.
+ *
+ * Does nothing outside of a defer_call_begin()/defer_call_end() section.
+ */
+void defer_call_flush(void)
+{
+    DeferCallThreadState *thread_state = get_ptr_defer_call_thread_state();
+    GArray *array = thread_state->deferred_call_array;
+
+    if (thread_state->nesting_level == 0 || !array) {
+        return;
+    }
+
+    /*
+     * The functions may defer new calls, including to themselves. Remove each
+     * one before calling it so that such calls are not lost as duplicates.
+     */
+    while (array->len > 0) {
+        DeferredCall call = g_array_index(array, DeferredCall, 0);
+
+        g_array_remove_index(array, 0);
+        call.fn(call.opaque);
+    }
+}
@@ -12,8 +12,10 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 #include "crypto/hash.h"
+#include "host/cpuinfo.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
  * array of unsigned longs, but HBitmap is also optimized to provide fast
@@ -101,6 +103,233 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/*
+ * Kernels that operate on whole arrays of words.  Dirty bitmaps of large
+ * disks have millions of words in the last level, so these are vectorized
+ * where the host allows it and selected when the program starts.  Like the
+ * rest of the file they work on unsigned longs, but the vector versions do
+ * not care about the size of a word.
+ */
+typedef struct HBitmapAccel {
+    /* Return the number of set bits in @p[0..@n-1] */
+    uint64_t (*count)(const unsigned long *p, size_t n);
+    /* Store @a | @b into @dst, which may alias either; return count(dst) */
+    uint64_t (*or_count)(unsigned long *dst, const unsigned long *a,
+                         const unsigned long *b, size_t n);
+    /* Return the first index >= @i that is not all ones, or @n */
+    size_t (*find_not_ones)(const unsigned long *p, size_t i, size_t n);
+} HBitmapAccel;
+
+static uint64_t hb_count_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+static uint64_t hb_or_count_int(unsigned long *dst, const unsigned long *a,
+                                const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += ctpopl(dst[i]);
+    }
+    return count;
+}
+
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t i, size_t n)
+{
+    while (i < n && p[i] == ~0UL) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+
+#define AVX2_LONGS (sizeof(__m256i) / sizeof(unsigned long))
+
+/* Population count of each 64-bit lane, using a nibble lookup table */
+static inline __m256i __attribute__((target("avx2")))
+hb_popcnt_avx2(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                  _mm256_shuffle_epi8(lookup, hi));
+
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+static inline uint64_t __attribute__((target("avx2")))
+hb_sum_avx2(__m256i acc)
+{
+    return _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+           _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+}
+
+static uint64_t __attribute__((target("avx2")))
+hb_count_avx2(const unsigned long *p, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + AVX2_LONGS <= n; i += AVX2_LONGS) {
+        __m256i v = _mm256_loadu_si256((const void *)&p[i]);
+        acc = _mm256_add_epi64(acc, hb_popcnt_avx2(v));
+    }
+    return hb_sum_avx2(acc) + hb_count_int(&p[i], n - i);
+}
+
+static uint64_t __attribute__((target("avx2")))
+hb_or_count_avx2(unsigned long *dst, const unsigned long *a,
+                 const unsigned long *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + AVX2_LONGS <= n; i += AVX2_LONGS) {
+        __m256i v = _mm256_or_si256(
+            _mm256_loadu_si256((const void *)&a[i]),
+            _mm256_loadu_si256((const void *)&b[i]));
+        _mm256_storeu_si256((void *)&dst[i], v);
+        acc = _mm256_add_epi64(acc, hb_popcnt_avx2(v));
+    }
+    return hb_sum_avx2(acc) + hb_or_count_int(&dst[i], &a[i], &b[i], n - i);
+}
+
+static size_t __attribute__((target("avx2")))
+hb_find_not_ones_avx2(const unsigned long *p, size_t i, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    for (; i + AVX2_LONGS <= n; i += AVX2_LONGS) {
+        __m256i v = _mm256_loadu_si256((const void *)&p[i]);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != -1) {
+            break;
+        }
+    }
+    return hb_find_not_ones_int(p, i, n);
+}
+
+static const HBitmapAccel accel_table[] = {
+    { hb_count_int, hb_or_count_int, hb_find_not_ones_int },
+    { hb_count_avx2, hb_or_count_avx2, hb_find_not_ones_avx2 },
+};
+
+static unsigned best_accel(void)
+{
+    return cpuinfo_init() & CPUINFO_AVX2 ? 1 : 0;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/* Each iteration handles 64 bytes, i.e. four NEON registers */
+#define NEON_LONGS (64 / sizeof(unsigned long))
+
+static uint64_t hb_count_neon(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i + NEON_LONGS <= n; i += NEON_LONGS) {
+        const uint8_t *b = (const uint8_t *)&p[i];
+        uint8x16_t c;
+
+        /* At most 32 per byte, so the sum cannot overflow */
+        c = vaddq_u8(vaddq_u8(vcntq_u8(vld1q_u8(b)),
+                              vcntq_u8(vld1q_u8(b + 16))),
+                     vaddq_u8(vcntq_u8(vld1q_u8(b + 32)),
+                              vcntq_u8(vld1q_u8(b + 48))));
+        count += vaddlvq_u8(c);
+    }
+    return count + hb_count_int(&p[i], n - i);
+}
+
+static uint64_t hb_or_count_neon(unsigned long *dst, const unsigned long *a,
+                                 const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i + NEON_LONGS <= n; i += NEON_LONGS) {
+        const uint8_t *pa = (const uint8_t *)&a[i];
+        const uint8_t *pb = (const uint8_t *)&b[i];
+        uint8_t *pd = (uint8_t *)&dst[i];
+        uint8x16_t v0 = vorrq_u8(vld1q_u8(pa), vld1q_u8(pb));
+        uint8x16_t v1 = vorrq_u8(vld1q_u8(pa + 16), vld1q_u8(pb + 16));
+        uint8x16_t v2 = vorrq_u8(vld1q_u8(pa + 32), vld1q_u8(pb + 32));
+        uint8x16_t v3 = vorrq_u8(vld1q_u8(pa + 48), vld1q_u8(pb + 48));
+
+        vst1q_u8(pd, v0);
+        vst1q_u8(pd + 16, v1);
+        vst1q_u8(pd + 32, v2);
+        vst1q_u8(pd + 48, v3);
+        count += vaddlvq_u8(vaddq_u8(vaddq_u8(vcntq_u8(v0), vcntq_u8(v1)),
+                                     vaddq_u8(vcntq_u8(v2), vcntq_u8(v3))));
+    }
+    return count + hb_or_count_int(&dst[i], &a[i], &b[i], n - i);
+}
+
+static size_t hb_find_not_ones_neon(const unsigned long *p, size_t i,
+                                    size_t n)
+{
+    for (; i + NEON_LONGS <= n; i += NEON_LONGS) {
+        const uint8_t *b = (const uint8_t *)&p[i];
+        uint8x16_t v = vandq_u8(vandq_u8(vld1q_u8(b), vld1q_u8(b + 16)),
+                                vandq_u8(vld1q_u8(b + 32), vld1q_u8(b + 48)));
+
+        if (vminvq_u8(v) != 0xff) {
+            break;
+        }
+    }
+    return hb_find_not_ones_int(p, i, n);
+}
+
+#define best_accel() 1
+static const HBitmapAccel accel_table[] = {
+    { hb_count_int, hb_or_count_int, hb_find_not_ones_int },
+    { hb_count_neon, hb_or_count_neon, hb_find_not_ones_neon },
+};
+#else
+#define best_accel() 0
+static const HBitmapAccel accel_table[1] = {
+    { hb_count_int, hb_or_count_int, hb_find_not_ones_int },
+};
+#endif
+
+static const HBitmapAccel *hb_accel;
+static unsigned accel_index;
+
+bool test_hbitmap_next_accel(void)
+{
+    if (accel_index != 0) {
+        hb_accel = &accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    hb_accel = &accel_table[accel_index];
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -245,10 +474,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_accel->find_not_ones(last_lev, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
@@ -408,6 +634,22 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+/*
+ * Return the number of set bits past the end of the bitmap in the last word
+ * of the bottom level.  hbitmap_deserialize_ones() can set them, and they
+ * must not be included when counting whole arrays.
+ */
+static uint64_t hb_count_past_end(const HBitmap *hb)
+{
+    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    int bit = hb->size & (BITS_PER_LONG - 1);
+
+    if (!bit) {
+        return 0;
+    }
+    return ctpopl(last_lev[hb->size >> BITS_PER_LEVEL] & ~((1UL << bit) - 1));
+}
+
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
@@ -680,8 +922,13 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
         return;
     }
     serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
 
+    if (!HOST_BIG_ENDIAN) {
+        memcpy(buf, cur, el_count * sizeof(unsigned long));
+        return;
+    }
+
+    end = cur + el_count;
     while (cur != end) {
         unsigned long el =
             (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
@@ -705,6 +952,11 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     serialization_chunk(hb, start, count, &cur, &el_count);
     end = cur + el_count;
 
+    if (!HOST_BIG_ENDIAN) {
+        memcpy(cur, buf, el_count * sizeof(unsigned long));
+        cur = end;
+    }
+
     while (cur != end) {
         memcpy(cur, buf, sizeof(*cur));
 
@@ -778,7 +1030,9 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_accel->count(bitmap->levels[HBITMAP_LEVELS - 1],
+                                    bitmap->sizes[HBITMAP_LEVELS - 1]) -
+                    hb_count_past_end(bitmap);
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -901,7 +1155,7 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
+    uint64_t j, count;
 
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
@@ -932,16 +1186,20 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * The dirty count is recomputed in the same pass over the last level.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    count = hb_accel->or_count(result->levels[HBITMAP_LEVELS - 1],
+                               a->levels[HBITMAP_LEVELS - 1],
+                               b->levels[HBITMAP_LEVELS - 1],
+                               a->sizes[HBITMAP_LEVELS - 1]);
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    result->count = count - hb_count_past_end(result);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
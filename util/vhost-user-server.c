@@ -52,6 +52,13 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * If the server is started with several virtqueue AioContexts, the kick fds
+ * of the virtqueues are spread over them and each virtqueue is processed in
+ * its own thread. libvhost-user is not thread-safe, so every virtqueue has a
+ * lock that is held while the virtqueue is processed, and vu_client_trip()
+ * holds all of them while it processes a message. The locks are dropped while
+ * waiting for the next message.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -95,8 +102,47 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+void vhost_user_server_lock_queue(VuServer *server, VuVirtq *vq)
+{
+    qemu_rec_mutex_lock(&server->vq_locks[vq - server->vu_dev.vq]);
+}
+
+void vhost_user_server_unlock_queue(VuServer *server, VuVirtq *vq)
+{
+    qemu_rec_mutex_unlock(&server->vq_locks[vq - server->vu_dev.vq]);
+}
+
+static void vu_lock_all_queues(VuServer *server)
+{
+    int i;
+
+    for (i = 0; i < server->max_queues; i++) {
+        qemu_rec_mutex_lock(&server->vq_locks[i]);
+    }
+}
+
+static void vu_unlock_all_queues(VuServer *server)
+{
+    int i;
+
+    for (i = server->max_queues - 1; i >= 0; i--) {
+        qemu_rec_mutex_unlock(&server->vq_locks[i]);
+    }
+}
+
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    /* libvhost-user only watches kick fds, with the virtqueue index as pvt */
+    if (server->vq_ctxs) {
+        intptr_t index = (intptr_t)vu_fd_watch->pvt;
+
+        return server->vq_ctxs[index % server->num_vq_ctxs];
+    }
+    return server->ctx;
+}
+
 static bool coroutine_fn
-vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
+vu_message_do_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
     struct iovec iov = {
         .iov_base = (char *)vmsg,
@@ -195,19 +241,41 @@ fail:
     return false;
 }
 
+/* Called with all virtqueue locks held, see vu_client_trip() */
+static bool coroutine_fn
+vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
+{
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    bool ret;
+
+    /* Don't hold up the virtqueues while waiting for the next message */
+    vu_unlock_all_queues(server);
+    ret = vu_message_do_read(vu_dev, conn_fd, vmsg);
+    vu_lock_all_queues(server);
+
+    return ret;
+}
+
 static coroutine_fn void vu_client_trip(void *opaque)
 {
     VuServer *server = opaque;
     VuDev *vu_dev = &server->vu_dev;
 
     while (!vu_dev->broken) {
+        bool ok;
+
         if (server->quiescing) {
             server->co_trip = NULL;
             aio_wait_kick();
             return;
         }
+
+        vu_lock_all_queues(server);
+        ok = vu_dispatch(vu_dev);
+        vu_unlock_all_queues(server);
+
         /* vu_dispatch() returns false if server->ctx went away */
-        if (!vu_dispatch(vu_dev) && server->ctx) {
+        if (!ok && server->ctx) {
             break;
         }
     }
@@ -220,7 +288,9 @@ static coroutine_fn void vu_client_trip(void *opaque)
     }
     assert(!vhost_user_server_has_in_flight(server));
 
+    vu_lock_all_queues(server);
     vu_deinit(vu_dev);
+    vu_unlock_all_queues(server);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -249,17 +319,26 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    intptr_t index = (intptr_t)vu_fd_watch->pvt;
 
-    vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    /*
+     * vu_client_trip() may remove the watch while we wait for the lock. It is
+     * only freed after this handler has returned, see remove_watch().
+     */
+    qemu_rec_mutex_lock(&server->vq_locks[index]);
+    if (!vu_fd_watch->removed) {
+        vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    }
+    qemu_rec_mutex_unlock(&server->vq_locks[index]);
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
 }
 
+/* Called with server->watches_lock held */
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
 {
 
@@ -282,6 +361,8 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
     g_assert(fd >= 0);
     g_assert(cb);
 
+    QEMU_LOCK_GUARD(&server->watches_lock);
+
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
@@ -291,32 +372,48 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        qemu_socket_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                           kick_handler, NULL, NULL, NULL, vu_fd_watch);
     }
 }
 
+static void vu_fd_watch_free_bh(void *opaque)
+{
+    g_free(opaque);
+}
 
+/* Called with the lock of the watched virtqueue held */
 static void remove_watch(VuDev *vu_dev, int fd)
 {
     VuServer *server;
+    AioContext *ctx;
     g_assert(vu_dev);
     g_assert(fd >= 0);
 
     server = container_of(vu_dev, VuServer, vu_dev);
 
+    QEMU_LOCK_GUARD(&server->watches_lock);
+
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    ctx = vu_fd_watch_ctx(server, vu_fd_watch);
+    aio_set_fd_handler(ctx, fd, NULL, NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+    vu_fd_watch->removed = true;
+
+    /*
+     * kick_handler() may already be running in the thread of ctx, waiting for
+     * the virtqueue lock that our caller holds. Handlers and BHs of an
+     * AioContext don't run concurrently, so a BH frees the watch safely.
+     */
+    aio_bh_schedule_oneshot(ctx, vu_fd_watch_free_bh, vu_fd_watch);
 }
 
 
@@ -363,6 +460,10 @@ static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
     vhost_user_server_attach_aio_context(server, server->ctx);
 }
 
+static void vu_sync_bh(void *opaque)
+{
+}
+
 /* server->ctx acquired by caller */
 void vhost_user_server_stop(VuServer *server)
 {
@@ -372,9 +473,12 @@ void vhost_user_server_stop(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+        WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+            QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+                aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                                   vu_fd_watch->fd,
+                                   NULL, NULL, NULL, NULL, vu_fd_watch);
+            }
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -386,6 +490,25 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    if (server->vq_locks) {
+        int i;
+
+        /*
+         * kick_handler() may still be running in a virtqueue AioContext and
+         * wait for a lock after vu_client_trip() has removed the watches
+         */
+        for (i = 0; i < server->num_vq_ctxs; i++) {
+            aio_wait_bh_oneshot(server->vq_ctxs[i], vu_sync_bh, NULL);
+        }
+
+        for (i = 0; i < server->max_queues; i++) {
+            qemu_rec_mutex_destroy(&server->vq_locks[i]);
+        }
+        g_free(server->vq_locks);
+        server->vq_locks = NULL;
+        qemu_mutex_destroy(&server->watches_lock);
+    }
 }
 
 /*
@@ -411,9 +534,12 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, kick_handler, NULL,
+                               NULL, NULL, vu_fd_watch);
+        }
     }
 
     if (server->co_trip) {
@@ -443,9 +569,12 @@ void vhost_user_server_detach_aio_context(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+        WITH_QEMU_LOCK_GUARD(&server->watches_lock) {
+            QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+                aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                                   vu_fd_watch->fd,
+                                   NULL, NULL, NULL, NULL, vu_fd_watch);
+            }
         }
     }
 
@@ -462,12 +591,15 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext **vq_ctxs,
+                             size_t num_vq_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
 {
     QEMUBH *bh;
     QIONetListener *listener;
+    int i;
 
     if (socket_addr->type != SOCKET_ADDRESS_TYPE_UNIX &&
         socket_addr->type != SOCKET_ADDRESS_TYPE_FD) {
@@ -491,8 +623,16 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .vq_ctxs               = vq_ctxs,
+        .num_vq_ctxs           = num_vq_ctxs,
+        .vq_locks              = g_new(QemuRecMutex, max_queues),
     };
 
+    for (i = 0; i < max_queues; i++) {
+        qemu_rec_mutex_init(&server->vq_locks[i]);
+    }
+    qemu_mutex_init(&server->watches_lock);
+
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
 
     qio_net_listener_set_client_func(server->listener,